@@ -0,0 +1,497 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "protocol.h"
+#include "histogram.h"
+
+/*
+ * Load generator for the Jeux server.
+ *
+ * Usage: jeux_bench -p <port> [-h <host>] [-c <connections>] [-t <threads>]
+ *                   [-d <seconds>] [-r <moves/s>] [-R <percent>] [-s <seed>]
+ *
+ * Opens the given number of connections (default 1000), logs each one in
+ * under a unique name, and pairs them up: one member of each pair
+ * invites the other, the invitation is accepted, and the two then play
+ * game after game of random legal moves until the run is over.  With -r,
+ * each game makes at most that many moves per second; otherwise the
+ * next move is sent as soon as the opponent's MOVED arrives.  With -R,
+ * each move is replaced by a resignation with the given probability.
+ *
+ * The connections are divided among the threads (default 4), each of
+ * which drives its share with an epoll(7) loop, so a pair is always
+ * handled by a single thread.  At the end, the number of games and
+ * packets per second is reported, along with percentiles of two
+ * latencies: the round trip from sending a request to receiving its ACK,
+ * and the time from sending a request to the timestamp the server put on
+ * its ACK.
+ */
+
+#define USAGE "Usage: bin/jeux_bench -p <port> [-h <host>] [-c <connections>] [-t <threads>] [-d <seconds>] [-r <moves/s>] [-R <percent>] [-s <seed>]\n"
+
+#define BENCH_INBUF 2048
+#define BENCH_PENDING 8
+#define BENCH_NAME_LEN 32
+
+typedef struct bench_pair BENCH_PAIR;
+typedef struct bench_thread BENCH_THREAD;
+
+/*
+ * A request awaiting its ACK or NACK.  The server answers the requests
+ * on a connection in order, so these are kept in a FIFO.
+ */
+typedef struct bench_request {
+	uint8_t type;
+	uint64_t sentMono;
+	uint64_t sentReal;
+} BENCH_REQUEST;
+
+typedef struct bench_conn {
+	int fd;
+	int side;			/* 0 for the inviter (X), 1 for the invitee (O) */
+	int gameId;			/* ID of the current game on this connection */
+	BENCH_PAIR *pair;
+	char name[BENCH_NAME_LEN];
+	BENCH_REQUEST pending[BENCH_PENDING];
+	int pendHead;
+	int pendCount;
+	size_t inLen;
+	char in[BENCH_INBUF];
+} BENCH_CONN;
+
+struct bench_pair {
+	BENCH_CONN conns[2];
+	int loggedIn;
+	int ended;
+	int over;
+	uint16_t board;			/* occupied cells */
+	uint16_t marks[2];		/* cells taken by each side */
+};
+
+/*
+ * A scheduled move.  Moves are all delayed by the same interval, so they
+ * fall due in the order they were scheduled and a FIFO suffices.
+ */
+typedef struct bench_due {
+	BENCH_CONN *conn;
+	uint64_t at;
+} BENCH_DUE;
+
+struct bench_thread {
+	pthread_t tid;
+	int index;
+	int epfd;
+	int numPairs;
+	BENCH_PAIR *pairs;
+	BENCH_DUE *due;
+	int dueHead;
+	int dueCount;
+	unsigned int seed;
+	uint64_t games;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t nacks;
+	uint64_t errors;
+	HISTOGRAM rtt;
+	HISTOGRAM toAck;
+};
+
+static char *host = "localhost";
+static char *port = NULL;
+static uint64_t moveInterval = 0;
+static int resignPercent = 0;
+static volatile int stopping = 0;
+
+static const uint16_t bench_lines[8] = {
+	0007, 0070, 0700, 0111, 0222, 0444, 0421, 0124
+};
+
+static uint64_t bench_now(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_has_line(uint16_t marks) {
+	for (int i = 0; i < 8; i++) {
+		if ((marks & bench_lines[i]) == bench_lines[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send a request, remembering when it was sent.
+ */
+static int bench_send(BENCH_THREAD *t, BENCH_CONN *conn, int type, int id, int role, char *data) {
+	size_t len = data != NULL ? strlen(data) : 0;
+	char buf[sizeof(JEUX_PACKET_HEADER) + BENCH_NAME_LEN];
+	JEUX_PACKET_HEADER hdr = {0};
+	hdr.type = type;
+	hdr.id = id;
+	hdr.role = role;
+	hdr.size = htons(len);
+	uint64_t real = bench_now(CLOCK_REALTIME);
+	hdr.timestamp_sec = htonl(real / 1000000000);
+	hdr.timestamp_nsec = htonl(real % 1000000000);
+	memcpy(buf, &hdr, sizeof(hdr));
+	if (len > 0) {
+		memcpy(buf + sizeof(hdr), data, len);
+	}
+	if (conn->pendCount == BENCH_PENDING) {
+		t->errors++;
+		return -1;
+	}
+	BENCH_REQUEST *req = &conn->pending[(conn->pendHead + conn->pendCount++) % BENCH_PENDING];
+	req->type = type;
+	req->sentReal = real;
+	req->sentMono = bench_now(CLOCK_MONOTONIC);
+	if (send(conn->fd, buf, sizeof(hdr) + len, MSG_NOSIGNAL) != sizeof(hdr) + len) {
+		t->errors++;
+		return -1;
+	}
+	t->sent++;
+	return 0;
+}
+
+static void bench_invite(BENCH_THREAD *t, BENCH_PAIR *pair) {
+	pair->ended = 0;
+	pair->over = 0;
+	pair->board = 0;
+	pair->marks[0] = pair->marks[1] = 0;
+	bench_send(t, &pair->conns[0], JEUX_INVITE_PKT, 0, 2, pair->conns[1].name);
+}
+
+/*
+ * Make a random legal move (or resign) on behalf of a connection.
+ */
+static void bench_move(BENCH_THREAD *t, BENCH_CONN *conn) {
+	BENCH_PAIR *pair = conn->pair;
+	if (pair->over) {
+		return;
+	}
+	if (resignPercent > 0 && rand_r(&t->seed) % 100 < resignPercent) {
+		pair->over = 1;
+		bench_send(t, conn, JEUX_RESIGN_PKT, conn->gameId, 0, NULL);
+		return;
+	}
+	int empty = 9 - __builtin_popcount(pair->board);
+	int pick = rand_r(&t->seed) % empty;
+	int cell = 0;
+	while (1) {
+		if (!(pair->board & (1 << cell)) && pick-- == 0) {
+			break;
+		}
+		cell++;
+	}
+	pair->board |= 1 << cell;
+	pair->marks[conn->side] |= 1 << cell;
+	if (bench_has_line(pair->marks[conn->side]) || pair->board == 0777) {
+		pair->over = 1;
+	}
+	char move[5] = { '1' + cell, '-', '>', conn->side == 0 ? 'X' : 'O', '\0' };
+	bench_send(t, conn, JEUX_MOVE_PKT, conn->gameId, 0, move);
+}
+
+static void bench_schedule(BENCH_THREAD *t, BENCH_CONN *conn) {
+	if (moveInterval == 0) {
+		bench_move(t, conn);
+		return;
+	}
+	BENCH_DUE *due = &t->due[(t->dueHead + t->dueCount++) % t->numPairs];
+	due->conn = conn;
+	due->at = bench_now(CLOCK_MONOTONIC) + moveInterval;
+}
+
+/*
+ * Handle a packet received on a connection.
+ */
+static void bench_packet(BENCH_THREAD *t, BENCH_CONN *conn, JEUX_PACKET_HEADER *hdr) {
+	BENCH_PAIR *pair = conn->pair;
+	t->received++;
+	switch (hdr->type) {
+	case JEUX_ACK_PKT:
+	case JEUX_NACK_PKT: {
+		if (conn->pendCount == 0) {
+			t->errors++;
+			return;
+		}
+		BENCH_REQUEST *req = &conn->pending[conn->pendHead];
+		conn->pendHead = (conn->pendHead + 1) % BENCH_PENDING;
+		conn->pendCount--;
+		uint64_t now = bench_now(CLOCK_MONOTONIC);
+		histogram_record(&t->rtt, now - req->sentMono);
+		uint64_t stamp = (uint64_t)ntohl(hdr->timestamp_sec) * 1000000000 + ntohl(hdr->timestamp_nsec);
+		if (stamp > req->sentReal) {
+			histogram_record(&t->toAck, stamp - req->sentReal);
+		}
+		if (hdr->type == JEUX_NACK_PKT) {
+			t->nacks++;
+			return;
+		}
+		if (req->type == JEUX_LOGIN_PKT && ++pair->loggedIn == 2) {
+			bench_invite(t, pair);
+		}
+		break;
+	}
+	case JEUX_INVITED_PKT:
+		conn->gameId = hdr->id;
+		bench_send(t, conn, JEUX_ACCEPT_PKT, hdr->id, 0, NULL);
+		break;
+	case JEUX_ACCEPTED_PKT:
+		conn->gameId = hdr->id;
+		bench_schedule(t, conn);
+		break;
+	case JEUX_MOVED_PKT:
+		if (!pair->over) {
+			bench_schedule(t, conn);
+		}
+		break;
+	case JEUX_ENDED_PKT:
+		if (++pair->ended == 2) {
+			t->games++;
+			if (!stopping) {
+				bench_invite(t, pair);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Read what is available on a connection and handle each complete
+ * packet.
+ *
+ * @return 0 if the connection is still open, otherwise -1.
+ */
+static int bench_read(BENCH_THREAD *t, BENCH_CONN *conn) {
+	while (1) {
+		ssize_t n = read(conn->fd, conn->in + conn->inLen, BENCH_INBUF - conn->inLen);
+		if (n == 0) {
+			return -1;
+		}
+		if (n == -1) {
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		}
+		conn->inLen += n;
+		size_t start = 0;
+		while (conn->inLen - start >= sizeof(JEUX_PACKET_HEADER)) {
+			JEUX_PACKET_HEADER hdr;
+			memcpy(&hdr, conn->in + start, sizeof(hdr));
+			size_t size = ntohs(hdr.size);
+			if (sizeof(hdr) + size > BENCH_INBUF) {
+				// No packet the benchmark provokes is this large.
+				return -1;
+			}
+			if (conn->inLen - start < sizeof(hdr) + size) {
+				break;
+			}
+			start += sizeof(hdr) + size;
+			bench_packet(t, conn, &hdr);
+		}
+		memmove(conn->in, conn->in + start, conn->inLen - start);
+		conn->inLen -= start;
+	}
+}
+
+static int bench_connect(void) {
+	struct addrinfo hints = {0};
+	struct addrinfo *list;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	if (getaddrinfo(host, port, &hints, &list) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo *p = list; p != NULL; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	if (fd != -1) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+	return fd;
+}
+
+static void *bench_thread(void *arg) {
+	BENCH_THREAD *t = arg;
+	t->epfd = epoll_create1(0);
+	for (int i = 0; i < t->numPairs; i++) {
+		BENCH_PAIR *pair = &t->pairs[i];
+		for (int side = 0; side < 2; side++) {
+			BENCH_CONN *conn = &pair->conns[side];
+			conn->side = side;
+			conn->pair = pair;
+			snprintf(conn->name, BENCH_NAME_LEN, "b%d_%d_%d_%d", (int)getpid(), t->index, i, side);
+			conn->fd = bench_connect();
+			if (conn->fd == -1) {
+				fprintf(stderr, "Connection failed: %s\n", strerror(errno));
+				t->errors++;
+				continue;
+			}
+			struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+			epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+			bench_send(t, conn, JEUX_LOGIN_PKT, 0, 0, conn->name);
+		}
+	}
+	struct epoll_event events[64];
+	while (!stopping) {
+		int timeout = 100;
+		if (t->dueCount > 0) {
+			uint64_t now = bench_now(CLOCK_MONOTONIC);
+			uint64_t at = t->due[t->dueHead].at;
+			timeout = at > now ? (at - now + 999999) / 1000000 : 0;
+		}
+		int n = epoll_wait(t->epfd, events, 64, timeout);
+		for (int i = 0; i < n; i++) {
+			BENCH_CONN *conn = events[i].data.ptr;
+			if (bench_read(t, conn) == -1) {
+				epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+				t->errors++;
+			}
+		}
+		uint64_t now = bench_now(CLOCK_MONOTONIC);
+		while (t->dueCount > 0 && t->due[t->dueHead].at <= now) {
+			BENCH_CONN *conn = t->due[t->dueHead].conn;
+			t->dueHead = (t->dueHead + 1) % t->numPairs;
+			t->dueCount--;
+			bench_move(t, conn);
+		}
+	}
+	for (int i = 0; i < t->numPairs; i++) {
+		for (int side = 0; side < 2; side++) {
+			if (t->pairs[i].conns[side].fd != -1) {
+				close(t->pairs[i].conns[side].fd);
+			}
+		}
+	}
+	close(t->epfd);
+	return NULL;
+}
+
+static void bench_report_latency(char *what, HISTOGRAM *h) {
+	printf("%-14s p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  max %8.1f us  (%lu samples)\n", what,
+	       histogram_percentile(h, 0.50) / 1e3, histogram_percentile(h, 0.99) / 1e3,
+	       histogram_percentile(h, 0.999) / 1e3, h->max / 1e3, h->count);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int connections = 1000;
+	int numThreads = 4;
+	double duration = 10;
+	double rate = 0;
+	unsigned int seed = time(NULL);
+	while ((opt = getopt(argc, argv, "p:h:c:t:d:r:R:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = optarg;
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'c':
+			connections = atoi(optarg);
+			break;
+		case 't':
+			numThreads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'R':
+			resignPercent = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, USAGE);
+			exit(EXIT_FAILURE);
+		}
+	}
+	int numPairs = connections / 2;
+	if (port == NULL || numPairs < 1 || numThreads < 1 || duration <= 0 || rate < 0
+	    || resignPercent < 0 || resignPercent > 100) {
+		fprintf(stderr, USAGE);
+		exit(EXIT_FAILURE);
+	}
+	if (numThreads > numPairs) {
+		numThreads = numPairs;
+	}
+	moveInterval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+	BENCH_THREAD *threads = calloc(numThreads, sizeof(BENCH_THREAD));
+	for (int i = 0; i < numThreads; i++) {
+		BENCH_THREAD *t = &threads[i];
+		t->index = i;
+		t->numPairs = numPairs / numThreads + (i < numPairs % numThreads);
+		t->pairs = calloc(t->numPairs, sizeof(BENCH_PAIR));
+		t->due = calloc(t->numPairs, sizeof(BENCH_DUE));
+		t->seed = seed + i;
+		histogram_init(&t->rtt);
+		histogram_init(&t->toAck);
+		pthread_create(&t->tid, NULL, bench_thread, t);
+	}
+	uint64_t start = bench_now(CLOCK_MONOTONIC);
+	struct timespec ts = { (time_t)duration, (long)((duration - (time_t)duration) * 1e9) };
+	nanosleep(&ts, NULL);
+	stopping = 1;
+	HISTOGRAM *rtt = malloc(sizeof(HISTOGRAM));
+	HISTOGRAM *toAck = malloc(sizeof(HISTOGRAM));
+	histogram_init(rtt);
+	histogram_init(toAck);
+	uint64_t games = 0, sent = 0, received = 0, nacks = 0, errors = 0;
+	for (int i = 0; i < numThreads; i++) {
+		BENCH_THREAD *t = &threads[i];
+		pthread_join(t->tid, NULL);
+		games += t->games;
+		sent += t->sent;
+		received += t->received;
+		nacks += t->nacks;
+		errors += t->errors;
+		histogram_merge(rtt, &t->rtt);
+		histogram_merge(toAck, &t->toAck);
+		free(t->pairs);
+		free(t->due);
+	}
+	double elapsed = (bench_now(CLOCK_MONOTONIC) - start) / 1e9;
+	printf("connections %d  threads %d  elapsed %.2f s\n", numPairs * 2, numThreads, elapsed);
+	printf("games          %lu (%.1f games/s)\n", games, games / elapsed);
+	printf("packets sent   %lu (%.1f packets/s)\n", sent, sent / elapsed);
+	printf("packets recvd  %lu (%.1f packets/s)\n", received, received / elapsed);
+	printf("nacks          %lu  errors %lu\n", nacks, errors);
+	bench_report_latency("round trip", rtt);
+	bench_report_latency("to ACK stamp", toAck);
+	free(rtt);
+	free(toAck);
+	free(threads);
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,470 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "proto_buf.h"
+#include "packet_pool.h"
+#include "game.h"
+#include "game_ext.h"
+#include "player.h"
+#include "player_registry.h"
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client.h"
+#include "client_ext.h"
+#include "outq.h"
+
+/*
+ * Microbenchmarks for the hot paths of the Jeux server.
+ *
+ * Usage: jeux_microbench [-o <file>] [-m <max entries>]
+ *
+ * Each benchmark times a loop over one operation and reports the mean
+ * time per operation and the mean number of heap allocations per
+ * operation.  Allocations are counted by wrapping malloc() and friends
+ * at link time (see the bench target in the Makefile), so they include
+ * every allocation made by the server code, but not those made inside
+ * the C library.  The registry benchmarks are repeated at 1K, 100K and
+ * 1M entries, or up to the maximum given by -m.
+ *
+ * A table is printed on standard output and, with -o, the results are
+ * also written to a file as JSON, for comparison between releases.
+ */
+
+#define USAGE "Usage: bin/jeux_microbench [-o <file>] [-m <max entries>]\n"
+
+#define MICRO_MAX_RESULTS 64
+#define MICRO_NAME_LEN 32
+
+/*
+ * Allocation counting.  The linker redirects calls to malloc() and
+ * friends to these wrappers.
+ */
+static atomic_long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __real_realloc(ptr, size);
+}
+
+typedef struct micro_result {
+	char name[48];
+	long entries;
+	long ops;
+	double nsPerOp;
+	double allocsPerOp;
+} MICRO_RESULT;
+
+static MICRO_RESULT results[MICRO_MAX_RESULTS];
+static int numResults;
+
+/*
+ * Timing of a measured section: micro_start() samples the clock and the
+ * allocation count, and micro_stop() records the result.
+ */
+typedef struct micro_timer {
+	struct timespec start;
+	long allocs;
+} MICRO_TIMER;
+
+static void micro_start(MICRO_TIMER *timer) {
+	timer->allocs = atomic_load(&allocations);
+	clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+static void micro_stop(MICRO_TIMER *timer, char *name, long entries, long ops) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long allocs = atomic_load(&allocations) - timer->allocs;
+	double ns = (end.tv_sec - timer->start.tv_sec) * 1e9 + (end.tv_nsec - timer->start.tv_nsec);
+	if (numResults == MICRO_MAX_RESULTS) {
+		return;
+	}
+	MICRO_RESULT *r = &results[numResults++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->entries = entries;
+	r->ops = ops;
+	r->nsPerOp = ns / ops;
+	r->allocsPerOp = (double)allocs / ops;
+	printf("%-28s %8ld entries %10ld ops %12.1f ns/op %8.2f allocs/op\n",
+	       r->name, r->entries, r->ops, r->nsPerOp, r->allocsPerOp);
+	fflush(stdout);
+}
+
+static void micro_names(char (*names)[MICRO_NAME_LEN], long n) {
+	for (long i = 0; i < n; i++) {
+		snprintf(names[i], MICRO_NAME_LEN, "player%07ld", i);
+	}
+}
+
+/*
+ * A full game that ends in a draw on the last move.
+ */
+static char *micro_moves[9] = { "5->X", "1->O", "3->X", "7->O", "4->X", "6->O", "8->X", "2->O", "9->X" };
+
+static void micro_game(void) {
+	long iters = 1000000;
+	MICRO_TIMER timer;
+	micro_start(&timer);
+	for (long i = 0; i < iters; i++) {
+		game_unref(game_create(), "because benchmark is done");
+	}
+	micro_stop(&timer, "game_create/unref", 0, iters);
+	GAME *game = game_create();
+	micro_start(&timer);
+	for (long i = 0; i < iters; i++) {
+		free(game_parse_move(game, NULL_ROLE, micro_moves[i % 9]));
+	}
+	micro_stop(&timer, "game_parse_move", 0, iters);
+
+	long numGames = 100000;
+	GAME **games = malloc(numGames * sizeof(GAME *));
+	GAME_MOVE *moves[9];
+	for (int i = 0; i < 9; i++) {
+		moves[i] = game_parse_move(game, NULL_ROLE, micro_moves[i]);
+	}
+	game_unref(game, "because benchmark is done");
+	for (long i = 0; i < numGames; i++) {
+		games[i] = game_create();
+	}
+	micro_start(&timer);
+	for (int m = 0; m < 9; m++) {
+		for (long i = 0; i < numGames; i++) {
+			game_apply_move(games[i], moves[m]);
+		}
+	}
+	micro_stop(&timer, "game_apply_move", 0, 9 * numGames);
+	for (long i = 0; i < numGames; i++) {
+		game_unref(games[i], "because benchmark is done");
+		games[i] = game_create();
+	}
+	micro_start(&timer);
+	for (int m = 0; m < 9; m++) {
+		for (long i = 0; i < numGames; i++) {
+			game_make_move(games[i], NULL_ROLE, micro_moves[m], NULL);
+		}
+	}
+	micro_stop(&timer, "game_make_move", 0, 9 * numGames);
+	micro_start(&timer);
+	for (long i = 0; i < numGames; i++) {
+		free(game_unparse_state(games[i]));
+	}
+	micro_stop(&timer, "game_unparse_state", 0, numGames);
+	for (long i = 0; i < numGames; i++) {
+		game_unref(games[i], "because benchmark is done");
+	}
+	for (int i = 0; i < 9; i++) {
+		free(moves[i]);
+	}
+	free(games);
+}
+
+/*
+ * Games of gomoku on the largest board, each played through a shuffled
+ * order of the cells until someone has five in a row, so that the time
+ * per move includes the win check made after every move.
+ */
+#define MICRO_GOMOKU_ORDERS 16
+#define MICRO_MOVE_LEN 16
+
+static void micro_gomoku(void) {
+	GAME_ENGINE engine;
+	game_engine_init(&engine, "gomoku19");
+	int numCells = engine.width * engine.height;
+	static char moves[MICRO_GOMOKU_ORDERS][GAME_MAX_WIDTH * GAME_MAX_HEIGHT][MICRO_MOVE_LEN];
+	unsigned int seed = 1;
+	for (int k = 0; k < MICRO_GOMOKU_ORDERS; k++) {
+		int cells[GAME_MAX_WIDTH * GAME_MAX_HEIGHT];
+		for (int i = 0; i < numCells; i++) {
+			cells[i] = i;
+		}
+		for (int i = numCells - 1; i > 0; i--) {
+			int j = rand_r(&seed) % (i + 1);
+			int cell = cells[i];
+			cells[i] = cells[j];
+			cells[j] = cell;
+		}
+		for (int i = 0; i < numCells; i++) {
+			snprintf(moves[k][i], MICRO_MOVE_LEN, "%c%d->%c", 'a' + cells[i] % engine.width,
+			    cells[i] / engine.width + 1, i % 2 == 0 ? 'X' : 'O');
+		}
+	}
+	game_set_engine(&engine);
+	long numGames = 20000;
+	long numMoves = 0;
+	MICRO_TIMER timer;
+	micro_start(&timer);
+	for (long g = 0; g < numGames; g++) {
+		GAME *game = game_create();
+		char (*order)[MICRO_MOVE_LEN] = moves[g % MICRO_GOMOKU_ORDERS];
+		for (int i = 0; i < numCells && !game_is_over(game); i++) {
+			game_make_move(game, NULL_ROLE, order[i], NULL);
+			numMoves++;
+		}
+		game_unref(game, "because benchmark is done");
+	}
+	micro_stop(&timer, "game_make_move (gomoku19)", 0, numMoves);
+	game_set_engine(&game_engine_tictactoe);
+}
+
+static void micro_preg(char (*names)[MICRO_NAME_LEN], long n) {
+	MICRO_TIMER timer;
+	PLAYER_REGISTRY *preg = preg_init();
+	micro_start(&timer);
+	for (long i = 0; i < n; i++) {
+		player_unref(preg_register(preg, names[i]), "because benchmark is done");
+	}
+	micro_stop(&timer, "preg_register (new)", n, n);
+	micro_start(&timer);
+	for (long i = 0; i < n; i++) {
+		player_unref(preg_register(preg, names[(i * 7919) % n]), "because benchmark is done");
+	}
+	micro_stop(&timer, "preg_register (existing)", n, n);
+	preg_fini(preg);
+}
+
+static void micro_creg(char (*names)[MICRO_NAME_LEN], long n) {
+	MICRO_TIMER timer;
+	PLAYER_REGISTRY *preg = preg_init();
+	CLIENT_REGISTRY *creg = creg_init_capacity(n);
+	CLIENT **clients = malloc(n * sizeof(CLIENT *));
+	PLAYER **players = malloc(n * sizeof(PLAYER *));
+	// The clients are never sent anything, so the descriptors are
+	// never used.
+	for (long i = 0; i < n; i++) {
+		clients[i] = creg_register(creg, 1000 + i);
+		players[i] = preg_register(preg, names[i]);
+		client_login(clients[i], players[i]);
+	}
+	long iters = 1000000;
+	micro_start(&timer);
+	for (long i = 0; i < iters; i++) {
+		client_unref(creg_lookup(creg, names[(i * 7919) % n]), "because benchmark is done");
+	}
+	micro_stop(&timer, "creg_lookup", n, iters);
+
+	iters = n <= 1000 ? 10000 : n <= 100000 ? 100 : 10;
+	micro_start(&timer);
+	for (long i = 0; i < iters; i++) {
+		PLAYER **list = creg_all_players(creg);
+		for (PLAYER **p = list; *p != NULL; p++) {
+			player_unref(*p, "because benchmark is done");
+		}
+		free(list);
+	}
+	micro_stop(&timer, "creg_all_players", n, iters);
+	// A result changes the ratings, which forces the snapshot to be
+	// rebuilt.
+	micro_start(&timer);
+	for (long i = 0; i < iters; i++) {
+		player_post_result(players[0], players[n > 1 ? 1 : 0], 0);
+		creg_users_unref(creg_users_snapshot(creg));
+	}
+	micro_stop(&timer, "USERS (rebuild)", n, iters);
+	iters = 1000000;
+	micro_start(&timer);
+	for (long i = 0; i < iters; i++) {
+		creg_users_unref(creg_users_snapshot(creg));
+	}
+	micro_stop(&timer, "USERS (cached)", n, iters);
+
+	for (long i = 0; i < n; i++) {
+		player_unref(players[i], "because benchmark is done");
+		client_logout(clients[i]);
+		client_shutdown_output(clients[i]);
+		creg_unregister(creg, clients[i]);
+	}
+	free(clients);
+	free(players);
+	creg_fini(creg);
+	preg_fini(preg);
+}
+
+typedef struct micro_poster {
+	PLAYER *players[2];
+	long iters;
+} MICRO_POSTER;
+
+static void *micro_post_thread(void *arg) {
+	MICRO_POSTER *poster = arg;
+	for (long i = 0; i < poster->iters; i++) {
+		player_post_result(poster->players[0], poster->players[1], i % 3);
+	}
+	return NULL;
+}
+
+/*
+ * player_post_result() throughput, first from a single thread and then
+ * from four threads posting results of disjoint pairs concurrently.
+ */
+static void micro_post_result(void) {
+	MICRO_TIMER timer;
+	PLAYER_REGISTRY *preg = preg_init();
+	MICRO_POSTER posters[4];
+	char name[MICRO_NAME_LEN];
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 2; j++) {
+			snprintf(name, sizeof(name), "poster%d", 2 * i + j);
+			posters[i].players[j] = preg_register(preg, name);
+		}
+		posters[i].iters = 1000000;
+	}
+	micro_start(&timer);
+	micro_post_thread(&posters[0]);
+	micro_stop(&timer, "player_post_result", 1, posters[0].iters);
+	pthread_t tids[4];
+	micro_start(&timer);
+	for (int i = 0; i < 4; i++) {
+		pthread_create(&tids[i], NULL, micro_post_thread, &posters[i]);
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	micro_stop(&timer, "player_post_result (4 thr)", 4, 4 * posters[0].iters);
+	for (int i = 0; i < 4; i++) {
+		player_unref(posters[i].players[0], "because benchmark is done");
+		player_unref(posters[i].players[1], "because benchmark is done");
+	}
+	preg_fini(preg);
+}
+
+typedef struct micro_sender {
+	int fd;
+	long count;
+} MICRO_SENDER;
+
+static void *micro_send_thread(void *arg) {
+	MICRO_SENDER *sender = arg;
+	char payload[32];
+	memset(payload, 'x', sizeof(payload));
+	for (long i = 0; i < sender->count; i++) {
+		JEUX_PACKET_HEADER hdr = {0};
+		hdr.type = JEUX_MOVED_PKT;
+		hdr.size = htons(sizeof(payload));
+		proto_send_packet(sender->fd, &hdr, payload);
+	}
+	return NULL;
+}
+
+/*
+ * Packet send and receive over a socketpair, with one thread sending
+ * and the main thread receiving, both with proto_recv_packet() and
+ * through a PROTO_BUF.
+ */
+static void micro_proto(void) {
+	MICRO_TIMER timer;
+	long count = 200000;
+	for (int buffered = 0; buffered < 2; buffered++) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+			return;
+		}
+		MICRO_SENDER sender = { fds[0], count };
+		PROTO_BUF *in = malloc(sizeof(PROTO_BUF));
+		proto_buf_init(in, fds[1]);
+		pthread_t tid;
+		micro_start(&timer);
+		pthread_create(&tid, NULL, micro_send_thread, &sender);
+		for (long i = 0; i < count; i++) {
+			JEUX_PACKET_HEADER hdr;
+			void *payload;
+			if (buffered) {
+				proto_buf_recv_packet(in, &hdr, &payload);
+				pool_free(payload);
+			} else {
+				proto_recv_packet(fds[1], &hdr, &payload);
+				free(payload);
+			}
+		}
+		pthread_join(tid, NULL);
+		micro_stop(&timer, buffered ? "proto_buf_recv_packet" : "proto_send/recv_packet", 0, count);
+		proto_buf_fini(in);
+		free(in);
+		close(fds[0]);
+		close(fds[1]);
+	}
+}
+
+static int micro_write_json(char *path) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		return -1;
+	}
+	fprintf(f, "{\n  \"benchmarks\": [\n");
+	for (int i = 0; i < numResults; i++) {
+		MICRO_RESULT *r = &results[i];
+		fprintf(f, "    {\"name\": \"%s\", \"entries\": %ld, \"ops\": %ld, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f}%s\n",
+			r->name, r->entries, r->ops, r->nsPerOp, r->allocsPerOp, i + 1 < numResults ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	return fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	char *output = NULL;
+	long maxEntries = 1000000;
+	while ((opt = getopt(argc, argv, "o:m:")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'm':
+			maxEntries = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, USAGE);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (maxEntries < 1) {
+		fprintf(stderr, USAGE);
+		exit(EXIT_FAILURE);
+	}
+	// Keep the per-client queues small, since nothing is ever sent.
+	outq_configure(1, OUTQ_DROP);
+	char (*names)[MICRO_NAME_LEN] = malloc(maxEntries * MICRO_NAME_LEN);
+	micro_names(names, maxEntries);
+	micro_game();
+	micro_gomoku();
+	long sizes[3] = { 1000, 100000, 1000000 };
+	for (int i = 0; i < 3; i++) {
+		long n = sizes[i] < maxEntries ? sizes[i] : maxEntries;
+		micro_preg(names, n);
+		micro_creg(names, n);
+		if (n == maxEntries) {
+			break;
+		}
+	}
+	micro_post_result();
+	micro_proto();
+	free(names);
+	if (output != NULL && micro_write_json(output) == -1) {
+		fprintf(stderr, "Failed to write %s: %s\n", output, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,28 @@
+#ifndef BOT_H
+#define BOT_H
+
+/*
+ * Server-side computer opponent.
+ *
+ * The bot is an ordinary client of the server that happens to run in a
+ * thread of the server process.  It is connected to the server through
+ * a socketpair(2), logs in under a chosen user name, accepts every
+ * invitation it receives, and answers each move with a HINT request
+ * whose result it then plays, so its play is perfect and costs one
+ * solver table lookup per move.  Since it talks the ordinary protocol,
+ * games against it exercise exactly the same code paths as games
+ * between networked clients.
+ */
+
+/*
+ * Start a bot that logs in under the specified user name.
+ *
+ * @param name  The user name of the bot, which must remain valid for
+ * the lifetime of the server.
+ * @return  The server's end of the bot's connection, which the caller
+ * must service like any newly accepted connection, or -1 if the bot
+ * could not be started.
+ */
+int bot_start(char *name);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stddef.h>
+
+/*
+ * Immutable, reference-counted packet payloads, for a payload that is
+ * sent unchanged to many clients, such as the update of a game sent to
+ * all its spectators.  The payload is rendered once into a BROADCAST,
+ * which is referenced from the outbound queue of every recipient rather
+ * than copied into it, and is freed when the last queue has finished
+ * writing it.  Its contents must not be changed once it has been
+ * created.
+ */
+
+typedef struct broadcast BROADCAST;
+
+/*
+ * Create a BROADCAST holding a copy of a payload.  The buffer comes
+ * from the packet pool.
+ *
+ * @param data  The payload.
+ * @param len  Its length.
+ * @return  The new BROADCAST, with a reference count of one, or NULL if
+ * it could not be allocated.
+ */
+BROADCAST *bcast_create(const void *data, size_t len);
+
+/*
+ * Create a BROADCAST that refers to a payload without copying it, for
+ * immutable text that outlives every packet, such as the pre-rendered
+ * boards of tic-tac-toe.
+ *
+ * @param data  The payload, which must never be modified or freed.
+ * @param len  Its length.
+ * @return  The new BROADCAST, with a reference count of one, or NULL if
+ * it could not be allocated.
+ */
+BROADCAST *bcast_create_static(const void *data, size_t len);
+
+/*
+ * Get the payload of a BROADCAST.
+ *
+ * @param bcast  The BROADCAST.
+ * @param lenp  Location in which the length of the payload is stored.
+ * @return  The payload.
+ */
+const void *bcast_data(BROADCAST *bcast, size_t *lenp);
+
+/*
+ * Increase the reference count on a BROADCAST by one.
+ *
+ * @return  The same BROADCAST.
+ */
+BROADCAST *bcast_ref(BROADCAST *bcast);
+
+/*
+ * Decrease the reference count on a BROADCAST by one, freeing it when
+ * the count reaches zero.  The argument is untyped, so that this can be
+ * given as the release function of a payload sent with
+ * client_send_packet_shared().
+ *
+ * @param bcast  The BROADCAST.
+ */
+void bcast_unref(void *bcast);
+
+#endif
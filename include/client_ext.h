@@ -0,0 +1,284 @@
+#ifndef CLIENT_EXT_H
+#define CLIENT_EXT_H
+
+#include "client.h"
+#include "matchmaker.h"
+#include "cluster.h"
+
+/*
+ * Extensions to the CLIENT interface used by other modules of the server.
+ */
+
+/*
+ * The number of invitation IDs of a CLIENT, which are carried in the
+ * 8-bit id field of a packet header.
+ */
+#define CLIENT_MAX_INVITATIONS 256
+
+/*
+ * The number of games a CLIENT can watch at once.  Each game watched
+ * takes one of its invitation IDs.
+ */
+#define CLIENT_MAX_WATCHES 16
+
+/*
+ * Get the client registry in which a CLIENT was created.
+ *
+ * @param client  The CLIENT to be queried.
+ * @return  The CLIENT_REGISTRY passed to client_create().
+ */
+CLIENT_REGISTRY *client_get_registry(CLIENT *client);
+
+/*
+ * Record or retrieve the index of the registry slot that holds a CLIENT,
+ * so that the registry can unregister it without searching.  These are
+ * intended for use only by the client registry.
+ */
+void client_set_slot(CLIENT *client, int slot);
+int client_get_slot(CLIENT *client);
+
+/*
+ * Stop sending to a CLIENT and discard any packets still queued for it.
+ * Once this returns, nothing more will be written to the client's file
+ * descriptor, which may then be closed.
+ *
+ * @param client  The CLIENT whose connection is being closed.
+ */
+void client_shutdown_output(CLIENT *client);
+
+/*
+ * Wait until everything queued for a CLIENT has been written to its
+ * connection.  This is only meaningful once nothing more is being sent
+ * to the client.
+ *
+ * @param client  The CLIENT.
+ * @param timeout  The longest time to wait, in milliseconds.
+ * @return 0 if the queue is empty, -1 if it could not be emptied in
+ * time or the connection has failed.
+ */
+int client_flush_output(CLIENT *client, int timeout);
+
+/*
+ * Cork or uncork the output of a CLIENT, as with outq_cork() and
+ * outq_uncork(), so that the packets sent to it while a batch of its
+ * requests is handled are written out together.
+ *
+ * @param client  The CLIENT.
+ */
+void client_cork_output(CLIENT *client);
+void client_uncork_output(CLIENT *client);
+
+/*
+ * Get the number of packets queued for a CLIENT that have not yet been
+ * written to its connection.
+ *
+ * @param client  The CLIENT.
+ * @return  The number of packets, or -1 if its connection has failed.
+ */
+int client_output_backlog(CLIENT *client);
+
+/*
+ * Send a packet to a client without copying its payload.  This is the
+ * same as client_send_packet(), except that the payload is referenced
+ * until it has been written, and release (if not NULL) is then called
+ * with arg.  release is also called if the packet cannot be queued.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent.
+ * @param data  Data payload to be sent, or NULL if none.
+ * @param release  Function to be called once the payload is no longer
+ * needed, or NULL.
+ * @param arg  Argument to be passed to release.
+ * @return 0 if the packet was queued, -1 otherwise.
+ */
+int client_send_packet_shared(CLIENT *client, JEUX_PACKET_HEADER *pkt, const void *data,
+			      void (*release)(void *), void *arg);
+
+/*
+ * Get a best move for a CLIENT in a game in progress, from the
+ * perfect-play solver.
+ *
+ * @param client  The CLIENT asking for the move.
+ * @param id  The ID assigned by the CLIENT to the INVITATION containing
+ * the GAME.
+ * @param buf  The buffer into which the move is stored, as for
+ * game_hint().
+ * @param len  The size of the buffer.
+ * @param outcomep  Location in which the predicted outcome is stored,
+ * as for game_hint().
+ * @return 0 if a move was found, -1 if there is no game in progress with
+ * that ID or the CLIENT is not on the move in it.
+ */
+int client_hint(CLIENT *client, int id, char *buf, size_t len, GAME_ROLE *outcomep);
+
+/*
+ * Start a game between two clients chosen by the matchmaker, without an
+ * INVITE or ACCEPT from either: an INVITATION is made and accepted on
+ * their behalf, and each is sent an ACCEPTED packet with its ID for the
+ * INVITATION and its role in the game.
+ *
+ * @param first  The CLIENT who is to play first.
+ * @param second  The CLIENT who is to play second.
+ * @param failedp  Location in which, if the game could not be started,
+ * the client on whose account it could not be is stored, or NULL if
+ * neither is to blame.
+ * @return 0 if the game was started, -1 if either client is no longer
+ * logged in or has no free invitation ID, or the game could not be made.
+ */
+int client_make_match(CLIENT *first, CLIENT *second, CLIENT **failedp);
+
+/*
+ * Start watching, as a spectator, the game in progress of a player
+ * logged in on this server.  The spectator is sent the ACK to its WATCH
+ * request, with the watch ID and the current state of the game, before
+ * any update of the game, and is then sent a MOVED packet after every
+ * move and an ENDED packet once the game is over, which ends the watch.
+ *
+ * @param client  The CLIENT that is to watch.
+ * @param player  The CLIENT of the player whose game is to be watched.
+ * @return  The watch ID, which the spectator has been sent, or -1 if the
+ * player is not playing, or the spectator is the player, is not logged
+ * in, or is already watching CLIENT_MAX_WATCHES games; the caller then
+ * sends the NACK.
+ */
+int client_watch(CLIENT *client, CLIENT *player);
+
+/*
+ * Stop watching a game.
+ *
+ * @param client  The spectator.
+ * @param id  The watch ID.
+ * @return 0 if the CLIENT has stopped watching, -1 if it was not
+ * watching a game under that ID.
+ */
+int client_unwatch(CLIENT *client, int id);
+
+/*
+ * Record or retrieve the matchmaking queue entry of a CLIENT, which is
+ * NULL when it is not queued.  These are intended for use only by the
+ * matchmaker, under its own lock.
+ */
+void client_set_match(CLIENT *client, MATCH_ENTRY *entry);
+MATCH_ENTRY *client_get_match(CLIENT *client);
+
+/*
+ * Get the INVITATION that a CLIENT knows by a specified ID.
+ *
+ * @param client  The CLIENT.
+ * @param id  The ID.
+ * @return  The INVITATION, with its reference count incremented, or NULL
+ * if the CLIENT has no INVITATION with that ID.
+ */
+INVITATION *client_get_invitation(CLIENT *client, int id);
+
+/*
+ * Get the key under which the requests of a CLIENT concerning one of its
+ * INVITATIONs are handled, which is the same for both of its clients, so
+ * that the moves of a game are handled together.
+ *
+ * @param client  The CLIENT.
+ * @param id  The ID by which the CLIENT knows the INVITATION.
+ * @return  The key of the INVITATION, or that of the CLIENT itself if it
+ * has no INVITATION with that ID.
+ */
+uintptr_t client_invitation_key(CLIENT *client, int id);
+
+/*
+ * Re-create an INVITATION between two logged-in clients under the IDs by
+ * which each of them already knows it, as when it is handed over by
+ * another server process.  No packets are sent.
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param sourceId  The ID by which the source knows it.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param targetId  The ID by which the target knows it.
+ * @param source_role  The GAME_ROLE to be played by the source.
+ * @param target_role  The GAME_ROLE to be played by the target.
+ * @param game  The GAME in progress, whose reference is taken over, or
+ * NULL if the INVITATION has not been accepted.
+ * @return 0 if the INVITATION was restored, -1 if either ID is in use.
+ */
+int client_restore_invitation(CLIENT *source, int sourceId, CLIENT *target, int targetId,
+			      GAME_ROLE source_role, GAME_ROLE target_role, GAME *game);
+
+/*
+ * Create a CLIENT that stands for a user logged in on another node of a
+ * cluster.  It has no connection: every packet sent to it is relayed
+ * with cluster_relay() to the user's home node instead.  It is not
+ * registered in the client registry, but once logged in its name is in
+ * the registry's index, so that creg_lookup() finds it.
+ *
+ * @param creg  The client registry in whose index it is to be logged in.
+ * @param node  The home node of the user.
+ * @param session  The session of the user on that node.
+ * @param name  The username, which is copied.
+ * @return  The new CLIENT, with a reference count of one, or NULL.
+ */
+CLIENT *client_create_remote(CLIENT_REGISTRY *creg, int node, uint64_t session, const char *name);
+
+/*
+ * Reserve a free invitation ID of a CLIENT without an INVITATION, for a
+ * game that another node hosts, or release such an ID.  A reserved ID
+ * is refused by all the client_*() operations that take an ID.
+ *
+ * @return  The reserved ID, or -1 if the CLIENT has no free ID.
+ */
+int client_reserve_id(CLIENT *client);
+void client_release_id(CLIENT *client, int id);
+
+/*
+ * Record or retrieve the cluster session of a CLIENT, which is NULL
+ * unless it has claimed a name with cluster_claim().  These are
+ * intended for use only by the cluster module.
+ */
+void client_set_cluster(CLIENT *client, CLUSTER_SESSION *session);
+CLUSTER_SESSION *client_get_cluster(CLIENT *client);
+
+/*
+ * Set the timeouts, in seconds, of which 0 disables each.  This is
+ * intended to be called once, during startup.
+ *
+ * A connection from which no packet has been received for the idle
+ * timeout is shut down, which logs its client out.  An INVITATION still
+ * open after the invitation timeout is withdrawn, as if it had been
+ * revoked and declined at once: its target is sent REVOKED and its
+ * source DECLINED.  A player who has had the move for the move timeout
+ * resigns the game, with the RESIGNED and ENDED packets of a
+ * resignation.  Whoever hosts a game times it out, so a remote CLIENT
+ * can lose a game on time, but it has no connection to time out.
+ *
+ * @param idle  The idle timeout.
+ * @param invite  The invitation timeout.
+ * @param move  The move timeout.
+ */
+void client_set_timeouts(int idle, int invite, int move);
+
+/*
+ * Exempt a connection from the idle timeout: that of the computer
+ * opponent, which only ever answers.  This must be called before the
+ * CLIENT for the connection is created.
+ *
+ * @param fd  The descriptor of the connection.
+ */
+void client_exempt_idle(int fd);
+
+/*
+ * Record that a packet has been received from a CLIENT, which is all the
+ * idle timeout costs a packet: the timer is not moved, but checks the
+ * time of the last packet when it expires, and is set again for the time
+ * the client will have been idle for long enough.
+ *
+ * @param client  The CLIENT.
+ */
+void client_touch(CLIENT *client);
+
+/*
+ * Stop timing out a CLIENT whose connection is being closed, so that
+ * its descriptor is left alone once it has been closed, and release the
+ * reference held for its idle timer.
+ *
+ * @param client  The CLIENT.
+ */
+void client_stop_idle(CLIENT *client);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef CLIENT_REGISTRY_EXT_H
+#define CLIENT_REGISTRY_EXT_H
+
+#include "client_registry.h"
+
+/*
+ * Extensions to the client registry interface.
+ *
+ * Besides its array of registered clients, the registry maintains a
+ * username index that maps the name of each logged-in player to its
+ * CLIENT, so that creg_lookup() does not have to scan every slot.  The
+ * index is split into shards, each protected by its own reader-writer
+ * lock, so that lookups from different service threads proceed in
+ * parallel and only logins and logouts take a lock exclusively.
+ */
+
+/*
+ * Initialize a new client registry able to hold a specified number of
+ * simultaneously connected clients.  creg_init() is equivalent to
+ * creg_init_capacity(MAX_CLIENTS).
+ *
+ * @param capacity  The maximum number of registered clients.
+ * @return  the newly initialized client registry, or NULL if
+ * initialization fails.
+ */
+CLIENT_REGISTRY *creg_init_capacity(int capacity);
+
+/*
+ * Get the number of clients currently registered.
+ *
+ * @param cr  The client registry.
+ * @return  The number of registered clients.
+ */
+int creg_count(CLIENT_REGISTRY *cr);
+
+/*
+ * Add a username to the registry's index of logged-in clients.
+ * This is called by client_login(), and fails if some other CLIENT is
+ * already indexed under the same name, which is what makes it
+ * impossible for two clients to log in as the same player.
+ *
+ * @param cr  The client registry.
+ * @param name  The username, which must remain valid until the entry is
+ * removed.
+ * @param client  The CLIENT that has logged in under the name.
+ * @return 0 if the entry was added, -1 if the name is already in use.
+ */
+int creg_index_add(CLIENT_REGISTRY *cr, char *name, CLIENT *client);
+
+/*
+ * Remove a username from the registry's index of logged-in clients.
+ * This is called by client_logout().
+ *
+ * @param cr  The client registry.
+ * @param name  The username under which the client was indexed.
+ * @param client  The CLIENT that is logging out.
+ * @return 0 if the entry was removed, -1 if there was no such entry.
+ */
+int creg_index_remove(CLIENT_REGISTRY *cr, char *name, CLIENT *client);
+
+/*
+ * A read-only snapshot of the list of logged-in players, serialized as
+ * the payload of the ACK sent in response to USERS: one "name\trating\n"
+ * line per player.  Snapshots are shared by all requests made while
+ * nothing has changed, and are reference counted.
+ */
+typedef struct creg_users CREG_USERS;
+
+/*
+ * Get a snapshot of the logged-in players.  The registry keeps the most
+ * recent snapshot, together with the login/logout version and rating
+ * epoch it was built at, and only rebuilds it when one of these has
+ * moved on.  The returned snapshot has had its reference count
+ * incremented to account for the reference returned.
+ *
+ * @param cr  The client registry.
+ * @return  The snapshot, or NULL if memory could not be allocated.
+ */
+CREG_USERS *creg_users_snapshot(CLIENT_REGISTRY *cr);
+
+/*
+ * Get the serialized contents of a snapshot.
+ *
+ * @param users  The snapshot.
+ * @param lenp  Location in which the length of the contents is stored.
+ * @return  The contents, which are not NUL-terminated.
+ */
+const char *creg_users_data(CREG_USERS *users, size_t *lenp);
+
+/*
+ * Release a reference to a snapshot obtained from creg_users_snapshot().
+ *
+ * @param users  The snapshot.
+ */
+void creg_users_unref(CREG_USERS *users);
+
+/*
+ * Shut down the sockets for connections to all currently registered
+ * clients in both directions, as creg_shutdown_all() does for writing.
+ * This is for a shutdown that cannot wait any longer for clients that do
+ * not close their end of the connection.
+ *
+ * @param cr  The client registry.
+ */
+void creg_abort_all(CLIENT_REGISTRY *cr);
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "client_registry.h"
+#include "client.h"
+
+/*
+ * Sharding of the server across several processes or hosts.
+ *
+ * Each server process is a node of a cluster, numbered from 0, and all
+ * the nodes listen for clients on the same port, with SO_REUSEPORT so
+ * that the kernel spreads connections over the processes of one host.
+ * A client is served entirely by the node that accepted its connection,
+ * which is its home node.  The nodes are told each other's addresses,
+ * and every node keeps one persistent TCP link to each of the others,
+ * over which messages are batched: whatever has been queued for a peer
+ * while the previous batch was being written goes out in a single
+ * write.
+ *
+ * Which node a username is logged in on is recorded in a directory that
+ * is itself sharded: the entry for a name is kept by the node the hash
+ * of the name selects.  A LOGIN claims the name there, and is refused if
+ * the user is logged in on any node.
+ *
+ * A game is played on the node of the player who sent the INVITE.  A
+ * user logged in elsewhere is represented there by a remote CLIENT,
+ * which is logged in and found by creg_lookup() like any other, but has
+ * no connection: the packets sent to it are relayed to the user's home
+ * node.  There, the invitation is given one of the user's own IDs, and
+ * requests that name that ID are forwarded to the node holding the
+ * game, which carries them out on the remote CLIENT and relays back the
+ * ACK or NACK.  The home node waits for it before handling the client's
+ * next request, so that responses stay in order.
+ *
+ * When the link from a peer is lost, the peer is taken to have gone:
+ * its users' directory entries and remote CLIENTs are discarded, which
+ * resigns or revokes their games here, and the games they were hosting
+ * for local users are reported to them as resigned or revoked.  A peer
+ * that leaves a forwarded request unanswered for CLUSTER_TIMEOUT_MS is
+ * taken to have gone in the same way, and both links with it are shut
+ * down so that it does the same, rather than the request being refused
+ * while the peer may still carry it out.
+ *
+ * USERS and MATCH only consider the users of the node handling them,
+ * and the result of a game between users of different nodes is posted
+ * to the ratings kept by the node that hosted it.
+ */
+
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_TIMEOUT_MS 2000
+#define CLUSTER_RETRY_MS 200
+#define CLUSTER_LINK_MAX (4 << 20)
+
+typedef struct cluster_session CLUSTER_SESSION;
+
+/*
+ * Configure this process as a node of a cluster.  This is intended to be
+ * called once, during startup.
+ *
+ * @param node  The number of this node.
+ * @param peers  Comma-separated "<host>:<port>" addresses of the links
+ * of all the nodes, in order of node number, including this one, whose
+ * entry gives the port on which it listens for links.
+ * @return 0 if the configuration is valid, otherwise -1.
+ */
+int cluster_configure(int node, char *peers);
+
+/*
+ * Determine whether this process is a node of a cluster.
+ *
+ * @return 1 if cluster_configure() has been called, otherwise 0.
+ */
+int cluster_enabled(void);
+
+/*
+ * Open the socket on which clients are accepted, shared with the other
+ * processes listening on the same port.
+ *
+ * @param port  The port on which clients are accepted.
+ * @return  The listening socket, or -1 if it could not be opened.
+ */
+int cluster_listen(char *port);
+
+/*
+ * Start accepting links from the other nodes and connecting to them.
+ *
+ * @return 0 if the threads were started, otherwise -1.
+ */
+int cluster_start(void);
+
+/*
+ * Claim a username in the directory for a client of this node.  This is
+ * done before the client is logged in, which must be followed by
+ * cluster_logout() if it fails.
+ *
+ * @param client  The client logging in.
+ * @param name  The username.
+ * @return 0 if the name was claimed, or if this is not a cluster, -1 if
+ * it is logged in elsewhere or the directory could not be reached.
+ */
+int cluster_claim(CLIENT *client, char *name);
+
+/*
+ * Release the username claimed for a client once it has been logged
+ * out, and tell the other nodes that the user has gone.
+ *
+ * @param client  The client, which need not have claimed a name.
+ */
+void cluster_logout(CLIENT *client);
+
+/*
+ * Find a user who is logged in on another node.
+ *
+ * @param name  The username.
+ * @return  The remote CLIENT for the user, with its reference count
+ * incremented, or NULL if the user is not logged in on another node.
+ */
+CLIENT *cluster_lookup(char *name);
+
+/*
+ * Forward a request that refers to a game hosted by another node, and
+ * send the client the ACK or NACK relayed back.
+ *
+ * @param client  The client from which the request was received.
+ * @param hdr  The header of the request.
+ * @param payload  The NUL-terminated payload of the request, or NULL.
+ * @return 1 if the request was forwarded and answered, 0 if it is to be
+ * handled by this node.
+ */
+int cluster_forward(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Relay a packet sent to a remote CLIENT to the home node of its user.
+ * This is intended for use only by client_send_packet().
+ *
+ * @param node  The home node.
+ * @param session  The session of the user on that node.
+ * @param name  The username.
+ * @param pkt  The header of the packet, with its size in host byte
+ * order; only its type, id and role are relayed.
+ * @param data  The payload, or NULL.
+ * @param len  The length of the payload.
+ * @return 0 if the packet was queued on the link, otherwise -1.
+ */
+int cluster_relay(int node, uint64_t session, const char *name, JEUX_PACKET_HEADER *pkt,
+		  const void *data, size_t len);
+
+/*
+ * Log out the remote CLIENTs, send what is still queued on the links and
+ * stop the link threads.  This is called once all local clients have
+ * gone.
+ */
+void cluster_stop(void);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef GAME_ENGINE_H
+#define GAME_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/*
+ * Game engines, which supply the rules behind the GAME interface.
+ *
+ * A GAME holds the state common to all games (its reference count,
+ * lock, result and the side to move) and an opaque block of at most
+ * GAME_STATE_SIZE bytes that belongs to its GAME_ENGINE.  Every operation
+ * on the board goes through the engine, so the same server can host
+ * tic-tac-toe, which is played from pre-computed tables, or a k-in-a-row
+ * game on a board of up to GAME_MAX_WIDTH by GAME_MAX_HEIGHT cells.
+ * The engine operations are called with the GAME locked.
+ *
+ * Pieces are numbered as in game.c: 1 for X, who moves first, and 0
+ * for O.
+ */
+
+#define GAME_STATE_SIZE 1024
+#define GAME_MAX_WIDTH 19
+#define GAME_MAX_HEIGHT 19
+
+typedef struct game_engine GAME_ENGINE;
+
+/*
+ * A move, as parsed by an engine.  The cell is engine-specific: for
+ * tic-tac-toe it is the cell number (1-9), and for a k-in-a-row game it
+ * is row * width + column, or -1 - column for a piece dropped into a
+ * column of a game with gravity.
+ */
+struct game_move {
+	const GAME_ENGINE *engine;
+	int piece;
+	int cell;
+};
+
+struct game_engine {
+	const char *name;
+	int width;
+	int height;
+	int connect;		/* length of a winning line */
+	int gravity;		/* pieces drop to the lowest free cell of a column */
+	size_t stateSize;	/* size of the state of a game */
+
+	/*
+	 * Initialize the state of a new game.
+	 */
+	void (*create)(const GAME_ENGINE *engine, void *state);
+
+	/*
+	 * Interpret a string as a move, without checking that it is legal.
+	 *
+	 * @return 0 if the string could be interpreted, otherwise -1.
+	 */
+	int (*parse)(const GAME_ENGINE *engine, const void *state, char *str, GAME_MOVE *move);
+
+	/*
+	 * Apply a move by the side whose turn it is.
+	 *
+	 * @return 0 if the move was legal and has been applied, otherwise -1.
+	 */
+	int (*apply)(const GAME_ENGINE *engine, void *state, const GAME_MOVE *move);
+
+	/*
+	 * Render a move in a form that parse() accepts.
+	 *
+	 * @return  The length of the text, or -1 if the buffer is too small.
+	 */
+	int (*unparse_move)(const GAME_ENGINE *engine, const GAME_MOVE *move, char *buf, size_t len);
+
+	/*
+	 * Render the board in a form suitable for human users.
+	 *
+	 * @return  The length of the text, or -1 if the buffer is too small.
+	 */
+	int (*unparse_state)(const GAME_ENGINE *engine, const void *state, char *buf, size_t len);
+
+	/*
+	 * Render the payload of a MOVED packet, as described for
+	 * game_render_moved().  An engine may return immutable text of its
+	 * own instead of rendering into the buffer.
+	 */
+	const char *(*render_moved)(const GAME_ENGINE *engine, const void *state, char *buf, size_t len,
+	    size_t *lenp);
+
+	/*
+	 * Determine whether the game has ended by the last move applied.
+	 *
+	 * @param winnerp  Location in which the GAME_ROLE of the winner, or
+	 * NULL_ROLE for a draw, is stored if the game is over.
+	 * @return 1 if the game is over, otherwise 0.
+	 */
+	int (*is_over)(const GAME_ENGINE *engine, const void *state, GAME_ROLE *winnerp);
+
+	/*
+	 * Suggest a move for the side to move, as described for game_hint().
+	 * This may be NULL if the engine cannot give hints.
+	 *
+	 * @return 0 if a move was found, otherwise -1.
+	 */
+	int (*hint)(const GAME_ENGINE *engine, const void *state, int piece, GAME_MOVE *move,
+	    GAME_ROLE *outcomep);
+};
+
+/*
+ * The tic-tac-toe engine, which is the default.
+ */
+extern const GAME_ENGINE game_engine_tictactoe;
+
+/*
+ * Set up the engine for a game named by a specification, which is
+ * either the name of a built-in variant ("tictactoe", "gomoku", which is
+ * five in a row on 15x15, "gomoku19", or "connect4", which is four in a
+ * row on 7x6 with gravity), or a k-in-a-row game given as
+ * "<width>x<height>:<k>", optionally followed by ":gravity".
+ *
+ * @param engine  The engine to be set up.
+ * @param spec  The specification.
+ * @return 0 if the specification is valid, otherwise -1.
+ */
+int game_engine_init(GAME_ENGINE *engine, char *spec);
+
+/*
+ * Initialize an engine for a k-in-a-row game.
+ */
+void game_mnk_init(GAME_ENGINE *engine, const char *name, int width, int height, int connect, int gravity);
+
+#endif
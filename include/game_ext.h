@@ -0,0 +1,252 @@
+#ifndef GAME_EXT_H
+#define GAME_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+#include "game_engine.h"
+#include "client_registry.h"
+#include "broadcast.h"
+
+/*
+ * Additional GAME operations that avoid the heap allocations implied by
+ * the interfaces in game.h, for use on the move-handling fast path.
+ */
+
+/*
+ * Maximum length of the string produced by game_unparse_state(), in any
+ * game, not counting the terminating NUL.
+ */
+#define GAME_STATE_MAX 1023
+
+/*
+ * Maximum length of the payload of a MOVED packet.
+ */
+#define GAME_MOVED_MAX (1 + GAME_STATE_MAX + 11)
+
+/*
+ * Set the engine used by games created from now on.  Until this is
+ * called, games are tic-tac-toe.
+ *
+ * @param engine  The engine, which must remain valid for as long as any
+ * GAME uses it.
+ */
+void game_set_engine(const GAME_ENGINE *engine);
+
+/*
+ * Get the engine used by games created from now on.
+ */
+const GAME_ENGINE *game_get_engine(void);
+
+/*
+ * Besides the text form, a tic-tac-toe move can be given in binary as
+ * the payload of a MOVE packet: one byte with the cell number (1-9, not
+ * the digit character), followed by one byte with the piece.
+ */
+#define GAME_MOVE_X 1
+#define GAME_MOVE_O 2
+
+/*
+ * Parse a move and, if it can be interpreted, apply it to a GAME.
+ *
+ * @param game  The GAME in which the move is to be made.
+ * @param role  The GAME_ROLE of the player making the move.
+ * @param str  The string that is to be interpreted as a move.
+ * @param movep  Location in which the move applied is stored, or NULL.
+ * @return 0 if the move was parsed and applied, otherwise -1.
+ */
+int game_make_move(GAME *game, GAME_ROLE role, char *str, GAME_MOVE *movep);
+
+/*
+ * Render the current GAME state, in the same format as
+ * game_unparse_state(), into caller-supplied storage.
+ *
+ * @param game  The GAME whose state is to be rendered.
+ * @param buf  The buffer into which the NUL-terminated description is
+ * to be stored.
+ * @param len  The size of the buffer; GAME_STATE_MAX + 1 is always
+ * enough.
+ * @return  The length of the description, or -1 if the buffer is too small.
+ */
+int game_unparse_state_into(GAME *game, char *buf, size_t len);
+
+/*
+ * Get the payload of the MOVED packet that reports the current GAME
+ * state: a newline, the board as given by game_unparse_state() and,
+ * unless the game is over, a line saying which side is to move.  For
+ * tic-tac-toe, the text comes from a table of pre-rendered boards and
+ * is never modified, so it can be sent without copying; other games
+ * render it into the buffer supplied.
+ *
+ * @param game  The GAME whose state is to be reported.
+ * @param buf  A buffer of at least GAME_MOVED_MAX bytes.
+ * @param len  The size of the buffer.
+ * @param lenp  Location in which the length of the text is stored.
+ * @return  The text, which is not NUL-terminated: either buf, or
+ * immutable text that outlives the GAME.
+ */
+const char *game_render_moved(GAME *game, char *buf, size_t len, size_t *lenp);
+
+/*
+ * Get the payload of the MOVED packet that reports the current GAME
+ * state, as given by game_render_moved(), in a BROADCAST that can be
+ * sent to any number of spectators.  It is rendered only once for each
+ * position.
+ *
+ * @param game  The GAME whose state is to be reported.
+ * @param plyp  Location in which the number of moves made in the
+ * position reported is stored.
+ * @return  The payload, with its reference count incremented, or NULL
+ * if it could not be allocated.
+ */
+BROADCAST *game_get_update(GAME *game, unsigned int *plyp);
+
+/*
+ * The spectators of a GAME: the clients watching it, each with the ID by
+ * which it knows the GAME and the number of moves after which it was
+ * last sent the state.  The spectators are protected by a lock of their
+ * own, which is held while an update is sent to them.  It is taken while
+ * the players of the GAME are still locked by the move or resignation
+ * that caused the update, so that updates reach every spectator in the
+ * order in which they were made.  CLIENTs may therefore be locked before
+ * the spectators, but never while they are locked.
+ */
+typedef struct game_watcher {
+	CLIENT *client;
+	int id;
+	unsigned int ply;
+} GAME_WATCHER;
+
+void game_lock_watchers(GAME *game);
+void game_unlock_watchers(GAME *game);
+
+/*
+ * Add a spectator to a GAME, whose spectators must be locked.  A
+ * reference to the CLIENT is held until it is removed.
+ *
+ * @param game  The GAME.
+ * @param client  The spectator.
+ * @param id  The ID by which the spectator knows the GAME.
+ * @param ply  The number of moves after which it has been sent the state.
+ * @return 0 if the spectator was added, -1 if the GAME has ended for its
+ * spectators or no memory was available.
+ */
+int game_add_watcher(GAME *game, CLIENT *client, int id, unsigned int ply);
+
+/*
+ * Remove a spectator from a GAME, whose spectators must be locked.
+ *
+ * @return 0 if the spectator was removed, -1 if it was not watching
+ * under that ID.
+ */
+int game_remove_watcher(GAME *game, CLIENT *client, int id);
+
+/*
+ * Get the spectators of a GAME, whose spectators must be locked.  The
+ * entries can be updated in place until they are unlocked.
+ *
+ * @param game  The GAME.
+ * @param countp  Location in which the number of spectators is stored.
+ * @return  The spectators.
+ */
+GAME_WATCHER *game_get_watchers(GAME *game, int *countp);
+
+/*
+ * Remove all the spectators of a GAME that has ended, whose spectators
+ * must be locked, and refuse any more.  Their references are handed to
+ * the caller, which must release them and free the array.
+ *
+ * @param game  The GAME.
+ * @param countp  Location in which the number of spectators is stored.
+ * @return  The spectators, or NULL if there were none.
+ */
+GAME_WATCHER *game_take_watchers(GAME *game, int *countp);
+
+/*
+ * Maximum length of a move in the text form produced by
+ * game_unparse_move(), such as "5->X" or "s19->O", not counting the
+ * terminating NUL.
+ */
+#define GAME_MOVE_MAX 6
+
+/*
+ * Find a best move for the player in a specified role.  In tic-tac-toe
+ * this comes from the perfect-play solver; a k-in-a-row game completes
+ * or blocks a line if it can, and otherwise plays next to the pieces on
+ * the board.
+ *
+ * @param game  The GAME in which the move is to be made.
+ * @param role  The GAME_ROLE of the player asking for the move.
+ * @param buf  The buffer into which the move is stored, NUL-terminated,
+ * in the text form produced by game_unparse_move().
+ * @param len  The size of the buffer; GAME_MOVE_MAX + 1 is always
+ * enough.
+ * @param outcomep  Location in which the GAME_ROLE of the winner under
+ * perfect play from here is stored, NULL_ROLE if it is a draw or, in a
+ * game without a solver, unless the move wins at once.
+ * @return 0 if a move was found, -1 if the game is over, the role is not
+ * the one on the move, or the buffer is too small.
+ */
+int game_hint(GAME *game, GAME_ROLE role, char *buf, size_t len, GAME_ROLE *outcomep);
+
+/*
+ * Set the ID under which a GAME is recorded in the game journal.
+ */
+void game_set_id(GAME *game, uint64_t id);
+
+/*
+ * Get the ID under which a GAME is recorded in the game journal.
+ *
+ * @return  The ID, or 0 if the GAME is not being recorded.
+ */
+uint64_t game_get_id(GAME *game);
+
+/*
+ * Get the number of moves that have been made in a GAME.
+ */
+unsigned int game_get_ply(GAME *game);
+
+/*
+ * Get the time at which the player to move in a GAME was given the move,
+ * for a move clock.  The first player is to move after an even number of
+ * moves.  A GAME restored by game_restore() gives the move afresh.
+ *
+ * @param game  The GAME.
+ * @param plyp  Location in which the number of moves made is stored.
+ * @return  The time of the last move, or of the start of the GAME if no
+ * move has been made, as given by timer_now().
+ */
+uint64_t game_get_move_time(GAME *game, unsigned int *plyp);
+
+/*
+ * The longest position saved by game_save().
+ */
+#define GAME_SAVE_MAX (1 + sizeof(uint32_t) + sizeof(uint64_t) + GAME_STATE_SIZE)
+
+/*
+ * Save the position of a GAME in progress, for handing it over to
+ * another server process running the same engine: the piece to move,
+ * the number of moves made and the journal ID, followed by the engine's
+ * state block.
+ *
+ * @param game  The GAME to be saved.
+ * @param buf  The buffer into which the position is stored.
+ * @param len  The size of the buffer; GAME_SAVE_MAX is always enough.
+ * @return  The length of the saved position, or 0 if the buffer is too
+ * small.
+ */
+size_t game_save(GAME *game, void *buf, size_t len);
+
+/*
+ * Create a GAME, using the current engine, in a position saved by
+ * game_save().
+ *
+ * @param buf  The saved position.
+ * @param len  Its length.
+ * @return  The new GAME, with a reference count of one, or NULL if the
+ * position does not belong to the current engine.
+ */
+GAME *game_restore(const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef HANDLER_POOL_H
+#define HANDLER_POOL_H
+
+#include <stdint.h>
+
+/*
+ * A work-stealing pool of handler workers, to which the reactor hands
+ * connections with requests to be handled, so that its threads do
+ * nothing but read sockets and frame packets, and a request that takes
+ * long, such as one that ends a game and posts its result, delays no
+ * other connection served by the same reactor worker.
+ *
+ * Each handler worker is pinned to a CPU and has a deque of tasks of its
+ * own.  A task is submitted under a key, which selects the worker whose
+ * deque it is added to, so that the tasks for one game, which share its
+ * key, are normally all handled on the same CPU while different games
+ * are spread over all of them.  A worker takes the oldest task from the
+ * head of its own deque, and a worker whose deque is empty steals from
+ * the tail of another's, so that a worker held up by one task does not
+ * hold up the rest of its deque.  Workers with nothing to do sleep, and
+ * whoever submits a task to a worker that is busy wakes one of them to
+ * steal it.
+ *
+ * Tasks are intrusive: a HPOOL_TASK is embedded in whatever it works on,
+ * so submitting one allocates nothing.  Nothing is guaranteed about the
+ * order in which tasks are run, so whatever has to be done in order,
+ * such as the requests of one connection, must be submitted one task at
+ * a time.
+ */
+
+typedef struct hpool_task {
+	void (*run)(struct hpool_task *task);
+	struct hpool_task *prev;
+	struct hpool_task *next;
+} HPOOL_TASK;
+
+/*
+ * Start the handler workers.  This is intended to be called once, during
+ * startup.
+ *
+ * @param nworkers  The number of workers, which must be at least one.
+ * Worker i is pinned to the i-th of the CPUs that the process may run on,
+ * counting round again if there are more workers than CPUs.
+ * @return 0 if the workers were started, otherwise -1.
+ */
+int hpool_start(int nworkers);
+
+/*
+ * Determine whether the handler workers have been started.
+ *
+ * @return 1 if they have, otherwise 0.
+ */
+int hpool_enabled(void);
+
+/*
+ * Submit a task, which must not already be waiting to be run.
+ *
+ * @param task  The task, whose run function is called once, by some
+ * handler worker, with the task as its argument.
+ * @param key  The key that selects the worker to run it, unless another
+ * worker steals it.
+ */
+void hpool_submit(HPOOL_TASK *task, uintptr_t key);
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "client_registry.h"
+#include "player_registry.h"
+#include "proto_buf.h"
+
+/*
+ * Hot restart: handing the server's connections over to a successor.
+ *
+ * A server started with a handoff socket (-H <path>) listens for a
+ * successor on that Unix-domain socket.  A new server started with the
+ * same path connects to it and says which game it plays.  If that is
+ * the game of the running server, the running server stops accepting
+ * connections and freezes its service threads and reactor workers
+ * between packets, so that each connection is left with any input it
+ * has read but not yet handled.  Its computer opponent, which cannot
+ * outlive it, is logged out, and everything queued for the other clients
+ * is written out.
+ *
+ * It then sends the successor its listening socket and the sockets of
+ * all its clients, with SCM_RIGHTS, followed by a snapshot of its state:
+ * the ratings of all its players, the login, matchmaking status and
+ * unhandled input of each client, and the open invitations and games in
+ * progress, each under the IDs its participants know it by.  Once the
+ * successor has acknowledged the snapshot, the old server closes its
+ * rating log or player store and its game journal, and exits without
+ * touching the sockets, and the successor, which has been waiting for it
+ * to exit, restores the snapshot and carries on serving the same
+ * connections.  Clients notice nothing but a short pause, except that
+ * spectators are not handed over: a watch of a game in progress ends
+ * with no ENDED packet, and its ID is free again on the successor.
+ *
+ * If the successor goes away before acknowledging the snapshot, or the
+ * service threads cannot all be frozen within HANDOFF_TIMEOUT_MS, the
+ * old server thaws them and carries on.  A client whose queued output
+ * cannot be written within that time is disconnected rather than handed
+ * over, as its stream could otherwise be left in the middle of a packet.
+ *
+ * Handing over is not supported for a node of a cluster.
+ */
+
+#define HANDOFF_TIMEOUT_MS 2000
+
+/*
+ * A connection frozen for a handoff, as given to handoff_park() by the
+ * thread that services it.
+ */
+typedef struct handoff_conn {
+	CLIENT *client;
+	PROTO_BUF *in;
+	int closed;			/* closed by the handoff; the descriptor remains */
+	int parked;			/* waiting for the handoff to be over */
+	struct handoff_conn *next;
+} HANDOFF_CONN;
+
+/*
+ * Set the pathname of the handoff socket.  This is intended to be
+ * called once, during startup.
+ *
+ * @param path  The pathname, which must remain valid.
+ */
+void handoff_configure(char *path);
+
+/*
+ * Take over from a server already running with the same handoff socket,
+ * if there is one.  The connections and the snapshot are received and
+ * acknowledged, and this waits for the old server to exit, so that its
+ * rating log, player store and metrics port are free to be opened.  The
+ * snapshot is restored later by handoff_restore().
+ *
+ * @return 1 if the state of a predecessor has been received, 0 if there
+ * is no predecessor, or -1 if there is one but the handoff failed.
+ */
+int handoff_receive(void);
+
+/*
+ * Get the listening socket received from the predecessor.
+ *
+ * @return  The socket, or -1 if there was no predecessor.
+ */
+int handoff_listenfd(void);
+
+/*
+ * Restore the state received from the predecessor and start servicing
+ * its connections.  This is done once the registries have been set up
+ * and the rating log or player store opened; players are only added to
+ * the player registry if they have not already been registered.
+ *
+ * @param creg  The client registry.
+ * @param preg  The player registry.
+ * @param useReactor  Whether the connections are to be serviced by the
+ * reactor rather than by threads of their own.
+ * @return  The number of clients restored, or -1 if the state could not
+ * be restored.
+ */
+int handoff_restore(CLIENT_REGISTRY *creg, PLAYER_REGISTRY *preg, int useReactor);
+
+/*
+ * Start listening for a successor on the handoff socket.  When one
+ * connects, the thread that called this function is sent SIGHUP, so
+ * that it stops accepting connections and calls handoff_hand_over().
+ *
+ * @param listenfd  The socket on which the server accepts connections.
+ * @return 0 if the handoff socket was opened, otherwise -1.
+ */
+int handoff_start(int listenfd);
+
+/*
+ * Determine whether a successor is waiting to take over.
+ *
+ * @return 1 if a successor has connected, otherwise 0.
+ */
+int handoff_pending(void);
+
+/*
+ * Hand everything over to the successor that has connected.  This is
+ * called by the thread that accepts connections, once it has stopped.
+ *
+ * @param creg  The client registry.
+ * @param preg  The player registry.
+ * @return 0 if the successor has taken over, and this server must exit
+ * without shutting down its connections, or -1 if it has not, and this
+ * server has resumed servicing them.
+ */
+int handoff_hand_over(CLIENT_REGISTRY *creg, PLAYER_REGISTRY *preg);
+
+/*
+ * Exclude a connection from being handed over: it is closed instead.
+ * This is for the connection of the computer opponent, whose other end
+ * is in this process.
+ *
+ * @param fd  The descriptor of the connection.
+ */
+void handoff_exclude(int fd);
+
+/*
+ * Get the descriptor that becomes readable when service threads are to
+ * freeze, which is to be polled along with their connections.
+ *
+ * @return  The descriptor, or -1 if there is no handoff socket.
+ */
+int handoff_wakefd(void);
+
+/*
+ * Determine whether service threads are to freeze.
+ *
+ * @return 1 if a handoff is in progress, otherwise 0.
+ */
+int handoff_frozen(void);
+
+/*
+ * Offer a frozen connection to the handoff.  The caller must not use
+ * the connection again until handoff_wait() has returned.
+ *
+ * @param conn  The connection, which must stay valid until then.
+ */
+void handoff_park(HANDOFF_CONN *conn);
+
+/*
+ * Wait, after parking one or more connections, until the handoff is
+ * over.  If it succeeds, this never returns.  Otherwise, the parked
+ * connections can be serviced again, except those marked as closed,
+ * which have been logged out and unregistered, and whose descriptors
+ * are to be closed.
+ *
+ * @param conn  One of the connections parked by the caller.
+ */
+void handoff_wait(HANDOFF_CONN *conn);
+
+/*
+ * Record that a service thread is being started for a new connection,
+ * or that it has registered its client, so that a handoff waits for
+ * the connection to be registered before counting the connections to be
+ * frozen.
+ */
+void handoff_service_starting(void);
+void handoff_service_started(void);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear latency histogram, in the style of HDR histograms.
+ *
+ * Values (normally nanoseconds) are counted in buckets whose width
+ * doubles with every power of two, each power of two being split into
+ * HISTOGRAM_SUB_BUCKETS equal sub-buckets, so every recorded value is
+ * known to within about 3% regardless of its magnitude.  Recording is a
+ * couple of shifts and an increment, and histograms kept separately
+ * (one per thread, say) can be merged by adding their counts.
+ *
+ * A HISTOGRAM is not synchronized; each one should be written by only
+ * one thread at a time.
+ */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXP 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+} HISTOGRAM;
+
+static inline void histogram_init(HISTOGRAM *h) {
+	memset(h, 0, sizeof(HISTOGRAM));
+}
+
+static inline int histogram_bucket(uint64_t value) {
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+	int e = 63 - __builtin_clzll(value);
+	if (e > HISTOGRAM_MAX_EXP) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+	return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+		+ ((value >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/*
+ * The smallest value that is counted in a bucket.
+ */
+static inline uint64_t histogram_bucket_value(int bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+	int e = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+	return (HISTOGRAM_SUB_BUCKETS + sub) << (e - HISTOGRAM_SUB_BITS);
+}
+
+static inline void histogram_record(HISTOGRAM *h, uint64_t value) {
+	h->buckets[histogram_bucket(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+/*
+ * Add the counts of one histogram into another.
+ */
+static inline void histogram_merge(HISTOGRAM *into, const HISTOGRAM *from) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		into->buckets[i] += from->buckets[i];
+	}
+	into->count += from->count;
+	into->sum += from->sum;
+	if (from->max > into->max) {
+		into->max = from->max;
+	}
+}
+
+/*
+ * Estimate the value below which the specified fraction of the recorded
+ * values lie.
+ *
+ * @param h  The histogram.
+ * @param fraction  The fraction, between 0 and 1 (0.99 for p99).
+ * @return  The lower bound of the bucket holding that value, or 0 if
+ * nothing has been recorded.
+ */
+static inline uint64_t histogram_percentile(const HISTOGRAM *h, double fraction) {
+	if (h->count == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(fraction * h->count);
+	if (rank >= h->count) {
+		rank = h->count - 1;
+	}
+	uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			uint64_t value = histogram_bucket_value(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+	return h->max;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef INVITATION_EXT_H
+#define INVITATION_EXT_H
+
+#include "invitation.h"
+#include "timer.h"
+
+/*
+ * Extensions to the INVITATION interface.
+ *
+ * Each participant in an INVITATION knows it by an ID of its own, which
+ * indexes that CLIENT's table of invitations.  The INVITATION records
+ * both IDs, so that either participant's ID can be found without
+ * searching.  Each ID is protected by the lock of the corresponding
+ * CLIENT, not by the INVITATION.
+ */
+
+/*
+ * Record the ID by which a participant knows an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The source or the target of the INVITATION.
+ * @param id  The ID, or -1 if the participant no longer holds it.
+ */
+void inv_set_id(INVITATION *inv, CLIENT *client, int id);
+
+/*
+ * Get the ID by which a participant knows an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The source or the target of the INVITATION.
+ * @return  The ID, or -1 if none has been recorded.
+ */
+int inv_get_id(INVITATION *inv, CLIENT *client);
+
+/*
+ * Get the TIMER of an INVITATION, which times it out while it is open
+ * and runs the move clock of its game.  It is created with no function,
+ * which whoever creates the INVITATION supplies with timer_init(), and
+ * it is cancelled when the INVITATION is closed, releasing the
+ * reference held for it.
+ *
+ * @param inv  The INVITATION.
+ * @return  The TIMER.
+ */
+TIMER *inv_get_timer(INVITATION *inv);
+
+/*
+ * Accept an INVITATION with a GAME already in progress, as when it is
+ * handed over by another server process, instead of starting a new one.
+ * If the INVITATION was not previously in the OPEN state then it is an
+ * error.
+ *
+ * @param inv  The INVITATION to be accepted.
+ * @param game  The GAME, whose reference is taken over by the
+ * INVITATION if it is accepted.
+ * @return 0 if the INVITATION was accepted, otherwise -1.
+ */
+int inv_accept_game(INVITATION *inv, GAME *game);
+
+#endif
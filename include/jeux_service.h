@@ -0,0 +1,94 @@
+#ifndef JEUX_SERVICE_H
+#define JEUX_SERVICE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+#include "client_registry.h"
+#include "proto_buf.h"
+
+/*
+ * Request handling shared by the different ways the server can service
+ * its connections.  The thread-per-connection service loop in server.c
+ * and the event-driven reactor both receive packets and hand each one
+ * to jeux_service_packet(), so that the LOGIN/USERS/INVITE/MOVE/...
+ * handlers are implemented exactly once.
+ */
+
+/*
+ * The default in-flight limit of each connection.
+ */
+#define JEUX_PIPELINE_DEFAULT 16
+
+/*
+ * Set the in-flight limit of each connection.  A client may send
+ * requests without waiting for their responses: all the requests that
+ * have been received from it are handled in turn, and their responses
+ * are written together once the last has been handled.  A connection's
+ * requests are only handled, however, while fewer than `depth' packets
+ * queued for it have yet to be written, so that a client that sends
+ * requests faster than it reads the responses is held back rather than
+ * having them pile up.  This is intended to be called once, during
+ * startup.
+ *
+ * @param depth  The limit, which must be at least one.
+ */
+void jeux_service_configure(int depth);
+
+/*
+ * Determine whether another request from a client may be handled, given
+ * its in-flight limit.
+ *
+ * @param client  The CLIENT.
+ * @return 1 if a request may be handled, or 0 if too much of the output
+ * for the client has yet to be written.
+ */
+int jeux_service_ready(CLIENT *client);
+
+/*
+ * Get the key under which a request from a client is to be handled by
+ * the handler pool: that of the game or invitation it concerns, if any,
+ * so that requests concerning the same game are handled together,
+ * otherwise that of the client.
+ *
+ * @param client  The CLIENT from which the request was received.
+ * @param hdr  The header of the request, in network byte order.
+ * @return  The key.
+ */
+uintptr_t jeux_service_key(CLIENT *client, JEUX_PACKET_HEADER *hdr);
+
+/*
+ * Handle a single packet received from a client, sending the ACK or NACK
+ * that answers it.
+ *
+ * @param client  The CLIENT from which the packet was received.
+ * @param hdr  The header of the received packet, in network byte order.
+ * @param payload  The NUL-terminated payload of the packet, or NULL.
+ * @return 0 if the request was handled, -1 if an internal failure
+ * prevented the request from being carried out.
+ */
+int jeux_service_packet(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Tear down the state associated with a client whose connection has
+ * reached EOF: log it out if necessary and unregister it.  The caller is
+ * responsible for closing the file descriptor.
+ *
+ * @param client  The CLIENT whose connection has ended.
+ */
+void jeux_service_close(CLIENT *client);
+
+/*
+ * Start a thread to service a connection that has been handed over by a
+ * predecessor, whose client is already registered.  The connection must
+ * be in blocking mode.
+ *
+ * @param client  The registered CLIENT.
+ * @param in  The input buffer of the connection, as restored, which is
+ * released by the thread.
+ * @return 0 if the thread was started, otherwise -1, in which case the
+ * client has been unregistered and its connection closed.
+ */
+int jeux_service_adopt(CLIENT *client, PROTO_BUF *in);
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "game.h"
+#include "game_engine.h"
+
+/*
+ * Append-only binary journal of the games played.
+ *
+ * Every game started, every move made and every result is recorded as a
+ * fixed-width JOURNAL_RECORD, stamped with the time carried by the
+ * packets that reported it to the players.  Recording a record only
+ * copies it into a ring buffer belonging to the recording thread, so that
+ * threads handling different games never contend; a background thread
+ * empties the rings every JOURNAL_INTERVAL_MS, or as soon as one is half
+ * full, into a single buffer that it writes out in one sequential write.
+ *
+ * The records of a game are recorded in order, but may be recorded by
+ * different threads, so they need not be adjacent or in order in the
+ * journal: a reader puts them back in order by their ply.  The records of
+ * one event, such as a start and the names that follow it, are always
+ * adjacent.  The journal contains nothing but records, so a reader can
+ * map it and step through it, and bin/jeux_replay does so to rebuild
+ * ratings or to audit games.
+ *
+ * Games are numbered from 1, continuing from the highest number already
+ * in the journal when it is opened.
+ */
+
+#define JOURNAL_INTERVAL_MS 50
+#define JOURNAL_RING_RECORDS 1024
+#define JOURNAL_BATCH_RECORDS 32768
+
+#define JOURNAL_START 1
+#define JOURNAL_NAME 2
+#define JOURNAL_MOVE 3
+#define JOURNAL_RESULT 4
+
+#define JOURNAL_NAME_CHUNK 16
+
+/*
+ * A record in the journal, in host byte order.  For each type:
+ *
+ * START: arg gives the lengths of the names of the first and the second
+ * player, which follow in NAME records, those of the first player first.
+ * ply is 0.
+ *
+ * NAME: len bytes of a name, in text, with role saying whose; there is
+ * no time.
+ *
+ * MOVE: role is the role of the player who moved, ply the number of the
+ * move, from 1, and arg the cell and the piece as given by the engine's
+ * GAME_MOVE.
+ *
+ * RESULT: role is the winner, or NULL_ROLE for a draw, ply the number of
+ * moves made, and arg[0] is 1 if the game was resigned.
+ */
+typedef struct journal_record {
+	uint8_t type;
+	uint8_t role;
+	uint16_t len;
+	uint32_t ply;
+	uint64_t game;
+	union {
+		struct {
+			uint32_t sec;
+			uint32_t nsec;
+			int32_t arg[2];
+		};
+		char text[JOURNAL_NAME_CHUNK];
+	};
+} JOURNAL_RECORD;
+
+_Static_assert(sizeof(JOURNAL_RECORD) == 32, "journal records must be 32 bytes");
+
+/*
+ * Open the journal, creating it if it does not exist, and start the
+ * thread that writes it.  A partial record left at its end by a crash is
+ * discarded.  This should be done once, at startup.
+ *
+ * @param path  The pathname of the journal.
+ * @return 0 if the journal was opened, otherwise -1.
+ */
+int journal_open(char *path);
+
+/*
+ * Record the start of a game.  This does nothing if no journal is open.
+ *
+ * @param ts  The time of the start.
+ * @param first  The name of the first player.
+ * @param second  The name of the second player.
+ * @return  The ID under which the game is recorded, or 0 if no journal
+ * is open.
+ */
+uint64_t journal_game_start(const struct timespec *ts, const char *first, const char *second);
+
+/*
+ * Record a move.
+ *
+ * @param ts  The time of the move.
+ * @param game  The ID of the game, as returned by journal_game_start();
+ * nothing is recorded for 0.
+ * @param ply  The number of the move.
+ * @param role  The role of the player who moved.
+ * @param move  The move.
+ */
+void journal_game_move(const struct timespec *ts, uint64_t game, unsigned int ply, GAME_ROLE role,
+		       const GAME_MOVE *move);
+
+/*
+ * Record the result of a game.
+ *
+ * @param ts  The time the game ended.
+ * @param game  The ID of the game; nothing is recorded for 0.
+ * @param ply  The number of moves made.
+ * @param winner  The winner, or NULL_ROLE for a draw.
+ * @param resigned  Whether the game was resigned.
+ */
+void journal_game_result(const struct timespec *ts, uint64_t game, unsigned int ply, GAME_ROLE winner,
+			 int resigned);
+
+/*
+ * Write out everything recorded so far, stop the writing thread and
+ * close the journal.  Nothing is recorded afterwards.
+ */
+void journal_close(void);
+
+#endif
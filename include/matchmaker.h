@@ -0,0 +1,81 @@
+#ifndef MATCHMAKER_H
+#define MATCHMAKER_H
+
+#include "client_registry.h"
+#include "client.h"
+
+/*
+ * Server-side matchmaking.
+ *
+ * A client that sends a MATCH packet is queued under the rating of its
+ * player, in one of MATCH_NUM_BUCKETS buckets of MATCH_BUCKET_WIDTH
+ * rating points each.  A background thread wakes every
+ * MATCH_INTERVAL_MS while at least two clients are waiting and pairs
+ * them in a batch: first those in the same bucket, in the order they
+ * were queued, and then those left over in nearby buckets.  How far
+ * apart the buckets of two clients may be grows by one bucket for every
+ * MATCH_WIDEN_MS that the longer-waiting of them has been queued, so
+ * that nobody waits forever for an opponent of the same strength.  Each
+ * pair is started on a game at once, with client_make_match(), without
+ * either client having to look for the other with USERS or exchange
+ * INVITE and ACCEPT.  A client for whom a game cannot be started, such
+ * as one with no free invitation ID, is sent a NACK and leaves the
+ * queue, and its partner is put back to be matched with someone else.
+ * Pairs whose games cannot be started through the fault of neither are
+ * tried again, at most MATCH_MAX_FAILURES times for either client.
+ */
+
+#define MATCH_BUCKET_WIDTH 50
+#define MATCH_NUM_BUCKETS 64
+#define MATCH_INTERVAL_MS 20
+#define MATCH_WIDEN_MS 1000
+#define MATCH_BATCH 256
+#define MATCH_MAX_FAILURES 3
+
+typedef struct match_entry MATCH_ENTRY;
+
+/*
+ * Start the matchmaking thread.
+ *
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int matchmaker_start(void);
+
+/*
+ * Queue a logged-in client for matchmaking.
+ *
+ * @param client  The client, which is referenced while it is queued.
+ * @return 0 if the client was queued, -1 if it is not logged in or is
+ * already queued.
+ */
+int matchmaker_enqueue(CLIENT *client);
+
+/*
+ * Take a client out of the matchmaking queue, if it is there.  This is
+ * done when the client logs out.
+ *
+ * @param client  The client.
+ */
+void matchmaker_cancel(CLIENT *client);
+
+/*
+ * Determine whether a client is in the matchmaking queue.
+ *
+ * @param client  The client.
+ * @return 1 if the client is queued, otherwise 0.
+ */
+int matchmaker_is_queued(CLIENT *client);
+
+/*
+ * Stop the matchmaking thread, once any game it is starting has been
+ * started, but keep the clients that are queued.  No clients can be
+ * queued until the thread is started again with matchmaker_start().
+ */
+void matchmaker_pause(void);
+
+/*
+ * Stop the matchmaking thread and discard any clients still queued.
+ */
+void matchmaker_stop(void);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/*
+ * Runtime metrics, always compiled in.
+ *
+ * The server counts, for each packet type, how long requests take to
+ * handle, from the time the packet has been received until its ACK or
+ * NACK has been queued, and how long threads wait for the locks most
+ * likely to be contended.  It also keeps gauges of the number of
+ * connected clients and of games in existence.
+ *
+ * Latencies are kept in log-linear histograms (see histogram.h) in a
+ * fixed set of shards.  Each thread is assigned a shard the first time
+ * it records anything, so threads rarely share a shard and updates are
+ * uncontended relaxed atomic additions.  The shards are merged only
+ * when a report is produced.
+ */
+
+/*
+ * The locks whose wait times are measured.  Waits are only timed if a
+ * lock could not be taken immediately, so an uncontended acquisition
+ * costs a single trylock.
+ */
+typedef enum {
+	METRICS_LOCK_CLIENT,		/* clientMutex of a CLIENT */
+	METRICS_LOCK_CLIENT_REGISTRY,	/* registryMutex of the client registry */
+	METRICS_LOCK_PLAYER_REGISTRY,	/* locks of the player registry */
+	METRICS_NUM_LOCKS
+} METRICS_LOCK;
+
+typedef enum {
+	METRICS_CONNECTIONS,
+	METRICS_GAMES,
+	METRICS_MATCHING,		/* clients queued for matchmaking */
+	METRICS_REMOTE_CLIENTS,		/* remote CLIENTs for users of other nodes */
+	METRICS_WATCHERS,		/* spectators of games in progress */
+	METRICS_NUM_GAUGES
+} METRICS_GAUGE;
+
+/*
+ * Get the current time in nanoseconds, for use as the start time of
+ * metrics_packet().
+ */
+uint64_t metrics_now(void);
+
+/*
+ * Record the handling of a packet.
+ *
+ * @param type  The type of the packet.
+ * @param start  The time, from metrics_now(), at which it was received.
+ */
+void metrics_packet(int type, uint64_t start);
+
+/*
+ * Lock a mutex or wait on a semaphore, recording the acquisition and,
+ * if the lock was not immediately available, the time spent waiting.
+ *
+ * @param lock  The mutex or semaphore.
+ * @param kind  Which kind of lock it is.
+ */
+void metrics_mutex_lock(pthread_mutex_t *lock, METRICS_LOCK kind);
+void metrics_sem_wait(sem_t *sem, METRICS_LOCK kind);
+
+/*
+ * Adjust a gauge.
+ *
+ * @param gauge  The gauge.
+ * @param delta  The amount to be added to it.
+ */
+void metrics_gauge_add(METRICS_GAUGE gauge, long delta);
+
+/*
+ * Produce a report of all the metrics, as text.
+ *
+ * @param lenp  Location in which the length of the report is stored.
+ * @return  The report, in malloc'ed storage that the caller must free,
+ * or NULL if it could not be produced.
+ */
+char *metrics_report(size_t *lenp);
+
+/*
+ * Start a thread that accepts connections on an administrative port and
+ * writes a report to each before closing it.
+ *
+ * @param port  The port on which to listen.
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int metrics_serve(char *port);
+
+/*
+ * Start a thread that writes a report to the standard error output
+ * whenever the specified signal is received.  The signal is blocked in
+ * the calling thread, so this should be called before any other
+ * threads are created, which then inherit the blocked signal.
+ *
+ * @param sig  The signal, normally SIGUSR1.
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int metrics_dump_on_signal(int sig);
+
+#endif
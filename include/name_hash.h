@@ -0,0 +1,19 @@
+#ifndef NAME_HASH_H
+#define NAME_HASH_H
+
+#include <stdint.h>
+
+/*
+ * 64-bit FNV-1a hash of a NUL-terminated username, shared by the
+ * registries that index players and clients by name.
+ */
+static inline uint64_t name_hash(const char *name) {
+	uint64_t hash = 14695981039346656037ULL;
+	while (*name != '\0') {
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+#endif
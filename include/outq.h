@@ -0,0 +1,161 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Per-connection asynchronous outbound packet queue.
+ *
+ * Any number of threads may enqueue packets for a connection without
+ * taking a lock: the queue is a bounded multi-producer ring.  Whichever
+ * producer finds the queue idle becomes its drainer and writes out as
+ * much as the socket will take with non-blocking sendmsg(2) calls,
+ * gathering many queued packets into one call.  If the socket's send
+ * buffer fills up, the rest of the queue is handed to a shared flusher
+ * thread, which resumes writing once epoll(7) reports that the socket is
+ * writable, so no producer ever waits on a slow client's TCP window.
+ *
+ * What happens when a queue is full is set by the backpressure policy:
+ * the producer can wait for space (OUTQ_BLOCK), the packet can be
+ * discarded (OUTQ_DROP), or the connection can be shut down
+ * (OUTQ_DISCONNECT).  Waiting loses nothing, but it holds up the thread
+ * that produced the packet, which in the reactor also serves many other
+ * connections; dropping keeps the connection but leaves the client
+ * without packets it may be waiting for.
+ */
+
+typedef struct outq OUTQ;
+
+typedef enum {
+	OUTQ_BLOCK,
+	OUTQ_DROP,
+	OUTQ_DISCONNECT
+} OUTQ_POLICY;
+
+#define OUTQ_DEFAULT_CAPACITY 256
+
+/*
+ * Set the capacity and backpressure policy for queues created after this
+ * call.  This is intended to be called once, during startup.
+ *
+ * @param capacity  The maximum number of packets that can be queued for
+ * a connection, which is rounded up to a power of two.
+ * @param policy  What to do when a queue is full.
+ * @return 0 if the settings are valid, otherwise -1.
+ */
+int outq_configure(int capacity, OUTQ_POLICY policy);
+
+/*
+ * Interpret the name of a backpressure policy: "block", "drop" or
+ * "disconnect".
+ *
+ * @return  The policy, or -1 if the name is not recognized.
+ */
+int outq_parse_policy(const char *name);
+
+/*
+ * Create an outbound queue for a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @return  The new queue, or NULL if it could not be allocated.
+ */
+OUTQ *outq_create(int fd);
+
+/*
+ * Enqueue a packet, copying the header and payload.  The packet is
+ * written before this function returns, unless the socket cannot
+ * currently accept it or another thread is already writing.
+ *
+ * @param q  The queue.
+ * @param hdr  The packet header, in network byte order.
+ * @param data  The payload, or NULL if there is none.
+ * @param len  The length of the payload.
+ * @return 0 if the packet was queued, -1 if it was refused because the
+ * queue is full or the connection has failed or been shut down.
+ */
+int outq_send(OUTQ *q, JEUX_PACKET_HEADER *hdr, const void *data, size_t len);
+
+/*
+ * Enqueue a packet whose payload is shared rather than copied.  The
+ * release function is called with arg once the payload is no longer
+ * needed by this queue, whether or not the packet was sent, including
+ * when the packet is refused.
+ *
+ * @return 0 if the packet was queued, otherwise -1.
+ */
+int outq_send_shared(OUTQ *q, JEUX_PACKET_HEADER *hdr, const void *data, size_t len,
+		     void (*release)(void *), void *arg);
+
+/*
+ * Enqueue a packet whose payload is shared, as outq_send_shared() does,
+ * but never wait for space: if the queue is full, the connection is shut
+ * down, whatever the backpressure policy.  This is for packets that a
+ * producer holding locks sends to many queues, such as the updates of a
+ * game sent to its spectators, none of which may hold up the others.
+ *
+ * @return 0 if the packet was queued, otherwise -1.
+ */
+int outq_offer_shared(OUTQ *q, JEUX_PACKET_HEADER *hdr, const void *data, size_t len,
+		      void (*release)(void *), void *arg);
+
+/*
+ * Cork a queue, so that packets enqueued are held rather than written
+ * until it is uncorked, when they are all written together, gathered
+ * into as few sendmsg(2) calls as possible.  This is for a thread that
+ * is about to send many packets to the same connection, such as the
+ * responses to a batch of pipelined requests.  Packets for a corked
+ * queue that is full are written out at once.  Corks nest.
+ *
+ * @param q  The queue.
+ */
+void outq_cork(OUTQ *q);
+
+/*
+ * Remove a cork placed by outq_cork(), writing out anything held if it
+ * was the last.
+ *
+ * @param q  The queue.
+ */
+void outq_uncork(OUTQ *q);
+
+/*
+ * Get the number of packets on a queue that have not yet been completely
+ * written, including any held by a cork.
+ *
+ * @param q  The queue.
+ * @return  The number of packets, or -1 if the connection has failed or
+ * been shut down.
+ */
+int outq_backlog(OUTQ *q);
+
+/*
+ * Wait until everything on a queue has been written to the connection.
+ * Producers are not held off, so this only means anything once nothing
+ * more is being sent.
+ *
+ * @param q  The queue.
+ * @param timeout  The longest time to wait, in milliseconds.
+ * @return 0 if the queue is empty, -1 if it could not be emptied in time
+ * or the connection has failed.
+ */
+int outq_flush(OUTQ *q, int timeout);
+
+/*
+ * Stop all output on a queue and discard anything still queued.  When
+ * this returns, no thread is writing to the connection and none will,
+ * so the file descriptor can be closed.
+ *
+ * @param q  The queue.
+ */
+void outq_shutdown(OUTQ *q);
+
+/*
+ * Free a queue.  outq_shutdown() must have been called first.
+ *
+ * @param q  The queue.
+ */
+void outq_destroy(OUTQ *q);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Per-thread pool of packet payload buffers.
+ *
+ * Payload sizes are bounded by the 16-bit size field of the packet
+ * header, so buffers are drawn from a small number of power-of-two size
+ * classes (32 bytes up to 64KB).  Each thread keeps a freelist for each
+ * class, so that in steady state receiving a packet neither takes a
+ * lock nor calls malloc().  A buffer may be released by a thread other
+ * than the one that allocated it; it then joins the releasing thread's
+ * freelist.  Each freelist is bounded, and anything beyond the bound is
+ * returned to the system allocator, as are the contents of a thread's
+ * freelists when the thread exits.
+ */
+
+/*
+ * Allocate a buffer of at least the specified number of bytes.
+ *
+ * @param size  The number of bytes required.
+ * @return  A pointer to the buffer, or NULL if none could be allocated.
+ */
+void *pool_alloc(size_t size);
+
+/*
+ * Release a buffer obtained from pool_alloc().  Passing NULL is allowed
+ * and has no effect.
+ *
+ * @param buf  The buffer to be released.
+ */
+void pool_free(void *buf);
+
+#endif
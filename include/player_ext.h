@@ -0,0 +1,86 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "player.h"
+
+/*
+ * Extensions to the PLAYER interface used by the player registry.
+ */
+
+/*
+ * Create a new PLAYER whose username is an interned string owned by the
+ * caller, rather than a private copy.  The string must remain valid for
+ * the lifetime of the PLAYER.  Otherwise this is the same as
+ * player_create().
+ *
+ * @param name  The interned username of the PLAYER.
+ * @return  A reference to the newly created PLAYER, if initialization
+ * was successful, otherwise NULL.
+ */
+PLAYER *player_create_interned(char *name);
+
+/*
+ * Create a block of PLAYERs with a single allocation, for bulk loading.
+ * Each PLAYER in the block has a reference count of one, an interned
+ * username taken from the names array, and either the corresponding
+ * rating or PLAYER_INITIAL_RATING if ratings is NULL.  When the reference
+ * count of a PLAYER in a block reaches zero the PLAYER is not freed
+ * individually; the block as a whole is released by player_block_free().
+ *
+ * @param names  Array of n interned usernames.
+ * @param ratings  Array of n initial ratings, or NULL.
+ * @param n  The number of PLAYERs to create.
+ * @return  The block, or NULL if it could not be allocated.
+ */
+PLAYER *player_create_block(char **names, int *ratings, size_t n);
+
+/*
+ * Create a PLAYER whose rating is kept at a location owned by the
+ * caller, such as a record of the player store, rather than in the
+ * PLAYER itself.  The name is interned as for player_create_interned(),
+ * the current value at the location is the PLAYER's rating, and the
+ * location must remain valid for the lifetime of the PLAYER.
+ *
+ * @param name  The interned username of the PLAYER.
+ * @param rating  The location of the rating.
+ * @return  A reference to the newly created PLAYER, if initialization
+ * was successful, otherwise NULL.
+ */
+PLAYER *player_create_mapped(char *name, atomic_int *rating);
+
+/*
+ * Create a block of PLAYERs, as player_create_block() does, whose
+ * ratings are kept at locations owned by the caller, as for
+ * player_create_mapped().
+ *
+ * @param names  Array of n interned usernames.
+ * @param ratings  Array of n rating locations.
+ * @param n  The number of PLAYERs to create.
+ * @return  The block, or NULL if it could not be allocated.
+ */
+PLAYER *player_create_block_mapped(char **names, atomic_int **ratings, size_t n);
+
+/*
+ * Get the i-th PLAYER of a block created by player_create_block().
+ */
+PLAYER *player_block_at(PLAYER *block, size_t i);
+
+/*
+ * Release a block created by player_create_block().  This must only be
+ * done once no references to any of its PLAYERs remain.
+ */
+void player_block_free(PLAYER *block);
+
+/*
+ * Get the current rating epoch.  The epoch is incremented every time
+ * player_post_result() changes any ratings, so that caches derived from
+ * ratings can tell when they have become stale.
+ *
+ * @return  The current rating epoch.
+ */
+unsigned long player_rating_epoch(void);
+
+#endif
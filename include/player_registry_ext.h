@@ -0,0 +1,79 @@
+#ifndef PLAYER_REGISTRY_EXT_H
+#define PLAYER_REGISTRY_EXT_H
+
+#include <stddef.h>
+
+#include "player_registry.h"
+#include "player_store.h"
+
+/*
+ * Extensions to the player registry interface.
+ *
+ * The registry is a hash table keyed on player names, split into
+ * independently locked shards so that logins of different players do not
+ * serialize.  Each shard is an open-addressing table; since players are
+ * never removed from the registry, no tombstones are needed.  Registered
+ * names are interned in per-shard string arenas, so each PLAYER refers to
+ * the registry's single copy of its name.
+ */
+
+/*
+ * Register a large number of players at once, as when warm-starting the
+ * server from saved state.  The names are interned with a single
+ * allocation and the PLAYERs are created as a single block, so no
+ * per-player allocation takes place.  A name that is already registered
+ * (or that occurs more than once) keeps the first PLAYER registered
+ * under it.  No references are returned: each new PLAYER is referenced
+ * only by the registry.
+ *
+ * @param preg  The player registry.
+ * @param names  Array of n usernames, which are copied.
+ * @param ratings  Array of n ratings, or NULL to use PLAYER_INITIAL_RATING.
+ * @param n  The number of players.
+ * @return  The number of players newly registered, or -1 if memory
+ * could not be allocated.
+ */
+long preg_preload(PLAYER_REGISTRY *preg, char **names, int *ratings, size_t n);
+
+/*
+ * Load the players of a player store into the registry, and keep the
+ * players registered from then on in the store.  The PLAYERs are created
+ * as a single block whose names and ratings remain in the store's
+ * mapping, so no per-player allocation or copying takes place.  This
+ * should be done once, at startup, and the store must not be closed
+ * until the registry has been finalized.
+ *
+ * @param preg  The player registry.
+ * @param store  The player store.
+ * @return  The number of players loaded, or -1 if memory could not be
+ * allocated.
+ */
+long preg_attach_store(PLAYER_REGISTRY *preg, PLAYER_STORE *store);
+
+/*
+ * Look up a player by name without registering it.
+ *
+ * @param preg  The player registry.
+ * @param name  The username.
+ * @return  The PLAYER registered under the name, with its reference count
+ * incremented, or NULL if there is none.
+ */
+PLAYER *preg_lookup(PLAYER_REGISTRY *preg, char *name);
+
+/*
+ * Get the number of players in the registry.
+ */
+size_t preg_count(PLAYER_REGISTRY *preg);
+
+/*
+ * Call a function for every player in the registry.  The function is
+ * called with a lock of the registry held, so it must not register or
+ * look up players.
+ *
+ * @param preg  The player registry.
+ * @param fn  The function, which is passed each PLAYER and arg.
+ * @param arg  The argument to be passed to fn.
+ */
+void preg_for_each(PLAYER_REGISTRY *preg, void (*fn)(PLAYER *, void *), void *arg);
+
+#endif
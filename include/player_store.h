@@ -0,0 +1,97 @@
+#ifndef PLAYER_STORE_H
+#define PLAYER_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "player.h"
+
+/*
+ * Memory-mapped, on-disk database of players.
+ *
+ * The store is a single file holding a header, an array of fixed-size
+ * records and a heap of NUL-terminated names.  Each record holds the
+ * hash of a player's name, the offset of the name in the heap and the
+ * player's rating.  The whole file is mapped shared when the store is
+ * opened, so loading it involves no parsing and no allocation per
+ * player: the player registry creates its PLAYERs with names pointing
+ * into the heap and ratings kept in the records themselves, so every
+ * rating change is a store to the mapping.  The pages that have been
+ * dirtied are written back by msync() from a background thread every
+ * PSTORE_SYNC_INTERVAL_MS.
+ *
+ * The file is sized when it is opened so that at least half of its
+ * records and heap are free, and it cannot grow while it is mapped.
+ * Players registered once it is full are remembered, and are added when
+ * the store is closed, by which time the file can be rewritten larger.
+ * After a crash, the players registered and the ratings changed since
+ * the last sync may be lost.
+ */
+
+#define PSTORE_SYNC_INTERVAL_MS 1000
+#define PSTORE_MIN_RECORDS 65536
+#define PSTORE_MIN_HEAP (1024 * 1024)
+
+typedef struct player_store PLAYER_STORE;
+
+/*
+ * Open and map a player store, creating it if it does not exist, and
+ * start the thread that syncs it.
+ *
+ * @param path  The pathname of the store.
+ * @return  The store, or NULL if it could not be opened or mapped, or
+ * is not a player store.
+ */
+PLAYER_STORE *pstore_open(char *path);
+
+/*
+ * Get the number of players in a store.
+ */
+size_t pstore_count(PLAYER_STORE *store);
+
+/*
+ * Get the i-th player of a store.
+ *
+ * @param store  The store.
+ * @param i  The index of the player, less than pstore_count().
+ * @param namep  Location in which the player's name, in the mapped
+ * heap, is stored.
+ * @param hashp  Location in which the name_hash() of the name is stored.
+ * @return  The location of the player's rating, in the mapped record.
+ */
+atomic_int *pstore_get(PLAYER_STORE *store, size_t i, char **namep, uint64_t *hashp);
+
+/*
+ * Add a player to a store, with PLAYER_INITIAL_RATING.
+ *
+ * @param store  The store.
+ * @param name  The player's name, which is copied into the heap.
+ * @param hash  The name_hash() of the name.
+ * @param namep  Location in which the copy of the name is stored.
+ * @return  The location of the player's rating, or NULL if the store is
+ * full, in which case pstore_overflow() should be used instead.
+ */
+atomic_int *pstore_add(PLAYER_STORE *store, char *name, uint64_t hash, char **namep);
+
+/*
+ * Remember a player that could not be added to a full store, so that
+ * it is added when the store is closed.  The store keeps a reference to
+ * the PLAYER until then.
+ *
+ * @param store  The store.
+ * @param player  The PLAYER.
+ */
+void pstore_overflow(PLAYER_STORE *store, PLAYER *player);
+
+/*
+ * Close a player store, syncing it, adding any players that overflowed
+ * it and unmapping it.  No PLAYER whose name or rating lies in the store
+ * may be used afterwards, so this must be done after finalizing the
+ * player registry.
+ *
+ * @param store  The store, which must not be used again.
+ */
+void pstore_close(PLAYER_STORE *store);
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef PROTO_BUF_H
+#define PROTO_BUF_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+/*
+ * Buffered, framing-aware packet input, in the style of the rio_t
+ * package in csapp.c.  A PROTO_BUF sits between a connection and the
+ * code that consumes its packets: each read() pulls in as many bytes as
+ * the kernel has available, which may be several packets at once or only
+ * part of one, and complete packets are then carved out of the buffer
+ * one at a time.  A packet whose payload does not fit in the buffer is
+ * reassembled directly into its own payload storage.
+ *
+ * The same PROTO_BUF serves both blocking descriptors (via
+ * proto_buf_recv_packet()) and non-blocking ones, for which the caller
+ * alternates proto_buf_fill() and proto_buf_next() as readiness is
+ * reported by epoll.
+ */
+
+#define PROTO_BUFSIZE 4096
+
+typedef struct proto_buf {
+    int fd;                       /* Descriptor for this buffer */
+    size_t start;                 /* Offset of first unconsumed byte */
+    size_t end;                   /* Offset just past last valid byte */
+    JEUX_PACKET_HEADER pendHdr;   /* Header of a partially received packet */
+    char *pendPayload;            /* Payload being reassembled, or NULL */
+    size_t pendRead;              /* Payload bytes reassembled so far */
+    char buf[PROTO_BUFSIZE];      /* Internal buffer */
+} PROTO_BUF;
+
+/*
+ * Initialize a PROTO_BUF for reading packets from a descriptor.
+ */
+void proto_buf_init(PROTO_BUF *pb, int fd);
+
+/*
+ * Release any partially received payload held by a PROTO_BUF.
+ */
+void proto_buf_fini(PROTO_BUF *pb);
+
+/*
+ * Perform a single read() to add data to a PROTO_BUF.
+ *
+ * @return  the number of bytes added, 0 on EOF, or -1 on error, with
+ *   errno set.  EAGAIN is reported as an error, with errno EAGAIN.
+ */
+ssize_t proto_buf_fill(PROTO_BUF *pb);
+
+/*
+ * Extract the next complete packet already present in a PROTO_BUF,
+ * without performing any I/O.
+ *
+ * @param pb  The buffer.
+ * @param hdr  Storage for the packet header, which is returned with its
+ *   multi-byte fields in network byte order.
+ * @param payloadp  Variable into which a pointer to the NUL-terminated
+ *   payload (or NULL, if there is none) is stored.  The payload is
+ *   drawn from the packet pool, and the caller is responsible for
+ *   releasing it with pool_free().
+ * @return  1 if a packet was extracted, 0 if more data is needed,
+ *   -1 if the payload storage could not be allocated.
+ */
+int proto_buf_next(PROTO_BUF *pb, JEUX_PACKET_HEADER *hdr, void **payloadp);
+
+/*
+ * Determine whether the next packet is complete in a PROTO_BUF, without
+ * performing any I/O or extracting it, so that the caller can decide who
+ * is to handle it by its header.  Part of a packet that does not fit in
+ * the buffer may be moved out of it, to make room for the rest.
+ *
+ * @param pb  The buffer.
+ * @param hdr  Storage for the header of the packet, in network byte
+ *   order, which is stored only if the packet is complete.
+ * @return  1 if the packet is complete, so that proto_buf_next() will
+ *   return it, 0 if more data is needed, -1 if the payload storage could
+ *   not be allocated.
+ */
+int proto_buf_complete(PROTO_BUF *pb, JEUX_PACKET_HEADER *hdr);
+
+/*
+ * Receive a packet through a PROTO_BUF, blocking until one is available.
+ * This is the buffered equivalent of proto_recv_packet(), except that
+ * the payload must be released with pool_free().
+ *
+ * @return  0 in case of successful reception, -1 on EOF or error.
+ */
+int proto_buf_recv_packet(PROTO_BUF *pb, JEUX_PACKET_HEADER *hdr, void **payloadp);
+
+/*
+ * Determine whether a PROTO_BUF holds bytes that have not yet been
+ * returned as part of a packet.
+ */
+int proto_buf_pending(PROTO_BUF *pb);
+
+/*
+ * The longest input that can be held by a PROTO_BUF without having been
+ * returned as part of a packet: a partly reassembled packet of the
+ * greatest size, or a full buffer.
+ */
+#define PROTO_BUF_SAVE_MAX (sizeof(JEUX_PACKET_HEADER) + 65535 + PROTO_BUFSIZE)
+
+/*
+ * Save the input held by a PROTO_BUF that has not yet been returned as
+ * part of a packet, as the bytes that were read, so that reading can be
+ * continued by another PROTO_BUF, perhaps in another process.  This
+ * must be done between packets, when proto_buf_next() has returned 0.
+ *
+ * @param pb  The buffer.
+ * @param out  Storage for the input, or NULL.
+ * @param len  The size of that storage.
+ * @return  The length of the input, which is stored only if it fits.
+ */
+size_t proto_buf_save(PROTO_BUF *pb, char *out, size_t len);
+
+/*
+ * Load input saved by proto_buf_save() into a newly initialized
+ * PROTO_BUF, as if it had just been read.
+ *
+ * @param pb  The buffer.
+ * @param data  The saved input.
+ * @param len  Its length.
+ * @return 0 if the input was loaded, -1 if it is not valid or the
+ * payload storage could not be allocated.
+ */
+int proto_buf_restore(PROTO_BUF *pb, const char *data, size_t len);
+
+/*
+ * Write a vector of buffers in its entirety using writev(), continuing
+ * after short writes and waiting for the descriptor to become writable
+ * if it is in non-blocking mode.
+ *
+ * @return  0 if all the data was written, -1 otherwise.
+ */
+int proto_writev(int fd, struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include "protocol.h"
+
+/*
+ * Packet types added to the "Jeux" protocol.  They are numbered after
+ * the last type in protocol.h, so existing clients are unaffected.
+ *
+ * Client-to-server requests:
+ *   HINT:     Ask for a best move in an ongoing game
+ *             Header: invitation ID assigned by player asking for the hint
+ *             ACK header: GAME_ROLE (none, first, second) of the winner
+ *                         under perfect play from the current position
+ *             ACK payload: the move, in the same form as a MOVE payload
+ *             The request is refused (NACK) if the game is over or
+ *             the player asking is not the one on the move.
+ *   MATCH:    Ask to be matched with an opponent of similar rating
+ *             ACK: the player has been queued for matchmaking
+ *             The request is refused (NACK) if the player is already
+ *             queued.  Once an opponent is found, a game is started
+ *             between the two at once, and each is sent:
+ *   ACCEPTED: Header: invitation ID assigned by the recipient, and the
+ *                     GAME_ROLE (first, second) in which it plays
+ *             Payload: initial game state, for the first player only
+ *             A player leaves the queue by logging out.  A player for
+ *             whom no game can be started, as when all its invitation
+ *             IDs are in use, is taken out of the queue and sent a NACK
+ *             with no ID, and may send MATCH again.
+ *   WATCH:    Watch the game in progress of another player
+ *             Payload: the player's username
+ *             ACK header: a watch ID assigned by the spectator, drawn
+ *                         from the same IDs as its invitations, and the
+ *                         GAME_ROLE (first, second) of the player named
+ *             ACK payload: the current game state, in the same form as
+ *                          a MOVED payload
+ *             The request is refused (NACK) if the player is not
+ *             logged in on this server, is the spectator, or is not
+ *             playing, or if the spectator is already watching
+ *             CLIENT_MAX_WATCHES games.  If the player is playing more
+ *             than one game, the one with the player's lowest ID is
+ *             watched.  After the ACK, the spectator is sent, under the
+ *             watch ID, a MOVED packet after every move and an ENDED
+ *             packet, with the result, once the game is over, which ends
+ *             the watch.  A spectator whose outbound queue is full is
+ *             disconnected rather than held up.
+ *   UNWATCH:  Stop watching a game
+ *             Header: the watch ID
+ */
+#define JEUX_HINT_PKT (JEUX_ENDED_PKT + 1)
+#define JEUX_MATCH_PKT (JEUX_HINT_PKT + 1)
+#define JEUX_WATCH_PKT (JEUX_MATCH_PKT + 1)
+#define JEUX_UNWATCH_PKT (JEUX_WATCH_PKT + 1)
+
+#endif
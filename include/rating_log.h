@@ -0,0 +1,62 @@
+#ifndef RATING_LOG_H
+#define RATING_LOG_H
+
+#include "player.h"
+#include "player_registry.h"
+
+/*
+ * Write-ahead log of rating changes.
+ *
+ * Every result posted by player_post_result() is appended to the log as
+ * a record of the rating change applied to each player.  Appending only
+ * copies the record into a memory buffer; a background thread writes
+ * the buffer out and syncs it in batches, every RATING_LOG_INTERVAL_MS
+ * or whenever RATING_LOG_BATCH bytes have accumulated, so that the end
+ * of a game never waits for the disk.
+ *
+ * Because the records are changes rather than ratings, replaying them
+ * produces the same ratings regardless of the order in which concurrent
+ * results were logged.  When the log is opened it is replayed into the
+ * player registry and then rewritten with a single record per player,
+ * so that it does not grow without bound across restarts.
+ *
+ * A crash loses at most the results of the last batch.  A record that
+ * was only partly written is detected by its checksum, and the log is
+ * truncated at that point.
+ */
+
+#define RATING_LOG_INTERVAL_MS 50
+#define RATING_LOG_BATCH (64 * 1024)
+#define RATING_LOG_BUFFER (1024 * 1024)
+
+/*
+ * Open the rating log, creating it if it does not exist, replay it into
+ * the player registry, compact it, and start the thread that flushes it.
+ * This should be done once, at startup, while the registry is still
+ * empty.
+ *
+ * @param path  The pathname of the log.
+ * @param preg  The player registry.
+ * @return  The number of players whose ratings were restored, or -1 if
+ * the log could not be opened.
+ */
+long rating_log_open(char *path, PLAYER_REGISTRY *preg);
+
+/*
+ * Append the rating changes resulting from one game to the log.  This
+ * does nothing if no log is open.
+ *
+ * @param player1  One of the players.
+ * @param delta1  The change to the rating of player1.
+ * @param player2  The other player.
+ * @param delta2  The change to the rating of player2.
+ */
+void rating_log_append(PLAYER *player1, int delta1, PLAYER *player2, int delta2);
+
+/*
+ * Flush everything appended so far, stop the flushing thread and close
+ * the log.  Results posted afterwards are no longer logged.
+ */
+void rating_log_close(void);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "client_registry.h"
+#include "proto_buf.h"
+
+/*
+ * Event-driven alternative to the thread-per-connection server.
+ *
+ * In reactor mode, a fixed pool of worker threads is started, each of
+ * which runs an epoll(7) loop over a set of non-blocking client sockets.
+ * Each connection keeps a small state machine that assembles packets
+ * from whatever bytes happen to be available, so that no thread ever
+ * blocks waiting for a particular client.  Complete packets are passed
+ * to jeux_service_packet(), the same dispatcher used by
+ * jeux_client_service(), so both modes share all request handlers.
+ *
+ * If the handler pool has been started, the reactor workers only read
+ * and frame: a connection with a complete request is submitted to the
+ * pool, under the key of its request, and is not read again until its
+ * handler task has finished, so a request that takes long holds up no
+ * other connection.
+ */
+
+/*
+ * Start the reactor worker threads.
+ *
+ * @param nworkers  The number of worker threads (and epoll instances)
+ * to create.  Must be at least one.  Any handler pool must have been
+ * started first.
+ * @return 0 if the reactor was started, otherwise -1.
+ */
+int reactor_start(int nworkers);
+
+/*
+ * Hand a newly accepted connection to the reactor.  The connection is
+ * registered with the client registry, switched to non-blocking mode
+ * and assigned to one of the workers.  If the connection cannot be
+ * registered, it is closed.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was handed to a worker, otherwise -1.
+ */
+int reactor_add(int connfd);
+
+/*
+ * Hand the reactor a connection that has been handed over by a
+ * predecessor, whose client is already registered and whose socket is
+ * already in non-blocking mode.  Any complete requests left in its input
+ * are handled by the worker, or the handler pool, as soon as the worker
+ * takes the connection, so the calling thread never waits for them.
+ *
+ * @param client  The registered CLIENT.
+ * @param in  The restored input buffer of the connection, which is
+ * moved into the reactor's own state and freed.
+ * @return 0 if the connection was handed to a worker, otherwise -1, in
+ * which case the client has been unregistered and its connection closed.
+ */
+int reactor_adopt(CLIENT *client, PROTO_BUF *in);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef REFCOUNT_H
+#define REFCOUNT_H
+
+#include <stdatomic.h>
+
+/*
+ * Atomic reference counts shared by PLAYER, CLIENT, GAME and INVITATION.
+ *
+ * Increments are relaxed: a new reference can only be made from an
+ * existing one, so no ordering is needed.  Decrements use release
+ * ordering, and the thread that drops the last reference issues an
+ * acquire fence before freeing, so that every access made through the
+ * other references happens before the object is destroyed.
+ */
+typedef atomic_int REFCOUNT;
+
+static inline void refcount_init(REFCOUNT *rc, int n) {
+	atomic_init(rc, n);
+}
+
+/*
+ * Increment a reference count.
+ *
+ * @return  The value of the count before the increment.
+ */
+static inline int refcount_inc(REFCOUNT *rc) {
+	return atomic_fetch_add_explicit(rc, 1, memory_order_relaxed);
+}
+
+/*
+ * Decrement a reference count.
+ *
+ * @return  The value of the count before the decrement; if this is 1,
+ * the caller held the last reference and must free the object.
+ */
+static inline int refcount_dec(REFCOUNT *rc) {
+	int old = atomic_fetch_sub_explicit(rc, 1, memory_order_release);
+	if (old == 1) {
+		atomic_thread_fence(memory_order_acquire);
+	}
+	return old;
+}
+
+#endif
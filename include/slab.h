@@ -0,0 +1,83 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Object caches for the server's fixed-size objects (CLIENT, INVITATION,
+ * GAME and PLAYER), after Bonwick's slab allocator with magazines.
+ *
+ * A SLAB hands out objects of a single type.  Objects are carved from
+ * cache-line-aligned chunks and passed once to the type's constructor,
+ * which initializes whatever the type needs to keep across uses, such
+ * as its mutex.  An object released by slab_free() must be in its
+ * constructed state again (with its mutex unlocked, say), and is
+ * recycled by the next slab_alloc() without being constructed again.
+ * Objects are never returned to the system allocator.
+ *
+ * Each thread keeps, for each SLAB, two magazines of up to
+ * SLAB_MAGAZINE_SIZE objects, so that allocation and release usually
+ * take no lock at all.  Only when both of its magazines are empty (or
+ * both full) does a thread go to the SLAB's depot of full and empty
+ * magazines, exchanging a whole magazine under the depot lock.  The
+ * magazines of an exiting thread are returned to the depot.
+ */
+
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_MAX_TYPES 8
+#define SLAB_ALIGN 64
+
+typedef struct slab_magazine SLAB_MAGAZINE;
+
+typedef struct slab {
+	const char *name;
+	size_t size;
+	void (*construct)(void *object);
+	atomic_int id;
+	pthread_mutex_t lock;
+	SLAB_MAGAZINE *full;
+	SLAB_MAGAZINE *empty;
+	atomic_ulong objects;
+} SLAB;
+
+/*
+ * Static initializer for the SLAB of a type.
+ *
+ * @param type  The type of the objects.
+ * @param construct  The function that constructs an object, which may
+ * be NULL.
+ */
+#define SLAB_INITIALIZER(type, construct) SLAB_INITIALIZER_SIZED(#type, sizeof(type), construct)
+
+/*
+ * Static initializer for a SLAB of objects of a given size, for types
+ * that end in a flexible array member.
+ *
+ * @param name  The name of the SLAB, for debugging printout.
+ * @param size  The size of the objects.
+ * @param construct  The function that constructs an object, which may
+ * be NULL.
+ */
+#define SLAB_INITIALIZER_SIZED(name, size, construct) \
+	{ (name), (size), (construct), -1, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 }
+
+/*
+ * Allocate an object.
+ *
+ * @param slab  The SLAB of the object's type.
+ * @return  A constructed object, or NULL if memory could not be
+ * allocated.
+ */
+void *slab_alloc(SLAB *slab);
+
+/*
+ * Release an object obtained from slab_alloc(), to be recycled.
+ *
+ * @param slab  The SLAB from which the object was allocated.
+ * @param object  The object, in its constructed state.
+ */
+void slab_free(SLAB *slab, void *object);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <stdint.h>
+
+/*
+ * Perfect-play solver for tic-tac-toe.
+ *
+ * Every position that can arise in a game is solved once, by a
+ * memoized minimax search over the whole game tree, and the result is
+ * kept in a table indexed by the base-3 board number used by game.c
+ * (digit n-1 gives the contents of cell n: 0 empty, 1 X, 2 O).  After
+ * that, the value of a position and a best move in it are found with a
+ * single table lookup.
+ */
+
+/*
+ * Number of entries in the solver table: one per base-3 board number.
+ */
+#define SOLVER_NUM_BOARDS 19683
+
+/*
+ * The outcome of a position under perfect play, from the point of view
+ * of the side to move.
+ */
+#define SOLVER_LOSS -1
+#define SOLVER_DRAW 0
+#define SOLVER_WIN 1
+
+/*
+ * Solve all positions, if this has not already been done.  This is
+ * called implicitly by solver_lookup(), and may be called at startup
+ * so that the first lookup does not pay for it.
+ */
+void solver_init(void);
+
+/*
+ * Look up the solution of a position.
+ *
+ * @param index  The base-3 number of the board.
+ * @param valuep  If not NULL, location in which the outcome of the
+ * position for the side to move (SOLVER_WIN, SOLVER_DRAW or SOLVER_LOSS)
+ * is stored.
+ * @return  The cell (1-9) in which the side to move should play: one
+ * that wins as quickly as possible or, failing that, loses as slowly as
+ * possible.  0 is returned if the game is already over in this position,
+ * or if the position cannot be reached in a legal game.
+ */
+int solver_lookup(uint16_t index, int *valuep);
+
+#endif
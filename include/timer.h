@@ -0,0 +1,90 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timeouts, kept on a hashed timer wheel.
+ *
+ * Time is divided into ticks of TIMER_TICK_MS, and a TIMER that expires
+ * in a given tick is kept in the slot of the wheel that the tick selects,
+ * in a doubly-linked list threaded through the TIMERs themselves, so
+ * that setting and cancelling a timer take constant time and allocate
+ * nothing.  A single thread turns the wheel, once per tick, and fires the
+ * timers in the slot it reaches whose tick has come; a timer due more
+ * than one turn of the wheel ahead stays in its slot until then.  The
+ * thread is started when the first timer is set, and it sleeps for as
+ * long as no timer is pending.
+ *
+ * A timer is fired at most once per setting, in the timer thread and
+ * with no lock held, so its function may set it again or do whatever a
+ * service thread could do.  The functions are called one at a time, and
+ * should not block for long.  The TIMER must stay valid while it is
+ * pending and while its function runs, so an object that embeds one
+ * holds a reference to itself for as long as the timer is set, which the
+ * function or whoever cancels the timer releases.
+ */
+
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_SLOTS 512
+
+typedef struct timer {
+	struct timer *next;
+	struct timer *prev;
+	uint64_t tick;			/* the tick in which the timer expires */
+	void (*fire)(void *arg);
+	void *arg;
+	int pending;
+} TIMER;
+
+/*
+ * Initialize a TIMER, which is not pending.
+ *
+ * @param timer  The TIMER.
+ * @param fire  The function to be called when the timer expires.
+ * @param arg  The argument to be passed to it.
+ */
+void timer_init(TIMER *timer, void (*fire)(void *arg), void *arg);
+
+/*
+ * Get the time by which timers are set: milliseconds since some fixed
+ * point, from the monotonic clock by which the wheel is turned.
+ */
+uint64_t timer_now(void);
+
+/*
+ * Set a TIMER to expire at a specified time, or move it there if it is
+ * already pending.  A time that has already passed makes it expire in
+ * the next tick.
+ *
+ * @param timer  The TIMER.
+ * @param when  The time, as given by timer_now().
+ * @return 1 if the TIMER was not pending, or 0 if it was and has only
+ * been moved, so that the caller can tell whether the reference it took
+ * for the timer is needed.
+ */
+int timer_schedule(TIMER *timer, uint64_t when);
+
+/*
+ * Cancel a pending TIMER.  A timer whose function has already been
+ * called, or is being called, is not pending.
+ *
+ * @param timer  The TIMER.
+ * @return 1 if the TIMER was pending and will not be fired, otherwise 0.
+ */
+int timer_cancel(TIMER *timer);
+
+/*
+ * Stop firing timers, once any timer function that is running has
+ * returned, while the state they act on is being handed over.  Timers
+ * can still be set and cancelled, and those that expire in the meantime
+ * are fired by timer_resume().
+ */
+void timer_pause(void);
+
+/*
+ * Resume firing timers after timer_pause().
+ */
+void timer_resume(void);
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary event tracing, cheap enough to leave on in production.
+ *
+ * Each event is a fixed-width TRACE_EVENT, written into a ring belonging
+ * to the thread that records it, with no lock and no atomic
+ * read-modify-write: only the thread itself writes its ring, and when
+ * the ring is full the oldest events are overwritten.  An event carries
+ * a timestamp read from the cycle counter where there is one, the
+ * serial number of the thread, the object concerned and, for a
+ * reference count, its value before and after.  As reasons for
+ * reference counting are string literals, only their addresses are
+ * recorded.
+ *
+ * Nothing is recorded until tracing has been enabled, which costs one
+ * predictable branch per event.  The rings are written to the trace
+ * file on SIGUSR2 and when the server terminates, each time replacing
+ * the previous dump; bin/jeux_tracedump decodes the file, merging the
+ * events of all threads in time order.
+ *
+ * The file begins with a TRACE_HEADER, which is followed by numEvents
+ * TRACE_EVENTs and then by numReasons TRACE_REASONs, each followed by
+ * len bytes of text, the reason recorded at that address.  Everything
+ * is in host byte order.
+ */
+
+#define TRACE_RING_EVENTS 4096
+#define TRACE_MAGIC "JEUXTRC1"
+
+/*
+ * The events, with the meaning that each gives to the fields of a
+ * TRACE_EVENT.  The REF and UNREF events of an object give its
+ * reference count before and after, and the reason; an UNREF to zero
+ * frees the object.
+ */
+#define TRACE_EVENTS(X)							\
+	X(THREAD,		"thread")	/* object: pthread_self(), arg: thread ID */ \
+	X(CLIENT_REF,		"client_ref")					\
+	X(CLIENT_UNREF,		"client_unref")					\
+	X(PLAYER_REF,		"player_ref")					\
+	X(PLAYER_UNREF,		"player_unref")					\
+	X(GAME_REF,		"game_ref")					\
+	X(GAME_UNREF,		"game_unref")					\
+	X(INV_REF,		"inv_ref")					\
+	X(INV_UNREF,		"inv_unref")					\
+	X(CLIENT_REGISTER,	"creg_register")	/* before/after: clients connected, arg: fd */ \
+	X(CLIENT_UNREGISTER,	"creg_unregister")	/* the same */		\
+	X(PACKET_RECV,		"packet_recv")	/* object: client, arg: type, before: id, after: size */ \
+	X(PACKET_SEND,		"packet_send")	/* the same */
+
+typedef enum {
+#define TRACE_ENUM(name, text) TRACE_##name,
+	TRACE_EVENTS(TRACE_ENUM)
+#undef TRACE_ENUM
+	TRACE_NUM_EVENTS
+} TRACE_EVENT_ID;
+
+typedef struct trace_event {
+	uint64_t time;		/* ticks; see TRACE_HEADER */
+	uint64_t object;
+	uint64_t reason;	/* address of the reason, or 0 */
+	int32_t before;
+	int32_t after;
+	uint16_t event;
+	uint16_t thread;	/* serial number of the thread, from 1 */
+	uint32_t arg;
+} TRACE_EVENT;
+
+_Static_assert(sizeof(TRACE_EVENT) == 40, "trace events must be 40 bytes");
+
+/*
+ * The tick counts converted to nanoseconds of CLOCK_MONOTONIC, as the
+ * clock and the counter were read together when tracing was enabled and
+ * again at the time of the dump.
+ */
+typedef struct trace_header {
+	char magic[8];
+	uint64_t startTicks;
+	uint64_t startNanos;
+	uint64_t dumpTicks;
+	uint64_t dumpNanos;
+	uint32_t numEvents;
+	uint32_t numReasons;
+} TRACE_HEADER;
+
+typedef struct trace_reason {
+	uint64_t address;
+	uint32_t len;
+	uint32_t pad;
+} TRACE_REASON;
+
+extern int traceEnabled;
+
+void trace_record(TRACE_EVENT_ID event, const void *object, int before, int after,
+		  unsigned int arg, const char *reason);
+
+/*
+ * Record an event, if tracing is enabled.
+ *
+ * @param event  The event.
+ * @param object  The object concerned.
+ * @param before  The first value, such as a reference count before it
+ * was changed.
+ * @param after  The second value.
+ * @param arg  Any other argument.
+ * @param reason  A string describing the reason, or NULL.  Only its
+ * address is recorded, and the text is read from there when the rings
+ * are dumped, so it must be a string literal.  This applies to the
+ * reasons given to the ref and unref functions of every object, which
+ * are passed on here.
+ */
+static inline void trace(TRACE_EVENT_ID event, const void *object, int before, int after,
+			 unsigned int arg, const char *reason) {
+	if (__builtin_expect(traceEnabled, 0)) {
+		trace_record(event, object, before, after, arg, reason);
+	}
+}
+
+/*
+ * Enable tracing, dumping to a file.  This is intended to be called
+ * once, during startup.
+ *
+ * @param path  The pathname of the trace file, which must remain valid.
+ */
+void trace_configure(char *path);
+
+/*
+ * Dump the rings to the trace file when a signal is received, handling
+ * it in a thread of its own.  As with metrics_dump_on_signal(), this
+ * must be called before any other thread is started, so that they all
+ * inherit the blocked signal; the signal is ignored while tracing has
+ * not been enabled.
+ *
+ * @param sig  The signal.
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int trace_dump_on_signal(int sig);
+
+/*
+ * Write the events in all the rings to the trace file, replacing it.
+ * Events recorded while the dump is under way are not included, and any
+ * that are overwritten while it is copied are left out.
+ *
+ * @return 0 if the trace file was written, otherwise -1.
+ */
+int trace_dump(void);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "bot.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "proto_buf.h"
+#include "packet_pool.h"
+#include "debug.h"
+
+/*
+ * The server answers the requests of a connection in the order they were
+ * sent, so the bot keeps a FIFO of the requests it has outstanding in
+ * order to tell which request each ACK or NACK belongs to.
+ */
+typedef struct bot_request {
+	uint8_t type;
+	uint8_t id;
+} BOT_REQUEST;
+
+typedef struct bot {
+	int fd;
+	char *name;
+	PROTO_BUF in;
+	BOT_REQUEST *pending;
+	size_t size;
+	size_t head;
+	size_t count;
+} BOT;
+
+#define BOT_INITIAL_PENDING 64
+
+/*
+ * Send a request to the server and remember it until it is answered.
+ */
+static int bot_request(BOT *bot, int type, int id, char *data) {
+	if (bot->count == bot->size) {
+		size_t size = bot->size * 2;
+		BOT_REQUEST *pending = malloc(size * sizeof(BOT_REQUEST));
+		if (pending == NULL) {
+			return -1;
+		}
+		for (size_t i = 0; i < bot->count; i++) {
+			pending[i] = bot->pending[(bot->head + i) % bot->size];
+		}
+		free(bot->pending);
+		bot->pending = pending;
+		bot->size = size;
+		bot->head = 0;
+	}
+	bot->pending[(bot->head + bot->count++) % bot->size] = (BOT_REQUEST){ type, id };
+	JEUX_PACKET_HEADER hdr = {0};
+	hdr.type = type;
+	hdr.id = id;
+	hdr.size = htons(data != NULL ? strlen(data) : 0);
+	return proto_send_packet(bot->fd, &hdr, data);
+}
+
+/*
+ * Handle a packet received from the server.
+ *
+ * @return 0 if the bot should carry on, -1 if it should stop.
+ */
+static int bot_handle(BOT *bot, JEUX_PACKET_HEADER *hdr, char *payload) {
+	if (hdr->type == JEUX_ACK_PKT || hdr->type == JEUX_NACK_PKT) {
+		if (bot->count == 0) {
+			return 0;
+		}
+		BOT_REQUEST req = bot->pending[bot->head];
+		bot->head = (bot->head + 1) % bot->size;
+		bot->count--;
+		if (req.type == JEUX_LOGIN_PKT && hdr->type == JEUX_NACK_PKT) {
+			debug("%ld: [%d] Bot could not log in as '%s'", pthread_self(), bot->fd, bot->name);
+			return -1;
+		}
+		// A hint is refused if the game ended in the meantime.
+		if (req.type == JEUX_HINT_PKT && hdr->type == JEUX_ACK_PKT && payload != NULL) {
+			return bot_request(bot, JEUX_MOVE_PKT, req.id, payload);
+		}
+		return 0;
+	}
+	if (hdr->type == JEUX_INVITED_PKT) {
+		if (bot_request(bot, JEUX_ACCEPT_PKT, hdr->id, NULL) == -1) {
+			return -1;
+		}
+		// Invited to play first, so it is the bot's move right away.
+		if (hdr->role == 1) {
+			return bot_request(bot, JEUX_HINT_PKT, hdr->id, NULL);
+		}
+		return 0;
+	}
+	if (hdr->type == JEUX_MOVED_PKT) {
+		return bot_request(bot, JEUX_HINT_PKT, hdr->id, NULL);
+	}
+	return 0;
+}
+
+/*
+ * Thread function for a bot, which runs until its connection is closed.
+ */
+static void *bot_thread(void *arg) {
+	BOT *bot = arg;
+	pthread_detach(pthread_self());
+	debug("%ld: [%d] Starting bot '%s'", pthread_self(), bot->fd, bot->name);
+	if (bot_request(bot, JEUX_LOGIN_PKT, 0, bot->name) == 0) {
+		while (1) {
+			JEUX_PACKET_HEADER hdr;
+			void *payload;
+			if (proto_buf_recv_packet(&bot->in, &hdr, &payload) == -1) {
+				break;
+			}
+			int error = bot_handle(bot, &hdr, payload);
+			pool_free(payload);
+			if (error == -1) {
+				break;
+			}
+		}
+	}
+	debug("%ld: [%d] Ending bot '%s'", pthread_self(), bot->fd, bot->name);
+	close(bot->fd);
+	proto_buf_fini(&bot->in);
+	free(bot->pending);
+	free(bot);
+	return NULL;
+}
+
+int bot_start(char *name) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		return -1;
+	}
+	BOT *bot = malloc(sizeof(BOT));
+	BOT_REQUEST *pending = malloc(BOT_INITIAL_PENDING * sizeof(BOT_REQUEST));
+	if (bot == NULL || pending == NULL) {
+		free(bot);
+		free(pending);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	bot->fd = fds[1];
+	bot->name = name;
+	proto_buf_init(&bot->in, fds[1]);
+	bot->pending = pending;
+	bot->size = BOT_INITIAL_PENDING;
+	bot->head = 0;
+	bot->count = 0;
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, bot_thread, bot) != 0) {
+		free(bot->pending);
+		free(bot);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	return fds[0];
+}
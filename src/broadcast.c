@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "broadcast.h"
+#include "packet_pool.h"
+#include "refcount.h"
+
+/*
+ * A copied payload follows the header in the same pool buffer; a static
+ * one is only pointed to.
+ */
+struct broadcast {
+	REFCOUNT count;
+	size_t len;
+	const void *data;
+	char payload[];
+};
+
+BROADCAST *bcast_create(const void *data, size_t len) {
+	BROADCAST *bcast = pool_alloc(sizeof(BROADCAST) + len);
+	if (bcast == NULL) {
+		return NULL;
+	}
+	refcount_init(&bcast->count, 1);
+	memcpy(bcast->payload, data, len);
+	bcast->data = bcast->payload;
+	bcast->len = len;
+	return bcast;
+}
+
+BROADCAST *bcast_create_static(const void *data, size_t len) {
+	BROADCAST *bcast = pool_alloc(sizeof(BROADCAST));
+	if (bcast == NULL) {
+		return NULL;
+	}
+	refcount_init(&bcast->count, 1);
+	bcast->data = data;
+	bcast->len = len;
+	return bcast;
+}
+
+const void *bcast_data(BROADCAST *bcast, size_t *lenp) {
+	*lenp = bcast->len;
+	return bcast->data;
+}
+
+BROADCAST *bcast_ref(BROADCAST *bcast) {
+	refcount_inc(&bcast->count);
+	return bcast;
+}
+
+void bcast_unref(void *arg) {
+	BROADCAST *bcast = arg;
+	if (refcount_dec(&bcast->count) == 1) {
+		pool_free(bcast);
+	}
+}
@@ -9,11 +9,25 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <time.h>
+#include <stdatomic.h>
 
+#include "refcount.h"
 #include "debug.h"
+#include "trace.h"
 #include "csapp.h"
 #include "server.h"
 #include "client.h"
+#include "game_ext.h"
+#include "client_ext.h"
+#include "invitation_ext.h"
+#include "client_registry_ext.h"
+#include "cluster.h"
+#include "journal.h"
+#include "broadcast.h"
+#include "outq.h"
+#include "metrics.h"
+#include "slab.h"
+#include "timer.h"
 
 
 /*
@@ -30,11 +44,17 @@
  * A CLIENT object will not be freed until its reference count reaches zero.
  */
 
-typedef struct invite_node {
-	int id;
-	INVITATION *invitation;
-	struct invite_node *next;
-} INVITE_NODE;
+/*
+ * The IDs by which a CLIENT knows its invitations are carried in the
+ * 8-bit id field of a packet header, so each CLIENT has a table of
+ * CLIENT_MAX_INVITATIONS invitations indexed by ID, and a bitmap of the
+ * IDs in use from which the lowest free ID is assigned to a new
+ * invitation.  The
+ * INVITATION records the ID each of its participants knows it by, so
+ * that looking up an invitation by ID or the ID of an invitation takes
+ * constant time.
+ */
+#define CLIENT_INVITE_WORDS (CLIENT_MAX_INVITATIONS / 64)
 
 /*
  * The CLIENT type is a structure type that defines the state of a client.
@@ -44,15 +64,92 @@ typedef struct invite_node {
  */
 struct client {
 	int fd;
+	CLIENT_REGISTRY *registry;
+	int slot;
 	PLAYER *player;
-	INVITE_NODE *inviteHead;
-	int count;
-	int invites;
+	REFCOUNT count;
 	pthread_mutex_t clientMutex;
-	pthread_mutexattr_t mutexAttr;
+	OUTQ *out;
+	int leaving;
+	MATCH_ENTRY *match;
+	int node;
+	uint64_t session;
+	char *remoteName;
+	CLUSTER_SESSION *cluster;
+	uint64_t inviteMap[CLIENT_INVITE_WORDS];
+	INVITATION *invitations[CLIENT_MAX_INVITATIONS];
+	// Games being watched, each holding a reference to its GAME and
+	// the reserved ID under which it is watched.
+	struct {
+		GAME *game;
+		int id;
+	} watching[CLIENT_MAX_WATCHES];
+	TIMER idleTimer;
+	atomic_uint_fast64_t active;	// timer_now() when a packet was last received
+	int closed;			// the connection is being closed
 };
 
+/*
+ * The timeouts set by client_set_timeouts(), in milliseconds, and the
+ * connection exempt from the idle timeout.
+ */
+static int idleTimeout;
+static int inviteTimeout;
+static int moveTimeout;
+static int idleExemptFd = -1;
+
+static void client_idle_timeout(void *arg);
+
+/*
+ * CLIENTs are recycled through a slab, so the recursive clientMutex is
+ * initialized only once per object.
+ */
+static void client_construct(void *object) {
+	CLIENT *client = object;
+	pthread_mutexattr_t mutexAttr;
+	pthread_mutexattr_init(&mutexAttr);
+	pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&client->clientMutex, &mutexAttr);
+	pthread_mutexattr_destroy(&mutexAttr);
+}
+
+static SLAB clientSlab = SLAB_INITIALIZER(CLIENT, client_construct);
+
+/*
+ * Packets to be sent once the CLIENT locks taken by an operation have
+ * been released, so that a slow connection to one client cannot stall a
+ * thread that holds the lock of another.  No operation sends more than
+ * CLIENT_OUTBOX_MAX packets.
+ */
+#define CLIENT_OUTBOX_MAX 3
 
+typedef struct client_outbox_entry {
+	CLIENT *client;
+	JEUX_PACKET_HEADER pkt;
+	const void *data;
+	int shared;
+	char buf[GAME_MOVED_MAX];
+} CLIENT_OUTBOX_ENTRY;
+
+/*
+ * The packets of an OUTBOX can all carry the same timestamp, which is
+ * then also the time of the event recorded in the game journal.
+ */
+typedef struct client_outbox {
+	int count;
+	int stamped;
+	struct timespec stamp;
+	CLIENT_OUTBOX_ENTRY entries[CLIENT_OUTBOX_MAX];
+} CLIENT_OUTBOX;
+
+
+
+/*
+ * Lock a CLIENT, recording any time spent waiting for it.
+ */
+static void client_mutex_lock(CLIENT *client) {
+	metrics_mutex_lock(&client->clientMutex, METRICS_LOCK_CLIENT);
+}
 
 /*
  * Create a new CLIENT object with a specified file descriptor with which
@@ -66,16 +163,56 @@ struct client {
  * otherwise NULL.
  */
 CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
-	CLIENT *client = malloc(sizeof(CLIENT));
+	CLIENT *client = slab_alloc(&clientSlab);
+	if (client == NULL) {
+		return NULL;
+	}
+	client->out = outq_create(fd);
+	if (client->out == NULL) {
+		slab_free(&clientSlab, client);
+		return NULL;
+	}
 	client->fd = fd;
+	client->registry = creg;
+	client->slot = -1;
 	client->player = NULL;
-	client->inviteHead = NULL;
-	client->count = 0;
-	client->invites = 0;
-	pthread_mutexattr_init(&client->mutexAttr);
-	pthread_mutexattr_settype(&client->mutexAttr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&client->clientMutex, &client->mutexAttr);
+	refcount_init(&client->count, 0);
+	client->leaving = 0;
+	client->match = NULL;
+	client->node = -1;
+	client->session = 0;
+	client->remoteName = NULL;
+	client->cluster = NULL;
+	memset(client->inviteMap, 0, sizeof(client->inviteMap));
+	memset(client->watching, 0, sizeof(client->watching));
+	client->closed = 0;
+	atomic_store_explicit(&client->active, timer_now(), memory_order_relaxed);
+	timer_init(&client->idleTimer, client_idle_timeout, client);
 	client_ref(client, "for newly created client");
+	if (idleTimeout > 0 && fd >= 0 && fd != idleExemptFd) {
+		client_ref(client, "for idle timer");
+		timer_schedule(&client->idleTimer, timer_now() + idleTimeout);
+	}
+	return client;
+}
+
+/*
+ * A remote CLIENT has an output queue like any other, which is never
+ * written to, so that it can be shut down and destroyed in the same way.
+ */
+CLIENT *client_create_remote(CLIENT_REGISTRY *creg, int node, uint64_t session, const char *name) {
+	char *remoteName = strdup(name);
+	if (remoteName == NULL) {
+		return NULL;
+	}
+	CLIENT *client = client_create(creg, -1);
+	if (client == NULL) {
+		free(remoteName);
+		return NULL;
+	}
+	client->node = node;
+	client->session = session;
+	client->remoteName = remoteName;
 	return client;
 }
 
@@ -84,15 +221,12 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
  *
  * @param client  The CLIENT whose reference count is to be increased.
  * @param why  A string describing the reason why the reference count is
- * being increased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being increased.
  * @return  The same CLIENT that was passed as a parameter.
  */
 CLIENT *client_ref(CLIENT *client, char *why) {
-	pthread_mutex_lock(&client->clientMutex);
-	debug("%ld: Increase refrence count on client %p (%d -> %d) %s", pthread_self(), client, client->count, client->count + 1, why);
-	client->count = client->count + 1;
-	pthread_mutex_unlock(&client->clientMutex);
+	int old = refcount_inc(&client->count);
+	trace(TRACE_CLIENT_REF, client, old, old + 1, 0, why);
 	return client;
 }
 
@@ -103,19 +237,16 @@ CLIENT *client_ref(CLIENT *client, char *why) {
  *
  * @param client  The CLIENT whose reference count is to be decreased.
  * @param why  A string describing the reason why the reference count is
- * being decreased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being decreased.
  */
 void client_unref(CLIENT *client, char *why) {
-	pthread_mutex_lock(&client->clientMutex);
-	debug("%ld: Decrease refrence count on client %p (%d -> %d) %s", pthread_self(), client, client->count, client->count - 1, why);
-	client->count = client->count - 1;
-	if (client->count == 0) {
-		debug("%ld: Free client %p", pthread_self(), client);
-		free(client);
-		return;
+	int old = refcount_dec(&client->count);
+	trace(TRACE_CLIENT_UNREF, client, old, old - 1, 0, why);
+	if (old == 1) {
+		outq_destroy(client->out);
+		free(client->remoteName);
+		slab_free(&clientSlab, client);
 	}
-	pthread_mutex_unlock(&client->clientMutex);
 }
 
 /*
@@ -132,12 +263,21 @@ void client_unref(CLIENT *client, char *why) {
  * @return 0 if the login operation is successful, otherwise -1.
  */
 int client_login(CLIENT *client, PLAYER *player) {
-	pthread_mutex_lock(&client->clientMutex);
+	client_mutex_lock(client);
 	if (client->player != NULL) {
 		debug("%ld: [%d] Already logged in (player %p) [%s]", pthread_self(), client->fd, client->player, player_get_name(client->player));
 		pthread_mutex_unlock(&client->clientMutex);
 		return -1;
 	}
+	pthread_mutex_unlock(&client->clientMutex);
+	// Claiming the name in the registry's index is what guarantees that
+	// no two clients are logged in as the same player.  It is done without
+	// holding clientMutex, because index lookups take a client reference
+	// while holding the index lock.
+	if (client->registry != NULL && creg_index_add(client->registry, player_get_name(player), client) == -1) {
+		return -1;
+	}
+	client_mutex_lock(client);
 	client->player = player;
 	player_ref(player, "for reference being retained by client");
 	pthread_mutex_unlock(&client->clientMutex);
@@ -151,36 +291,88 @@ int client_login(CLIENT *client, PLAYER *player) {
  * INVITATIONs in the client's list are revoked or declined, if
  * possible, any games in progress are resigned, and the invitations
  * are removed from the list of this CLIENT as well as its opponents'.
+ * Any games the client is watching are no longer watched.
  *
  * @param client  The CLIENT that is to be logged out.
  * @return 0 if the client was logged in and has been successfully
  * logged out, otherwise -1.
  */
 int client_logout(CLIENT *client) {
-	pthread_mutex_lock(&client->clientMutex);
+	client_mutex_lock(client);
 	if (client->player == NULL) {
 		debug("%ld: Client %p is not logged in", pthread_self(), client);
 		pthread_mutex_unlock(&client->clientMutex);
 		return -1;
 	}
 	debug("%ld: Log out client %p", pthread_self(), client);
-	player_unref(client->player, "becuase refrence retained by client is being released");
-	INVITE_NODE *current = client->inviteHead;
-	while(current != NULL) {
-		INVITE_NODE *temp = current;
-		current = current->next;
-		if (inv_get_game(temp->invitation) != NULL) {
-			client_resign_game(client, temp->id);
-		} else {
-			if (inv_get_source(temp->invitation) == client) {
-				client_revoke_invitation(client, temp->id);
-			} else {
-				client_decline_invitation(client, temp->id);
+	PLAYER *player = client->player;
+	// Once this is set, the matchmaker cannot start a game for the
+	// client, so none is missed by the invitations collected below.
+	client->leaving = 1;
+	int watchIds[CLIENT_MAX_WATCHES];
+	int numWatches = 0;
+	for (int i = 0; i < CLIENT_MAX_WATCHES; i++) {
+		if (client->watching[i].game != NULL) {
+			watchIds[numWatches++] = client->watching[i].id;
+		}
+	}
+	pthread_mutex_unlock(&client->clientMutex);
+	matchmaker_cancel(client);
+	if (client->registry != NULL) {
+		creg_index_remove(client->registry, player_get_name(player), client);
+	}
+	for (int i = 0; i < numWatches; i++) {
+		client_unwatch(client, watchIds[i]);
+	}
+	// Resigning, revoking and declining each lock this client together
+	// with another, which must not be done while this client's lock is
+	// already held, so the invitations are collected first.
+	client_mutex_lock(client);
+	int numPending = 0;
+	for (int w = 0; w < CLIENT_INVITE_WORDS; w++) {
+		numPending += __builtin_popcountll(client->inviteMap[w]);
+	}
+	struct {
+		int id;
+		int inGame;
+		int isSource;
+	} *pending = NULL;
+	if (numPending > 0 && (pending = malloc(numPending * sizeof(*pending))) == NULL) {
+		debug("%ld: Unable to allocate list of invitations to close", pthread_self());
+		numPending = 0;
+	}
+	// IDs reserved for games hosted by other nodes have no INVITATION
+	// here, and are released by cluster_logout().
+	int i = 0;
+	for (int w = 0; w < CLIENT_INVITE_WORDS && i < numPending; w++) {
+		for (uint64_t bits = client->inviteMap[w]; bits != 0 && i < numPending; bits &= bits - 1) {
+			int id = w * 64 + __builtin_ctzll(bits);
+			if (client->invitations[id] == NULL) {
+				continue;
 			}
+			pending[i].id = id;
+			pending[i].inGame = inv_get_game(client->invitations[id]) != NULL;
+			pending[i].isSource = inv_get_source(client->invitations[id]) == client;
+			i++;
 		}
 	}
+	numPending = i;
+	pthread_mutex_unlock(&client->clientMutex);
+	for (i = 0; i < numPending; i++) {
+		if (pending[i].inGame) {
+			client_resign_game(client, pending[i].id);
+		} else if (pending[i].isSource) {
+			client_revoke_invitation(client, pending[i].id);
+		} else {
+			client_decline_invitation(client, pending[i].id);
+		}
+	}
+	free(pending);
+	client_mutex_lock(client);
 	client->player = NULL;
+	client->leaving = 0;
 	pthread_mutex_unlock(&client->clientMutex);
+	player_unref(player, "becuase refrence retained by client is being released");
 	return 0;
 }
 
@@ -195,7 +387,7 @@ int client_logout(CLIENT *client) {
  * otherwise NULL if the player is not currently logged in.
  */
 PLAYER *client_get_player(CLIENT *client) {
-	pthread_mutex_lock(&client->clientMutex);
+	client_mutex_lock(client);
 	PLAYER *player = client->player;
 	pthread_mutex_unlock(&client->clientMutex);
 	return player;
@@ -210,67 +402,352 @@ PLAYER *client_get_player(CLIENT *client) {
  * @return the file descriptor.
  */
 int client_get_fd(CLIENT *client) {
-	pthread_mutex_lock(&client->clientMutex);
+	client_mutex_lock(client);
 	int fd = client->fd;
 	pthread_mutex_unlock(&client->clientMutex);
 	return fd;
 }
 
-INVITE_NODE *get_invite_node_from_id(CLIENT *client, int id) {
-	pthread_mutex_lock(&client->clientMutex);
-	INVITE_NODE *current = client->inviteHead;
-	while(current != NULL && current->id != id) {
-		current = current->next;
+CLIENT_REGISTRY *client_get_registry(CLIENT *client) {
+	return client->registry;
+}
+
+void client_set_slot(CLIENT *client, int slot) {
+	client->slot = slot;
+}
+
+int client_get_slot(CLIENT *client) {
+	return client->slot;
+}
+
+void client_set_match(CLIENT *client, MATCH_ENTRY *entry) {
+	client->match = entry;
+}
+
+MATCH_ENTRY *client_get_match(CLIENT *client) {
+	return client->match;
+}
+
+void client_set_cluster(CLIENT *client, CLUSTER_SESSION *session) {
+	client->cluster = session;
+}
+
+CLUSTER_SESSION *client_get_cluster(CLIENT *client) {
+	return client->cluster;
+}
+
+void client_set_timeouts(int idle, int invite, int move) {
+	idleTimeout = idle * 1000;
+	inviteTimeout = invite * 1000;
+	moveTimeout = move * 1000;
+}
+
+void client_exempt_idle(int fd) {
+	idleExemptFd = fd;
+}
+
+void client_touch(CLIENT *client) {
+	if (idleTimeout > 0) {
+		atomic_store_explicit(&client->active, timer_now(), memory_order_relaxed);
 	}
-	if (current == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return NULL;
+}
+
+/*
+ * The idle timer of a CLIENT has expired.  Its connection is shut down
+ * if no packet has been received since the timeout began, and otherwise
+ * the timer is set again, for the end of a timeout beginning with the
+ * last packet.  Either is done with the CLIENT locked, so that
+ * client_stop_idle() cannot be missed.
+ */
+static void client_idle_timeout(void *arg) {
+	CLIENT *client = arg;
+	uint64_t deadline = atomic_load_explicit(&client->active, memory_order_relaxed) + idleTimeout;
+	int set = 0;
+	client_mutex_lock(client);
+	if (!client->closed) {
+		if (timer_now() >= deadline) {
+			debug("%ld: [%d] Client %p has been idle for %d ms", pthread_self(), client->fd, client, idleTimeout);
+			shutdown(client->fd, SHUT_RDWR);
+		} else {
+			set = timer_schedule(&client->idleTimer, deadline);
+		}
 	}
 	pthread_mutex_unlock(&client->clientMutex);
-	return current;
+	if (!set) {
+		client_unref(client, "because idle timer has expired");
+	}
+}
+
+void client_stop_idle(CLIENT *client) {
+	client_mutex_lock(client);
+	client->closed = 1;
+	pthread_mutex_unlock(&client->clientMutex);
+	if (timer_cancel(&client->idleTimer)) {
+		client_unref(client, "because idle timer has been cancelled");
+	}
 }
 
-INVITE_NODE *get_invite_node_from_inv(CLIENT *client, INVITATION *inv) {
-	pthread_mutex_lock(&client->clientMutex);
-	INVITE_NODE *current = client->inviteHead;
-	while(current != NULL && current->invitation != inv) {
-		current = current->next;
+/*
+ * Get the INVITATION that a CLIENT knows by a specified ID.  The CLIENT
+ * must be locked.
+ *
+ * @return  The INVITATION, or NULL if there is none with that ID.
+ */
+static INVITATION *client_invitation(CLIENT *client, int id) {
+	if (id < 0 || id >= CLIENT_MAX_INVITATIONS
+	    || (client->inviteMap[id / 64] & ((uint64_t)1 << (id % 64))) == 0) {
+		return NULL;
+	}
+	return client->invitations[id];
+}
+
+/*
+ * Get the ID by which a CLIENT knows an INVITATION.  The CLIENT must be
+ * locked.
+ *
+ * @return  The ID, or -1 if the INVITATION is not in the CLIENT's table.
+ */
+static int client_invitation_id(CLIENT *client, INVITATION *inv) {
+	int id = inv_get_id(inv, client);
+	if (client_invitation(client, id) != inv) {
+		return -1;
+	}
+	return id;
+}
+
+/*
+ * Lock two CLIENTs.  Whenever two CLIENTs are locked together they are
+ * locked in order of address, so two threads acting on the same pair of
+ * clients from opposite sides cannot deadlock.
+ */
+static void client_lock_pair(CLIENT *a, CLIENT *b) {
+	if (a > b) {
+		CLIENT *t = a;
+		a = b;
+		b = t;
 	}
-	if (current == NULL) {
+	client_mutex_lock(a);
+	client_mutex_lock(b);
+}
+
+static void client_unlock_pair(CLIENT *a, CLIENT *b) {
+	pthread_mutex_unlock(&a->clientMutex);
+	pthread_mutex_unlock(&b->clientMutex);
+}
+
+/*
+ * Find the INVITATION that a CLIENT knows by a specified ID, and lock the
+ * CLIENT together with the other participant in the INVITATION.  The
+ * other participant is only known once the CLIENT's list has been
+ * searched, so the CLIENT is unlocked, both are locked in order, and the
+ * INVITATION is looked up again in case it was removed in the meantime.
+ * A reference to the INVITATION is held throughout, so that it and the
+ * CLIENTs it refers to stay valid while nothing is locked.
+ *
+ * @param client  The CLIENT whose ID is to be looked up.
+ * @param id  The ID assigned by the CLIENT to the INVITATION.
+ * @param otherp  Location in which the other participant is stored.
+ * @return  The INVITATION, with both participants locked and its
+ * reference count incremented, or NULL if there is no such INVITATION.
+ */
+static INVITATION *client_lock_invitation(CLIENT *client, int id, CLIENT **otherp) {
+	client_mutex_lock(client);
+	INVITATION *inv = client_invitation(client, id);
+	if (inv == NULL) {
 		pthread_mutex_unlock(&client->clientMutex);
 		return NULL;
 	}
+	inv_ref(inv, "while participants are being locked");
 	pthread_mutex_unlock(&client->clientMutex);
-	return current;
+	CLIENT *other = inv_get_source(inv) == client ? inv_get_target(inv) : inv_get_source(inv);
+	client_lock_pair(client, other);
+	if (client_invitation(client, id) != inv) {
+		client_unlock_pair(client, other);
+		inv_unref(inv, "because invitation changed while participants were being locked");
+		return NULL;
+	}
+	*otherp = other;
+	return inv;
 }
 
 /*
- * Send a packet to a client.  Exclusive access to the network connection
- * is obtained for the duration of this operation, to prevent concurrent
- * invocations from corrupting each other's transmissions.  To prevent
- * such interference, only this function should be used to send packets to
- * the client, rather than the lower-level proto_send_packet() function.
+ * Add a packet to an OUTBOX.  A payload that fits in the entry is copied;
+ * a longer one is referenced, and must remain valid until the OUTBOX is
+ * flushed.  A reference to the recipient is held until then.
+ */
+static void client_outbox_add(CLIENT_OUTBOX *box, CLIENT *client, int type, int id, int role, void *data, size_t len) {
+	CLIENT_OUTBOX_ENTRY *entry = &box->entries[box->count++];
+	entry->client = client_ref(client, "for packet held in outbox");
+	entry->shared = 0;
+	entry->pkt.type = type;
+	entry->pkt.id = id;
+	entry->pkt.role = role;
+	entry->pkt.size = len;
+	if (data != NULL && len <= sizeof(entry->buf)) {
+		memcpy(entry->buf, data, len);
+		data = entry->buf;
+	}
+	entry->data = data;
+}
+
+/*
+ * Add a packet to an OUTBOX whose payload is immutable static data,
+ * which is sent without being copied.
+ */
+static void client_outbox_add_static(CLIENT_OUTBOX *box, CLIENT *client, int type, int id, int role, const void *data, size_t len) {
+	CLIENT_OUTBOX_ENTRY *entry = &box->entries[box->count++];
+	entry->client = client_ref(client, "for packet held in outbox");
+	entry->shared = 1;
+	entry->pkt.type = type;
+	entry->pkt.id = id;
+	entry->pkt.role = role;
+	entry->pkt.size = len;
+	entry->data = data;
+}
+
+/*
+ * Take the time at which the packets of an OUTBOX are to be stamped.
+ *
+ * @return  The time.
+ */
+static const struct timespec *client_outbox_stamp(CLIENT_OUTBOX *box) {
+	if (!box->stamped && clock_gettime(CLOCK_REALTIME, &box->stamp) == 0) {
+		box->stamped = 1;
+	}
+	return box->stamped ? &box->stamp : NULL;
+}
+
+static int client_send_stamped(CLIENT *client, JEUX_PACKET_HEADER *pkt, const void *data,
+			       int shared, const struct timespec *ts);
+
+/*
+ * Send the packets in an OUTBOX, in the order they were added.  This
+ * must be called with no CLIENT locks held.
+ *
+ * @return 0 if all the packets were sent, otherwise -1.
+ */
+static int client_outbox_flush(CLIENT_OUTBOX *box) {
+	int error = 0;
+	const struct timespec *ts = box->stamped ? &box->stamp : NULL;
+	for (int i = 0; i < box->count; i++) {
+		CLIENT_OUTBOX_ENTRY *entry = &box->entries[i];
+		int sent = client_send_stamped(entry->client, &entry->pkt, entry->data, entry->shared, ts);
+		if (sent == -1) {
+			error = -1;
+		}
+		client_unref(entry->client, "because packet held in outbox has been sent");
+	}
+	box->count = 0;
+	return error;
+}
+
+/*
+ * Map the winner of a GAME to the role field of an ENDED packet.
+ */
+static int client_game_result(GAME_ROLE winner) {
+	if (winner == FIRST_PLAYER_ROLE) {
+		return 1;
+	} else if (winner == SECOND_PLAYER_ROLE) {
+		return 2;
+	}
+	return 0;
+}
+
+/*
+ * Convert the size of a packet header to network byte order and set
+ * its timestamp, to the time given or, if that is NULL, the current
+ * time.
+ */
+static void client_stamp_packet(JEUX_PACKET_HEADER *pkt, const struct timespec *stamp) {
+	pkt->size = htons(pkt->size);
+	struct timespec ts;
+	if (stamp != NULL) {
+		ts = *stamp;
+	} else if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
+	   pkt->timestamp_sec = htonl(0);
+	   pkt->timestamp_nsec = htonl(0);
+	   return;
+	}
+	pkt->timestamp_sec = htonl(ts.tv_sec);
+	pkt->timestamp_nsec = htonl(ts.tv_nsec);
+}
+
+/*
+ * Send a packet to a client.  The packet is placed on the client's
+ * outbound queue, which keeps packets from concurrent senders whole and
+ * in order, and is written to the network without the caller having to
+ * wait for a slow client.  To prevent interference, only this function
+ * should be used to send packets to the client, rather than the
+ * lower-level proto_send_packet() function.
  *
  * @param client  The CLIENT who should be sent the packet.
  * @param pkt  The header of the packet to be sent.
  * @param data  Data payload to be sent, or NULL if none.
  * @return 0 if transmission succeeds, -1 otherwise.
+ *
+ * The header is converted to network byte order in place and is not
+ * retained, so callers normally pass a header in automatic storage.
  */
 int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data) {
-	pthread_mutex_lock(&player->clientMutex);
-	pkt->size = htons(pkt->size);
-	struct timespec ts;
-	if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-	   pkt->timestamp_sec = htonl(0);
-	   pkt->timestamp_nsec = htonl(0);
-	} else {
-		pkt->timestamp_sec = htonl(ts.tv_sec);
-		pkt->timestamp_nsec = htonl(ts.tv_nsec);
+	size_t len = pkt->size;
+	if (player->node != -1) {
+		return cluster_relay(player->node, player->session, player->remoteName, pkt, data, len);
 	}
-	int error = proto_send_packet(player->fd, pkt, data);
-	free(pkt);
-	pthread_mutex_unlock(&player->clientMutex);
-	return error;
+	trace(TRACE_PACKET_SEND, player, pkt->id, len, pkt->type, NULL);
+	client_stamp_packet(pkt, NULL);
+	return outq_send(player->out, pkt, data, len);
+}
+
+int client_send_packet_shared(CLIENT *client, JEUX_PACKET_HEADER *pkt, const void *data,
+			      void (*release)(void *), void *arg) {
+	size_t len = pkt->size;
+	if (client->node != -1) {
+		int error = cluster_relay(client->node, client->session, client->remoteName, pkt, data, len);
+		if (release != NULL) {
+			release(arg);
+		}
+		return error;
+	}
+	trace(TRACE_PACKET_SEND, client, pkt->id, len, pkt->type, NULL);
+	client_stamp_packet(pkt, NULL);
+	return outq_send_shared(client->out, pkt, data, len, release, arg);
+}
+
+/*
+ * Send a packet from an OUTBOX with the OUTBOX's timestamp.
+ */
+static int client_send_stamped(CLIENT *client, JEUX_PACKET_HEADER *pkt, const void *data,
+			       int shared, const struct timespec *ts) {
+	size_t len = pkt->size;
+	if (client->node != -1) {
+		return cluster_relay(client->node, client->session, client->remoteName, pkt, data, len);
+	}
+	trace(TRACE_PACKET_SEND, client, pkt->id, len, pkt->type, NULL);
+	client_stamp_packet(pkt, ts);
+	if (shared) {
+		return outq_send_shared(client->out, pkt, data, len, NULL, NULL);
+	}
+	return outq_send(client->out, pkt, data, len);
+}
+
+void client_shutdown_output(CLIENT *client) {
+	outq_shutdown(client->out);
+}
+
+int client_flush_output(CLIENT *client, int timeout) {
+	return outq_flush(client->out, timeout);
+}
+
+void client_cork_output(CLIENT *client) {
+	outq_cork(client->out);
+}
+
+void client_uncork_output(CLIENT *client) {
+	outq_uncork(client->out);
+}
+
+int client_output_backlog(CLIENT *client) {
+	return outq_backlog(client->out);
 }
 
 
@@ -295,15 +772,12 @@ typedef struct jeux_packet_header {
  * @return 0 if transmission succeeds, -1 otherwise.
  */
 int client_send_ack(CLIENT *client, void *data, size_t datalen) {
-	pthread_mutex_lock(&client->clientMutex);
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt->type = JEUX_ACK_PKT;
-	pkt->id = 0;
-	pkt->role = 0;
-	pkt->size = datalen;
-	int error = client_send_packet(client, pkt, data);
-	pthread_mutex_unlock(&client->clientMutex);
-	return error;
+	JEUX_PACKET_HEADER pkt = {0};
+	pkt.type = JEUX_ACK_PKT;
+	pkt.id = 0;
+	pkt.role = 0;
+	pkt.size = datalen;
+	return client_send_packet(client, &pkt, data);
 }
 
 /*
@@ -314,15 +788,12 @@ int client_send_ack(CLIENT *client, void *data, size_t datalen) {
  * @return 0 if transmission succeeds, -1 otherwise.
  */
 int client_send_nack(CLIENT *client) {
-	pthread_mutex_lock(&client->clientMutex);
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt->type = JEUX_NACK_PKT;
-	pkt->id = 0;
-	pkt->role = 0;
-	pkt->size = 0;
-	int error = client_send_packet(client, pkt, NULL);
-	pthread_mutex_unlock(&client->clientMutex);
-	return error;
+	JEUX_PACKET_HEADER pkt = {0};
+	pkt.type = JEUX_NACK_PKT;
+	pkt.id = 0;
+	pkt.role = 0;
+	pkt.size = 0;
+	return client_send_packet(client, &pkt, NULL);
 }
 
 /*
@@ -338,23 +809,22 @@ int client_send_nack(CLIENT *client) {
  * was successfully added, otherwise -1.
  */
 int client_add_invitation(CLIENT *client, INVITATION *inv) {
-	pthread_mutex_lock(&client->clientMutex);
-	INVITE_NODE *node = calloc(1, sizeof(INVITE_NODE));
-	node->id = client->invites;
-	int id = node->id;
-	client->invites = client->invites + 1;
-	node->next = NULL;
-	node->invitation = inv;
-	if (client->inviteHead == NULL) {
-		client->inviteHead = node;
-	} else {
-		INVITE_NODE *last = client->inviteHead;
-		while(last->next != NULL) {
-			last = last->next;
+	client_mutex_lock(client);
+	int id = -1;
+	for (int w = 0; w < CLIENT_INVITE_WORDS; w++) {
+		if (~client->inviteMap[w] != 0) {
+			id = w * 64 + __builtin_ctzll(~client->inviteMap[w]);
+			break;
 		}
-		last->next = node;
 	}
-	inv_ref(inv, "for refrence being retained by the client");
+	if (id == -1) {
+		debug("%ld: Client %p has too many invitations", pthread_self(), client);
+		pthread_mutex_unlock(&client->clientMutex);
+		return -1;
+	}
+	client->inviteMap[id / 64] |= (uint64_t)1 << (id % 64);
+	client->invitations[id] = inv_ref(inv, "for refrence being retained by the client");
+	inv_set_id(inv, client, id);
 	pthread_mutex_unlock(&client->clientMutex);
 	return id;
 }
@@ -370,36 +840,163 @@ int client_add_invitation(CLIENT *client, INVITATION *inv) {
  * removed, otherwise -1.
  */
 int client_remove_invitation(CLIENT *client, INVITATION *inv) {
-	pthread_mutex_lock(&client->clientMutex);
-	if (client->inviteHead != NULL && client->inviteHead->invitation == inv) {
-		inv_unref(client->inviteHead->invitation, "because invitation is being removed from clients list");
-		INVITE_NODE *temp = client->inviteHead;
-		client->inviteHead = client->inviteHead->next;
-		client->invites = client->invites - 1;
-		int id = temp->id;
-		free(temp);
+	client_mutex_lock(client);
+	int id = client_invitation_id(client, inv);
+	if (id == -1) {
 		pthread_mutex_unlock(&client->clientMutex);
-		return id;
+		return -1;
 	}
-	INVITE_NODE *current = client->inviteHead;
-	INVITE_NODE *prev;
-	while (current != NULL && current->invitation != inv) {
-		prev = current;
-		current = current->next;
+	client->inviteMap[id / 64] &= ~((uint64_t)1 << (id % 64));
+	client->invitations[id] = NULL;
+	inv_set_id(inv, client, -1);
+	inv_unref(inv, "because invitation is being removed from clients list");
+	pthread_mutex_unlock(&client->clientMutex);
+	return id;
+}
+
+INVITATION *client_get_invitation(CLIENT *client, int id) {
+	client_mutex_lock(client);
+	INVITATION *inv = client_invitation(client, id);
+	if (inv != NULL) {
+		inv_ref(inv, "for reference being returned by client_get_invitation()");
 	}
-	if (current == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
+	pthread_mutex_unlock(&client->clientMutex);
+	return inv;
+}
+
+/*
+ * The key is only a hint, so the INVITATION need not outlive it.
+ */
+uintptr_t client_invitation_key(CLIENT *client, int id) {
+	client_mutex_lock(client);
+	INVITATION *inv = client_invitation(client, id);
+	pthread_mutex_unlock(&client->clientMutex);
+	return inv != NULL ? (uintptr_t)inv : (uintptr_t)client;
+}
+
+/*
+ * Put an INVITATION in a CLIENT's table under a specified ID.  The CLIENT
+ * must be locked.
+ *
+ * @return 0 if the ID was free, otherwise -1.
+ */
+static int client_put_invitation(CLIENT *client, INVITATION *inv, int id) {
+	if (id < 0 || id >= CLIENT_MAX_INVITATIONS
+	    || (client->inviteMap[id / 64] & ((uint64_t)1 << (id % 64))) != 0) {
+		return -1;
+	}
+	client->inviteMap[id / 64] |= (uint64_t)1 << (id % 64);
+	client->invitations[id] = inv_ref(inv, "for refrence being retained by the client");
+	inv_set_id(inv, client, id);
+	return 0;
+}
+
+static void client_invitation_timeout(void *arg);
+static int client_resign(CLIENT *client, int id, int ply);
+
+/*
+ * Create an INVITATION whose TIMER times it out.
+ */
+static INVITATION *client_create_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role,
+					    GAME_ROLE target_role) {
+	INVITATION *inv = inv_create(source, target, source_role, target_role);
+	if (inv != NULL) {
+		timer_init(inv_get_timer(inv), client_invitation_timeout, inv);
+	}
+	return inv;
+}
+
+/*
+ * Set the TIMER of an INVITATION in both participants' tables, which
+ * are locked, for the end of the invitation timeout if it is open, or of
+ * the move timeout of the player to move if its game is in progress.
+ * A reference to the INVITATION is held for as long as the timer is set.
+ */
+static void client_set_invitation_timer(INVITATION *inv) {
+	TIMER *timer = inv_get_timer(inv);
+	GAME *game = inv_get_game(inv);
+	int timeout = game == NULL ? inviteTimeout : moveTimeout;
+	if (timeout == 0) {
+		if (timer_cancel(timer)) {
+			inv_unref(inv, "because invitation timer has been cancelled");
+		}
+		return;
+	}
+	uint64_t start = timer_now();
+	if (game != NULL) {
+		unsigned int ply;
+		start = game_get_move_time(game, &ply);
+	}
+	inv_ref(inv, "for invitation timer");
+	if (timer_schedule(timer, start + timeout) == 0) {
+		inv_unref(inv, "because invitation timer was already set");
+	}
+}
+
+/*
+ * As with client_make_invitation(), the INVITATION's reference from its
+ * creation is kept until it is closed.  Its timeout starts afresh.
+ */
+int client_restore_invitation(CLIENT *source, int sourceId, CLIENT *target, int targetId,
+			      GAME_ROLE source_role, GAME_ROLE target_role, GAME *game) {
+	INVITATION *inv = client_create_invitation(source, target, source_role, target_role);
+	if (inv == NULL) {
+		if (game != NULL) {
+			game_unref(game, "because invitation could not be restored");
+		}
+		return -1;
+	}
+	if (game != NULL && inv_accept_game(inv, game) == -1) {
+		game_unref(game, "because invitation could not be restored");
+		inv_unref(inv, "because invitation could not be restored");
+		return -1;
+	}
+	client_lock_pair(source, target);
+	if (client_put_invitation(source, inv, sourceId) == -1) {
+		client_unlock_pair(source, target);
+		inv_unref(inv, "because invitation could not be restored");
+		return -1;
+	}
+	if (client_put_invitation(target, inv, targetId) == -1) {
+		client_remove_invitation(source, inv);
+		client_unlock_pair(source, target);
+		inv_unref(inv, "because invitation could not be restored");
 		return -1;
 	}
-	client->invites = client->invites - 1;
-	prev->next = current->next;
-	inv_unref(current->invitation, "because invitation is being removed from clients list");
-	int id = current->id;
-	free(current);
+	client_set_invitation_timer(inv);
+	client_unlock_pair(source, target);
+	return 0;
+}
+
+/*
+ * A reserved ID is marked as in use in the bitmap but has no INVITATION
+ * in the table, so client_invitation() does not find it.
+ */
+int client_reserve_id(CLIENT *client) {
+	client_mutex_lock(client);
+	int id = -1;
+	for (int w = 0; w < CLIENT_INVITE_WORDS; w++) {
+		if (~client->inviteMap[w] != 0) {
+			id = w * 64 + __builtin_ctzll(~client->inviteMap[w]);
+			break;
+		}
+	}
+	if (id != -1) {
+		client->inviteMap[id / 64] |= (uint64_t)1 << (id % 64);
+		client->invitations[id] = NULL;
+	}
 	pthread_mutex_unlock(&client->clientMutex);
 	return id;
 }
 
+void client_release_id(CLIENT *client, int id) {
+	client_mutex_lock(client);
+	if (id >= 0 && id < CLIENT_MAX_INVITATIONS && client->invitations[id] == NULL) {
+		client->inviteMap[id / 64] &= ~((uint64_t)1 << (id % 64));
+	}
+	pthread_mutex_unlock(&client->clientMutex);
+}
+
 /*
  * Make a new invitation from a specified "source" CLIENT to a specified
  * target CLIENT.  The invitation represents an offer to the target to
@@ -416,24 +1013,96 @@ int client_remove_invitation(CLIENT *client, INVITATION *inv) {
  * is successful, otherwise -1.
  */
 int client_make_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GAME_ROLE target_role) {
-	INVITATION *inv = inv_create(source, target, source_role, target_role);
+	INVITATION *inv = client_create_invitation(source, target, source_role, target_role);
 	if (inv == NULL) {
 		return -1;
 	}
-	pthread_mutex_lock(&source->clientMutex);
-	pthread_mutex_lock(&target->clientMutex);
-	client_add_invitation(source, inv);
+	CLIENT_OUTBOX box = {0};
+	client_lock_pair(source, target);
+	int sourceId = client_add_invitation(source, inv);
 	int id = client_add_invitation(target, inv);
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
+	if (sourceId == -1 || id == -1) {
+		client_remove_invitation(source, inv);
+		client_remove_invitation(target, inv);
+		client_unlock_pair(source, target);
+		inv_unref(inv, "because invitation could not be added");
+		return -1;
+	}
 	char *name = player_get_name(client_get_player(source));
-	pkt->type = JEUX_INVITED_PKT;
-	pkt->id = id;
-	pkt->role = inv_get_target_role(inv);
-	pkt->size = strlen(name);
-	int error = client_send_packet(target, pkt, name);
-	pthread_mutex_unlock(&target->clientMutex);
-	pthread_mutex_unlock(&source->clientMutex);
-	return error;
+	client_outbox_add(&box, target, JEUX_INVITED_PKT, id, inv_get_target_role(inv), name, strlen(name));
+	client_set_invitation_timer(inv);
+	client_unlock_pair(source, target);
+	if (client_outbox_flush(&box) == -1) {
+		return -1;
+	}
+	return sourceId;
+}
+
+/*
+ * Record the start of the game of an INVITATION that has just been
+ * accepted in the game journal, at the time its ACCEPTED packets are to
+ * carry.  Both participants are locked by the caller.
+ */
+static void client_journal_start(CLIENT_OUTBOX *box, INVITATION *inv) {
+	CLIENT *source = inv_get_source(inv);
+	CLIENT *target = inv_get_target(inv);
+	if (source->player == NULL || target->player == NULL) {
+		return;
+	}
+	CLIENT *first = inv_get_source_role(inv) == FIRST_PLAYER_ROLE ? source : target;
+	CLIENT *second = first == source ? target : source;
+	uint64_t id = journal_game_start(client_outbox_stamp(box), player_get_name(first->player),
+					 player_get_name(second->player));
+	game_set_id(inv_get_game(inv), id);
+}
+
+/*
+ * Start a game between two clients chosen by the matchmaker.  The
+ * INVITATION's reference from its creation is kept, as for one made by
+ * client_make_invitation(), until the game ends.  Once the game has been
+ * started, the match stands even if a client could not be sent its
+ * ACCEPTED packet, since that client's connection is being closed and
+ * logging it out will resign the game.
+ */
+int client_make_match(CLIENT *first, CLIENT *second, CLIENT **failedp) {
+	*failedp = NULL;
+	if (first == second) {
+		return -1;
+	}
+	INVITATION *inv = client_create_invitation(first, second, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+	if (inv == NULL) {
+		return -1;
+	}
+	CLIENT_OUTBOX box = {0};
+	client_lock_pair(first, second);
+	int firstId = -1;
+	int secondId = -1;
+	if (first->player == NULL || first->leaving) {
+		*failedp = first;
+	} else if (second->player == NULL || second->leaving) {
+		*failedp = second;
+	} else if ((firstId = client_add_invitation(first, inv)) == -1) {
+		*failedp = first;
+	} else if ((secondId = client_add_invitation(second, inv)) == -1) {
+		*failedp = second;
+	}
+	if (firstId == -1 || secondId == -1 || inv_accept(inv) == -1) {
+		client_remove_invitation(first, inv);
+		client_remove_invitation(second, inv);
+		client_unlock_pair(first, second);
+		inv_unref(inv, "because match could not be made");
+		return -1;
+	}
+	debug("%ld: Match client %p with client %p", pthread_self(), first, second);
+	client_journal_start(&box, inv);
+	char *gameState = game_unparse_state(inv_get_game(inv));
+	client_outbox_add(&box, first, JEUX_ACCEPTED_PKT, firstId, FIRST_PLAYER_ROLE, gameState, strlen(gameState));
+	client_outbox_add(&box, second, JEUX_ACCEPTED_PKT, secondId, SECOND_PLAYER_ROLE, NULL, 0);
+	free(gameState);
+	client_set_invitation_timer(inv);
+	client_unlock_pair(first, second);
+	client_outbox_flush(&box);
+	return 0;
 }
 
 /*
@@ -454,56 +1123,26 @@ int client_make_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role
  * @return 0 if the invitation is successfully revoked, otherwise -1.
  */
 int client_revoke_invitation(CLIENT *client, int id) {
-	pthread_mutex_lock(&client->clientMutex);
-	INVITE_NODE *current = get_invite_node_from_id(client, id);
-	if (current == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	INVITATION *inv = current->invitation;
-	if (inv_get_game(inv) != NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	CLIENT *target = inv_get_target(inv);
-	pthread_mutex_lock(&target->clientMutex);
-	INVITE_NODE *targetNode = get_invite_node_from_inv(target, inv);
-	if (targetNode == NULL) {
-		pthread_mutex_unlock(&target->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	if (inv_get_source(inv) != client) {
-		pthread_mutex_unlock(&target->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	if (inv_close(inv, NULL_ROLE) == -1) {
-		pthread_mutex_unlock(&target->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	CLIENT *target;
+	INVITATION *inv = client_lock_invitation(client, id, &target);
+	if (inv == NULL) {
 		return -1;
 	}
-	int error = client_remove_invitation(client, inv);
-	if (error == -1) {
-		pthread_mutex_unlock(&target->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	CLIENT_OUTBOX box = {0};
+	int error = -1;
+	if (inv_get_source(inv) == client && inv_get_game(inv) == NULL
+	    && client_invitation_id(target, inv) != -1 && inv_close(inv, NULL_ROLE) == 0) {
+		client_remove_invitation(client, inv);
+		int targetId = client_remove_invitation(target, inv);
+		inv_unref(inv, "because pointer to closed invitation is being discarded");
+		client_outbox_add(&box, target, JEUX_REVOKED_PKT, targetId, 0, NULL, 0);
+		error = 0;
 	}
-	int targetId = client_remove_invitation(target, inv);
-	if (targetId == -1) {
-		pthread_mutex_unlock(&target->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	client_unlock_pair(client, target);
+	inv_unref(inv, "because participants have been unlocked");
+	if (client_outbox_flush(&box) == -1) {
 		return -1;
 	}
-	inv_unref(inv, "because pointer to closed invitation is being discarded");
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt->type = JEUX_REVOKED_PKT;
-	pkt->id = targetId;
-	pkt->role = 0;
-	pkt->size = 0;
-	error = client_send_packet(target, pkt, NULL);
-	pthread_mutex_unlock(&target->clientMutex);
-	pthread_mutex_unlock(&client->clientMutex);
 	return error;
 }
 
@@ -525,60 +1164,26 @@ int client_revoke_invitation(CLIENT *client, int id) {
  * @return 0 if the invitation is successfully declined, otherwise -1.
  */
 int client_decline_invitation(CLIENT *client, int id) {
-	pthread_mutex_lock(&client->clientMutex);
-	INVITE_NODE *current = get_invite_node_from_id(client, id);
-	if (current == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	INVITATION *inv = current->invitation;
-	if (inv_get_game(inv) != NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	CLIENT *source = inv_get_source(inv);
-	pthread_mutex_lock(&source->clientMutex);
-	INVITE_NODE *sourceNode = get_invite_node_from_inv(source, inv);
-	if (sourceNode == NULL) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	if (inv_get_target(inv) != client) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	if (inv_close(inv, NULL_ROLE) == -1) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	CLIENT *source;
+	INVITATION *inv = client_lock_invitation(client, id, &source);
+	if (inv == NULL) {
 		return -1;
 	}
-	int error = client_remove_invitation(client, inv);
-	if (error == -1) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	CLIENT_OUTBOX box = {0};
+	int error = -1;
+	if (inv_get_target(inv) == client && inv_get_game(inv) == NULL
+	    && client_invitation_id(source, inv) != -1 && inv_close(inv, NULL_ROLE) == 0) {
+		client_remove_invitation(client, inv);
+		int sourceId = client_remove_invitation(source, inv);
+		inv_unref(inv, "because pointer to closed invitation is being discarded");
+		client_outbox_add(&box, source, JEUX_DECLINED_PKT, sourceId, 0, NULL, 0);
+		error = 0;
 	}
-	int sourceId = client_remove_invitation(source, inv);
-	if (sourceId == -1) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	client_unlock_pair(client, source);
+	inv_unref(inv, "because participants have been unlocked");
+	if (client_outbox_flush(&box) == -1) {
 		return -1;
 	}
-	debug("0");
-	inv_unref(inv, "because pointer to closed invitation is being discarded");
-	debug("1");
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt->type = JEUX_DECLINED_PKT;
-	pkt->id = sourceId;
-	pkt->role = 0;
-	pkt->size = 0;
-	debug("2");
-	error = client_send_packet(source, pkt, NULL);
-	debug("3");
-	pthread_mutex_unlock(&source->clientMutex);
-	pthread_mutex_unlock(&client->clientMutex);
 	return error;
 }
 
@@ -606,60 +1211,141 @@ int client_decline_invitation(CLIENT *client, int id) {
  * @return 0 if the INVITATION is successfully accepted, otherwise -1.
  */
 int client_accept_invitation(CLIENT *client, int id, char **strp) {
-	pthread_mutex_lock(&client->clientMutex);
 	*strp = NULL;
-	INVITE_NODE *current = get_invite_node_from_id(client, id);
-	if (current == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	INVITATION *targetInv = current->invitation;
-	if (inv_get_game(targetInv) != NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
+	CLIENT *source;
+	INVITATION *inv = client_lock_invitation(client, id, &source);
+	if (inv == NULL) {
 		return -1;
 	}
-	CLIENT *source = inv_get_source(targetInv);
-	pthread_mutex_lock(&source->clientMutex);
-	current = get_invite_node_from_inv(source, targetInv);
-	if (current == NULL) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	CLIENT_OUTBOX box = {0};
+	int error = -1;
+	int sourceId = client_invitation_id(source, inv);
+	if (inv_get_target(inv) == client && sourceId != -1 && inv_accept(inv) == 0) {
+		client_journal_start(&box, inv);
+		char *gameState = game_unparse_state(inv_get_game(inv));
+		if (inv_get_source_role(inv) == FIRST_PLAYER_ROLE) {
+			client_outbox_add(&box, source, JEUX_ACCEPTED_PKT, sourceId, 0, gameState, strlen(gameState));
+			free(gameState);
+		} else {
+			client_outbox_add(&box, source, JEUX_ACCEPTED_PKT, sourceId, 0, NULL, 0);
+			*strp = gameState;
+		}
+		client_set_invitation_timer(inv);
+		error = 0;
 	}
-	int sourceId = current->id;
-	int error = inv_accept(targetInv);
-	if (error == -1) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	client_unlock_pair(client, source);
+	inv_unref(inv, "because participants have been unlocked");
+	if (client_outbox_flush(&box) == -1) {
+		free(*strp);
+		*strp = NULL;
 		return -1;
 	}
-	GAME_ROLE sourceRole = inv_get_source_role(targetInv);
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	char *gameState = NULL;
-	int len = 0;
-	*strp = NULL;
-	if (sourceRole == FIRST_PLAYER_ROLE) {
-		gameState = game_unparse_state(inv_get_game(targetInv));
-		len = strlen(gameState);
-	} else {
-		*strp = game_unparse_state(inv_get_game(targetInv));
-	}
-	pkt->type = JEUX_ACCEPTED_PKT;
-	pkt->id = sourceId;
-	pkt->role = 0;
-	pkt->size = len;
-	error = client_send_packet(source, pkt, gameState);
-	if (*strp == NULL) {
-		free(gameState);
+	return error;
+}
+
+/*
+ * Send a packet to a spectator of a GAME, referencing the payload, if
+ * any, for as long as it is queued.  Spectators are always connected to
+ * this server, and a spectator is never waited for: one that cannot keep
+ * up is disconnected instead.
+ */
+static int client_send_watcher(CLIENT *client, int type, int id, int role, BROADCAST *payload,
+			       const struct timespec *ts) {
+	JEUX_PACKET_HEADER pkt = {0};
+	pkt.type = type;
+	pkt.id = id;
+	pkt.role = role;
+	const void *data = NULL;
+	size_t len = 0;
+	if (payload != NULL) {
+		data = bcast_data(bcast_ref(payload), &len);
 	}
-	if (error == -1) {
-		pthread_mutex_unlock(&source->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	pkt.size = len;
+	trace(TRACE_PACKET_SEND, client, id, len, type, NULL);
+	client_stamp_packet(&pkt, ts);
+	return outq_offer_shared(client->out, &pkt, data, len, payload != NULL ? bcast_unref : NULL, payload);
+}
+
+/*
+ * Release the watch slot and ID of a spectator whose watch has ended,
+ * unless whoever ended it has already done so.
+ */
+static void client_end_watch(CLIENT *client, int id, GAME *game) {
+	int found = 0;
+	client_mutex_lock(client);
+	for (int i = 0; i < CLIENT_MAX_WATCHES; i++) {
+		if (client->watching[i].game == game && client->watching[i].id == id) {
+			client->watching[i].game = NULL;
+			client_release_id(client, id);
+			found = 1;
+			break;
+		}
 	}
-	pthread_mutex_unlock(&source->clientMutex);
 	pthread_mutex_unlock(&client->clientMutex);
-	return 0;
+	if (found) {
+		game_unref(game, "because spectator has stopped watching");
+	}
+}
+
+/*
+ * Lock the spectators of a GAME in which a move has been made or which
+ * has ended, while its players are still locked, and render the new
+ * position if there is anyone to send it to.
+ *
+ * @param game  The GAME.
+ * @param plyp  Location in which the number of moves in the position
+ * rendered is stored.
+ * @return  The position, or NULL if there are no spectators.
+ */
+static BROADCAST *client_watch_begin(GAME *game, unsigned int *plyp) {
+	game_lock_watchers(game);
+	int n;
+	game_get_watchers(game, &n);
+	return n > 0 ? game_get_update(game, plyp) : NULL;
+}
+
+/*
+ * Send an update to the spectators of a GAME locked by
+ * client_watch_begin(), once its players have been unlocked, and unlock
+ * the spectators.  Each spectator that has not yet been sent the position
+ * is sent a MOVED packet and, if the game is over, an ENDED packet,
+ * which ends its watch.
+ *
+ * @param game  The GAME.
+ * @param update  The position from client_watch_begin(), whose
+ * reference is released, or NULL.
+ * @param ply  The number of moves in the position.
+ * @param result  The role field of the ENDED packet, or -1 if the game
+ * is not over.
+ * @param ts  The time of the update.
+ */
+static void client_watch_end(GAME *game, BROADCAST *update, unsigned int ply, int result,
+			     const struct timespec *ts) {
+	int n;
+	GAME_WATCHER *watchers = game_get_watchers(game, &n);
+	for (int i = 0; i < n; i++) {
+		GAME_WATCHER *w = &watchers[i];
+		if (update != NULL && w->ply < ply) {
+			client_send_watcher(w->client, JEUX_MOVED_PKT, w->id, 0, update, ts);
+			w->ply = ply;
+		}
+		if (result != -1) {
+			client_send_watcher(w->client, JEUX_ENDED_PKT, w->id, result, NULL, ts);
+		}
+	}
+	GAME_WATCHER *ended = result != -1 ? game_take_watchers(game, &n) : NULL;
+	game_unlock_watchers(game);
+	if (update != NULL) {
+		bcast_unref(update);
+	}
+	if (ended != NULL) {
+		debug("%ld: Game %p ended for %d spectators", pthread_self(), game, n);
+		for (int i = 0; i < n; i++) {
+			client_end_watch(ended[i].client, ended[i].id, game);
+			client_unref(ended[i].client, "because watched game has ended");
+		}
+		free(ended);
+	}
 }
 
 /*
@@ -678,107 +1364,107 @@ int client_accept_invitation(CLIENT *client, int id, char **strp) {
  * @return 0 if the game is successfully resigned, otherwise -1.
  */
 int client_resign_game(CLIENT *client, int id) {
-	pthread_mutex_lock(&client->clientMutex);
-	INVITE_NODE *current = get_invite_node_from_id(client, id);
-	if (current == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	return client_resign(client, id, -1);
+}
+
+/*
+ * The INVITATION's timer has expired.  What is to be done is found with
+ * both participants locked, and with the INVITATION still in both their
+ * tables, so that it has not been closed.  An open INVITATION is
+ * withdrawn.  In a game in progress, the player to move resigns if the
+ * move timeout has passed since they were given the move, and otherwise
+ * the timer is set again for when it will have.  Resigning is left until
+ * the participants have been unlocked, and is only done if no move has
+ * been made in the meantime.
+ */
+static void client_invitation_timeout(void *arg) {
+	INVITATION *inv = arg;
+	CLIENT *source = inv_get_source(inv);
+	CLIENT *target = inv_get_target(inv);
+	CLIENT_OUTBOX box = {0};
+	CLIENT *mover = NULL;
+	int moverId = -1;
+	unsigned int ply = 0;
+	client_lock_pair(source, target);
+	int sourceId = client_invitation_id(source, inv);
+	int targetId = client_invitation_id(target, inv);
+	GAME *game = inv_get_game(inv);
+	if (sourceId != -1 && targetId != -1) {
+		if (game == NULL) {
+			if (inv_close(inv, NULL_ROLE) == 0) {
+				debug("%ld: Invitation %p has timed out", pthread_self(), inv);
+				client_remove_invitation(source, inv);
+				client_remove_invitation(target, inv);
+				inv_unref(inv, "because pointer to closed invitation is being discarded");
+				client_outbox_add(&box, target, JEUX_REVOKED_PKT, targetId, 0, NULL, 0);
+				client_outbox_add(&box, source, JEUX_DECLINED_PKT, sourceId, 0, NULL, 0);
+			}
+		} else if (moveTimeout > 0 && timer_now() >= game_get_move_time(game, &ply) + moveTimeout) {
+			GAME_ROLE turn = ply % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+			mover = inv_get_source_role(inv) == turn ? source : target;
+			moverId = mover == source ? sourceId : targetId;
+			client_ref(mover, "while player is being timed out");
+		} else {
+			client_set_invitation_timer(inv);
+		}
 	}
-	INVITATION *inv = current->invitation;
-	if (inv_get_game(inv) == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	client_unlock_pair(source, target);
+	client_outbox_flush(&box);
+	if (mover != NULL) {
+		debug("%ld: Client %p has run out of time in game %p", pthread_self(), mover, game);
+		client_resign(mover, moverId, ply);
+		client_unref(mover, "because player has been timed out");
 	}
-	int sourceResign;
+	inv_unref(inv, "because invitation timer has expired");
+}
+
+/*
+ * Resign a game in progress, as client_resign_game() does, but only if
+ * it still has a given number of moves, or whatever its number of moves
+ * if that is -1.
+ */
+static int client_resign(CLIENT *client, int id, int ply) {
 	CLIENT *opponent;
-	if (client == inv_get_source(inv)) {
-		sourceResign = 1;
-		opponent = inv_get_target(inv);
-		pthread_mutex_lock(&opponent->clientMutex);
-	} else {
-		sourceResign = 0;
-		opponent = inv_get_source(inv);
-		pthread_mutex_lock(&opponent->clientMutex);
-	}
-	INVITE_NODE *opponentNode = get_invite_node_from_inv(opponent, inv);
-	if (opponentNode == NULL) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	int error;
-	if (sourceResign) {
-		error = inv_close(inv, inv_get_source_role(inv));
-	} else {
-		error = inv_close(inv, inv_get_target_role(inv));
-	}
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	int clientId = client_remove_invitation(client, inv);
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
-	}
-	int opponentId = client_remove_invitation(opponent, inv);
-	if (opponentId == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	INVITATION *inv = client_lock_invitation(client, id, &opponent);
+	if (inv == NULL) {
 		return -1;
 	}
-	player_post_result(client_get_player(client), client_get_player(opponent), 2);
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt->type = JEUX_RESIGNED_PKT;
-	pkt->id = opponentId;
-	pkt->role = 0;
-	pkt->size = 0;
-	error = client_send_packet(opponent, pkt, NULL);
-	if (error == -1) {
+	CLIENT_OUTBOX box = {0};
+	int error = -1;
+	GAME *watched = NULL;
+	BROADCAST *update = NULL;
+	unsigned int updatePly = 0;
+	int result = -1;
+	GAME_ROLE clientRole = client == inv_get_source(inv) ? inv_get_source_role(inv) : inv_get_target_role(inv);
+	int opponentId = client_invitation_id(opponent, inv);
+	if (inv_get_game(inv) != NULL && opponentId != -1
+	    && (ply == -1 || game_get_ply(inv_get_game(inv)) == (unsigned int)ply)
+	    && inv_close(inv, clientRole) == 0) {
+		client_remove_invitation(client, inv);
+		client_remove_invitation(opponent, inv);
+		player_post_result(client_get_player(client), client_get_player(opponent), 2);
+		GAME *game = inv_get_game(inv);
+		journal_game_result(client_outbox_stamp(&box), game_get_id(game), game_get_ply(game),
+				    game_get_winner(game), 1);
+		result = client_game_result(game_get_winner(game));
+		client_outbox_add(&box, opponent, JEUX_RESIGNED_PKT, opponentId, 0, NULL, 0);
+		client_outbox_add(&box, client, JEUX_ENDED_PKT, id, result, NULL, 0);
+		client_outbox_add(&box, opponent, JEUX_ENDED_PKT, opponentId, result, NULL, 0);
 		inv_unref(inv, "because pointer to closed invitation is being discarded");
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+		watched = game;
+		update = client_watch_begin(game, &updatePly);
+		error = 0;
 	}
-	GAME_ROLE winner = game_get_winner(inv_get_game(inv));
-	int roleWinner;
-	if (winner == FIRST_PLAYER_ROLE) {
-		roleWinner = 1;
-	} else if (winner == SECOND_PLAYER_ROLE) {
-		roleWinner = 2;
-	} else {
-		roleWinner = 0;
-	}
-	JEUX_PACKET_HEADER *pkt1 = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt1->type = JEUX_ENDED_PKT;
-	pkt1->id = clientId;
-	pkt1->role = roleWinner;
-	pkt1->size = 0;
-	error = client_send_packet(client, pkt1, NULL);
-	if (error == -1) {
-		inv_unref(inv, "because pointer to closed invitation is being discarded");
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	client_unlock_pair(client, opponent);
+	int flushed = client_outbox_flush(&box);
+	if (watched != NULL) {
+		client_watch_end(watched, update, updatePly, result, client_outbox_stamp(&box));
 	}
-	JEUX_PACKET_HEADER *pkt2 = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt2->type = JEUX_ENDED_PKT;
-	pkt2->id = opponentId;
-	pkt2->role = roleWinner;
-	pkt2->size = 0;
-	error = client_send_packet(opponent, pkt2, NULL);
-	if (error == -1) {
-		inv_unref(inv, "because pointer to closed invitation is being discarded");
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	inv_unref(inv, "because participants have been unlocked");
+	if (flushed == -1) {
 		return -1;
 	}
-	inv_unref(inv, "because pointer to closed invitation is being discarded");
-	pthread_mutex_unlock(&opponent->clientMutex);
-	pthread_mutex_unlock(&client->clientMutex);
-	return 0;
+	return error;
 }
 
 /*
@@ -805,136 +1491,187 @@ int client_resign_game(CLIENT *client, int id) {
  * @return 0 if the move was made successfully, -1 otherwise.
  */
 int client_make_move(CLIENT *client, int id, char *move) {
-	pthread_mutex_lock(&client->clientMutex);
-	INVITE_NODE *current = get_invite_node_from_id(client, id);
-	if (current == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
+	CLIENT *opponent;
+	INVITATION *inv = client_lock_invitation(client, id, &opponent);
+	if (inv == NULL) {
 		return -1;
 	}
-	INVITATION *inv = current->invitation;
-	if (inv_get_game(inv) == NULL) {
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	CLIENT_OUTBOX box = {0};
+	int error = -1;
+	GAME *game = inv_get_game(inv);
+	GAME_ROLE clientRole = client == inv_get_source(inv) ? inv_get_source_role(inv) : inv_get_target_role(inv);
+	int opponentId = client_invitation_id(opponent, inv);
+	GAME_MOVE applied;
+	int watched = 0;
+	BROADCAST *update = NULL;
+	unsigned int updatePly = 0;
+	int result = -1;
+	if (game != NULL && opponentId != -1 && game_make_move(game, clientRole, move, &applied) == 0) {
+		uint64_t gameId = game_get_id(game);
+		unsigned int ply = game_get_ply(game);
+		journal_game_move(client_outbox_stamp(&box), gameId, ply, clientRole, &applied);
+		size_t len;
+		char buf[GAME_MOVED_MAX];
+		const char *moved = game_render_moved(game, buf, sizeof(buf), &len);
+		if (moved == buf) {
+			client_outbox_add(&box, opponent, JEUX_MOVED_PKT, opponentId, 0, buf, len);
+		} else {
+			client_outbox_add_static(&box, opponent, JEUX_MOVED_PKT, opponentId, 0, moved, len);
+		}
+		error = 0;
+		if (game_is_over(game)) {
+			GAME_ROLE winner = game_get_winner(game);
+			journal_game_result(client_outbox_stamp(&box), gameId, ply, winner, 0);
+			int clientOutcome;
+			if (winner == clientRole) {
+				clientOutcome = 1;
+			} else if (winner == NULL_ROLE) {
+				clientOutcome = 0;
+			} else {
+				clientOutcome = 2;
+			}
+			result = client_game_result(winner);
+			client_outbox_add(&box, client, JEUX_ENDED_PKT, id, result, NULL, 0);
+			client_outbox_add(&box, opponent, JEUX_ENDED_PKT, opponentId, result, NULL, 0);
+			if (inv_close(inv, winner) == 0) {
+				player_post_result(client->player, opponent->player, clientOutcome);
+				client_remove_invitation(client, inv);
+				client_remove_invitation(opponent, inv);
+				inv_unref(inv, "because pointer to closed invitation is being discarded");
+			} else {
+				error = -1;
+			}
+		}
+		watched = 1;
+		update = client_watch_begin(game, &updatePly);
 	}
-	GAME_ROLE clientRole;
-	CLIENT *opponent;
-	if (client == inv_get_source(inv)) {
-		clientRole = inv_get_source_role(inv);
-		opponent = inv_get_target(inv);
-		pthread_mutex_lock(&opponent->clientMutex);
-	} else {
-		clientRole = inv_get_target_role(inv);
-		opponent = inv_get_source(inv);
-		pthread_mutex_lock(&opponent->clientMutex);
-	}
-	GAME_MOVE *gameMove = game_parse_move(inv_get_game(inv), clientRole, move);
-	if (gameMove == NULL) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	client_unlock_pair(client, opponent);
+	int flushed = client_outbox_flush(&box);
+	if (watched) {
+		client_watch_end(game, update, updatePly, result, client_outbox_stamp(&box));
+	}
+	inv_unref(inv, "because participants have been unlocked");
+	if (flushed == -1) {
 		return -1;
 	}
-	int error = game_apply_move(inv_get_game(inv), gameMove);
-	free(gameMove);
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
+	return error;
+}
+
+/*
+ * Get a best move for a CLIENT in a game in progress.  Only the CLIENT's
+ * own table has to be consulted, and the INVITATION is referenced so
+ * that its GAME stays valid once the CLIENT has been unlocked.
+ */
+int client_hint(CLIENT *client, int id, char *buf, size_t len, GAME_ROLE *outcomep) {
+	client_mutex_lock(client);
+	INVITATION *inv = client_invitation(client, id);
+	if (inv == NULL || inv_get_game(inv) == NULL) {
 		pthread_mutex_unlock(&client->clientMutex);
 		return -1;
 	}
-	INVITE_NODE *opponentNode = get_invite_node_from_inv(opponent, inv);
-	if (opponentNode == NULL) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	inv_ref(inv, "while a hint is being found");
+	pthread_mutex_unlock(&client->clientMutex);
+	GAME_ROLE clientRole = client == inv_get_source(inv) ? inv_get_source_role(inv) : inv_get_target_role(inv);
+	int error = game_hint(inv_get_game(inv), clientRole, buf, len, outcomep);
+	inv_unref(inv, "because hint has been found");
+	return error;
+}
+
+/*
+ * Start watching the game of a player.  The player's table is only
+ * searched for a game, which is referenced so that it stays valid, and
+ * the spectator's watch slot is reserved before its spectators are
+ * locked, since no CLIENT may be locked while they are.  The ACK is sent
+ * with the spectators locked, so that it reaches the spectator before
+ * any update, and it carries the same rendering of the position as the
+ * updates sent to the other spectators.
+ */
+int client_watch(CLIENT *client, CLIENT *player) {
+	if (client == player || player->node != -1) {
 		return -1;
 	}
-	JEUX_PACKET_HEADER *pkt = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	char *gameState = game_unparse_state(inv_get_game(inv));
-	char *buffer = calloc(1024, sizeof(char));
-	buffer[0] = '\n';
-	strcat(buffer, gameState);
-	free(gameState);
-	if (!game_is_over(inv_get_game(inv))) {
-		if (clientRole == FIRST_PLAYER_ROLE) {
-			strcat(buffer, "\nO to move\n");
-		} else {
-			strcat(buffer, "\nX to move\n");
+	GAME *game = NULL;
+	GAME_ROLE role = NULL_ROLE;
+	client_mutex_lock(player);
+	for (int w = 0; w < CLIENT_INVITE_WORDS && game == NULL; w++) {
+		for (uint64_t bits = player->inviteMap[w]; bits != 0; bits &= bits - 1) {
+			INVITATION *inv = player->invitations[w * 64 + __builtin_ctzll(bits)];
+			if (inv != NULL && inv_get_game(inv) != NULL) {
+				game = game_ref(inv_get_game(inv), "for game being watched");
+				role = inv_get_source(inv) == player ? inv_get_source_role(inv) : inv_get_target_role(inv);
+				break;
+			}
 		}
 	}
-	pkt->type = JEUX_MOVED_PKT;
-	pkt->id = opponentNode->id;
-	pkt->role = 0;
-	pkt->size = strlen(buffer);
-	error = client_send_packet(opponent, pkt, buffer);
-	free(buffer);
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	pthread_mutex_unlock(&player->clientMutex);
+	if (game == NULL) {
 		return -1;
 	}
-	if (!game_is_over(inv_get_game(inv))) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return 0;
-	}
-	GAME_ROLE winner = game_get_winner(inv_get_game(inv));
-	int clientOutcome;
-	if (winner == clientRole) {
-		clientOutcome = 1;
-	} else if (winner == NULL_ROLE) {
-		clientOutcome = 0;
-	} else {
-		clientOutcome = 2;
-	}
-	int roleWinner;
-	if (winner == FIRST_PLAYER_ROLE) {
-		roleWinner = 1;
-	} else if (winner == SECOND_PLAYER_ROLE) {
-		roleWinner = 2;
-	} else {
-		roleWinner = 0;
-	}
-	JEUX_PACKET_HEADER *pkt1 = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt1->type = JEUX_ENDED_PKT;
-	pkt1->id = current->id;
-	pkt1->role = roleWinner;
-	pkt1->size = 0;
-	error = client_send_packet(client, pkt1, NULL);
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	int id = -1;
+	client_mutex_lock(client);
+	for (int i = 0; i < CLIENT_MAX_WATCHES; i++) {
+		if (client->watching[i].game == NULL) {
+			if (client->player != NULL && !client->leaving && (id = client_reserve_id(client)) != -1) {
+				client->watching[i].game = game;
+				client->watching[i].id = id;
+			}
+			break;
+		}
 	}
-	JEUX_PACKET_HEADER *pkt2 = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	pkt2->type = JEUX_ENDED_PKT;
-	pkt2->id = opponentNode->id;
-	pkt2->role = roleWinner;
-	pkt2->size = 0;
-	error = client_send_packet(opponent, pkt2, NULL);
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+	pthread_mutex_unlock(&client->clientMutex);
+	if (id == -1) {
+		game_unref(game, "because game could not be watched");
 		return -1;
 	}
-	error = inv_close(inv, winner);
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	game_lock_watchers(game);
+	unsigned int ply;
+	BROADCAST *update = game_get_update(game, &ply);
+	int error = update == NULL || game_add_watcher(game, client, id, ply) == -1 ? -1 : 0;
+	if (error == 0) {
+		client_send_watcher(client, JEUX_ACK_PKT, id, role, update, NULL);
 	}
-	player_post_result(client->player, opponent->player, clientOutcome);
-	error = client_remove_invitation(client, inv);
-	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
-		return -1;
+	game_unlock_watchers(game);
+	if (update != NULL) {
+		bcast_unref(update);
 	}
-	error = client_remove_invitation(opponent, inv);
 	if (error == -1) {
-		pthread_mutex_unlock(&opponent->clientMutex);
-		pthread_mutex_unlock(&client->clientMutex);
+		client_end_watch(client, id, game);
 		return -1;
 	}
-	inv_unref(inv, "because pointer to closed invitation is being discarded");
-	pthread_mutex_unlock(&opponent->clientMutex);
+	debug("%ld: Client %p watching game %p under ID %d", pthread_self(), client, game, id);
+	// A logout that began before the watch was added did not see it.
+	client_mutex_lock(client);
+	int leaving = client->player == NULL || client->leaving;
 	pthread_mutex_unlock(&client->clientMutex);
-	return 0;
-}
\ No newline at end of file
+	if (leaving) {
+		client_unwatch(client, id);
+	}
+	return id;
+}
+
+/*
+ * Stop watching a game.  Whichever of this and the end of the game
+ * removes the spectator from the game releases its watch slot.
+ */
+int client_unwatch(CLIENT *client, int id) {
+	GAME *game = NULL;
+	client_mutex_lock(client);
+	for (int i = 0; i < CLIENT_MAX_WATCHES; i++) {
+		if (client->watching[i].game != NULL && client->watching[i].id == id) {
+			game = game_ref(client->watching[i].game, "while spectator is being removed");
+			break;
+		}
+	}
+	pthread_mutex_unlock(&client->clientMutex);
+	if (game == NULL) {
+		return -1;
+	}
+	game_lock_watchers(game);
+	int error = game_remove_watcher(game, client, id);
+	game_unlock_watchers(game);
+	if (error == 0) {
+		client_end_watch(client, id, game);
+	}
+	game_unref(game, "because spectator has been removed");
+	return error;
+}
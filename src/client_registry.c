@@ -5,24 +5,86 @@
 #include <pthread.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 
 #include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "name_hash.h"
+#include "player_ext.h"
+#include "refcount.h"
+#include "metrics.h"
 #include "csapp.h"
 #include "debug.h"
+#include "trace.h"
+
+#define CREG_SHARDS 16
 
 int waitingForEmpty = 0;
 
+/*
+ * An entry in the username index.  The name is not copied: it is the
+ * name of the PLAYER that the client is logged in as, which remains
+ * valid for as long as the client stays logged in.
+ */
+typedef struct creg_entry {
+	uint64_t hash;
+	char *name;
+	CLIENT *client;
+	struct creg_entry *next;
+} CREG_ENTRY;
+
+struct creg_users {
+	REFCOUNT count;
+	unsigned long version;
+	unsigned long epoch;
+	size_t len;
+	char data[];
+};
+
+/*
+ * One shard of the username index: a chained hash table with its own
+ * reader-writer lock.  A name always hashes to the same shard, and the
+ * low bits of the hash not used to select the shard select the bucket.
+ */
+typedef struct creg_shard {
+	pthread_rwlock_t lock;
+	size_t numBuckets;
+	CREG_ENTRY **buckets;
+} CREG_SHARD;
+
+/*
+ * The registry proper.  The slot array and the stack of free slot
+ * indices are protected by registryMutex; the username index is
+ * protected by the shard locks.
+ */
 struct client_registry {
     int numClients;
-    CLIENT *clients[MAX_CLIENTS];
+    int capacity;
+    CLIENT **clients;
+    int *freeSlots;
+    int numFree;
     sem_t registryMutex;
     sem_t emptyRegisterMutex;
+    CREG_SHARD shards[CREG_SHARDS];
+    atomic_ulong version;
+    CREG_USERS *users;
+    pthread_mutex_t usersMutex;
 };
 
+static CREG_SHARD *creg_shard_for(CLIENT_REGISTRY *cr, uint64_t hash) {
+	return &cr->shards[hash % CREG_SHARDS];
+}
+
+static CREG_ENTRY **creg_bucket_for(CREG_SHARD *shard, uint64_t hash) {
+	return &shard->buckets[(hash / CREG_SHARDS) & (shard->numBuckets - 1)];
+}
+
 /*
  * Initialize a new client registry.
  *
@@ -30,14 +92,48 @@ struct client_registry {
  * fails.
  */
 CLIENT_REGISTRY *creg_init() {
-	CLIENT_REGISTRY *registry = malloc(sizeof(CLIENT_REGISTRY));
+	return creg_init_capacity(MAX_CLIENTS);
+}
+
+CLIENT_REGISTRY *creg_init_capacity(int capacity) {
+	if (capacity < 1) {
+		return NULL;
+	}
+	CLIENT_REGISTRY *registry = calloc(1, sizeof(CLIENT_REGISTRY));
+	if (registry == NULL) {
+		return NULL;
+	}
 	registry->numClients = 0;
+	registry->capacity = capacity;
+	registry->clients = calloc(capacity, sizeof(CLIENT *));
+	registry->freeSlots = malloc(capacity * sizeof(int));
+	if (registry->clients == NULL || registry->freeSlots == NULL) {
+		free(registry->clients);
+		free(registry->freeSlots);
+		free(registry);
+		return NULL;
+	}
+	// Slots are handed out lowest index first.
+	for (int i = 0; i < capacity; i++) {
+		registry->freeSlots[i] = capacity - 1 - i;
+	}
+	registry->numFree = capacity;
+	// Size each shard for a load factor of at most one when full.
+	size_t numBuckets = 1;
+	while (numBuckets * CREG_SHARDS < (size_t)capacity) {
+		numBuckets <<= 1;
+	}
+	for (int i = 0; i < CREG_SHARDS; i++) {
+		pthread_rwlock_init(&registry->shards[i].lock, NULL);
+		registry->shards[i].numBuckets = numBuckets;
+		registry->shards[i].buckets = calloc(numBuckets, sizeof(CREG_ENTRY *));
+	}
 	Sem_init(&registry->registryMutex, 0, 1);
 	Sem_init(&registry->emptyRegisterMutex, 0, 1);
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		registry->clients[i] = NULL;
-	}
-	debug("%ld: Initialize client registry", pthread_self());
+	atomic_init(&registry->version, 0);
+	registry->users = NULL;
+	pthread_mutex_init(&registry->usersMutex, NULL);
+	debug("%ld: Initialize client registry (capacity %d)", pthread_self(), capacity);
 	return registry;
 }
 
@@ -50,20 +146,28 @@ CLIENT_REGISTRY *creg_init() {
  * be referenced again.
  */
 void creg_fini(CLIENT_REGISTRY *cr) {
-	P(&cr->registryMutex);
+	metrics_sem_wait(&cr->registryMutex, METRICS_LOCK_CLIENT_REGISTRY);
 	debug("%ld: Finalize client registry", pthread_self());
-	if (cr->clients != 0) {
-		V(&cr->registryMutex);
-		free(cr);
-		return;
-	} else {
-		for(int i = 0; i < MAX_CLIENTS; i++) {
-			cr->clients[i] = NULL;
+	for (int i = 0; i < CREG_SHARDS; i++) {
+		CREG_SHARD *shard = &cr->shards[i];
+		for (size_t b = 0; b < shard->numBuckets; b++) {
+			CREG_ENTRY *entry = shard->buckets[b];
+			while (entry != NULL) {
+				CREG_ENTRY *next = entry->next;
+				free(entry);
+				entry = next;
+			}
 		}
-		cr->numClients = 0;
-		free(cr);
-		return;
+		free(shard->buckets);
+		pthread_rwlock_destroy(&shard->lock);
 	}
+	if (cr->users != NULL) {
+		creg_users_unref(cr->users);
+	}
+	pthread_mutex_destroy(&cr->usersMutex);
+	free(cr->clients);
+	free(cr->freeSlots);
+	free(cr);
 }
 
 /*
@@ -79,8 +183,8 @@ void creg_fini(CLIENT_REGISTRY *cr) {
  * is successful, otherwise NULL.
  */
 CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
-	P(&cr->registryMutex);
-	if (cr->numClients == MAX_CLIENTS) {
+	metrics_sem_wait(&cr->registryMutex, METRICS_LOCK_CLIENT_REGISTRY);
+	if (cr->numFree == 0) {
 		V(&cr->registryMutex);
 		return NULL;
 	}
@@ -89,14 +193,12 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
 		V(&cr->registryMutex);
 		return NULL;
 	}
-	for(int i = 0; i < MAX_CLIENTS; i++) {
-		if (cr->clients[i] == NULL) {
-			cr->clients[i] = client;
-			cr->numClients = cr->numClients + 1;
-			debug("%ld: Register client fd %d (total connected: %d)", pthread_self(), fd, cr->numClients);
-			break;
-		}
-	}
+	int slot = cr->freeSlots[--cr->numFree];
+	cr->clients[slot] = client;
+	client_set_slot(client, slot);
+	cr->numClients = cr->numClients + 1;
+	metrics_gauge_add(METRICS_CONNECTIONS, 1);
+	trace(TRACE_CLIENT_REGISTER, client, cr->numClients - 1, cr->numClients, fd, NULL);
 	V(&cr->registryMutex);
 	return client;
 }
@@ -115,31 +217,71 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
  * @return 0  if unregistration succeeds, otherwise -1.
  */
 int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client) {
-	P(&cr->registryMutex);
+	metrics_sem_wait(&cr->registryMutex, METRICS_LOCK_CLIENT_REGISTRY);
 	int found = 0;
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (cr->clients[i] == client) {
-			cr->clients[i] = NULL;
-			cr->numClients = cr->numClients - 1;
-			found = 1;
-			debug("%ld: Unregister client %d (total connected: %d)", pthread_self(), client_get_fd(client), cr->numClients);
-			client_unref(client, "because client is being unregistered");
-			break;
-		}
+	int slot = client_get_slot(client);
+	if (slot >= 0 && slot < cr->capacity && cr->clients[slot] == client) {
+		cr->clients[slot] = NULL;
+		cr->freeSlots[cr->numFree++] = slot;
+		client_set_slot(client, -1);
+		cr->numClients = cr->numClients - 1;
+		metrics_gauge_add(METRICS_CONNECTIONS, -1);
+		found = 1;
+		trace(TRACE_CLIENT_UNREGISTER, client, cr->numClients + 1, cr->numClients, client_get_fd(client), NULL);
+		client_unref(client, "because client is being unregistered");
 	}
-	if (found) {
-		V(&cr->registryMutex);
-		if (cr->numClients == 0 && waitingForEmpty) {
-			V(&cr->emptyRegisterMutex);
+	V(&cr->registryMutex);
+	if (cr->numClients == 0 && waitingForEmpty) {
+		V(&cr->emptyRegisterMutex);
+	}
+	return found ? 0 : -1;
+}
+
+int creg_index_add(CLIENT_REGISTRY *cr, char *name, CLIENT *client) {
+	uint64_t hash = name_hash(name);
+	CREG_SHARD *shard = creg_shard_for(cr, hash);
+	CREG_ENTRY *entry = malloc(sizeof(CREG_ENTRY));
+	if (entry == NULL) {
+		return -1;
+	}
+	pthread_rwlock_wrlock(&shard->lock);
+	CREG_ENTRY **bucket = creg_bucket_for(shard, hash);
+	for (CREG_ENTRY *e = *bucket; e != NULL; e = e->next) {
+		if (e->hash == hash && strcmp(e->name, name) == 0) {
+			pthread_rwlock_unlock(&shard->lock);
+			free(entry);
+			debug("%ld: Username '%s' is already logged in (client %p)", pthread_self(), name, e->client);
+			return -1;
 		}
-		return 0;
-	} else {
-		V(&cr->registryMutex);
-		if (cr->numClients == 0 && waitingForEmpty) {
-			V(&cr->emptyRegisterMutex);
+	}
+	entry->hash = hash;
+	entry->name = name;
+	entry->client = client;
+	entry->next = *bucket;
+	*bucket = entry;
+	pthread_rwlock_unlock(&shard->lock);
+	atomic_fetch_add_explicit(&cr->version, 1, memory_order_release);
+	return 0;
+}
+
+int creg_index_remove(CLIENT_REGISTRY *cr, char *name, CLIENT *client) {
+	uint64_t hash = name_hash(name);
+	CREG_SHARD *shard = creg_shard_for(cr, hash);
+	pthread_rwlock_wrlock(&shard->lock);
+	CREG_ENTRY **link = creg_bucket_for(shard, hash);
+	while (*link != NULL) {
+		CREG_ENTRY *e = *link;
+		if (e->client == client && e->hash == hash && strcmp(e->name, name) == 0) {
+			*link = e->next;
+			pthread_rwlock_unlock(&shard->lock);
+			free(e);
+			atomic_fetch_add_explicit(&cr->version, 1, memory_order_release);
+			return 0;
 		}
-		return -1;
+		link = &e->next;
 	}
+	pthread_rwlock_unlock(&shard->lock);
+	return -1;
 }
 
 /*
@@ -153,21 +295,17 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client) {
  * username, if there is one, otherwise NULL.
  */
 CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user) {
-	P(&cr->registryMutex);;
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (cr->clients[i] != NULL) {
-			PLAYER *player = client_get_player(cr->clients[i]);
-			if (player != NULL) {
-				char *username = player_get_name(player);
-				if (strcmp(username, user) == 0) {
-					client_ref(cr->clients[i], "for reference being returned by creg_lookup()");
-					V(&cr->registryMutex);
-					return cr->clients[i];
-				}
-			}
+	uint64_t hash = name_hash(user);
+	CREG_SHARD *shard = creg_shard_for(cr, hash);
+	pthread_rwlock_rdlock(&shard->lock);
+	for (CREG_ENTRY *e = *creg_bucket_for(shard, hash); e != NULL; e = e->next) {
+		if (e->hash == hash && strcmp(e->name, user) == 0) {
+			CLIENT *client = client_ref(e->client, "for reference being returned by creg_lookup()");
+			pthread_rwlock_unlock(&shard->lock);
+			return client;
 		}
 	}
-	V(&cr->registryMutex);
+	pthread_rwlock_unlock(&shard->lock);
 	return NULL;
 }
 
@@ -180,23 +318,22 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user) {
  *
  * @param cr  The registry for which the set of players is to be
  * obtained.
- * @return the list of players.
+ * @return the list of players, or NULL if it could not be allocated.
  */
 PLAYER **creg_all_players(CLIENT_REGISTRY *cr) {
-	P(&cr->registryMutex);
-	int maxPlayers = 10;
+	metrics_sem_wait(&cr->registryMutex, METRICS_LOCK_CLIENT_REGISTRY);
 	int numPlayers = 0;
-	PLAYER **playerList = (PLAYER **)malloc(maxPlayers * sizeof(PLAYER *));
-	for (int i = 0; i < MAX_CLIENTS; i++) {
+	PLAYER **playerList = (PLAYER **)malloc((cr->numClients + 1) * sizeof(PLAYER *));
+	if (playerList == NULL) {
+		V(&cr->registryMutex);
+		return NULL;
+	}
+	for (int i = 0; i < cr->capacity; i++) {
 		if (cr->clients[i] != NULL) {
 			PLAYER *player = client_get_player(cr->clients[i]);
 			if (player != NULL) {
 				playerList[numPlayers++] = player;
 				player_ref(player, "for reference being added to players list");
-				if (numPlayers + 1 == maxPlayers) {
-					maxPlayers = maxPlayers + 10;
-					playerList = realloc(playerList, maxPlayers);
-				}
 			}
 		}
 	}
@@ -205,6 +342,81 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr) {
 	return playerList;
 }
 
+/*
+ * Serialize the list of logged-in players into a new snapshot.  The
+ * version and epoch are sampled before the list is taken, so that a
+ * change racing with the build causes the next request to rebuild.
+ */
+static CREG_USERS *creg_users_build(CLIENT_REGISTRY *cr) {
+	unsigned long version = atomic_load_explicit(&cr->version, memory_order_acquire);
+	unsigned long epoch = player_rating_epoch();
+	PLAYER **playerList = creg_all_players(cr);
+	if (playerList == NULL) {
+		return NULL;
+	}
+	size_t len = 0;
+	for (PLAYER **p = playerList; *p != NULL; p++) {
+		// Name, tab, at most 11 characters of rating, newline.
+		len += strlen(player_get_name(*p)) + 13;
+	}
+	CREG_USERS *users = malloc(sizeof(CREG_USERS) + len + 1);
+	if (users != NULL) {
+		char *end = users->data;
+		for (PLAYER **p = playerList; *p != NULL; p++) {
+			end += sprintf(end, "%s\t%d\n", player_get_name(*p), player_get_rating(*p));
+		}
+		refcount_init(&users->count, 1);
+		users->version = version;
+		users->epoch = epoch;
+		users->len = end - users->data;
+	}
+	for (PLAYER **p = playerList; *p != NULL; p++) {
+		player_unref(*p, "for player removed from players list");
+	}
+	free(playerList);
+	return users;
+}
+
+CREG_USERS *creg_users_snapshot(CLIENT_REGISTRY *cr) {
+	pthread_mutex_lock(&cr->usersMutex);
+	CREG_USERS *users = cr->users;
+	if (users == NULL
+	    || users->version != atomic_load_explicit(&cr->version, memory_order_acquire)
+	    || users->epoch != player_rating_epoch()) {
+		CREG_USERS *fresh = creg_users_build(cr);
+		if (fresh == NULL) {
+			pthread_mutex_unlock(&cr->usersMutex);
+			return NULL;
+		}
+		debug("%ld: Rebuilt USERS snapshot (version %lu, epoch %lu, %lu bytes)", pthread_self(), fresh->version, fresh->epoch, fresh->len);
+		if (users != NULL) {
+			creg_users_unref(users);
+		}
+		cr->users = users = fresh;
+	}
+	refcount_inc(&users->count);
+	pthread_mutex_unlock(&cr->usersMutex);
+	return users;
+}
+
+const char *creg_users_data(CREG_USERS *users, size_t *lenp) {
+	*lenp = users->len;
+	return users->data;
+}
+
+void creg_users_unref(CREG_USERS *users) {
+	if (refcount_dec(&users->count) == 1) {
+		free(users);
+	}
+}
+
+int creg_count(CLIENT_REGISTRY *cr) {
+	metrics_sem_wait(&cr->registryMutex, METRICS_LOCK_CLIENT_REGISTRY);
+	int count = cr->numClients;
+	V(&cr->registryMutex);
+	return count;
+}
+
 /*
  * A thread calling this function will block in the call until
  * the number of registered clients has reached zero, at which
@@ -234,14 +446,26 @@ void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
  *
  * @param cr  The client registry.
  */
-void creg_shutdown_all(CLIENT_REGISTRY *cr) {
-	P(&cr->registryMutex);
-	for (int i = 0; i < MAX_CLIENTS; i++) {
+static void creg_shutdown(CLIENT_REGISTRY *cr, int how) {
+	metrics_sem_wait(&cr->registryMutex, METRICS_LOCK_CLIENT_REGISTRY);
+	for (int i = 0; i < cr->capacity; i++) {
 		if (cr->clients[i] != NULL) {
 			int fd = client_get_fd(cr->clients[i]);
 			debug("%ld: Shutting down client %d", pthread_self(), fd);
-			shutdown(fd, SHUT_WR);
+			shutdown(fd, how);
 		}
 	}
 	V(&cr->registryMutex);
-}
\ No newline at end of file
+}
+
+void creg_shutdown_all(CLIENT_REGISTRY *cr) {
+	creg_shutdown(cr, SHUT_WR);
+}
+
+/*
+ * Shutting down reading as well makes a service thread blocked in a read
+ * see EOF at once, whatever the client does.
+ */
+void creg_abort_all(CLIENT_REGISTRY *cr) {
+	creg_shutdown(cr, SHUT_RDWR);
+}
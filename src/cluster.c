@@ -0,0 +1,1491 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+#include "cluster.h"
+#include "client_ext.h"
+#include "protocol_ext.h"
+#include "jeux_service.h"
+#include "handler_pool.h"
+#include "player_registry.h"
+#include "jeux_globals.h"
+#include "name_hash.h"
+#include "refcount.h"
+#include "metrics.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define CLUSTER_BUCKETS 1024
+#define CLUSTER_MAX_IDS 256
+#define CLUSTER_MAX_READERS (4 * CLUSTER_MAX_NODES)
+
+/*
+ * Longest message body: a username and a relayed packet, each of which
+ * may have a payload of up to 64K.
+ */
+#define CLUSTER_BODY_MAX (2 * 65536 + 8)
+
+/*
+ * The kinds of message sent over a link.  Every message but a REPLY
+ * starts its body with a NUL-terminated username.
+ *
+ *   HELLO:       First message on a link, from the node given in the
+ *                header, whose incarnation is in the top half of the
+ *                session field.
+ *   CLAIM:       Claim the name for the session in the header, which
+ *                is answered, unless the sequence number is 0.
+ *   LOOKUP:      Ask where the name is logged in.
+ *   REPLY:       Answer to the request with the same sequence number:
+ *                status 0 if the name was claimed or found, and for a
+ *                LOOKUP, the node and session of the user.
+ *   GONE:        The user has logged out of the session in the header.
+ *   TO_CLIENT:   Packet for the user, sent to its remote CLIENT.
+ *   FROM_CLIENT: Request from the user, for its remote CLIENT.
+ *
+ * The two kinds that carry a packet follow the name with its type, id
+ * and role, the length of its payload in network byte order, and the
+ * payload.
+ */
+enum {
+	CLUSTER_HELLO = 1,
+	CLUSTER_CLAIM,
+	CLUSTER_LOOKUP,
+	CLUSTER_REPLY,
+	CLUSTER_GONE,
+	CLUSTER_TO_CLIENT,
+	CLUSTER_FROM_CLIENT
+};
+
+/*
+ * Header of a message, in network byte order.
+ */
+typedef struct cluster_msg {
+	uint64_t session;
+	uint32_t size;		/* length of the body */
+	uint32_t seq;
+	uint8_t kind;
+	uint8_t node;		/* sender */
+	uint8_t status;
+	uint8_t shard;		/* node found by a LOOKUP */
+	uint32_t reserved;
+} CLUSTER_MSG;
+
+#define CLUSTER_PACKET_LEN 5
+
+/*
+ * The outgoing link to a peer.  Messages are appended to buf under the
+ * lock, and the link's thread takes the whole buffer at a time and
+ * writes it without the lock, so senders never wait for the network.
+ */
+typedef struct cluster_link {
+	int node;
+	char *host;
+	char *port;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf;
+	size_t len;
+	size_t cap;
+	int fd;
+	int reset;		/* fd has been shut down, nothing more to be written */
+	int stopping;
+	pthread_t thread;
+} CLUSTER_LINK;
+
+/*
+ * An entry of the directory, or of the table of remote CLIENTs, which
+ * records the node and session of a user logged in on another node.
+ */
+typedef struct cluster_entry {
+	uint64_t hash;
+	int node;
+	uint64_t session;
+	CLIENT *client;
+	struct cluster_entry *next;
+	char name[];
+} CLUSTER_ENTRY;
+
+/*
+ * The invitation of another node that a local client knows by one of its
+ * own IDs: the node, the ID of the remote CLIENT there, the role of the
+ * client, and whether the invitation has been accepted.
+ */
+typedef struct cluster_remote_id {
+	int8_t node;
+	uint8_t id;
+	uint8_t role;
+	uint8_t inGame;
+} CLUSTER_REMOTE_ID;
+
+/*
+ * A local client that has claimed a name.  The lock protects the table
+ * of remote IDs and the state of a forwarded request, for which the
+ * service thread of the client waits on cond.
+ */
+struct cluster_session {
+	REFCOUNT count;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	CLIENT *client;
+	uint64_t hash;
+	uint64_t id;
+	int awaiting;
+	int awaitNode;
+	int awaitType;
+	int awaitId;
+	CLUSTER_REMOTE_ID ids[CLUSTER_MAX_IDS];
+	struct cluster_session *next;
+	char name[];
+};
+
+/*
+ * A request forwarded from another node, carried out on a remote CLIENT
+ * apart from the reader of the link it came on, with a copy of its
+ * NUL-terminated payload.
+ */
+typedef struct cluster_request {
+	HPOOL_TASK task;
+	CLIENT *client;
+	JEUX_PACKET_HEADER pkt;
+	char *data;
+	char buf[];
+} CLUSTER_REQUEST;
+
+/*
+ * A request to another node waiting for its REPLY.
+ */
+typedef struct cluster_call {
+	uint32_t seq;
+	int done;
+	int status;
+	int node;
+	uint64_t session;
+	struct cluster_call *next;
+} CLUSTER_CALL;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int enabled;
+	int node;
+	int numNodes;
+	uint32_t incarnation;
+	uint32_t nextSession;
+	uint32_t nextSeq;
+	CLUSTER_LINK links[CLUSTER_MAX_NODES];
+	uint32_t peerIncarnations[CLUSTER_MAX_NODES];
+	unsigned long peerLinks[CLUSTER_MAX_NODES];
+	CLUSTER_ENTRY *directory[CLUSTER_BUCKETS];
+	CLUSTER_ENTRY *remotes[CLUSTER_BUCKETS];
+	CLUSTER_SESSION *sessions[CLUSTER_BUCKETS];
+	CLUSTER_CALL *calls;
+	int readers[CLUSTER_MAX_READERS];
+	int readerNodes[CLUSTER_MAX_READERS];
+	int numReaders;
+	int numRequests;
+	int listenfd;
+	pthread_t listener;
+} cluster = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.listenfd = -1
+};
+
+/*
+ * The node that keeps the directory entry for a name.  The bucket of a
+ * name is chosen by the low bits of its hash, and the node by the high
+ * bits.
+ */
+static int cluster_owner(uint64_t hash) {
+	return (hash >> 32) % cluster.numNodes;
+}
+
+static void cluster_deadline(struct timespec *ts, int ms) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int cluster_write(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int cluster_read(int fd, void *buf, size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Encode the header of a message at the given position in a buffer.
+ * Messages are packed one after another, so the header is built in a
+ * local CLUSTER_MSG and copied, since the position need not be aligned.
+ */
+static void cluster_encode(char *p, int kind, size_t size, uint32_t seq, int status, int shard,
+    uint64_t session) {
+	CLUSTER_MSG msg = {0};
+	msg.session = htobe64(session);
+	msg.size = htonl(size);
+	msg.seq = htonl(seq);
+	msg.kind = kind;
+	msg.node = cluster.node;
+	msg.status = status;
+	msg.shard = shard;
+	memcpy(p, &msg, sizeof(msg));
+}
+
+/*
+ * Queue a message on the link to a node.  A message that would take the
+ * link past CLUSTER_LINK_MAX queued bytes, because the peer is down or
+ * not keeping up, is dropped.
+ *
+ * @return 0 if the message was queued, otherwise -1.
+ */
+static int cluster_send(int node, int kind, uint32_t seq, int status, int shard, uint64_t session,
+    const char *name, const JEUX_PACKET_HEADER *pkt, const void *data, size_t len) {
+	CLUSTER_LINK *link = &cluster.links[node];
+	size_t nameLen = name != NULL ? strlen(name) + 1 : 0;
+	size_t size = nameLen + (pkt != NULL ? CLUSTER_PACKET_LEN + len : 0);
+	size_t total = sizeof(CLUSTER_MSG) + size;
+	pthread_mutex_lock(&link->lock);
+	if (link->stopping || link->len + total > CLUSTER_LINK_MAX) {
+		pthread_mutex_unlock(&link->lock);
+		debug("%ld: Dropped message of kind %d for node %d", pthread_self(), kind, node);
+		return -1;
+	}
+	if (link->len + total > link->cap) {
+		size_t cap = link->cap == 0 ? 4096 : link->cap;
+		while (cap < link->len + total) {
+			cap *= 2;
+		}
+		char *buf = realloc(link->buf, cap);
+		if (buf == NULL) {
+			pthread_mutex_unlock(&link->lock);
+			return -1;
+		}
+		link->buf = buf;
+		link->cap = cap;
+	}
+	char *p = link->buf + link->len;
+	cluster_encode(p, kind, size, seq, status, shard, session);
+	p += sizeof(CLUSTER_MSG);
+	if (name != NULL) {
+		memcpy(p, name, nameLen);
+		p += nameLen;
+	}
+	if (pkt != NULL) {
+		p[0] = pkt->type;
+		p[1] = pkt->id;
+		p[2] = pkt->role;
+		p[3] = len >> 8;
+		p[4] = len;
+		if (len > 0) {
+			memcpy(p + CLUSTER_PACKET_LEN, data, len);
+		}
+	}
+	if (link->len == 0) {
+		pthread_cond_signal(&link->cond);
+	}
+	link->len += total;
+	pthread_mutex_unlock(&link->lock);
+	return 0;
+}
+
+/*
+ * Send a request to a node and wait up to CLUSTER_TIMEOUT_MS for its
+ * REPLY.
+ *
+ * @return 0 if the request was answered, otherwise -1.
+ */
+static int cluster_call(int node, int kind, const char *name, uint64_t session, CLUSTER_CALL *call) {
+	pthread_mutex_lock(&cluster.lock);
+	if (++cluster.nextSeq == 0) {
+		++cluster.nextSeq;
+	}
+	call->seq = cluster.nextSeq;
+	call->done = 0;
+	call->next = cluster.calls;
+	cluster.calls = call;
+	pthread_mutex_unlock(&cluster.lock);
+	int error = cluster_send(node, kind, call->seq, 0, 0, session, name, NULL, NULL, 0);
+	pthread_mutex_lock(&cluster.lock);
+	if (error == 0) {
+		struct timespec deadline;
+		cluster_deadline(&deadline, CLUSTER_TIMEOUT_MS);
+		while (!call->done && pthread_cond_timedwait(&cluster.cond, &cluster.lock, &deadline) != ETIMEDOUT)
+			;
+	}
+	CLUSTER_CALL **link = &cluster.calls;
+	while (*link != call) {
+		link = &(*link)->next;
+	}
+	*link = call->next;
+	pthread_mutex_unlock(&cluster.lock);
+	if (!call->done) {
+		debug("%ld: No reply from node %d to request %u", pthread_self(), node, call->seq);
+		return -1;
+	}
+	return 0;
+}
+
+static void cluster_complete(uint32_t seq, int status, int node, uint64_t session) {
+	pthread_mutex_lock(&cluster.lock);
+	for (CLUSTER_CALL *call = cluster.calls; call != NULL; call = call->next) {
+		if (call->seq == seq) {
+			call->status = status;
+			call->node = node;
+			call->session = session;
+			call->done = 1;
+			pthread_cond_broadcast(&cluster.cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cluster.lock);
+}
+
+/*
+ * Find the link to the entry for a name in a table, or to the NULL at
+ * the end of its bucket.  The lock must be held.
+ */
+static CLUSTER_ENTRY **cluster_find(CLUSTER_ENTRY **table, const char *name, uint64_t hash) {
+	CLUSTER_ENTRY **link = &table[hash % CLUSTER_BUCKETS];
+	while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+static CLUSTER_ENTRY *cluster_entry_create(const char *name, uint64_t hash, int node, uint64_t session) {
+	size_t len = strlen(name);
+	CLUSTER_ENTRY *entry = malloc(sizeof(CLUSTER_ENTRY) + len + 1);
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->node = node;
+	entry->session = session;
+	entry->client = NULL;
+	entry->next = NULL;
+	memcpy(entry->name, name, len + 1);
+	return entry;
+}
+
+/*
+ * Record in the directory that a name is logged in on a node.  A name
+ * already claimed by that node is taken to be left over from a session
+ * whose GONE has not arrived, since each node keeps its own names
+ * unique.  The lock must be held.
+ *
+ * @return 0 if the name has been claimed, 1 if it is taken.
+ */
+static int cluster_dir_claim(const char *name, uint64_t hash, int node, uint64_t session) {
+	CLUSTER_ENTRY **link = cluster_find(cluster.directory, name, hash);
+	if (*link != NULL) {
+		if ((*link)->node != node) {
+			return 1;
+		}
+		(*link)->session = session;
+		return 0;
+	}
+	CLUSTER_ENTRY *entry = cluster_entry_create(name, hash, node, session);
+	if (entry == NULL) {
+		return 1;
+	}
+	*link = entry;
+	return 0;
+}
+
+/*
+ * Remove a directory entry, if it is still that of the given session.
+ * The lock must be held.
+ */
+static void cluster_dir_release(const char *name, uint64_t hash, int node, uint64_t session) {
+	CLUSTER_ENTRY **link = cluster_find(cluster.directory, name, hash);
+	CLUSTER_ENTRY *entry = *link;
+	if (entry != NULL && entry->node == node && entry->session == session) {
+		*link = entry->next;
+		free(entry);
+	}
+}
+
+/*
+ * Find the session of a local client by name.  The lock must be held.
+ */
+static CLUSTER_SESSION **cluster_session_find(const char *name, uint64_t hash) {
+	CLUSTER_SESSION **link = &cluster.sessions[hash % CLUSTER_BUCKETS];
+	while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+static void cluster_session_unref(CLUSTER_SESSION *session) {
+	if (refcount_dec(&session->count) == 1) {
+		client_unref(session->client, "because cluster session has ended");
+		pthread_mutex_destroy(&session->lock);
+		pthread_cond_destroy(&session->cond);
+		free(session);
+	}
+}
+
+/*
+ * Send a packet to the client of a session.
+ */
+static void cluster_session_deliver(CLUSTER_SESSION *session, int type, int id, int role, void *data,
+    size_t len) {
+	JEUX_PACKET_HEADER pkt = {0};
+	pkt.type = type;
+	pkt.id = id;
+	pkt.role = role;
+	pkt.size = len;
+	client_send_packet(session->client, &pkt, data);
+}
+
+/*
+ * Forget the remote invitation a client knows by an ID, and free the ID.
+ * The session must be locked.
+ */
+static void cluster_session_release(CLUSTER_SESSION *session, int id) {
+	session->ids[id].node = -1;
+	client_release_id(session->client, id);
+}
+
+/*
+ * Find the ID by which a client knows an invitation of another node.
+ * The session must be locked.
+ *
+ * @return  The ID, or -1 if there is none.
+ */
+static int cluster_session_id(CLUSTER_SESSION *session, int node, int remoteId) {
+	for (int id = 0; id < CLUSTER_MAX_IDS; id++) {
+		if (session->ids[id].node == node && session->ids[id].id == remoteId) {
+			return id;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Log out and discard a remote CLIENT that has been taken out of the
+ * table, which resigns, revokes or declines whatever it was doing here.
+ */
+static void cluster_remote_free(CLUSTER_ENTRY *entry) {
+	debug("%ld: Discard remote client for '%s' of node %d", pthread_self(), entry->name, entry->node);
+	client_logout(entry->client);
+	client_shutdown_output(entry->client);
+	client_unref(entry->client, "because remote client has been discarded");
+	metrics_gauge_add(METRICS_REMOTE_CLIENTS, -1);
+	free(entry);
+}
+
+/*
+ * Get the remote CLIENT for a user of another node, creating and logging
+ * it in if there is none yet.  One left from an earlier session of the
+ * user is replaced.
+ */
+static CLIENT *cluster_remote(const char *name, uint64_t hash, int node, uint64_t session) {
+	pthread_mutex_lock(&cluster.lock);
+	CLUSTER_ENTRY **link = cluster_find(cluster.remotes, name, hash);
+	CLUSTER_ENTRY *stale = NULL;
+	if (*link != NULL) {
+		if ((*link)->node == node && (*link)->session == session) {
+			CLIENT *client = client_ref((*link)->client, "for reference being returned by cluster_lookup()");
+			pthread_mutex_unlock(&cluster.lock);
+			return client;
+		}
+		stale = *link;
+		*link = stale->next;
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	if (stale != NULL) {
+		cluster_remote_free(stale);
+	}
+	CLUSTER_ENTRY *entry = cluster_entry_create(name, hash, node, session);
+	CLIENT *client = entry != NULL ? client_create_remote(client_registry, node, session, name) : NULL;
+	if (client == NULL) {
+		free(entry);
+		return NULL;
+	}
+	// Only one CLIENT can be logged in under the name, so if two threads
+	// get here at once, the one whose login fails gives up.
+	PLAYER *player = preg_register(player_registry, entry->name);
+	int error = player != NULL ? client_login(client, player) : -1;
+	if (player != NULL) {
+		player_unref(player, "because remote client retains its own reference");
+	}
+	if (error == -1) {
+		client_shutdown_output(client);
+		client_unref(client, "because remote client could not be logged in");
+		free(entry);
+		return NULL;
+	}
+	entry->client = client;
+	pthread_mutex_lock(&cluster.lock);
+	link = cluster_find(cluster.remotes, name, hash);
+	entry->next = *link;
+	*link = entry;
+	client = client_ref(client, "for reference being returned by cluster_lookup()");
+	pthread_mutex_unlock(&cluster.lock);
+	metrics_gauge_add(METRICS_REMOTE_CLIENTS, 1);
+	debug("%ld: Created remote client %p for '%s' of node %d", pthread_self(), client, name, node);
+	return client;
+}
+
+/*
+ * Forget what is known about a node that has gone, or about an earlier
+ * incarnation of one that has restarted: the directory entries of its
+ * users and their remote CLIENTs, and the invitations it was hosting
+ * for local clients, which are reported to them as revoked or resigned.
+ *
+ * @param node  The node.
+ * @param keep  The incarnation of the node whose sessions are kept, or 0.
+ */
+static void cluster_purge(int node, uint32_t keep) {
+	CLUSTER_ENTRY *remotes = NULL;
+	CLUSTER_SESSION **sessions = NULL;
+	int numSessions = 0;
+	pthread_mutex_lock(&cluster.lock);
+	for (int b = 0; b < CLUSTER_BUCKETS; b++) {
+		for (CLUSTER_ENTRY **link = &cluster.directory[b]; *link != NULL; ) {
+			CLUSTER_ENTRY *entry = *link;
+			if (entry->node == node && (entry->session >> 32) != keep) {
+				*link = entry->next;
+				free(entry);
+			} else {
+				link = &entry->next;
+			}
+		}
+		for (CLUSTER_ENTRY **link = &cluster.remotes[b]; *link != NULL; ) {
+			CLUSTER_ENTRY *entry = *link;
+			if (entry->node == node && (entry->session >> 32) != keep) {
+				*link = entry->next;
+				entry->next = remotes;
+				remotes = entry;
+			} else {
+				link = &entry->next;
+			}
+		}
+		for (CLUSTER_SESSION *s = cluster.sessions[b]; s != NULL; s = s->next) {
+			numSessions++;
+		}
+	}
+	if (numSessions > 0 && (sessions = malloc(numSessions * sizeof(CLUSTER_SESSION *))) == NULL) {
+		numSessions = 0;
+	}
+	int n = 0;
+	for (int b = 0; b < CLUSTER_BUCKETS && n < numSessions; b++) {
+		for (CLUSTER_SESSION *s = cluster.sessions[b]; s != NULL && n < numSessions; s = s->next) {
+			refcount_inc(&s->count);
+			sessions[n++] = s;
+		}
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	debug("%ld: Purging state of node %d", pthread_self(), node);
+	while (remotes != NULL) {
+		CLUSTER_ENTRY *next = remotes->next;
+		cluster_remote_free(remotes);
+		remotes = next;
+	}
+	// Every invitation held for a local client by the node is from a
+	// previous link, so all of them are given up.
+	for (int i = 0; i < n; i++) {
+		CLUSTER_SESSION *s = sessions[i];
+		pthread_mutex_lock(&s->lock);
+		for (int id = 0; id < CLUSTER_MAX_IDS; id++) {
+			CLUSTER_REMOTE_ID *r = &s->ids[id];
+			if (r->node != node) {
+				continue;
+			}
+			if (r->inGame) {
+				cluster_session_deliver(s, JEUX_RESIGNED_PKT, id, 0, NULL, 0);
+				cluster_session_deliver(s, JEUX_ENDED_PKT, id, r->role == FIRST_PLAYER_ROLE ? 1 : 2, NULL, 0);
+			} else {
+				cluster_session_deliver(s, JEUX_REVOKED_PKT, id, 0, NULL, 0);
+			}
+			cluster_session_release(s, id);
+		}
+		if (s->awaiting && s->awaitNode == node) {
+			s->awaiting = 0;
+			cluster_session_deliver(s, JEUX_NACK_PKT, 0, 0, NULL, 0);
+			pthread_cond_broadcast(&s->cond);
+		}
+		pthread_mutex_unlock(&s->lock);
+		cluster_session_unref(s);
+	}
+	free(sessions);
+}
+
+/*
+ * Deliver a packet relayed from another node to the local client of a
+ * session, giving it the client's own ID for the invitation.  An ACK or
+ * NACK is delivered only to a client waiting for one from that node.
+ */
+static void cluster_to_client(int node, const char *name, uint64_t id, JEUX_PACKET_HEADER *pkt, void *data) {
+	uint64_t hash = name_hash(name);
+	pthread_mutex_lock(&cluster.lock);
+	CLUSTER_SESSION *s = *cluster_session_find(name, hash);
+	if (s != NULL && s->id == id) {
+		refcount_inc(&s->count);
+	} else {
+		s = NULL;
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	if (s == NULL) {
+		debug("%ld: Dropped packet for '%s', who is no longer logged in", pthread_self(), name);
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	if (pkt->type == JEUX_ACK_PKT || pkt->type == JEUX_NACK_PKT) {
+		if (s->awaiting && s->awaitNode == node) {
+			if (pkt->type == JEUX_ACK_PKT && s->ids[s->awaitId].node == node) {
+				if (s->awaitType == JEUX_DECLINE_PKT || s->awaitType == JEUX_REVOKE_PKT) {
+					cluster_session_release(s, s->awaitId);
+				} else if (s->awaitType == JEUX_ACCEPT_PKT) {
+					s->ids[s->awaitId].inGame = 1;
+				}
+			}
+			cluster_session_deliver(s, pkt->type, pkt->id, pkt->role, data, pkt->size);
+			s->awaiting = 0;
+			pthread_cond_broadcast(&s->cond);
+		}
+	} else if (pkt->type == JEUX_INVITED_PKT) {
+		int localId = client_reserve_id(s->client);
+		if (localId == -1) {
+			// The client has no free ID, so the invitation is declined.
+			JEUX_PACKET_HEADER decline = {0};
+			decline.type = JEUX_DECLINE_PKT;
+			decline.id = pkt->id;
+			cluster_send(node, CLUSTER_FROM_CLIENT, 0, 0, 0, id, name, &decline, NULL, 0);
+		} else {
+			s->ids[localId].node = node;
+			s->ids[localId].id = pkt->id;
+			s->ids[localId].role = pkt->role;
+			s->ids[localId].inGame = 0;
+			cluster_session_deliver(s, pkt->type, localId, pkt->role, data, pkt->size);
+		}
+	} else {
+		int localId = cluster_session_id(s, node, pkt->id);
+		if (localId != -1) {
+			cluster_session_deliver(s, pkt->type, localId, pkt->role, data, pkt->size);
+			if (pkt->type == JEUX_REVOKED_PKT || pkt->type == JEUX_DECLINED_PKT || pkt->type == JEUX_ENDED_PKT) {
+				cluster_session_release(s, localId);
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	cluster_session_unref(s);
+}
+
+/*
+ * Carry out a forwarded request, whose ACK or NACK is relayed back.
+ */
+static void cluster_request_run(CLUSTER_REQUEST *req) {
+	jeux_service_packet(req->client, &req->pkt, req->data);
+	client_unref(req->client, "because forwarded request has been carried out");
+	free(req);
+	pthread_mutex_lock(&cluster.lock);
+	if (--cluster.numRequests == 0) {
+		pthread_cond_broadcast(&cluster.cond);
+	}
+	pthread_mutex_unlock(&cluster.lock);
+}
+
+static void cluster_request_task(HPOOL_TASK *task) {
+	cluster_request_run((CLUSTER_REQUEST *)task);
+}
+
+static void *cluster_request_thread(void *arg) {
+	pthread_detach(pthread_self());
+	cluster_request_run(arg);
+	return NULL;
+}
+
+/*
+ * Carry out a request forwarded from the home node of a user on the
+ * user's remote CLIENT, whose responses are relayed back.  A request for
+ * a remote CLIENT that is not there, or of a kind that is never
+ * forwarded, is refused.  The request is handed to the handler pool, or
+ * to a thread of its own if there is none, like the request of a local
+ * client, so that a request that takes long holds up no other message
+ * from the node; since the home node waits for the answer before
+ * forwarding the user's next request, those are still carried out in
+ * order.
+ */
+static void cluster_from_client(int node, const char *name, uint64_t id, JEUX_PACKET_HEADER *pkt, void *data) {
+	uint64_t hash = name_hash(name);
+	CLIENT *client = NULL;
+	pthread_mutex_lock(&cluster.lock);
+	CLUSTER_ENTRY *entry = *cluster_find(cluster.remotes, name, hash);
+	if (entry != NULL && entry->node == node && entry->session == id) {
+		client = client_ref(entry->client, "while forwarded request is carried out");
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	int type = pkt->type;
+	CLUSTER_REQUEST *req = NULL;
+	if (client != NULL && (type == JEUX_REVOKE_PKT || type == JEUX_DECLINE_PKT || type == JEUX_ACCEPT_PKT
+	    || type == JEUX_MOVE_PKT || type == JEUX_RESIGN_PKT || type == JEUX_HINT_PKT)) {
+		req = malloc(sizeof(CLUSTER_REQUEST) + (data != NULL ? pkt->size + 1 : 0));
+	}
+	if (req == NULL) {
+		if (client != NULL) {
+			client_unref(client, "because forwarded request has been refused");
+		}
+		JEUX_PACKET_HEADER nack = {0};
+		nack.type = JEUX_NACK_PKT;
+		cluster_send(node, CLUSTER_TO_CLIENT, 0, 0, 0, id, name, &nack, NULL, 0);
+		return;
+	}
+	req->task.run = cluster_request_task;
+	req->client = client;
+	req->pkt = *pkt;
+	req->data = NULL;
+	if (data != NULL) {
+		req->data = req->buf;
+		memcpy(req->data, data, pkt->size + 1);
+	}
+	pthread_mutex_lock(&cluster.lock);
+	cluster.numRequests++;
+	pthread_mutex_unlock(&cluster.lock);
+	pthread_t tid;
+	if (hpool_enabled()) {
+		hpool_submit(&req->task, jeux_service_key(client, &req->pkt));
+	} else if (pthread_create(&tid, NULL, cluster_request_thread, req) != 0) {
+		cluster_request_run(req);
+	}
+}
+
+/*
+ * Handle a message received from a node.  The body is NUL-terminated.
+ */
+static void cluster_handle(int node, CLUSTER_MSG *msg, char *body, size_t size) {
+	uint64_t session = be64toh(msg->session);
+	uint32_t seq = ntohl(msg->seq);
+	if (msg->kind == CLUSTER_REPLY) {
+		cluster_complete(seq, msg->status, msg->shard, session);
+		return;
+	}
+	size_t nameLen = strnlen(body, size);
+	if (nameLen == size) {
+		return;
+	}
+	const char *name = body;
+	uint64_t hash = name_hash(name);
+	if (msg->kind == CLUSTER_CLAIM) {
+		pthread_mutex_lock(&cluster.lock);
+		int status = cluster_dir_claim(name, hash, node, session);
+		pthread_mutex_unlock(&cluster.lock);
+		if (seq != 0) {
+			cluster_send(node, CLUSTER_REPLY, seq, status, 0, 0, NULL, NULL, NULL, 0);
+		}
+	} else if (msg->kind == CLUSTER_LOOKUP) {
+		int status = 1;
+		int shard = 0;
+		uint64_t found = 0;
+		pthread_mutex_lock(&cluster.lock);
+		CLUSTER_ENTRY *entry = *cluster_find(cluster.directory, name, hash);
+		if (entry != NULL) {
+			status = 0;
+			shard = entry->node;
+			found = entry->session;
+		}
+		pthread_mutex_unlock(&cluster.lock);
+		cluster_send(node, CLUSTER_REPLY, seq, status, shard, found, NULL, NULL, NULL, 0);
+	} else if (msg->kind == CLUSTER_GONE) {
+		CLUSTER_ENTRY *stale = NULL;
+		pthread_mutex_lock(&cluster.lock);
+		cluster_dir_release(name, hash, node, session);
+		CLUSTER_ENTRY **link = cluster_find(cluster.remotes, name, hash);
+		if (*link != NULL && (*link)->node == node && (*link)->session == session) {
+			stale = *link;
+			*link = stale->next;
+		}
+		pthread_mutex_unlock(&cluster.lock);
+		if (stale != NULL) {
+			cluster_remote_free(stale);
+		}
+	} else if (msg->kind == CLUSTER_TO_CLIENT || msg->kind == CLUSTER_FROM_CLIENT) {
+		unsigned char *p = (unsigned char *)body + nameLen + 1;
+		size_t rest = size - nameLen - 1;
+		if (rest < CLUSTER_PACKET_LEN || rest != CLUSTER_PACKET_LEN + ((p[3] << 8) | p[4])) {
+			return;
+		}
+		JEUX_PACKET_HEADER pkt = {0};
+		pkt.type = p[0];
+		pkt.id = p[1];
+		pkt.role = p[2];
+		pkt.size = rest - CLUSTER_PACKET_LEN;
+		void *data = pkt.size > 0 ? p + CLUSTER_PACKET_LEN : NULL;
+		if (msg->kind == CLUSTER_TO_CLIENT) {
+			cluster_to_client(node, name, session, &pkt, data);
+		} else {
+			cluster_from_client(node, name, session, &pkt, data);
+		}
+	}
+}
+
+/*
+ * Note a new link from a node.  If the node has restarted since its last
+ * link, what was known about its previous incarnation is discarded, and
+ * if the link replaces one whose loss has not been noticed yet, what was
+ * known from that link.
+ *
+ * @return  The generation of the link, by which a link that is lost can
+ * be told from one that has since replaced it.
+ */
+static unsigned long cluster_peer_hello(int fd, int node, uint32_t incarnation) {
+	pthread_mutex_lock(&cluster.lock);
+	for (int i = 0; i < cluster.numReaders; i++) {
+		if (cluster.readers[i] == fd) {
+			cluster.readerNodes[i] = node;
+		}
+	}
+	unsigned long generation = ++cluster.peerLinks[node];
+	uint32_t previous = cluster.peerIncarnations[node];
+	cluster.peerIncarnations[node] = incarnation;
+	if (previous != 0) {
+		// The node has dropped a link whose loss has yet to be noticed
+		// here, and with it whatever it was writing, so the link is
+		// closed now and its loss disregarded.
+		for (int i = 0; i < cluster.numReaders; i++) {
+			if (cluster.readerNodes[i] == node && cluster.readers[i] != fd) {
+				shutdown(cluster.readers[i], SHUT_RDWR);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	debug("%ld: Link from node %d (incarnation %u)", pthread_self(), node, incarnation);
+	if (previous != 0) {
+		cluster_purge(node, previous != incarnation ? incarnation : 0);
+	}
+	return generation;
+}
+
+static void cluster_peer_lost(int node, unsigned long generation) {
+	pthread_mutex_lock(&cluster.lock);
+	if (cluster.peerLinks[node] != generation) {
+		pthread_mutex_unlock(&cluster.lock);
+		return;
+	}
+	cluster.peerIncarnations[node] = 0;
+	pthread_mutex_unlock(&cluster.lock);
+	debug("%ld: Lost link from node %d", pthread_self(), node);
+	cluster_purge(node, 0);
+}
+
+/*
+ * Declare a node that has stopped answering to have gone.  Both links
+ * with it are shut down, so that it forgets this node as this node
+ * forgets it, and the loss of the link from it that has yet to be
+ * noticed by its reader is disregarded, since it has already been dealt
+ * with here.  The links are connected again as usual if it is still up.
+ */
+static void cluster_peer_dead(int node) {
+	pthread_mutex_lock(&cluster.lock);
+	++cluster.peerLinks[node];
+	cluster.peerIncarnations[node] = 0;
+	for (int i = 0; i < cluster.numReaders; i++) {
+		if (cluster.readerNodes[i] == node) {
+			shutdown(cluster.readers[i], SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	CLUSTER_LINK *link = &cluster.links[node];
+	pthread_mutex_lock(&link->lock);
+	if (link->fd != -1) {
+		shutdown(link->fd, SHUT_RDWR);
+		link->reset = 1;
+	}
+	pthread_cond_signal(&link->cond);
+	pthread_mutex_unlock(&link->lock);
+	debug("%ld: Node %d is not answering", pthread_self(), node);
+	cluster_purge(node, 0);
+}
+
+/*
+ * Thread function for a link from another node, which handles the
+ * messages on it in order until the link is closed.
+ */
+static void *cluster_reader_thread(void *arg) {
+	int fd = (int)(long)arg;
+	pthread_detach(pthread_self());
+	int node = -1;
+	unsigned long generation = 0;
+	CLUSTER_MSG msg;
+	while (cluster_read(fd, &msg, sizeof(msg)) == 0) {
+		uint32_t size = ntohl(msg.size);
+		if (size > CLUSTER_BODY_MAX || (node == -1 && msg.kind != CLUSTER_HELLO)) {
+			break;
+		}
+		char *body = malloc(size + 1);
+		if (body == NULL || cluster_read(fd, body, size) == -1) {
+			free(body);
+			break;
+		}
+		body[size] = '\0';
+		if (msg.kind == CLUSTER_HELLO) {
+			free(body);
+			if (node != -1 || msg.node >= cluster.numNodes || msg.node == cluster.node) {
+				break;
+			}
+			node = msg.node;
+			generation = cluster_peer_hello(fd, node, be64toh(msg.session) >> 32);
+			continue;
+		}
+		cluster_handle(node, &msg, body, size);
+		free(body);
+	}
+	if (node != -1) {
+		cluster_peer_lost(node, generation);
+	}
+	pthread_mutex_lock(&cluster.lock);
+	for (int i = 0; i < cluster.numReaders; i++) {
+		if (cluster.readers[i] == fd) {
+			cluster.readers[i] = cluster.readers[--cluster.numReaders];
+			cluster.readerNodes[i] = cluster.readerNodes[cluster.numReaders];
+			break;
+		}
+	}
+	close(fd);
+	pthread_cond_broadcast(&cluster.cond);
+	pthread_mutex_unlock(&cluster.lock);
+	return NULL;
+}
+
+/*
+ * Thread function that accepts links from the other nodes.
+ */
+static void *cluster_listen_thread(void *arg) {
+	while (1) {
+		int fd = accept(cluster.listenfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+		pthread_t tid;
+		pthread_mutex_lock(&cluster.lock);
+		if (cluster.numReaders == CLUSTER_MAX_READERS
+		    || pthread_create(&tid, NULL, cluster_reader_thread, (void *)(long)fd) != 0) {
+			pthread_mutex_unlock(&cluster.lock);
+			close(fd);
+			continue;
+		}
+		cluster.readerNodes[cluster.numReaders] = -1;
+		cluster.readers[cluster.numReaders++] = fd;
+		pthread_mutex_unlock(&cluster.lock);
+	}
+	return NULL;
+}
+
+/*
+ * Connect the link to a node.  The HELLO is followed by claims for the
+ * names of local clients that the node keeps in its directory, in case
+ * it lost them along with a previous link; these are not answered.
+ *
+ * @return  The connected socket, or -1.
+ */
+static int cluster_connect(CLUSTER_LINK *link) {
+	int fd = open_clientfd(link->host, link->port);
+	if (fd < 0) {
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	size_t cap = 4096;
+	size_t len = sizeof(CLUSTER_MSG);
+	char *buf = malloc(cap);
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+	cluster_encode(buf, CLUSTER_HELLO, 0, 0, 0, 0, (uint64_t)cluster.incarnation << 32);
+	pthread_mutex_lock(&cluster.lock);
+	for (int b = 0; b < CLUSTER_BUCKETS; b++) {
+		for (CLUSTER_SESSION *s = cluster.sessions[b]; s != NULL; s = s->next) {
+			if (cluster_owner(s->hash) != link->node) {
+				continue;
+			}
+			size_t size = strlen(s->name) + 1;
+			if (len + sizeof(CLUSTER_MSG) + size > cap) {
+				char *grown = realloc(buf, 2 * cap + size);
+				if (grown == NULL) {
+					continue;
+				}
+				buf = grown;
+				cap = 2 * cap + size;
+			}
+			cluster_encode(buf + len, CLUSTER_CLAIM, size, 0, 0, 0, s->id);
+			memcpy(buf + len + sizeof(CLUSTER_MSG), s->name, size);
+			len += sizeof(CLUSTER_MSG) + size;
+		}
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	int error = cluster_write(fd, buf, len);
+	free(buf);
+	if (error == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Determine whether the peer has closed a link.  Nothing is ever sent
+ * back on a link, so if there is anything to read, it is EOF or an
+ * error.  This is how a link that was connected to a node just as it
+ * went down is noticed without waiting for a write to fail.
+ */
+static int cluster_link_closed(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	return poll(&pfd, 1, 0) != 0;
+}
+
+/*
+ * Thread function for the link to a node.  The link is reconnected every
+ * CLUSTER_RETRY_MS while it is down, and whatever has been queued is
+ * written in one batch each time the thread wakes.  A batch that cannot
+ * be written is lost along with the connection, since the peer discards
+ * what it knew from it.  An idle link is checked every CLUSTER_RETRY_MS,
+ * so that a node which has lost it, and with it the names of the local
+ * clients, is sent them again soon after.  Once the link is stopping,
+ * what is still queued is written before the thread exits.
+ */
+static void *cluster_link_thread(void *arg) {
+	CLUSTER_LINK *link = arg;
+	char *spare = NULL;
+	size_t spareCap = 0;
+	pthread_mutex_lock(&link->lock);
+	while (1) {
+		if (link->reset) {
+			// What is now queued is for the link that replaces this one.
+			link->reset = 0;
+			if (link->fd != -1) {
+				close(link->fd);
+				link->fd = -1;
+			}
+			continue;
+		}
+		if (link->fd == -1) {
+			if (link->stopping) {
+				break;
+			}
+			pthread_mutex_unlock(&link->lock);
+			int fd = cluster_connect(link);
+			pthread_mutex_lock(&link->lock);
+			if (fd == -1) {
+				struct timespec deadline;
+				cluster_deadline(&deadline, CLUSTER_RETRY_MS);
+				pthread_cond_timedwait(&link->cond, &link->lock, &deadline);
+				continue;
+			}
+			debug("%ld: Link to node %d connected", pthread_self(), link->node);
+			link->fd = fd;
+			continue;
+		}
+		if (link->len == 0) {
+			if (link->stopping) {
+				break;
+			}
+			struct timespec deadline;
+			cluster_deadline(&deadline, CLUSTER_RETRY_MS);
+			if (pthread_cond_timedwait(&link->cond, &link->lock, &deadline) == ETIMEDOUT
+			    && cluster_link_closed(link->fd)) {
+				debug("%ld: Link to node %d closed", pthread_self(), link->node);
+				close(link->fd);
+				link->fd = -1;
+			}
+			continue;
+		}
+		char *batch = link->buf;
+		size_t batchCap = link->cap;
+		size_t len = link->len;
+		link->buf = spare;
+		link->cap = spareCap;
+		link->len = 0;
+		spare = batch;
+		spareCap = batchCap;
+		pthread_mutex_unlock(&link->lock);
+		int error = cluster_write(link->fd, batch, len);
+		pthread_mutex_lock(&link->lock);
+		if (error == -1) {
+			debug("%ld: Link to node %d lost", pthread_self(), link->node);
+			close(link->fd);
+			link->fd = -1;
+		}
+	}
+	if (link->fd != -1) {
+		close(link->fd);
+		link->fd = -1;
+	}
+	pthread_mutex_unlock(&link->lock);
+	free(spare);
+	return NULL;
+}
+
+int cluster_configure(int node, char *peers) {
+	char *list = strdup(peers);
+	if (list == NULL) {
+		return -1;
+	}
+	int n = 0;
+	char *save;
+	for (char *addr = strtok_r(list, ",", &save); addr != NULL; addr = strtok_r(NULL, ",", &save)) {
+		char *colon = strrchr(addr, ':');
+		if (colon == NULL || colon == addr || colon[1] == '\0' || n == CLUSTER_MAX_NODES) {
+			free(list);
+			return -1;
+		}
+		*colon = '\0';
+		CLUSTER_LINK *link = &cluster.links[n];
+		link->node = n;
+		link->host = addr;
+		link->port = colon + 1;
+		pthread_mutex_init(&link->lock, NULL);
+		pthread_cond_init(&link->cond, NULL);
+		link->fd = -1;
+		n++;
+	}
+	if (node < 0 || node >= n) {
+		free(list);
+		return -1;
+	}
+	// The addresses point into the list, which is kept for good.
+	cluster.node = node;
+	cluster.numNodes = n;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	cluster.incarnation = (uint32_t)(ts.tv_sec * 1000003 ^ ts.tv_nsec ^ ((uint32_t)getpid() << 16));
+	if (cluster.incarnation == 0) {
+		cluster.incarnation = 1;
+	}
+	cluster.enabled = 1;
+	return 0;
+}
+
+int cluster_enabled(void) {
+	return cluster.enabled;
+}
+
+/*
+ * This is open_listenfd(), except that SO_REUSEPORT is set as well, so
+ * that several processes can listen on the port.
+ */
+int cluster_listen(char *port) {
+	struct addrinfo hints, *listp, *p;
+	int listenfd = -1;
+	int optval = 1;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+	if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+		return -1;
+	}
+	for (p = listp; p != NULL; p = p->ai_next) {
+		if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+			continue;
+		}
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+		if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+			break;
+		}
+		close(listenfd);
+	}
+	freeaddrinfo(listp);
+	if (p == NULL) {
+		return -1;
+	}
+	if (listen(listenfd, LISTENQ) < 0) {
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+int cluster_start(void) {
+	if (!cluster.enabled) {
+		return 0;
+	}
+	cluster.listenfd = open_listenfd(cluster.links[cluster.node].port);
+	if (cluster.listenfd < 0) {
+		return -1;
+	}
+	if (pthread_create(&cluster.listener, NULL, cluster_listen_thread, NULL) != 0) {
+		close(cluster.listenfd);
+		cluster.listenfd = -1;
+		return -1;
+	}
+	for (int n = 0; n < cluster.numNodes; n++) {
+		if (n != cluster.node && pthread_create(&cluster.links[n].thread, NULL, cluster_link_thread, &cluster.links[n]) != 0) {
+			return -1;
+		}
+	}
+	debug("%ld: Node %d of %d, links on port %s", pthread_self(), cluster.node, cluster.numNodes,
+	      cluster.links[cluster.node].port);
+	return 0;
+}
+
+int cluster_claim(CLIENT *client, char *name) {
+	if (!cluster.enabled) {
+		return 0;
+	}
+	uint64_t hash = name_hash(name);
+	size_t len = strlen(name);
+	CLUSTER_SESSION *s = malloc(sizeof(CLUSTER_SESSION) + len + 1);
+	if (s == NULL) {
+		return -1;
+	}
+	refcount_init(&s->count, 1);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->client = client_ref(client, "for cluster session");
+	s->hash = hash;
+	s->awaiting = 0;
+	for (int id = 0; id < CLUSTER_MAX_IDS; id++) {
+		s->ids[id].node = -1;
+	}
+	memcpy(s->name, name, len + 1);
+	int owner = cluster_owner(hash);
+	pthread_mutex_lock(&cluster.lock);
+	CLUSTER_SESSION **link = cluster_session_find(name, hash);
+	if (client_get_cluster(client) != NULL || *link != NULL) {
+		pthread_mutex_unlock(&cluster.lock);
+		cluster_session_unref(s);
+		return -1;
+	}
+	s->id = ((uint64_t)cluster.incarnation << 32) | ++cluster.nextSession;
+	s->next = NULL;
+	*link = s;
+	int status = owner == cluster.node ? cluster_dir_claim(name, hash, cluster.node, s->id) : 0;
+	pthread_mutex_unlock(&cluster.lock);
+	if (owner != cluster.node) {
+		CLUSTER_CALL call;
+		status = cluster_call(owner, CLUSTER_CLAIM, name, s->id, &call) == 0 ? call.status : 1;
+		if (status != 0) {
+			// A claim that timed out may yet be made, so it is withdrawn.
+			cluster_send(owner, CLUSTER_GONE, 0, 0, 0, s->id, name, NULL, NULL, 0);
+		}
+	}
+	if (status != 0) {
+		debug("%ld: Name '%s' is logged in on another node", pthread_self(), name);
+		pthread_mutex_lock(&cluster.lock);
+		link = cluster_session_find(name, hash);
+		*link = s->next;
+		pthread_mutex_unlock(&cluster.lock);
+		cluster_session_unref(s);
+		return -1;
+	}
+	client_set_cluster(client, s);
+	return 0;
+}
+
+void cluster_logout(CLIENT *client) {
+	CLUSTER_SESSION *s = client_get_cluster(client);
+	if (s == NULL) {
+		return;
+	}
+	client_set_cluster(client, NULL);
+	pthread_mutex_lock(&cluster.lock);
+	CLUSTER_SESSION **link = cluster_session_find(s->name, s->hash);
+	*link = s->next;
+	if (cluster_owner(s->hash) == cluster.node) {
+		cluster_dir_release(s->name, s->hash, cluster.node, s->id);
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	for (int n = 0; n < cluster.numNodes; n++) {
+		if (n != cluster.node) {
+			cluster_send(n, CLUSTER_GONE, 0, 0, 0, s->id, s->name, NULL, NULL, 0);
+		}
+	}
+	pthread_mutex_lock(&s->lock);
+	for (int id = 0; id < CLUSTER_MAX_IDS; id++) {
+		if (s->ids[id].node != -1) {
+			cluster_session_release(s, id);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	cluster_session_unref(s);
+}
+
+CLIENT *cluster_lookup(char *name) {
+	if (!cluster.enabled) {
+		return NULL;
+	}
+	uint64_t hash = name_hash(name);
+	int owner = cluster_owner(hash);
+	int found = 0;
+	int node = -1;
+	uint64_t session = 0;
+	if (owner == cluster.node) {
+		pthread_mutex_lock(&cluster.lock);
+		CLUSTER_ENTRY *entry = *cluster_find(cluster.directory, name, hash);
+		if (entry != NULL) {
+			found = 1;
+			node = entry->node;
+			session = entry->session;
+		}
+		pthread_mutex_unlock(&cluster.lock);
+	} else {
+		CLUSTER_CALL call;
+		if (cluster_call(owner, CLUSTER_LOOKUP, name, 0, &call) == 0 && call.status == 0) {
+			found = 1;
+			node = call.node;
+			session = call.session;
+		}
+	}
+	if (!found || node == cluster.node || node >= cluster.numNodes) {
+		return NULL;
+	}
+	return cluster_remote(name, hash, node, session);
+}
+
+int cluster_forward(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *payload) {
+	CLUSTER_SESSION *s = client_get_cluster(client);
+	if (s == NULL) {
+		return 0;
+	}
+	int type = hdr->type;
+	if (type != JEUX_REVOKE_PKT && type != JEUX_DECLINE_PKT && type != JEUX_ACCEPT_PKT
+	    && type != JEUX_MOVE_PKT && type != JEUX_RESIGN_PKT && type != JEUX_HINT_PKT) {
+		return 0;
+	}
+	pthread_mutex_lock(&s->lock);
+	CLUSTER_REMOTE_ID *r = &s->ids[hdr->id];
+	if (r->node == -1) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+	debug("%ld: [%d] Forward request of type %d for '%d' to node %d", pthread_self(), client_get_fd(client),
+	      type, hdr->id, r->node);
+	JEUX_PACKET_HEADER pkt = {0};
+	pkt.type = type;
+	pkt.id = r->id;
+	pkt.role = hdr->role;
+	size_t len = payload != NULL ? strlen(payload) : 0;
+	s->awaiting = 1;
+	s->awaitNode = r->node;
+	s->awaitType = type;
+	s->awaitId = hdr->id;
+	int node = r->node;
+	if (cluster_send(node, CLUSTER_FROM_CLIENT, 0, 0, 0, s->id, s->name, &pkt, payload, len) == -1) {
+		// The request never left this node, so it can safely be refused.
+		s->awaiting = 0;
+		pthread_mutex_unlock(&s->lock);
+		client_send_nack(client);
+		return 1;
+	}
+	struct timespec deadline;
+	cluster_deadline(&deadline, CLUSTER_TIMEOUT_MS);
+	while (s->awaiting && pthread_cond_timedwait(&s->cond, &s->lock, &deadline) != ETIMEDOUT)
+		;
+	int answered = !s->awaiting;
+	pthread_mutex_unlock(&s->lock);
+	if (!answered) {
+		// The node may yet carry out the request, so it is not refused
+		// here: the node is taken to have gone, which ends every game it
+		// hosts for local clients on both nodes, and answers the request
+		// with a NACK in the same way as when the link from it is lost.
+		debug("%ld: [%d] No response from node %d", pthread_self(), client_get_fd(client), node);
+		cluster_peer_dead(node);
+		pthread_mutex_lock(&s->lock);
+		answered = !s->awaiting;
+		s->awaiting = 0;
+		pthread_mutex_unlock(&s->lock);
+		if (!answered) {
+			client_send_nack(client);
+		}
+	}
+	return 1;
+}
+
+int cluster_relay(int node, uint64_t session, const char *name, JEUX_PACKET_HEADER *pkt,
+		  const void *data, size_t len) {
+	return cluster_send(node, CLUSTER_TO_CLIENT, 0, 0, 0, session, name, pkt, data, len);
+}
+
+void cluster_stop(void) {
+	if (!cluster.enabled) {
+		return;
+	}
+	CLUSTER_ENTRY *remotes = NULL;
+	pthread_mutex_lock(&cluster.lock);
+	for (int b = 0; b < CLUSTER_BUCKETS; b++) {
+		while (cluster.remotes[b] != NULL) {
+			CLUSTER_ENTRY *entry = cluster.remotes[b];
+			cluster.remotes[b] = entry->next;
+			entry->next = remotes;
+			remotes = entry;
+		}
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	while (remotes != NULL) {
+		CLUSTER_ENTRY *next = remotes->next;
+		cluster_remote_free(remotes);
+		remotes = next;
+	}
+	for (int n = 0; n < cluster.numNodes; n++) {
+		if (n == cluster.node) {
+			continue;
+		}
+		CLUSTER_LINK *link = &cluster.links[n];
+		pthread_mutex_lock(&link->lock);
+		link->stopping = 1;
+		pthread_cond_broadcast(&link->cond);
+		pthread_mutex_unlock(&link->lock);
+		pthread_join(link->thread, NULL);
+	}
+	if (cluster.listenfd != -1) {
+		shutdown(cluster.listenfd, SHUT_RDWR);
+		pthread_join(cluster.listener, NULL);
+		close(cluster.listenfd);
+	}
+	// The links from the other nodes are closed, and their readers and the
+	// requests they handed on waited for, so that nothing is delivered
+	// once the registries are gone.
+	pthread_mutex_lock(&cluster.lock);
+	for (int i = 0; i < cluster.numReaders; i++) {
+		shutdown(cluster.readers[i], SHUT_RDWR);
+	}
+	while (cluster.numReaders > 0 || cluster.numRequests > 0) {
+		pthread_cond_wait(&cluster.cond, &cluster.lock);
+	}
+	pthread_mutex_unlock(&cluster.lock);
+	debug("%ld: Cluster links stopped", pthread_self());
+}
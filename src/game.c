@@ -8,58 +8,232 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <stdint.h>
 #include <math.h>
 
 
 #include "game.h"
+#include "game_ext.h"
+#include "game_engine.h"
+#include "broadcast.h"
 #include "csapp.h"
+#include "refcount.h"
+#include "metrics.h"
+#include "slab.h"
+#include "timer.h"
 #include "debug.h"
+#include "trace.h"
 
+/*
+ * The state common to every game.  The board itself lives in the state
+ * block at the end, whose layout is known only to the engine.
+ */
 struct game {
-	int game_board[9];
+	const GAME_ENGINE *engine;
 	int isOver;
 	GAME_ROLE winner;
-	int count;
+	REFCOUNT count;
 	int expectedPiece;
+	unsigned int ply;		/* number of moves made */
+	uint64_t id;			/* ID of the game in the journal, or 0 */
+	uint64_t moveTime;		/* timer_now() at the start or the last move */
 	pthread_mutex_t gameMutex;
-	pthread_mutexattr_t mutexAttr;
+	BROADCAST *update;		/* MOVED payload after updatePly moves */
+	unsigned int updatePly;
+	pthread_mutex_t watchMutex;	/* protects the fields below */
+	GAME_WATCHER *watchers;
+	int numWatchers;
+	int maxWatchers;
+	int watchClosed;		/* the game has ended for its spectators */
+	uint64_t state[];
 };
 
-struct game_move {
-	int piece;
-	int placement;
+/*
+ * Tic-tac-toe states are a few bytes, so that GAMEs for it fit in a
+ * cache line or two; only the engines for larger boards get GAMEs with
+ * room for GAME_STATE_SIZE bytes of state.
+ */
+#define GAME_SMALL_STATE 16
+
+/*
+ * GAMEs are created and freed with every game played, so they are
+ * recycled through a slab and the recursive gameMutex and the
+ * watchMutex are initialized only once per object.
+ */
+static void game_construct(void *object) {
+	GAME *game = object;
+	pthread_mutexattr_t mutexAttr;
+	pthread_mutexattr_init(&mutexAttr);
+	pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&game->gameMutex, &mutexAttr);
+	pthread_mutexattr_destroy(&mutexAttr);
+	pthread_mutex_init(&game->watchMutex, NULL);
+}
+
+static SLAB gameSlab = SLAB_INITIALIZER_SIZED("GAME", sizeof(GAME) + GAME_SMALL_STATE, game_construct);
+static SLAB largeGameSlab = SLAB_INITIALIZER_SIZED("large GAME", sizeof(GAME) + GAME_STATE_SIZE, game_construct);
+
+static SLAB *game_slab(const GAME_ENGINE *engine) {
+	return engine->stateSize <= GAME_SMALL_STATE ? &gameSlab : &largeGameSlab;
+}
+
+static const GAME_ENGINE *game_engine = &game_engine_tictactoe;
+
+void game_set_engine(const GAME_ENGINE *engine) {
+	game_engine = engine;
+}
+
+const GAME_ENGINE *game_get_engine(void) {
+	return game_engine;
+}
+
+/*
+ * The built-in variants that can be named in a game specification.
+ */
+static const struct {
+	const char *name;
+	int width;
+	int height;
+	int connect;
+	int gravity;
+} game_variants[] = {
+	{ "gomoku", 15, 15, 5, 0 },
+	{ "gomoku19", 19, 19, 5, 0 },
+	{ "connect4", 7, 6, 4, 1 }
 };
 
+int game_engine_init(GAME_ENGINE *engine, char *spec) {
+	if (strcmp(spec, game_engine_tictactoe.name) == 0) {
+		*engine = game_engine_tictactoe;
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(game_variants) / sizeof(game_variants[0]); i++) {
+		if (strcmp(spec, game_variants[i].name) == 0) {
+			game_mnk_init(engine, game_variants[i].name, game_variants[i].width, game_variants[i].height,
+			    game_variants[i].connect, game_variants[i].gravity);
+			return 0;
+		}
+	}
+	int width, height, connect, end = 0;
+	char gravity[8] = "";
+	if (sscanf(spec, "%dx%d:%d%n:%7s", &width, &height, &connect, &end, gravity) < 3 || end == 0
+	    || (spec[end] != '\0' && strcmp(gravity, "gravity") != 0)) {
+		return -1;
+	}
+	if (width < 1 || width > GAME_MAX_WIDTH || height < 1 || height > GAME_MAX_HEIGHT
+	    || connect < 1 || (connect > width && connect > height)) {
+		return -1;
+	}
+	game_mnk_init(engine, spec, width, height, connect, spec[end] != '\0');
+	return 0;
+}
+
 GAME *game_create(void) {
-	GAME *game = calloc(1, sizeof(GAME));
-	for (int i = 0; i < 9; i++) {
-		game->game_board[i] = -1;
+	const GAME_ENGINE *engine = game_engine;
+	GAME *game = slab_alloc(game_slab(engine));
+	if (game == NULL) {
+		return NULL;
 	}
+	game->engine = engine;
+	engine->create(engine, game->state);
 	game->isOver = 0;
 	game->winner = NULL_ROLE;
-	game->count = 0;
+	refcount_init(&game->count, 0);
 	game->expectedPiece = 1;
-	pthread_mutexattr_init(&game->mutexAttr);
-	pthread_mutexattr_settype(&game->mutexAttr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&game->gameMutex, &game->mutexAttr);
+	game->ply = 0;
+	game->id = 0;
+	game->moveTime = timer_now();
+	game->update = NULL;
+	game->updatePly = 0;
+	game->watchers = NULL;
+	game->numWatchers = 0;
+	game->maxWatchers = 0;
+	game->watchClosed = 0;
 	game_ref(game, "for newly created game");
+	metrics_gauge_add(METRICS_GAMES, 1);
 	return game;
 }
 
+/*
+ * The state block is plain data, so a position is saved by copying it,
+ * after the piece to move, the number of moves made and the journal ID.
+ */
+#define GAME_SAVE_HEADER (1 + sizeof(uint32_t) + sizeof(uint64_t))
+
+size_t game_save(GAME *game, void *buf, size_t len) {
+	pthread_mutex_lock(&game->gameMutex);
+	size_t size = GAME_SAVE_HEADER + game->engine->stateSize;
+	if (len < size) {
+		pthread_mutex_unlock(&game->gameMutex);
+		return 0;
+	}
+	unsigned char *saved = buf;
+	uint32_t ply = game->ply;
+	saved[0] = game->expectedPiece;
+	memcpy(saved + 1, &ply, sizeof(ply));
+	memcpy(saved + 1 + sizeof(ply), &game->id, sizeof(game->id));
+	memcpy(saved + GAME_SAVE_HEADER, game->state, game->engine->stateSize);
+	pthread_mutex_unlock(&game->gameMutex);
+	return size;
+}
+
+GAME *game_restore(const void *buf, size_t len) {
+	const unsigned char *saved = buf;
+	if (len != GAME_SAVE_HEADER + game_engine->stateSize || saved[0] > 1) {
+		return NULL;
+	}
+	GAME *game = game_create();
+	if (game == NULL) {
+		return NULL;
+	}
+	uint32_t ply;
+	game->expectedPiece = saved[0];
+	memcpy(&ply, saved + 1, sizeof(ply));
+	memcpy(&game->id, saved + 1 + sizeof(ply), sizeof(game->id));
+	game->ply = ply;
+	memcpy(game->state, saved + GAME_SAVE_HEADER, game->engine->stateSize);
+	return game;
+}
+
+void game_set_id(GAME *game, uint64_t id) {
+	pthread_mutex_lock(&game->gameMutex);
+	game->id = id;
+	pthread_mutex_unlock(&game->gameMutex);
+}
+
+uint64_t game_get_id(GAME *game) {
+	pthread_mutex_lock(&game->gameMutex);
+	uint64_t id = game->id;
+	pthread_mutex_unlock(&game->gameMutex);
+	return id;
+}
+
+unsigned int game_get_ply(GAME *game) {
+	pthread_mutex_lock(&game->gameMutex);
+	unsigned int ply = game->ply;
+	pthread_mutex_unlock(&game->gameMutex);
+	return ply;
+}
+
+uint64_t game_get_move_time(GAME *game, unsigned int *plyp) {
+	pthread_mutex_lock(&game->gameMutex);
+	uint64_t time = game->moveTime;
+	*plyp = game->ply;
+	pthread_mutex_unlock(&game->gameMutex);
+	return time;
+}
+
 /*
  * Increase the reference count on a game by one.
  *
  * @param game  The GAME whose reference count is to be increased.
  * @param why  A string describing the reason why the reference count is
- * being increased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being increased.
  * @return  The same GAME object that was passed as a parameter.
  */
 GAME *game_ref(GAME *game, char *why) {
-	pthread_mutex_lock(&game->gameMutex);
-	debug("%ld: Increase refrence count on game %p (%d -> %d) %s", pthread_self(), game, game->count, game->count + 1, why);
-	game->count = game->count + 1;
-	pthread_mutex_unlock(&game->gameMutex);
+	int old = refcount_inc(&game->count);
+	trace(TRACE_GAME_REF, game, old, old + 1, 0, why);
 	return game;
 }
 
@@ -70,19 +244,23 @@ GAME *game_ref(GAME *game, char *why) {
  *
  * @param game  The GAME whose reference count is to be decreased.
  * @param why  A string describing the reason why the reference count is
- * being decreased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being decreased.
  */
 void game_unref(GAME *game, char *why) {
-	pthread_mutex_lock(&game->gameMutex);
-	debug("%ld: Decrease refrence count on game %p (%d -> %d) %s", pthread_self(), game, game->count, game->count - 1, why);
-	game->count = game->count - 1;
-	if (game->count == 0) {
-		debug("%ld: Free game %p", pthread_self(), game);
-		free(game);
-		return;
+	int old = refcount_dec(&game->count);
+	trace(TRACE_GAME_UNREF, game, old, old - 1, 0, why);
+	if (old == 1) {
+		for (int i = 0; i < game->numWatchers; i++) {
+			client_unref(game->watchers[i].client, "because watched game is being freed");
+		}
+		metrics_gauge_add(METRICS_WATCHERS, -game->numWatchers);
+		free(game->watchers);
+		if (game->update != NULL) {
+			bcast_unref(game->update);
+		}
+		slab_free(game_slab(game->engine), game);
+		metrics_gauge_add(METRICS_GAMES, -1);
 	}
-	pthread_mutex_unlock(&game->gameMutex);
 	return;
 }
 
@@ -96,75 +274,21 @@ void game_unref(GAME *game, char *why) {
  */
 int game_apply_move(GAME *game, GAME_MOVE *move) {
 	pthread_mutex_lock(&game->gameMutex);
-	if (game->isOver || game->game_board[move->placement - 1] != -1 || game->expectedPiece != move->piece) {
+	if (game->isOver || move->engine != game->engine || game->expectedPiece != move->piece
+	    || game->engine->apply(game->engine, game->state, move) == -1) {
 		pthread_mutex_unlock(&game->gameMutex);
 		return -1;
-	} else {
-		game->game_board[move->placement - 1] = move->piece;
-		game->expectedPiece = 1 - game->expectedPiece;
-		if (game->game_board[0] != -1) {
-			if (game->game_board[0] == game->game_board[4] && game->game_board[4] == game->game_board[8]) {
-				game->isOver = 1;
-				if(game->game_board[0] == 1) {
-					game->winner = FIRST_PLAYER_ROLE;
-				} else {
-					game->winner = SECOND_PLAYER_ROLE;
-				}
-				pthread_mutex_unlock(&game->gameMutex);
-				return 0;
-			}
-		}
-		if (game->game_board[2] != -1) {
-			if (game->game_board[2] == game->game_board[4] && game->game_board[4] == game->game_board[6]) {
-				game->isOver = 1;
-				if(game->game_board[2] == 1) {
-					game->winner = FIRST_PLAYER_ROLE;
-				} else {
-					game->winner = SECOND_PLAYER_ROLE;
-				}
-				pthread_mutex_unlock(&game->gameMutex);
-				return 0;
-			}
-		}
-		for(int i = 0, j = 0; i < 7 && j < 3; i+=3, j++) {
-			if (game->game_board[i] != -1) {
-				if (game->game_board[i] == game->game_board[i + 1] && game->game_board[i + 1] == game->game_board[i + 2]) {
-					game->isOver = 1;
-					if(game->game_board[i] == 1) {
-						game->winner = FIRST_PLAYER_ROLE;
-					} else {
-						game->winner = SECOND_PLAYER_ROLE;
-					}
-					break;
-				}
-			}
-			if (game->game_board[j] != -1) {
-				if (game->game_board[j] == game->game_board[j + 3] && game->game_board[j + 3] == game->game_board[j + 6]) {
-					game->isOver = 1;
-					if(game->game_board[j] == 1) {
-						game->winner = FIRST_PLAYER_ROLE;
-					} else {
-						game->winner = SECOND_PLAYER_ROLE;
-					}
-					break;
-				}
-			}
-		}
-		int cleared = 1;
-		if (!game->isOver) {
-			for (int i = 0; i < 9; i++) {
-				if (game->game_board[i] == -1) {
-					cleared = 0;
-				}
-			}
-			if (cleared) {
-				game->isOver = 1;
-				game->winner = NULL_ROLE;
-			}
-		}
-		pthread_mutex_unlock(&game->gameMutex);
-		return 0;
 	}
+	game->expectedPiece = 1 - game->expectedPiece;
+	game->ply++;
+	game->moveTime = timer_now();
+	GAME_ROLE winner;
+	if (game->engine->is_over(game->engine, game->state, &winner)) {
+		game->isOver = 1;
+		game->winner = winner;
+	}
+	pthread_mutex_unlock(&game->gameMutex);
+	return 0;
 }
 
 /*
@@ -201,41 +325,142 @@ int game_resign(GAME *game, GAME_ROLE role) {
  * @return  A string that describes the current GAME state.
  */
 char *game_unparse_state(GAME *game) {
+	char buf[GAME_STATE_MAX + 1];
+	int len = game_unparse_state_into(game, buf, sizeof(buf));
+	char *gameState = malloc(len + 1);
+	memcpy(gameState, buf, len + 1);
+	return gameState;
+}
+
+/*
+ * Render the current GAME state, in the same format as
+ * game_unparse_state(), into caller-supplied storage.
+ *
+ * @param game  The GAME for which the state description is to be
+ * obtained.
+ * @param buf  The buffer into which the NUL-terminated description is
+ * to be stored.
+ * @param len  The size of the buffer.
+ * @return  The length of the description, or -1 if the buffer is too small.
+ */
+int game_unparse_state_into(GAME *game, char *buf, size_t len) {
+	pthread_mutex_lock(&game->gameMutex);
+	int n = game->engine->unparse_state(game->engine, game->state, buf, len);
+	pthread_mutex_unlock(&game->gameMutex);
+	return n;
+}
+
+const char *game_render_moved(GAME *game, char *buf, size_t len, size_t *lenp) {
 	pthread_mutex_lock(&game->gameMutex);
-	char *gameState = calloc(30, sizeof(char));
-	char *temp = gameState;
-	int boardPlace = 0;
-	int dashes = 0;
-	for(int i = 1; i < 30; i++) {
-		if (dashes) {
-			if (i % 6 == 0) {
-				dashes = 1 - dashes;
-				gameState[i - 1] = '\n';
-			} else {
-				gameState[i - 1] = '-';
-			}
-		} else {
-			if (i % 6 == 0) {
-				dashes = 1 - dashes;
-				gameState[i - 1] = '\n';
-			} else {
-				if (i % 2 == 0) {
-					gameState[i - 1] = '|';
-				} else {
-					int gamePiece = game->game_board[boardPlace++];
-					if (gamePiece == -1) {
-						gameState[i - 1] = ' ';
-					} else if (gamePiece == 1) {
-						gameState[i - 1] = 'X';
-					} else {
-						gameState[i - 1] = 'O';
-					}
-				}
-			}
+	const char *text = game->engine->render_moved(game->engine, game->state, buf, len, lenp);
+	pthread_mutex_unlock(&game->gameMutex);
+	return text;
+}
+
+/*
+ * The update is rendered at most once for each position, however many
+ * spectators it is sent to.
+ */
+BROADCAST *game_get_update(GAME *game, unsigned int *plyp) {
+	pthread_mutex_lock(&game->gameMutex);
+	if (game->update == NULL || game->updatePly != game->ply) {
+		char buf[GAME_MOVED_MAX];
+		size_t len;
+		const char *text = game->engine->render_moved(game->engine, game->state, buf, sizeof(buf), &len);
+		BROADCAST *update = text == buf ? bcast_create(buf, len) : bcast_create_static(text, len);
+		if (update == NULL) {
+			pthread_mutex_unlock(&game->gameMutex);
+			return NULL;
+		}
+		if (game->update != NULL) {
+			bcast_unref(game->update);
+		}
+		game->update = update;
+		game->updatePly = game->ply;
+	}
+	BROADCAST *update = bcast_ref(game->update);
+	*plyp = game->updatePly;
+	pthread_mutex_unlock(&game->gameMutex);
+	return update;
+}
+
+void game_lock_watchers(GAME *game) {
+	pthread_mutex_lock(&game->watchMutex);
+}
+
+void game_unlock_watchers(GAME *game) {
+	pthread_mutex_unlock(&game->watchMutex);
+}
+
+int game_add_watcher(GAME *game, CLIENT *client, int id, unsigned int ply) {
+	if (game->watchClosed) {
+		return -1;
+	}
+	if (game->numWatchers == game->maxWatchers) {
+		int max = game->maxWatchers == 0 ? 4 : 2 * game->maxWatchers;
+		GAME_WATCHER *watchers = realloc(game->watchers, max * sizeof(GAME_WATCHER));
+		if (watchers == NULL) {
+			return -1;
 		}
+		game->watchers = watchers;
+		game->maxWatchers = max;
+	}
+	GAME_WATCHER *w = &game->watchers[game->numWatchers++];
+	w->client = client_ref(client, "for spectator of game");
+	w->id = id;
+	w->ply = ply;
+	metrics_gauge_add(METRICS_WATCHERS, 1);
+	return 0;
+}
+
+int game_remove_watcher(GAME *game, CLIENT *client, int id) {
+	for (int i = 0; i < game->numWatchers; i++) {
+		GAME_WATCHER *w = &game->watchers[i];
+		if (w->client == client && w->id == id) {
+			client_unref(client, "because spectator has stopped watching");
+			*w = game->watchers[--game->numWatchers];
+			metrics_gauge_add(METRICS_WATCHERS, -1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+GAME_WATCHER *game_get_watchers(GAME *game, int *countp) {
+	*countp = game->numWatchers;
+	return game->watchers;
+}
+
+GAME_WATCHER *game_take_watchers(GAME *game, int *countp) {
+	GAME_WATCHER *watchers = game->watchers;
+	*countp = game->numWatchers;
+	metrics_gauge_add(METRICS_WATCHERS, -game->numWatchers);
+	game->watchers = NULL;
+	game->numWatchers = 0;
+	game->maxWatchers = 0;
+	game->watchClosed = 1;
+	return watchers;
+}
+
+/*
+ * Find a best move for the player in a specified role.  The search, if
+ * any, is done with the GAME locked, so that the position cannot change
+ * under it.
+ */
+int game_hint(GAME *game, GAME_ROLE role, char *buf, size_t len, GAME_ROLE *outcomep) {
+	pthread_mutex_lock(&game->gameMutex);
+	const GAME_ENGINE *engine = game->engine;
+	GAME_ROLE toMove = game->expectedPiece == 1 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+	GAME_MOVE move = { engine, game->expectedPiece, 0 };
+	int error = -1;
+	if (!game->isOver && role == toMove && engine->hint != NULL) {
+		error = engine->hint(engine, game->state, game->expectedPiece, &move, outcomep);
 	}
 	pthread_mutex_unlock(&game->gameMutex);
-	return temp;
+	if (error == -1 || engine->unparse_move(engine, &move, buf, len) == -1) {
+		return -1;
+	}
+	return 0;
 }
 
 /*
@@ -283,31 +508,41 @@ GAME_ROLE game_get_winner(GAME *game) {
  * in fact be interpreted as a move, otherwise NULL.
  */
 GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str) {
+	GAME_MOVE parsed = { game->engine, 0, 0 };
 	pthread_mutex_lock(&game->gameMutex);
-	int placement = (int)(str[0]) - 48;
-	if (placement <= 0 && placement >= 10) {
-		pthread_mutex_unlock(&game->gameMutex);
+	int error = game->engine->parse(game->engine, game->state, str, &parsed);
+	pthread_mutex_unlock(&game->gameMutex);
+	if (error == -1) {
 		return NULL;
 	}
-	int piece = -1;
-	for (int i = 1; i < strlen(str); i++) {
-		if (str[i] == 'x' || str[i] == 'X') {
-			piece = 1;
-			break;
-		} else if (str[i] == 'o' || str[i] == 'O') {
-			piece = 0;
-			break;
-		}
+	GAME_MOVE *move = malloc(sizeof(GAME_MOVE));
+	*move = parsed;
+	return move;
+}
+
+/*
+ * Parse a move and, if it can be interpreted, apply it to a GAME.
+ * This has the same effect as game_parse_move() followed by
+ * game_apply_move(), but the GAME_MOVE is never heap-allocated.
+ *
+ * @param game  The GAME in which the move is to be made.
+ * @param role  The GAME_ROLE of the player making the move.
+ * @param str  The string that is to be interpreted as a move.
+ * @param movep  Location in which the move applied is stored, or NULL.
+ * @return 0 if the move was parsed and applied, otherwise -1.
+ */
+int game_make_move(GAME *game, GAME_ROLE role, char *str, GAME_MOVE *movep) {
+	GAME_MOVE move = { game->engine, 0, 0 };
+	pthread_mutex_lock(&game->gameMutex);
+	int error = game->engine->parse(game->engine, game->state, str, &move);
+	if (error == 0) {
+		error = game_apply_move(game, &move);
 	}
-	if (piece == -1) {
-		pthread_mutex_unlock(&game->gameMutex);
-		return NULL;
+	if (error == 0 && movep != NULL) {
+		*movep = move;
 	}
-	GAME_MOVE *move = malloc(sizeof(GAME_MOVE));
-	move->placement = placement;
-	move->piece = piece;
 	pthread_mutex_unlock(&game->gameMutex);
-	return move;
+	return error;
 }
 
 /*
@@ -322,16 +557,7 @@ GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str) {
  * @return  A string describing the specified GAME_MOVE.
  */
 char *game_unparse_move(GAME_MOVE *move) {
-	char *str = calloc(5, sizeof(char));
-	str[0] = move->placement + 48;
-	str[1] = '-';
-	str[2] = '>';
-	char c;
-	if (move->piece == 1) {
-		c = 'X';
-	} else {
-		c = 'O';
-	}
-	str[3] = c;
+	char *str = calloc(GAME_MOVE_MAX + 1, sizeof(char));
+	move->engine->unparse_move(move->engine, move, str, GAME_MOVE_MAX + 1);
 	return str;
 }
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "game_engine.h"
+#include "game_ext.h"
+
+/*
+ * The k-in-a-row engine (gomoku, connect-four and the like), for boards
+ * of up to GAME_MAX_WIDTH by GAME_MAX_HEIGHT cells.
+ *
+ * Each side's pieces are kept as bitboards of every line on the board,
+ * in each of the four directions: rows[r] has bit c set for a piece at
+ * row r, column c, cols[c] has bit r set, and the diagonals through the
+ * cell, numbered by r - c and r + c, have bit c set.  The four lines
+ * through a cell therefore come out as four 32-bit words, and a line of
+ * k pieces shows up as a run of k set bits in one of them.  A run is
+ * found by shifting and ANDing the words with themselves, doubling the
+ * length of the runs each time, so the win check after a move takes a
+ * handful of vector instructions whatever the size of the board.  Only
+ * lines through the last piece placed need checking, since the game
+ * would have ended already if there were any other.
+ */
+
+#define MNK_DIAGONALS (GAME_MAX_WIDTH + GAME_MAX_HEIGHT - 1)
+
+typedef struct mnk_side {
+	uint32_t rows[GAME_MAX_HEIGHT];
+	uint32_t cols[GAME_MAX_WIDTH];
+	uint32_t diag[MNK_DIAGONALS];		/* indexed by r - c + GAME_MAX_WIDTH - 1 */
+	uint32_t anti[MNK_DIAGONALS];		/* indexed by r + c */
+} MNK_SIDE;
+
+typedef struct mnk_state {
+	MNK_SIDE sides[2];			/* X, then O */
+	uint8_t heights[GAME_MAX_WIDTH];	/* pieces in each column */
+	int16_t moves;
+	int16_t last;				/* cell of the last piece, or -1 */
+} MNK_STATE;
+
+_Static_assert(sizeof(MNK_STATE) <= GAME_STATE_SIZE, "MNK_STATE does not fit in a GAME");
+_Static_assert(GAME_MAX_WIDTH <= 26 && GAME_MAX_HEIGHT <= 32, "lines must fit in 32 bits");
+
+#define MNK_SIDE_OF(piece) (1 - (piece))
+#define MNK_DIAG(r, c) ((r) - (c) + GAME_MAX_WIDTH - 1)
+#define MNK_ANTI(r, c) ((r) + (c))
+
+/*
+ * Determine whether any of four lines contains a run of k set bits.
+ */
+#ifdef __SSE2__
+static int mnk_has_run(uint32_t row, uint32_t col, uint32_t diag, uint32_t anti, int k) {
+	__m128i run = _mm_set_epi32(anti, diag, col, row);
+	for (int len = 1; len < k; ) {
+		int shift = len < k - len ? len : k - len;
+		run = _mm_and_si128(run, _mm_srl_epi32(run, _mm_cvtsi32_si128(shift)));
+		len += shift;
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi32(run, _mm_setzero_si128())) != 0xffff;
+}
+#else
+static int mnk_has_run(uint32_t row, uint32_t col, uint32_t diag, uint32_t anti, int k) {
+	uint64_t rc = (uint64_t)col << 32 | row;
+	uint64_t da = (uint64_t)anti << 32 | diag;
+	// Two lines are checked per 64-bit word.  No line is longer than 19
+	// bits, so the clear bits between the two keep a run in one from
+	// joining a run in the other.
+	for (int len = 1; len < k; ) {
+		int shift = len < k - len ? len : k - len;
+		rc &= rc >> shift;
+		da &= da >> shift;
+		len += shift;
+	}
+	return (rc | da) != 0;
+}
+#endif
+
+/*
+ * Determine whether a side would have k in a row with a piece at a cell.
+ */
+static int mnk_wins_at(const GAME_ENGINE *engine, const MNK_SIDE *side, int r, int c) {
+	uint32_t bit = (uint32_t)1 << c;
+	return mnk_has_run(side->rows[r] | bit, side->cols[c] | (uint32_t)1 << r,
+	    side->diag[MNK_DIAG(r, c)] | bit, side->anti[MNK_ANTI(r, c)] | bit, engine->connect);
+}
+
+static int mnk_occupied(const MNK_STATE *mnk, int r, int c) {
+	return ((mnk->sides[0].rows[r] | mnk->sides[1].rows[r]) >> c) & 1;
+}
+
+/*
+ * Get the cell at which a move places its piece.
+ *
+ * @return  The row, or -1 if the move is not legal.
+ */
+static int mnk_target(const GAME_ENGINE *engine, const MNK_STATE *mnk, int cell, int *colp) {
+	int r, c;
+	if (cell < 0) {
+		c = -1 - cell;
+		if (c >= engine->width || mnk->heights[c] == engine->height) {
+			return -1;
+		}
+		r = engine->height - 1 - mnk->heights[c];
+	} else {
+		r = cell / engine->width;
+		c = cell % engine->width;
+		if (r >= engine->height || mnk_occupied(mnk, r, c)) {
+			return -1;
+		}
+		if (engine->gravity && r != engine->height - 1 - mnk->heights[c]) {
+			return -1;
+		}
+	}
+	*colp = c;
+	return r;
+}
+
+static void mnk_create(const GAME_ENGINE *engine, void *state) {
+	MNK_STATE *mnk = state;
+	memset(mnk, 0, sizeof(*mnk));
+	mnk->last = -1;
+}
+
+/*
+ * Interpret a move of the form "h8->X": a column letter and a row
+ * number, counted from 1 at the top of the board, followed by the piece.
+ * In a game with gravity the row may be left out, as in "d->O".
+ */
+static int mnk_parse(const GAME_ENGINE *engine, const void *state, char *str, GAME_MOVE *move) {
+	int c = tolower((unsigned char)str[0]) - 'a';
+	if (c < 0 || c >= engine->width) {
+		return -1;
+	}
+	int i = 1;
+	int r = 0;
+	while (isdigit((unsigned char)str[i]) && r <= engine->height) {
+		r = 10 * r + (str[i++] - '0');
+	}
+	int drop = i == 1;
+	if (drop ? !engine->gravity : (r < 1 || r > engine->height)) {
+		return -1;
+	}
+	int piece = -1;
+	for (; str[i] != '\0'; i++) {
+		if (str[i] == 'x' || str[i] == 'X') {
+			piece = 1;
+			break;
+		} else if (str[i] == 'o' || str[i] == 'O') {
+			piece = 0;
+			break;
+		}
+	}
+	if (piece == -1) {
+		return -1;
+	}
+	move->piece = piece;
+	move->cell = drop ? -1 - c : (r - 1) * engine->width + c;
+	return 0;
+}
+
+static int mnk_apply(const GAME_ENGINE *engine, void *state, const GAME_MOVE *move) {
+	MNK_STATE *mnk = state;
+	int c;
+	int r = mnk_target(engine, mnk, move->cell, &c);
+	if (r == -1) {
+		return -1;
+	}
+	MNK_SIDE *side = &mnk->sides[MNK_SIDE_OF(move->piece)];
+	side->rows[r] |= (uint32_t)1 << c;
+	side->cols[c] |= (uint32_t)1 << r;
+	side->diag[MNK_DIAG(r, c)] |= (uint32_t)1 << c;
+	side->anti[MNK_ANTI(r, c)] |= (uint32_t)1 << c;
+	mnk->heights[c]++;
+	mnk->moves++;
+	mnk->last = r * engine->width + c;
+	return 0;
+}
+
+static int mnk_unparse_move(const GAME_ENGINE *engine, const GAME_MOVE *move, char *buf, size_t len) {
+	char piece = move->piece == 1 ? 'X' : 'O';
+	int n;
+	if (move->cell < 0) {
+		n = snprintf(buf, len, "%c->%c", 'a' + (-1 - move->cell), piece);
+	} else {
+		n = snprintf(buf, len, "%c%d->%c", 'a' + move->cell % engine->width, move->cell / engine->width + 1,
+		    piece);
+	}
+	return n < 0 || (size_t)n >= len ? -1 : n;
+}
+
+/*
+ * Render the board with the column letters above it and the row numbers
+ * to its left, without a trailing newline.
+ */
+static int mnk_render_board(const GAME_ENGINE *engine, const MNK_STATE *mnk, char *buf, size_t len) {
+	size_t lineLen = 2 + 2 * engine->width;
+	size_t n = (engine->height + 1) * (lineLen + 1) - 1;
+	if (len < n + 1) {
+		return -1;
+	}
+	char *p = buf;
+	*p++ = ' ';
+	*p++ = ' ';
+	for (int c = 0; c < engine->width; c++) {
+		*p++ = ' ';
+		*p++ = 'a' + c;
+	}
+	for (int r = 0; r < engine->height; r++) {
+		*p++ = '\n';
+		*p++ = r + 1 < 10 ? ' ' : '0' + (r + 1) / 10;
+		*p++ = '0' + (r + 1) % 10;
+		for (int c = 0; c < engine->width; c++) {
+			*p++ = ' ';
+			if ((mnk->sides[0].rows[r] >> c) & 1) {
+				*p++ = 'X';
+			} else if ((mnk->sides[1].rows[r] >> c) & 1) {
+				*p++ = 'O';
+			} else {
+				*p++ = '.';
+			}
+		}
+	}
+	*p = '\0';
+	return n;
+}
+
+static int mnk_unparse_state(const GAME_ENGINE *engine, const void *state, char *buf, size_t len) {
+	return mnk_render_board(engine, state, buf, len);
+}
+
+static int mnk_is_over(const GAME_ENGINE *engine, const void *state, GAME_ROLE *winnerp) {
+	const MNK_STATE *mnk = state;
+	if (mnk->last == -1) {
+		return 0;
+	}
+	int r = mnk->last / engine->width;
+	int c = mnk->last % engine->width;
+	// The last piece was placed by X if an odd number have been placed.
+	int side = (mnk->moves & 1) ? 0 : 1;
+	if (mnk_wins_at(engine, &mnk->sides[side], r, c)) {
+		*winnerp = side == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+		return 1;
+	}
+	if (mnk->moves == engine->width * engine->height) {
+		*winnerp = NULL_ROLE;
+		return 1;
+	}
+	return 0;
+}
+
+static const char *mnk_render_moved(const GAME_ENGINE *engine, const void *state, char *buf, size_t len,
+    size_t *lenp) {
+	const MNK_STATE *mnk = state;
+	GAME_ROLE winner;
+	buf[0] = '\n';
+	int n = mnk_render_board(engine, mnk, buf + 1, len - 1);
+	if (n == -1) {
+		*lenp = 0;
+		return buf;
+	}
+	*lenp = 1 + n;
+	if (!mnk_is_over(engine, mnk, &winner) && *lenp + 11 <= len) {
+		memcpy(buf + *lenp, (mnk->moves & 1) ? "\nO to move\n" : "\nX to move\n", 11);
+		*lenp += 11;
+	}
+	return buf;
+}
+
+/*
+ * Suggest a move: one that completes a line if there is one, otherwise
+ * one that stops the opponent from completing a line next move, and
+ * otherwise the free cell next to a piece already on the board that is
+ * nearest the centre.  There is no search, so the outcome is predicted
+ * only when the move wins.
+ */
+static int mnk_hint(const GAME_ENGINE *engine, const void *state, int piece, GAME_MOVE *move,
+    GAME_ROLE *outcomep) {
+	const MNK_STATE *mnk = state;
+	const MNK_SIDE *own = &mnk->sides[MNK_SIDE_OF(piece)];
+	const MNK_SIDE *other = &mnk->sides[1 - MNK_SIDE_OF(piece)];
+	int block = -1;
+	int best = -1;
+	int bestScore = -1;
+	for (int r = 0; r < engine->height; r++) {
+		for (int c = 0; c < engine->width; c++) {
+			if (mnk_occupied(mnk, r, c) || (engine->gravity && r != engine->height - 1 - mnk->heights[c])) {
+				continue;
+			}
+			int cell = r * engine->width + c;
+			if (mnk_wins_at(engine, own, r, c)) {
+				move->piece = piece;
+				move->cell = engine->gravity ? -1 - c : cell;
+				*outcomep = piece == 1 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+				return 0;
+			}
+			if (block == -1 && mnk_wins_at(engine, other, r, c)) {
+				block = cell;
+			}
+			int neighbours = 0;
+			for (int dr = -1; dr <= 1; dr++) {
+				for (int dc = -1; dc <= 1; dc++) {
+					int nr = r + dr;
+					int nc = c + dc;
+					if (nr >= 0 && nr < engine->height && nc >= 0 && nc < engine->width
+					    && mnk_occupied(mnk, nr, nc)) {
+						neighbours = 1;
+					}
+				}
+			}
+			int distance = abs(2 * r - (engine->height - 1)) + abs(2 * c - (engine->width - 1));
+			int score = (neighbours || mnk->moves == 0 ? 4 * MNK_DIAGONALS : 0) - distance;
+			if (score > bestScore) {
+				best = cell;
+				bestScore = score;
+			}
+		}
+	}
+	if (block != -1) {
+		best = block;
+	}
+	if (best == -1) {
+		return -1;
+	}
+	move->piece = piece;
+	move->cell = engine->gravity ? -1 - best % engine->width : best;
+	*outcomep = NULL_ROLE;
+	return 0;
+}
+
+void game_mnk_init(GAME_ENGINE *engine, const char *name, int width, int height, int connect, int gravity) {
+	engine->name = name;
+	engine->width = width;
+	engine->height = height;
+	engine->connect = connect;
+	engine->gravity = gravity;
+	engine->stateSize = sizeof(MNK_STATE);
+	engine->create = mnk_create;
+	engine->parse = mnk_parse;
+	engine->apply = mnk_apply;
+	engine->unparse_move = mnk_unparse_move;
+	engine->unparse_state = mnk_unparse_state;
+	engine->render_moved = mnk_render_moved;
+	engine->is_over = mnk_is_over;
+	engine->hint = mnk_hint;
+}
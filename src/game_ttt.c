@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "game_engine.h"
+#include "game_ext.h"
+#include "solver.h"
+
+/*
+ * The tic-tac-toe engine.
+ *
+ * The board is kept as two 9-bit masks, one per side: board[0] holds the
+ * cells occupied by X and board[1] the cells occupied by O, with cell n
+ * (1-9, row-major) stored at bit n-1.  The index is the base-3 number
+ * of the board, used to find its pre-rendered description and its entry
+ * in the solver table.
+ */
+typedef struct ttt_state {
+	uint16_t board[2];
+	uint16_t index;
+} TTT_STATE;
+
+_Static_assert(sizeof(TTT_STATE) <= GAME_STATE_SIZE, "TTT_STATE does not fit in a GAME");
+
+/*
+ * Length of the board rendered by ttt_render_board().
+ */
+#define TTT_STATE_LEN 29
+
+/*
+ * Map a piece (1 for X, 0 for O) to the index of its mask in the board.
+ */
+#define TTT_SIDE(piece) (1 - (piece))
+
+/*
+ * The eight lines of the board, as cell masks.
+ */
+static const uint16_t ttt_lines[8] = {
+	0007, 0070, 0700,	// rows
+	0111, 0222, 0444,	// columns
+	0421, 0124		// diagonals
+};
+
+/*
+ * ttt_wins[mask] is nonzero if the set of cells in mask contains a line.
+ */
+static uint8_t ttt_wins[512];
+
+/*
+ * Boards are also numbered in base 3, with digit n-1 giving the contents
+ * of cell n (0 empty, 1 X, 2 O), and ttt_renders[index] holds the
+ * rendering of each.  Both tables are built once, on first use.
+ */
+#define TTT_NUM_BOARDS 19683
+#define TTT_MOVED_MAX (1 + TTT_STATE_LEN + 11)
+
+typedef struct ttt_render {
+	uint8_t len;
+	char text[TTT_MOVED_MAX];
+} TTT_RENDER;
+
+static const uint16_t ttt_pow3[9] = { 1, 3, 9, 27, 81, 243, 729, 2187, 6561 };
+static TTT_RENDER ttt_renders[TTT_NUM_BOARDS];
+static pthread_once_t ttt_tables_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Render a board in the format of game_unparse_state(), without the
+ * terminating NUL.
+ */
+static void ttt_render_board(uint16_t x, uint16_t o, char *buf) {
+	char *gameState = buf;
+	int boardPlace = 0;
+	int dashes = 0;
+	for(int i = 1; i < 30; i++) {
+		if (dashes) {
+			if (i % 6 == 0) {
+				dashes = 1 - dashes;
+				gameState[i - 1] = '\n';
+			} else {
+				gameState[i - 1] = '-';
+			}
+		} else {
+			if (i % 6 == 0) {
+				dashes = 1 - dashes;
+				gameState[i - 1] = '\n';
+			} else {
+				if (i % 2 == 0) {
+					gameState[i - 1] = '|';
+				} else {
+					uint16_t cell = 1 << boardPlace++;
+					if (x & cell) {
+						gameState[i - 1] = 'X';
+					} else if (o & cell) {
+						gameState[i - 1] = 'O';
+					} else {
+						gameState[i - 1] = ' ';
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Pre-render the payload of the MOVED packet for every board: a newline,
+ * the board, and, unless the game is over, which side is to move.  The
+ * side to move follows from the number of pieces, since X moves first.
+ */
+static void ttt_tables_init(void) {
+	for (int mask = 0; mask < 512; mask++) {
+		for (int i = 0; i < 8; i++) {
+			if ((mask & ttt_lines[i]) == ttt_lines[i]) {
+				ttt_wins[mask] = 1;
+				break;
+			}
+		}
+	}
+	for (int index = 0; index < TTT_NUM_BOARDS; index++) {
+		uint16_t x = 0;
+		uint16_t o = 0;
+		for (int i = 0, rest = index; i < 9; i++, rest /= 3) {
+			if (rest % 3 == 1) {
+				x |= 1 << i;
+			} else if (rest % 3 == 2) {
+				o |= 1 << i;
+			}
+		}
+		TTT_RENDER *render = &ttt_renders[index];
+		render->text[0] = '\n';
+		ttt_render_board(x, o, render->text + 1);
+		render->len = 1 + TTT_STATE_LEN;
+		if (!ttt_wins[x] && !ttt_wins[o] && __builtin_popcount(x | o) != 9) {
+			char *toMove = __builtin_popcount(x) == __builtin_popcount(o) ? "\nX to move\n" : "\nO to move\n";
+			memcpy(render->text + render->len, toMove, 11);
+			render->len += 11;
+		}
+	}
+}
+
+static void ttt_create(const GAME_ENGINE *engine, void *state) {
+	pthread_once(&ttt_tables_once, ttt_tables_init);
+	TTT_STATE *ttt = state;
+	ttt->board[0] = 0;
+	ttt->board[1] = 0;
+	ttt->index = 0;
+}
+
+/*
+ * Interpret a string as a move.  Both the text form and the two-byte
+ * binary form described in game_ext.h are accepted; they are told apart
+ * by the first byte, which is a digit character in the text form.
+ */
+static int ttt_parse(const GAME_ENGINE *engine, const void *state, char *str, GAME_MOVE *move) {
+	unsigned char cell = str[0];
+	if (cell >= 1 && cell <= 9) {
+		unsigned char piece = str[1];
+		if (piece != GAME_MOVE_X && piece != GAME_MOVE_O) {
+			return -1;
+		}
+		move->cell = cell;
+		move->piece = piece == GAME_MOVE_X ? 1 : 0;
+		return 0;
+	}
+	int placement = (int)(str[0]) - 48;
+	if (placement <= 0 || placement >= 10) {
+		return -1;
+	}
+	int piece = -1;
+	for (int i = 1; str[i] != '\0'; i++) {
+		if (str[i] == 'x' || str[i] == 'X') {
+			piece = 1;
+			break;
+		} else if (str[i] == 'o' || str[i] == 'O') {
+			piece = 0;
+			break;
+		}
+	}
+	if (piece == -1) {
+		return -1;
+	}
+	move->cell = placement;
+	move->piece = piece;
+	return 0;
+}
+
+static int ttt_apply(const GAME_ENGINE *engine, void *state, const GAME_MOVE *move) {
+	TTT_STATE *ttt = state;
+	uint16_t cell = 1 << (move->cell - 1);
+	int side = TTT_SIDE(move->piece);
+	if ((ttt->board[0] | ttt->board[1]) & cell) {
+		return -1;
+	}
+	ttt->board[side] |= cell;
+	ttt->index += (side + 1) * ttt_pow3[move->cell - 1];
+	return 0;
+}
+
+static int ttt_unparse_move(const GAME_ENGINE *engine, const GAME_MOVE *move, char *buf, size_t len) {
+	if (len < 5) {
+		return -1;
+	}
+	buf[0] = move->cell + 48;
+	buf[1] = '-';
+	buf[2] = '>';
+	buf[3] = move->piece == 1 ? 'X' : 'O';
+	buf[4] = '\0';
+	return 4;
+}
+
+static int ttt_unparse_state(const GAME_ENGINE *engine, const void *state, char *buf, size_t len) {
+	const TTT_STATE *ttt = state;
+	if (len < TTT_STATE_LEN + 1) {
+		return -1;
+	}
+	memcpy(buf, ttt_renders[ttt->index].text + 1, TTT_STATE_LEN);
+	buf[TTT_STATE_LEN] = '\0';
+	return TTT_STATE_LEN;
+}
+
+static const char *ttt_render_moved(const GAME_ENGINE *engine, const void *state, char *buf, size_t len,
+    size_t *lenp) {
+	const TTT_STATE *ttt = state;
+	TTT_RENDER *render = &ttt_renders[ttt->index];
+	*lenp = render->len;
+	return render->text;
+}
+
+/*
+ * Only the side that just moved can have completed a line, but checking
+ * both masks costs no more than working out which side that was.
+ */
+static int ttt_is_over(const GAME_ENGINE *engine, const void *state, GAME_ROLE *winnerp) {
+	const TTT_STATE *ttt = state;
+	int pieces = __builtin_popcount(ttt->board[0] | ttt->board[1]);
+	if (pieces == 0) {
+		return 0;
+	}
+	// Only the side that placed the last piece can have completed a
+	// line, and that is X if an odd number have been placed.
+	int side = (pieces & 1) ? 0 : 1;
+	if (ttt_wins[ttt->board[side]]) {
+		*winnerp = side == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+		return 1;
+	}
+	if (pieces == 9) {
+		*winnerp = NULL_ROLE;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The position is looked up in the solver table by its board number, so
+ * no search is done here.
+ */
+static int ttt_hint(const GAME_ENGINE *engine, const void *state, int piece, GAME_MOVE *move,
+    GAME_ROLE *outcomep) {
+	const TTT_STATE *ttt = state;
+	int value;
+	int cell = solver_lookup(ttt->index, &value);
+	if (cell == 0) {
+		return -1;
+	}
+	GAME_ROLE toMove = piece == 1 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+	move->piece = piece;
+	move->cell = cell;
+	if (value == SOLVER_WIN) {
+		*outcomep = toMove;
+	} else if (value == SOLVER_LOSS) {
+		*outcomep = toMove == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+	} else {
+		*outcomep = NULL_ROLE;
+	}
+	return 0;
+}
+
+const GAME_ENGINE game_engine_tictactoe = {
+	.name = "tictactoe",
+	.width = 3,
+	.height = 3,
+	.connect = 3,
+	.gravity = 0,
+	.stateSize = sizeof(TTT_STATE),
+	.create = ttt_create,
+	.parse = ttt_parse,
+	.apply = ttt_apply,
+	.unparse_move = ttt_unparse_move,
+	.unparse_state = ttt_unparse_state,
+	.render_moved = ttt_render_moved,
+	.is_over = ttt_is_over,
+	.hint = ttt_hint
+};
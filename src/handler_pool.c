@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "handler_pool.h"
+#include "debug.h"
+
+/*
+ * A handler worker and its deque of tasks, which is doubly linked
+ * through the tasks themselves.  Tasks are added at the tail, the owner
+ * takes them from the head and thieves from the tail.  A worker that
+ * finds no task anywhere marks itself as sleeping, and is woken either
+ * by a task being added to its own deque or by a submitter that wants
+ * it to steal.
+ */
+typedef struct hpool_worker {
+	pthread_mutex_t lock;		// protects the deque and the flags below
+	pthread_cond_t cond;
+	HPOOL_TASK *head;
+	HPOOL_TASK *tail;
+	int sleeping;
+	int woken;
+	int index;
+	pthread_t tid;
+} HPOOL_WORKER;
+
+static HPOOL_WORKER *handlers = NULL;
+static int numHandlers = 0;
+static atomic_int numSleeping;
+
+/*
+ * Take the task at one end of a worker's deque.
+ */
+static HPOOL_TASK *hpool_take(HPOOL_WORKER *worker, int fromTail) {
+	pthread_mutex_lock(&worker->lock);
+	HPOOL_TASK *task = fromTail ? worker->tail : worker->head;
+	if (task != NULL) {
+		if (task->prev != NULL) {
+			task->prev->next = task->next;
+		} else {
+			worker->head = task->next;
+		}
+		if (task->next != NULL) {
+			task->next->prev = task->prev;
+		} else {
+			worker->tail = task->prev;
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return task;
+}
+
+/*
+ * Steal a task from the first of the other workers, after this one, that
+ * has one.
+ */
+static HPOOL_TASK *hpool_steal(HPOOL_WORKER *thief) {
+	for (int i = 1; i < numHandlers; i++) {
+		HPOOL_TASK *task = hpool_take(&handlers[(thief->index + i) % numHandlers], 1);
+		if (task != NULL) {
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Wake a sleeping worker other than a busy one, to steal from it.
+ */
+static void hpool_wake_thief(HPOOL_WORKER *busy) {
+	for (int i = 1; i < numHandlers; i++) {
+		HPOOL_WORKER *worker = &handlers[(busy->index + i) % numHandlers];
+		pthread_mutex_lock(&worker->lock);
+		int wake = worker->sleeping && !worker->woken;
+		if (wake) {
+			worker->woken = 1;
+			pthread_cond_signal(&worker->cond);
+		}
+		pthread_mutex_unlock(&worker->lock);
+		if (wake) {
+			return;
+		}
+	}
+}
+
+/*
+ * A worker counts itself as sleeping before it looks for a task to steal
+ * for the last time, so a task submitted to a busy worker meanwhile is
+ * either found or makes its submitter wake some sleeping worker.
+ */
+static void *hpool_thread(void *arg) {
+	HPOOL_WORKER *self = arg;
+	debug("%ld: Handler worker %d started", pthread_self(), self->index);
+	while (1) {
+		HPOOL_TASK *task = hpool_take(self, 0);
+		if (task == NULL) {
+			task = hpool_steal(self);
+		}
+		if (task == NULL) {
+			pthread_mutex_lock(&self->lock);
+			self->sleeping = 1;
+			pthread_mutex_unlock(&self->lock);
+			atomic_fetch_add(&numSleeping, 1);
+			task = hpool_steal(self);
+			pthread_mutex_lock(&self->lock);
+			while (task == NULL && self->head == NULL && !self->woken) {
+				pthread_cond_wait(&self->cond, &self->lock);
+			}
+			self->sleeping = 0;
+			self->woken = 0;
+			pthread_mutex_unlock(&self->lock);
+			atomic_fetch_sub(&numSleeping, 1);
+			if (task == NULL) {
+				continue;
+			}
+		}
+		task->run(task);
+	}
+	return NULL;
+}
+
+int hpool_start(int nworkers) {
+	if (nworkers < 1) {
+		return -1;
+	}
+	handlers = calloc(nworkers, sizeof(HPOOL_WORKER));
+	if (handlers == NULL) {
+		return -1;
+	}
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+		CPU_ZERO(&allowed);
+		CPU_SET(0, &allowed);
+	}
+	int numCpus = CPU_COUNT(&allowed);
+	for (int i = 0; i < nworkers; i++) {
+		HPOOL_WORKER *worker = &handlers[i];
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		worker->index = i;
+	}
+	numHandlers = nworkers;
+	for (int i = 0; i < nworkers; i++) {
+		HPOOL_WORKER *worker = &handlers[i];
+		if (pthread_create(&worker->tid, NULL, hpool_thread, worker) != 0) {
+			return -1;
+		}
+		pthread_detach(worker->tid);
+		// Find the (i % numCpus)-th CPU in the set.
+		int nth = i % numCpus;
+		int cpu = 0;
+		while (!CPU_ISSET(cpu, &allowed) || nth-- > 0) {
+			cpu++;
+		}
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(worker->tid, sizeof(set), &set) != 0) {
+			debug("%ld: Failed to pin handler worker %d to CPU %d", pthread_self(), i, cpu);
+		}
+	}
+	debug("%ld: Handler pool started with %d workers on %d CPUs", pthread_self(), nworkers, numCpus);
+	return 0;
+}
+
+int hpool_enabled(void) {
+	return numHandlers > 0;
+}
+
+/*
+ * Keys are mostly addresses, whose low bits are all alike, so they are
+ * hashed before selecting a worker.
+ */
+void hpool_submit(HPOOL_TASK *task, uintptr_t key) {
+	uint64_t hash = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+	HPOOL_WORKER *worker = &handlers[(hash >> 32) % numHandlers];
+	pthread_mutex_lock(&worker->lock);
+	task->next = NULL;
+	task->prev = worker->tail;
+	if (worker->tail != NULL) {
+		worker->tail->next = task;
+	} else {
+		worker->head = task;
+	}
+	worker->tail = task;
+	int asleep = worker->sleeping;
+	if (asleep) {
+		worker->woken = 1;
+		pthread_cond_signal(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	if (!asleep && atomic_load(&numSleeping) > 0) {
+		hpool_wake_thief(worker);
+	}
+}
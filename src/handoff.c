@@ -0,0 +1,919 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "handoff.h"
+#include "jeux_service.h"
+#include "reactor.h"
+#include "client_ext.h"
+#include "timer.h"
+#include "client_registry_ext.h"
+#include "player_registry_ext.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "matchmaker.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define HANDOFF_MAGIC 0x4f48584a	/* "JXHO" */
+#define HANDOFF_VERSION 1
+#define HANDOFF_GAME_NAME 64
+#define HANDOFF_FDS_PER_MSG 250
+#define HANDOFF_MAX_EXCLUDED 8
+#define HANDOFF_EXIT_TIMEOUT_MS 10000
+
+#define HANDOFF_LOGGED_IN 1
+#define HANDOFF_QUEUED 2
+
+/*
+ * What a successor sends on connecting: the game it plays, which must be
+ * the game of the running server, since the positions of games in
+ * progress are handed over as the engine's own state.
+ */
+typedef struct handoff_hello {
+	uint32_t magic;
+	uint32_t version;
+	char game[HANDOFF_GAME_NAME];
+} HANDOFF_HELLO;
+
+/*
+ * What the running server sends once it has frozen: the number of
+ * descriptors, which follow in batches of HANDOFF_FDS_PER_MSG, each
+ * attached to a single byte, and the size of the snapshot that follows
+ * them.
+ */
+typedef struct handoff_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numFds;
+	uint32_t size;
+} HANDOFF_HEADER;
+
+/*
+ * A growable buffer in which the snapshot is built, and a cursor over a
+ * received snapshot.  Integers are in host byte order, since both ends
+ * of a handoff are on the same host.
+ */
+typedef struct handoff_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+	int failed;
+} HANDOFF_BUF;
+
+typedef struct handoff_reader {
+	const char *data;
+	size_t len;
+	size_t pos;
+	int failed;
+} HANDOFF_READER;
+
+static struct {
+	char *path;
+	int wakefd;
+	atomic_int frozen;
+	atomic_int starting;
+	atomic_int pending;		// 1 when a successor waits, 2 once taken
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	HANDOFF_CONN *parked;
+	int numParked;
+	int busy;
+	int peerfd;
+	int listenfd;
+	int sockfd;
+	pthread_t notify;
+	pthread_t thread;
+	int excluded[HANDOFF_MAX_EXCLUDED];
+	int numExcluded;
+	// State received from a predecessor.
+	int *fds;
+	int numFds;
+	char *snapshot;
+	size_t snapshotLen;
+} ho = {
+	.wakefd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.peerfd = -1,
+	.listenfd = -1,
+	.sockfd = -1
+};
+
+static void handoff_put(HANDOFF_BUF *b, const void *data, size_t len) {
+	if (b->failed) {
+		return;
+	}
+	if (b->len + len > b->cap) {
+		size_t cap = b->cap == 0 ? 4096 : b->cap;
+		while (cap < b->len + len) {
+			cap *= 2;
+		}
+		char *grown = realloc(b->data, cap);
+		if (grown == NULL) {
+			b->failed = 1;
+			return;
+		}
+		b->data = grown;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void handoff_put_u8(HANDOFF_BUF *b, uint8_t v) {
+	handoff_put(b, &v, sizeof(v));
+}
+
+static void handoff_put_u16(HANDOFF_BUF *b, uint16_t v) {
+	handoff_put(b, &v, sizeof(v));
+}
+
+static void handoff_put_u32(HANDOFF_BUF *b, uint32_t v) {
+	handoff_put(b, &v, sizeof(v));
+}
+
+static void handoff_put_str(HANDOFF_BUF *b, const char *str) {
+	size_t len = strlen(str);
+	handoff_put_u16(b, len);
+	handoff_put(b, str, len);
+}
+
+static const char *handoff_get(HANDOFF_READER *r, size_t len) {
+	if (r->failed || r->len - r->pos < len) {
+		r->failed = 1;
+		return NULL;
+	}
+	const char *data = r->data + r->pos;
+	r->pos += len;
+	return data;
+}
+
+static uint8_t handoff_get_u8(HANDOFF_READER *r) {
+	const char *p = handoff_get(r, sizeof(uint8_t));
+	return p != NULL ? *(const uint8_t *)p : 0;
+}
+
+static uint16_t handoff_get_u16(HANDOFF_READER *r) {
+	uint16_t v = 0;
+	const char *p = handoff_get(r, sizeof(v));
+	if (p != NULL) {
+		memcpy(&v, p, sizeof(v));
+	}
+	return v;
+}
+
+static uint32_t handoff_get_u32(HANDOFF_READER *r) {
+	uint32_t v = 0;
+	const char *p = handoff_get(r, sizeof(v));
+	if (p != NULL) {
+		memcpy(&v, p, sizeof(v));
+	}
+	return v;
+}
+
+/*
+ * Get a string saved by handoff_put_str(), as a NUL-terminated copy.
+ */
+static char *handoff_get_str(HANDOFF_READER *r) {
+	uint16_t len = handoff_get_u16(r);
+	const char *p = handoff_get(r, len);
+	if (p == NULL) {
+		return NULL;
+	}
+	char *str = malloc(len + 1);
+	if (str == NULL) {
+		r->failed = 1;
+		return NULL;
+	}
+	memcpy(str, p, len);
+	str[len] = '\0';
+	return str;
+}
+
+void handoff_configure(char *path) {
+	ho.path = path;
+	ho.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+int handoff_wakefd(void) {
+	return ho.path != NULL ? ho.wakefd : -1;
+}
+
+int handoff_frozen(void) {
+	return atomic_load_explicit(&ho.frozen, memory_order_acquire);
+}
+
+void handoff_service_starting(void) {
+	atomic_fetch_add(&ho.starting, 1);
+}
+
+void handoff_service_started(void) {
+	atomic_fetch_sub(&ho.starting, 1);
+}
+
+void handoff_exclude(int fd) {
+	pthread_mutex_lock(&ho.lock);
+	if (ho.numExcluded < HANDOFF_MAX_EXCLUDED) {
+		ho.excluded[ho.numExcluded++] = fd;
+	}
+	pthread_mutex_unlock(&ho.lock);
+}
+
+/*
+ * A connection offered once the handoff is over is not parked, and
+ * handoff_wait() then returns at once.
+ */
+void handoff_park(HANDOFF_CONN *conn) {
+	pthread_mutex_lock(&ho.lock);
+	conn->closed = 0;
+	conn->parked = handoff_frozen();
+	if (conn->parked) {
+		conn->next = ho.parked;
+		ho.parked = conn;
+		ho.numParked++;
+		pthread_cond_broadcast(&ho.cond);
+	}
+	pthread_mutex_unlock(&ho.lock);
+}
+
+void handoff_wait(HANDOFF_CONN *conn) {
+	pthread_mutex_lock(&ho.lock);
+	while (conn->parked) {
+		pthread_cond_wait(&ho.cond, &ho.lock);
+	}
+	pthread_mutex_unlock(&ho.lock);
+}
+
+int handoff_pending(void) {
+	return atomic_load(&ho.pending) != 0;
+}
+
+int handoff_listenfd(void) {
+	return ho.fds != NULL ? ho.fds[0] : -1;
+}
+
+static void handoff_deadline(struct timespec *ts, int ms) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int handoff_expired(const struct timespec *deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > deadline->tv_sec
+	    || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static int handoff_remaining_ms(const struct timespec *deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+static void handoff_set_timeout(int fd, int ms) {
+	struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void handoff_address(struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, ho.path, sizeof(addr->sun_path) - 1);
+}
+
+/*
+ * Send descriptors in batches, each attached to a single byte.
+ */
+static int handoff_send_fds(int sock, int *fds, int numFds) {
+	for (int i = 0; i < numFds; i += HANDOFF_FDS_PER_MSG) {
+		int n = numFds - i < HANDOFF_FDS_PER_MSG ? numFds - i : HANDOFF_FDS_PER_MSG;
+		char byte = 'F';
+		struct iovec iov = { &byte, 1 };
+		union {
+			char buf[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+				     .msg_controllen = CMSG_SPACE(n * sizeof(int)) };
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds + i, n * sizeof(int));
+		ssize_t sent;
+		do {
+			sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+		} while (sent == -1 && errno == EINTR);
+		if (sent != 1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int handoff_recv_fds(int sock, int *fds, int numFds) {
+	for (int i = 0; i < numFds; ) {
+		char byte;
+		struct iovec iov = { &byte, 1 };
+		union {
+			char buf[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+				     .msg_controllen = sizeof(control.buf) };
+		ssize_t n;
+		do {
+			n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+		} while (n == -1 && errno == EINTR);
+		if (n != 1 || (mh.msg_flags & MSG_CTRUNC)) {
+			return -1;
+		}
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			return -1;
+		}
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (count > numFds - i) {
+			return -1;
+		}
+		memcpy(fds + i, CMSG_DATA(cmsg), count * sizeof(int));
+		i += count;
+	}
+	return 0;
+}
+
+int handoff_receive(void) {
+	if (ho.path == NULL) {
+		return 0;
+	}
+	struct sockaddr_un addr;
+	handoff_address(&addr);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		// Nobody is listening, or the socket was left behind by a server
+		// that is no longer running: this is a fresh start.
+		close(sock);
+		return 0;
+	}
+	debug("%ld: Taking over from the server on %s", pthread_self(), ho.path);
+	handoff_set_timeout(sock, HANDOFF_EXIT_TIMEOUT_MS);
+	HANDOFF_HELLO hello = { HANDOFF_MAGIC, HANDOFF_VERSION, "" };
+	strncpy(hello.game, game_get_engine()->name, sizeof(hello.game) - 1);
+	HANDOFF_HEADER hdr;
+	if (rio_writen(sock, &hello, sizeof(hello)) != sizeof(hello)
+	    || rio_readn(sock, &hdr, sizeof(hdr)) != sizeof(hdr)
+	    || hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION || hdr.numFds < 1) {
+		debug("%ld: The server on %s refused to hand over", pthread_self(), ho.path);
+		close(sock);
+		return -1;
+	}
+	int *fds = malloc(hdr.numFds * sizeof(int));
+	char *snapshot = malloc(hdr.size > 0 ? hdr.size : 1);
+	char ack = 'A';
+	if (fds == NULL || snapshot == NULL || handoff_recv_fds(sock, fds, hdr.numFds) == -1
+	    || rio_readn(sock, snapshot, hdr.size) != (ssize_t)hdr.size
+	    || rio_writen(sock, &ack, 1) != 1) {
+		debug("%ld: Failed to receive state from %s", pthread_self(), ho.path);
+		free(fds);
+		free(snapshot);
+		close(sock);
+		return -1;
+	}
+	// The socket is closed when the predecessor exits.
+	char byte;
+	ssize_t n;
+	do {
+		n = read(sock, &byte, 1);
+	} while (n == -1 && errno == EINTR);
+	close(sock);
+	if (n != 0) {
+		debug("%ld: The server on %s did not exit", pthread_self(), ho.path);
+		free(fds);
+		free(snapshot);
+		return -1;
+	}
+	ho.fds = fds;
+	ho.numFds = hdr.numFds;
+	ho.snapshot = snapshot;
+	ho.snapshotLen = hdr.size;
+	debug("%ld: Received %d connections and %u bytes of state", pthread_self(), ho.numFds - 1, hdr.size);
+	return 1;
+}
+
+/*
+ * Make a descriptor blocking or non-blocking, since the file status
+ * flags of a connection come with it from the predecessor.
+ */
+static int handoff_set_blocking(int fd, int blocking) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) {
+		return -1;
+	}
+	flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+	return fcntl(fd, F_SETFL, flags);
+}
+
+int handoff_restore(CLIENT_REGISTRY *creg, PLAYER_REGISTRY *preg, int useReactor) {
+	if (ho.fds == NULL) {
+		return 0;
+	}
+	HANDOFF_READER r = { ho.snapshot, ho.snapshotLen, 0, 0 };
+	uint32_t numPlayers = handoff_get_u32(&r);
+	char **names = calloc(numPlayers + 1, sizeof(char *));
+	int *ratings = calloc(numPlayers + 1, sizeof(int));
+	uint32_t loaded = 0;
+	while (names != NULL && ratings != NULL && loaded < numPlayers && !r.failed) {
+		names[loaded] = handoff_get_str(&r);
+		ratings[loaded] = (int)handoff_get_u32(&r);
+		if (names[loaded] != NULL) {
+			loaded++;
+		}
+	}
+	if (names != NULL && ratings != NULL && !r.failed) {
+		preg_preload(preg, names, ratings, loaded);
+	}
+	for (uint32_t i = 0; names != NULL && i < loaded; i++) {
+		free(names[i]);
+	}
+	free(names);
+	free(ratings);
+	if (names == NULL || ratings == NULL || r.failed) {
+		return -1;
+	}
+
+	uint32_t numClients = handoff_get_u32(&r);
+	if (numClients != (uint32_t)ho.numFds - 1) {
+		return -1;
+	}
+	CLIENT **clients = calloc(numClients + 1, sizeof(CLIENT *));
+	PROTO_BUF **ins = calloc(numClients + 1, sizeof(PROTO_BUF *));
+	uint8_t *flags = calloc(numClients + 1, 1);
+	if (clients == NULL || ins == NULL || flags == NULL) {
+		free(clients);
+		free(ins);
+		free(flags);
+		return -1;
+	}
+	for (uint32_t i = 0; i < numClients && !r.failed; i++) {
+		int fd = ho.fds[i + 1];
+		flags[i] = handoff_get_u8(&r);
+		char *name = (flags[i] & HANDOFF_LOGGED_IN) ? handoff_get_str(&r) : NULL;
+		uint32_t inputLen = handoff_get_u32(&r);
+		const char *input = handoff_get(&r, inputLen);
+		CLIENT *client = r.failed ? NULL : creg_register(creg, fd);
+		PROTO_BUF *in = client != NULL ? malloc(sizeof(PROTO_BUF)) : NULL;
+		if (in != NULL) {
+			proto_buf_init(in, fd);
+		}
+		if (in == NULL || proto_buf_restore(in, input, inputLen) == -1) {
+			debug("%ld: [%d] Failed to restore client", pthread_self(), fd);
+			if (client != NULL) {
+				jeux_service_close(client);
+			}
+			if (in != NULL) {
+				proto_buf_fini(in);
+				free(in);
+			}
+			close(fd);
+			free(name);
+			continue;
+		}
+		if (name != NULL) {
+			// As at LOGIN, the reference returned by preg_register() is
+			// kept until the client's connection is closed.
+			PLAYER *player = preg_register(preg, name);
+			if (player != NULL && client_login(client, player) == -1) {
+				player_unref(player, "because login failed");
+			}
+			free(name);
+		}
+		clients[i] = client;
+		ins[i] = in;
+	}
+
+	uint32_t numInvitations = handoff_get_u32(&r);
+	for (uint32_t i = 0; i < numInvitations && !r.failed; i++) {
+		uint32_t source = handoff_get_u32(&r);
+		uint8_t sourceId = handoff_get_u8(&r);
+		uint32_t target = handoff_get_u32(&r);
+		uint8_t targetId = handoff_get_u8(&r);
+		uint8_t sourceRole = handoff_get_u8(&r);
+		uint8_t targetRole = handoff_get_u8(&r);
+		uint16_t gameLen = handoff_get_u16(&r);
+		const char *saved = handoff_get(&r, gameLen);
+		if (r.failed || source >= numClients || target >= numClients
+		    || clients[source] == NULL || clients[target] == NULL) {
+			continue;
+		}
+		GAME *game = NULL;
+		if (gameLen > 0 && (game = game_restore(saved, gameLen)) == NULL) {
+			continue;
+		}
+		if (client_restore_invitation(clients[source], sourceId, clients[target], targetId,
+					      sourceRole, targetRole, game) == -1) {
+			debug("%ld: Failed to restore invitation %d of client %p", pthread_self(), sourceId,
+			      clients[source]);
+		}
+	}
+
+	// Only once every client is back are any requests handled.
+	int restored = 0;
+	for (uint32_t i = 0; i < numClients; i++) {
+		if (clients[i] == NULL) {
+			continue;
+		}
+		if (flags[i] & HANDOFF_QUEUED) {
+			matchmaker_enqueue(clients[i]);
+		}
+		int error;
+		if (useReactor) {
+			error = handoff_set_blocking(ho.fds[i + 1], 0) == -1 ? -1 : reactor_adopt(clients[i], ins[i]);
+		} else {
+			error = handoff_set_blocking(ho.fds[i + 1], 1) == -1 ? -1 : jeux_service_adopt(clients[i], ins[i]);
+		}
+		if (error == 0) {
+			restored++;
+		}
+	}
+	debug("%ld: Restored %d of %u clients and %u invitations", pthread_self(), restored, numClients,
+	      numInvitations);
+	free(clients);
+	free(ins);
+	free(flags);
+	free(ho.snapshot);
+	ho.snapshot = NULL;
+	return r.failed ? -1 : restored;
+}
+
+/*
+ * Remove a descriptor from those excluded from the handoff, as it is
+ * about to be closed.
+ *
+ * @return 1 if the descriptor was excluded, otherwise 0.
+ */
+static int handoff_unexclude(int fd) {
+	for (int i = 0; i < ho.numExcluded; i++) {
+		if (ho.excluded[i] == fd) {
+			ho.excluded[i] = ho.excluded[--ho.numExcluded];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Close a parked connection instead of handing it over.  Logging the
+ * client out may send packets to other clients, which are flushed
+ * afterwards.
+ */
+static void handoff_close(HANDOFF_CONN *conn) {
+	debug("%ld: [%d] Closing connection instead of handing it over", pthread_self(), conn->in->fd);
+	jeux_service_close(conn->client);
+	conn->closed = 1;
+}
+
+static void handoff_save_player(PLAYER *player, void *arg) {
+	HANDOFF_BUF *b = arg;
+	handoff_put_str(b, player_get_name(player));
+	handoff_put_u32(b, (uint32_t)player_get_rating(player));
+}
+
+static int handoff_compare_clients(const void *a, const void *b) {
+	CLIENT *x = ((HANDOFF_CONN *const *)a)[0]->client;
+	CLIENT *y = ((HANDOFF_CONN *const *)b)[0]->client;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Find the index of a client among the connections being handed over,
+ * which are sorted by the address of their CLIENT.
+ */
+static int handoff_index(HANDOFF_CONN **conns, int n, CLIENT *client) {
+	int lo = 0, hi = n - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (conns[mid]->client == client) {
+			return mid;
+		} else if (conns[mid]->client < client) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Build the snapshot of the connections being handed over.  Each
+ * invitation is saved once, from the side of its source.
+ */
+static void handoff_save(HANDOFF_BUF *b, PLAYER_REGISTRY *preg, HANDOFF_CONN **conns, int n) {
+	size_t countAt = b->len;
+	handoff_put_u32(b, 0);
+	uint32_t numPlayers = preg_count(preg);
+	preg_for_each(preg, handoff_save_player, b);
+	if (!b->failed) {
+		memcpy(b->data + countAt, &numPlayers, sizeof(numPlayers));
+	}
+
+	handoff_put_u32(b, n);
+	char *input = malloc(PROTO_BUF_SAVE_MAX);
+	if (input == NULL) {
+		b->failed = 1;
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		CLIENT *client = conns[i]->client;
+		PLAYER *player = client_get_player(client);
+		uint8_t flags = 0;
+		if (player != NULL) {
+			flags |= HANDOFF_LOGGED_IN;
+		}
+		if (matchmaker_is_queued(client)) {
+			flags |= HANDOFF_QUEUED;
+		}
+		handoff_put_u8(b, flags);
+		if (player != NULL) {
+			handoff_put_str(b, player_get_name(player));
+		}
+		size_t len = proto_buf_save(conns[i]->in, input, PROTO_BUF_SAVE_MAX);
+		handoff_put_u32(b, len);
+		handoff_put(b, input, len);
+	}
+	free(input);
+
+	countAt = b->len;
+	uint32_t numInvitations = 0;
+	handoff_put_u32(b, 0);
+	unsigned char saved[GAME_SAVE_MAX];
+	for (int i = 0; i < n; i++) {
+		CLIENT *client = conns[i]->client;
+		for (int id = 0; id < CLIENT_MAX_INVITATIONS; id++) {
+			INVITATION *inv = client_get_invitation(client, id);
+			if (inv == NULL) {
+				continue;
+			}
+			CLIENT *target = inv_get_target(inv);
+			int t = handoff_index(conns, n, target);
+			if (inv_get_source(inv) == client && t != -1) {
+				GAME *game = inv_get_game(inv);
+				size_t gameLen = game != NULL ? game_save(game, saved, sizeof(saved)) : 0;
+				handoff_put_u32(b, i);
+				handoff_put_u8(b, id);
+				handoff_put_u32(b, t);
+				handoff_put_u8(b, inv_get_id(inv, target));
+				handoff_put_u8(b, inv_get_source_role(inv));
+				handoff_put_u8(b, inv_get_target_role(inv));
+				handoff_put_u16(b, gameLen);
+				handoff_put(b, saved, gameLen);
+				numInvitations++;
+			}
+			inv_unref(inv, "after saving invitation for handoff");
+		}
+	}
+	if (!b->failed) {
+		memcpy(b->data + countAt, &numInvitations, sizeof(numInvitations));
+	}
+}
+
+/*
+ * Thaw the service threads after a handoff that did not succeed.
+ */
+static void handoff_thaw(void) {
+	uint64_t count;
+	if (read(ho.wakefd, &count, sizeof(count)) == -1) {
+		// Nothing to consume.
+	}
+	pthread_mutex_lock(&ho.lock);
+	atomic_store(&ho.frozen, 0);
+	for (HANDOFF_CONN *conn = ho.parked; conn != NULL; conn = conn->next) {
+		conn->parked = 0;
+	}
+	ho.parked = NULL;
+	ho.numParked = 0;
+	pthread_cond_broadcast(&ho.cond);
+	pthread_mutex_unlock(&ho.lock);
+}
+
+/*
+ * Let the handoff thread wait for the next successor.
+ */
+static void handoff_done(void) {
+	pthread_mutex_lock(&ho.lock);
+	close(ho.peerfd);
+	ho.peerfd = -1;
+	ho.busy = 0;
+	atomic_store(&ho.pending, 0);
+	pthread_cond_broadcast(&ho.cond);
+	pthread_mutex_unlock(&ho.lock);
+}
+
+int handoff_hand_over(CLIENT_REGISTRY *creg, PLAYER_REGISTRY *preg) {
+	atomic_store(&ho.pending, 2);
+	struct timespec deadline;
+	handoff_deadline(&deadline, HANDOFF_TIMEOUT_MS);
+	debug("%ld: Handing over to successor", pthread_self());
+
+	// Let service threads that are starting register their clients, so
+	// that the registry counts every connection to be frozen.
+	while (atomic_load(&ho.starting) > 0 && !handoff_expired(&deadline)) {
+		struct timespec interval = { 0, 1000 * 1000 };
+		nanosleep(&interval, NULL);
+	}
+	pthread_mutex_lock(&ho.lock);
+	ho.parked = NULL;
+	ho.numParked = 0;
+	atomic_store(&ho.frozen, 1);
+	pthread_mutex_unlock(&ho.lock);
+	uint64_t one = 1;
+	if (write(ho.wakefd, &one, sizeof(one)) == -1) {
+		debug("%ld: Failed to wake service threads", pthread_self());
+	}
+	pthread_mutex_lock(&ho.lock);
+	while (ho.numParked < creg_count(creg) && !handoff_expired(&deadline)) {
+		struct timespec wake;
+		handoff_deadline(&wake, 10);
+		pthread_cond_timedwait(&ho.cond, &ho.lock, &wake);
+	}
+	int numParked = ho.numParked;
+	int frozen = numParked >= creg_count(creg);
+	pthread_mutex_unlock(&ho.lock);
+	if (!frozen) {
+		debug("%ld: Only %d connections could be frozen", pthread_self(), numParked);
+		handoff_thaw();
+		handoff_done();
+		return -1;
+	}
+	// Timers change the state being saved as much as the matchmaker does.
+	matchmaker_pause();
+	timer_pause();
+
+	HANDOFF_CONN **conns = malloc((numParked + 1) * sizeof(HANDOFF_CONN *));
+	int n = 0;
+	if (conns == NULL) {
+		matchmaker_start();
+		timer_resume();
+		handoff_thaw();
+		handoff_done();
+		return -1;
+	}
+	for (HANDOFF_CONN *conn = ho.parked; conn != NULL; conn = conn->next) {
+		pthread_mutex_lock(&ho.lock);
+		int excluded = handoff_unexclude(conn->in->fd);
+		pthread_mutex_unlock(&ho.lock);
+		if (excluded) {
+			handoff_close(conn);
+		}
+	}
+	// A client whose output cannot be written out in time is closed, which
+	// may give others more to write, so this is repeated until every
+	// remaining client is up to date.
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (HANDOFF_CONN *conn = ho.parked; conn != NULL; conn = conn->next) {
+			if (!conn->closed && client_flush_output(conn->client, handoff_remaining_ms(&deadline)) == -1) {
+				handoff_close(conn);
+				changed = 1;
+			}
+		}
+	}
+	for (HANDOFF_CONN *conn = ho.parked; conn != NULL; conn = conn->next) {
+		if (!conn->closed) {
+			conns[n++] = conn;
+		}
+	}
+	qsort(conns, n, sizeof(HANDOFF_CONN *), handoff_compare_clients);
+
+	HANDOFF_BUF b = { NULL, 0, 0, 0 };
+	handoff_save(&b, preg, conns, n);
+	int *fds = malloc((n + 1) * sizeof(int));
+	int error = b.failed || fds == NULL;
+	if (!error) {
+		fds[0] = ho.listenfd;
+		for (int i = 0; i < n; i++) {
+			fds[i + 1] = conns[i]->in->fd;
+		}
+		HANDOFF_HEADER hdr = { HANDOFF_MAGIC, HANDOFF_VERSION, n + 1, b.len };
+		char ack;
+		handoff_set_timeout(ho.peerfd, HANDOFF_TIMEOUT_MS);
+		error = rio_writen(ho.peerfd, &hdr, sizeof(hdr)) != sizeof(hdr)
+		    || handoff_send_fds(ho.peerfd, fds, n + 1) == -1
+		    || rio_writen(ho.peerfd, b.data, b.len) != (ssize_t)b.len
+		    || rio_readn(ho.peerfd, &ack, 1) != 1 || ack != 'A';
+	}
+	free(fds);
+	free(b.data);
+	free(conns);
+	if (error) {
+		debug("%ld: Successor failed to take over", pthread_self());
+		matchmaker_start();
+		timer_resume();
+		handoff_thaw();
+		handoff_done();
+		return -1;
+	}
+	// The connection to the successor is closed by exiting, which tells it
+	// that everything this server had open is free.
+	debug("%ld: Handed over %d connections", pthread_self(), n);
+	return 0;
+}
+
+/*
+ * Thread function for the thread that waits for successors.  Once one
+ * has said hello, the thread that accepts connections is interrupted
+ * until it has started the handoff, and this thread then waits for the
+ * handoff to fail before accepting another successor.
+ */
+static void *handoff_thread(void *arg) {
+	while (1) {
+		int fd = accept(ho.sockfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			debug("%ld: Handoff socket failed: %s", pthread_self(), strerror(errno));
+			return NULL;
+		}
+		HANDOFF_HELLO hello;
+		handoff_set_timeout(fd, HANDOFF_TIMEOUT_MS);
+		if (rio_readn(fd, &hello, sizeof(hello)) != sizeof(hello) || hello.magic != HANDOFF_MAGIC
+		    || hello.version != HANDOFF_VERSION
+		    || strncmp(hello.game, game_get_engine()->name, sizeof(hello.game) - 1) != 0) {
+			debug("%ld: Refusing to hand over to a successor that does not match", pthread_self());
+			close(fd);
+			continue;
+		}
+		pthread_mutex_lock(&ho.lock);
+		ho.peerfd = fd;
+		ho.busy = 1;
+		pthread_mutex_unlock(&ho.lock);
+		atomic_store(&ho.pending, 1);
+		while (atomic_load(&ho.pending) == 1) {
+			pthread_kill(ho.notify, SIGHUP);
+			struct timespec interval = { 0, 10 * 1000 * 1000 };
+			nanosleep(&interval, NULL);
+		}
+		pthread_mutex_lock(&ho.lock);
+		while (ho.busy) {
+			pthread_cond_wait(&ho.cond, &ho.lock);
+		}
+		pthread_mutex_unlock(&ho.lock);
+	}
+	return NULL;
+}
+
+int handoff_start(int listenfd) {
+	if (ho.path == NULL) {
+		return 0;
+	}
+	if (ho.wakefd == -1) {
+		return -1;
+	}
+	struct sockaddr_un addr;
+	handoff_address(&addr);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		return -1;
+	}
+	// A predecessor has exited by now, but its socket remains.
+	unlink(ho.path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1) {
+		close(sock);
+		return -1;
+	}
+	ho.sockfd = sock;
+	ho.listenfd = listenfd;
+	ho.notify = pthread_self();
+	if (pthread_create(&ho.thread, NULL, handoff_thread, NULL) != 0) {
+		close(sock);
+		ho.sockfd = -1;
+		return -1;
+	}
+	pthread_detach(ho.thread);
+	debug("%ld: Waiting for successors on %s", pthread_self(), ho.path);
+	return 0;
+}
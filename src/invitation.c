@@ -13,7 +13,12 @@
 #include "game.h"
 #include "csapp.h"
 #include "invitation.h"
+#include "invitation_ext.h"
+#include "refcount.h"
+#include "slab.h"
+#include "timer.h"
 #include "debug.h"
+#include "trace.h"
 
 struct invitation {
 	CLIENT *source;
@@ -22,10 +27,24 @@ struct invitation {
 	GAME_ROLE target_role;
 	INVITATION_STATE state;
 	GAME *game;
-	int count;
+	REFCOUNT count;
+	int sourceId;
+	int targetId;
+	TIMER timer;
 	sem_t invitationMutex;
 };
 
+/*
+ * INVITATIONs are recycled through a slab, which initializes each
+ * semaphore only once.
+ */
+static void inv_construct(void *object) {
+	INVITATION *inv = object;
+	Sem_init(&inv->invitationMutex, 0, 1);
+}
+
+static SLAB invitationSlab = SLAB_INITIALIZER(INVITATION, inv_construct);
+
 /*
  * Create an INVITATION in the OPEN state, containing reference to
  * specified source and target CLIENTs, which cannot be the same CLIENT.
@@ -44,15 +63,20 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GA
 		debug("%ld: Source and target cannot be the same client", pthread_self());
 		return NULL;
 	}
-	INVITATION *invitation = malloc(sizeof(INVITATION));
+	INVITATION *invitation = slab_alloc(&invitationSlab);
+	if (invitation == NULL) {
+		return NULL;
+	}
 	invitation->source = source;
 	invitation->target = target;
 	invitation->source_role = source_role;
 	invitation->target_role = target_role;
 	invitation->state = INV_OPEN_STATE;
-	invitation->count = 0;
+	refcount_init(&invitation->count, 0);
 	invitation->game = NULL;
-	Sem_init(&invitation->invitationMutex, 0, 1);
+	invitation->sourceId = -1;
+	invitation->targetId = -1;
+	timer_init(&invitation->timer, NULL, invitation);
 	client_ref(source, "as source of new invitation");
 	client_ref(target, "as target of new invitation");
 	inv_ref(invitation, "for newly created invitation");
@@ -64,15 +88,12 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GA
  *
  * @param inv  The INVITATION whose reference count is to be increased.
  * @param why  A string describing the reason why the reference count is
- * being increased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being increased.
  * @return  The same INVITATION object that was passed as a parameter.
  */
 INVITATION *inv_ref(INVITATION *inv, char *why) {
-	P(&inv->invitationMutex);
-	debug("%ld: Increase refrence count on invitation %p (%d -> %d) %s", pthread_self(), inv, inv->count, inv->count + 1, why);
-	inv->count = inv->count + 1;
-	V(&inv->invitationMutex);
+	int old = refcount_inc(&inv->count);
+	trace(TRACE_INV_REF, inv, old, old + 1, 0, why);
 	return inv;
 }
 
@@ -83,25 +104,20 @@ INVITATION *inv_ref(INVITATION *inv, char *why) {
  *
  * @param inv  The INVITATION whose reference count is to be decreased.
  * @param why  A string describing the reason why the reference count is
- * being decreased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being decreased.
  *
  */
 void inv_unref(INVITATION *inv, char *why) {
-	P(&inv->invitationMutex);
-	debug("%ld: Decrease refrence count on invitation %p (%d -> %d) %s", pthread_self(), inv, inv->count, inv->count - 1, why);
-	inv->count = inv->count - 1;
-	if (inv->count == 0) {
-		debug("%ld: Free invitation %p", pthread_self(), inv);
+	int old = refcount_dec(&inv->count);
+	trace(TRACE_INV_UNREF, inv, old, old - 1, 0, why);
+	if (old == 1) {
 		client_unref(inv->source, "because invitation is being freed");
 		client_unref(inv->target, "because invitation is being freed");
 		if (inv->game != NULL) {
 			game_unref(inv->game, "because invitation is being freed");
 		}
-		free(inv);
-		return;
+		slab_free(&invitationSlab, inv);
 	}
-	V(&inv->invitationMutex);
 }
 
 /*
@@ -136,6 +152,22 @@ CLIENT *inv_get_target(INVITATION *inv) {
 	return target;
 }
 
+void inv_set_id(INVITATION *inv, CLIENT *client, int id) {
+	if (client == inv->source) {
+		inv->sourceId = id;
+	} else {
+		inv->targetId = id;
+	}
+}
+
+int inv_get_id(INVITATION *inv, CLIENT *client) {
+	return client == inv->source ? inv->sourceId : inv->targetId;
+}
+
+TIMER *inv_get_timer(INVITATION *inv) {
+	return &inv->timer;
+}
+
 /*
  * Get the GAME_ROLE to be played by the source of an INVITATION.
  *
@@ -203,6 +235,18 @@ int inv_accept(INVITATION *inv) {
 	return 0;
 }
 
+int inv_accept_game(INVITATION *inv, GAME *game) {
+	P(&inv->invitationMutex);
+	if (inv->state != INV_OPEN_STATE) {
+		V(&inv->invitationMutex);
+		return -1;
+	}
+	inv->state = INV_ACCEPTED_STATE;
+	inv->game = game;
+	V(&inv->invitationMutex);
+	return 0;
+}
+
 /*
  * Close an INVITATION, changing it from either the OPEN state or the
  * ACCEPTED state to the CLOSED state.  If the INVITATION was not previously
@@ -240,5 +284,9 @@ int inv_close(INVITATION *inv, GAME_ROLE role) {
 		}
 	}
 	V(&inv->invitationMutex);
+	// The caller holds a reference, so this is never the last one.
+	if (timer_cancel(&inv->timer)) {
+		inv_unref(inv, "because timer of closed invitation has been cancelled");
+	}
 	return 0;
 }
\ No newline at end of file
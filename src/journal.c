@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Names longer than this are truncated, so that the records of a start
+ * always fit in a ring.
+ */
+#define JOURNAL_MAX_NAME (JOURNAL_RING_RECORDS / 4 * JOURNAL_NAME_CHUNK)
+
+#define JOURNAL_RING_MASK (JOURNAL_RING_RECORDS - 1)
+
+_Static_assert((JOURNAL_RING_RECORDS & JOURNAL_RING_MASK) == 0, "ring size must be a power of two");
+
+/*
+ * A ring of records with a single producer, the thread that owns it, and
+ * a single consumer, the writing thread.  The producer advances head once
+ * it has filled in the records of an event, and the consumer advances
+ * tail once it has copied them out.  A thread gives its ring up when it
+ * exits, and the ring is then taken over by the next thread that needs
+ * one, after any records left in it.
+ */
+typedef struct journal_ring {
+	JOURNAL_RECORD records[JOURNAL_RING_RECORDS];
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_int owned;
+	struct journal_ring *next;
+} JOURNAL_RING;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	JOURNAL_RING *rings;
+	JOURNAL_RECORD *batch;
+	int closing;
+	int fd;
+	pthread_key_t key;
+	pthread_t thread;
+	atomic_uint_fast64_t nextGame;
+} journal = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1
+};
+
+static atomic_int journalOpen;
+static __thread JOURNAL_RING *journalRing;
+
+/*
+ * Give up the ring of a thread that is exiting.
+ */
+static void journal_release_ring(void *arg) {
+	JOURNAL_RING *ring = arg;
+	atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+/*
+ * Get the ring of the calling thread, taking over one that has been
+ * given up or adding a new one if it has none.
+ */
+static JOURNAL_RING *journal_ring(void) {
+	if (journalRing != NULL) {
+		return journalRing;
+	}
+	pthread_mutex_lock(&journal.lock);
+	JOURNAL_RING *ring;
+	for (ring = journal.rings; ring != NULL; ring = ring->next) {
+		if (atomic_load_explicit(&ring->owned, memory_order_acquire) == 0) {
+			break;
+		}
+	}
+	if (ring == NULL && (ring = calloc(1, sizeof(JOURNAL_RING))) != NULL) {
+		ring->next = journal.rings;
+		journal.rings = ring;
+	}
+	if (ring != NULL) {
+		atomic_store_explicit(&ring->owned, 1, memory_order_relaxed);
+		pthread_setspecific(journal.key, ring);
+	}
+	pthread_mutex_unlock(&journal.lock);
+	journalRing = ring;
+	return ring;
+}
+
+/*
+ * Reserve room for the records of an event in the calling thread's ring.
+ * If the writing thread has fallen a whole ring behind, this waits for
+ * it, as records are never dropped.
+ *
+ * @return  The ring, or NULL if none could be allocated.
+ */
+static JOURNAL_RING *journal_reserve(unsigned int n) {
+	JOURNAL_RING *ring = journal_ring();
+	if (ring == NULL) {
+		return NULL;
+	}
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) + n > JOURNAL_RING_RECORDS) {
+		pthread_cond_signal(&journal.cond);
+		struct timespec interval = { 0, 100 * 1000 };
+		nanosleep(&interval, NULL);
+	}
+	return ring;
+}
+
+static JOURNAL_RECORD *journal_slot(JOURNAL_RING *ring, unsigned int i) {
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	return &ring->records[(head + i) & JOURNAL_RING_MASK];
+}
+
+/*
+ * Publish the records filled in after a journal_reserve(), and have
+ * them written early if the ring is getting full.
+ */
+static void journal_commit(JOURNAL_RING *ring, unsigned int n) {
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed) + n;
+	atomic_store_explicit(&ring->head, head, memory_order_release);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_relaxed) >= JOURNAL_RING_RECORDS / 2) {
+		pthread_cond_signal(&journal.cond);
+	}
+}
+
+static void journal_stamp(JOURNAL_RECORD *rec, const struct timespec *ts) {
+	struct timespec now;
+	if (ts == NULL) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		ts = &now;
+	}
+	rec->sec = ts->tv_sec;
+	rec->nsec = ts->tv_nsec;
+}
+
+static void journal_write(size_t n) {
+	if (n == 0) {
+		return;
+	}
+	size_t len = n * sizeof(JOURNAL_RECORD);
+	if (rio_writen(journal.fd, journal.batch, len) != len) {
+		fprintf(stderr, "Failed to write game journal: %s\n", strerror(errno));
+	}
+	debug("%ld: Wrote %zu records of game journal", pthread_self(), n);
+}
+
+/*
+ * Copy the records in every ring into the batch, writing it out each
+ * time it fills.
+ */
+static void journal_drain(void) {
+	pthread_mutex_lock(&journal.lock);
+	JOURNAL_RING *rings = journal.rings;
+	pthread_mutex_unlock(&journal.lock);
+	size_t n = 0;
+	// Rings are only ever added at the head of the list.
+	for (JOURNAL_RING *ring = rings; ring != NULL; ring = ring->next) {
+		unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		while (tail != head) {
+			unsigned int count = head - tail;
+			unsigned int start = tail & JOURNAL_RING_MASK;
+			if (count > JOURNAL_RING_RECORDS - start) {
+				count = JOURNAL_RING_RECORDS - start;
+			}
+			if (count > JOURNAL_BATCH_RECORDS - n) {
+				count = JOURNAL_BATCH_RECORDS - n;
+			}
+			memcpy(journal.batch + n, ring->records + start, count * sizeof(JOURNAL_RECORD));
+			n += count;
+			tail += count;
+			atomic_store_explicit(&ring->tail, tail, memory_order_release);
+			if (n == JOURNAL_BATCH_RECORDS) {
+				journal_write(n);
+				n = 0;
+			}
+		}
+	}
+	journal_write(n);
+}
+
+static void *journal_thread(void *arg) {
+	pthread_mutex_lock(&journal.lock);
+	while (!journal.closing) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += JOURNAL_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&journal.cond, &journal.lock, &deadline);
+		pthread_mutex_unlock(&journal.lock);
+		journal_drain();
+		pthread_mutex_lock(&journal.lock);
+	}
+	pthread_mutex_unlock(&journal.lock);
+	journal_drain();
+	return NULL;
+}
+
+/*
+ * Find the highest game ID in the journal by mapping it.
+ */
+static uint64_t journal_last_game(int fd, size_t n) {
+	if (n == 0) {
+		return 0;
+	}
+	JOURNAL_RECORD *records = mmap(NULL, n * sizeof(JOURNAL_RECORD), PROT_READ, MAP_PRIVATE, fd, 0);
+	if (records == MAP_FAILED) {
+		return UINT64_MAX;
+	}
+	uint64_t last = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (records[i].type == JOURNAL_START && records[i].game > last) {
+			last = records[i].game;
+		}
+	}
+	munmap(records, n * sizeof(JOURNAL_RECORD));
+	return last;
+}
+
+int journal_open(char *path) {
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	size_t n = st.st_size / sizeof(JOURNAL_RECORD);
+	if (st.st_size % sizeof(JOURNAL_RECORD) != 0) {
+		debug("%ld: Discarding %zu bytes at end of game journal", pthread_self(),
+		      (size_t)st.st_size % sizeof(JOURNAL_RECORD));
+		if (ftruncate(fd, n * sizeof(JOURNAL_RECORD)) == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+	uint64_t last = journal_last_game(fd, n);
+	journal.batch = malloc(JOURNAL_BATCH_RECORDS * sizeof(JOURNAL_RECORD));
+	if (last == UINT64_MAX || journal.batch == NULL
+	    || pthread_key_create(&journal.key, journal_release_ring) != 0) {
+		free(journal.batch);
+		journal.batch = NULL;
+		close(fd);
+		return -1;
+	}
+	journal.fd = fd;
+	journal.closing = 0;
+	atomic_store(&journal.nextGame, last + 1);
+	if (pthread_create(&journal.thread, NULL, journal_thread, NULL) != 0) {
+		pthread_key_delete(journal.key);
+		free(journal.batch);
+		journal.batch = NULL;
+		journal.fd = -1;
+		close(fd);
+		return -1;
+	}
+	atomic_store_explicit(&journalOpen, 1, memory_order_release);
+	debug("%ld: Opened game journal %s with %zu records, continuing from game %lu", pthread_self(), path,
+	      n, (unsigned long)last + 1);
+	return 0;
+}
+
+/*
+ * Fill in the NAME records for a name, truncated to JOURNAL_MAX_NAME.
+ *
+ * @return  The number of records.
+ */
+static unsigned int journal_name(JOURNAL_RING *ring, unsigned int first, uint64_t game, GAME_ROLE role,
+				 const char *name, size_t len) {
+	unsigned int n = 0;
+	for (size_t off = 0; off < len; off += JOURNAL_NAME_CHUNK, n++) {
+		JOURNAL_RECORD *rec = journal_slot(ring, first + n);
+		size_t chunk = len - off < JOURNAL_NAME_CHUNK ? len - off : JOURNAL_NAME_CHUNK;
+		memset(rec, 0, sizeof(*rec));
+		rec->type = JOURNAL_NAME;
+		rec->role = role;
+		rec->len = chunk;
+		rec->game = game;
+		memcpy(rec->text, name + off, chunk);
+	}
+	return n;
+}
+
+static unsigned int journal_chunks(size_t len) {
+	return (len + JOURNAL_NAME_CHUNK - 1) / JOURNAL_NAME_CHUNK;
+}
+
+uint64_t journal_game_start(const struct timespec *ts, const char *first, const char *second) {
+	if (!atomic_load_explicit(&journalOpen, memory_order_acquire)) {
+		return 0;
+	}
+	size_t len1 = strlen(first);
+	size_t len2 = strlen(second);
+	len1 = len1 < JOURNAL_MAX_NAME ? len1 : JOURNAL_MAX_NAME;
+	len2 = len2 < JOURNAL_MAX_NAME ? len2 : JOURNAL_MAX_NAME;
+	unsigned int n = 1 + journal_chunks(len1) + journal_chunks(len2);
+	JOURNAL_RING *ring = journal_reserve(n);
+	if (ring == NULL) {
+		return 0;
+	}
+	uint64_t game = atomic_fetch_add(&journal.nextGame, 1);
+	JOURNAL_RECORD *rec = journal_slot(ring, 0);
+	memset(rec, 0, sizeof(*rec));
+	rec->type = JOURNAL_START;
+	rec->game = game;
+	rec->arg[0] = len1;
+	rec->arg[1] = len2;
+	journal_stamp(rec, ts);
+	unsigned int i = 1;
+	i += journal_name(ring, i, game, FIRST_PLAYER_ROLE, first, len1);
+	i += journal_name(ring, i, game, SECOND_PLAYER_ROLE, second, len2);
+	journal_commit(ring, i);
+	return game;
+}
+
+void journal_game_move(const struct timespec *ts, uint64_t game, unsigned int ply, GAME_ROLE role,
+		       const GAME_MOVE *move) {
+	if (game == 0 || !atomic_load_explicit(&journalOpen, memory_order_acquire)) {
+		return;
+	}
+	JOURNAL_RING *ring = journal_reserve(1);
+	if (ring == NULL) {
+		return;
+	}
+	JOURNAL_RECORD *rec = journal_slot(ring, 0);
+	memset(rec, 0, sizeof(*rec));
+	rec->type = JOURNAL_MOVE;
+	rec->role = role;
+	rec->ply = ply;
+	rec->game = game;
+	rec->arg[0] = move->cell;
+	rec->arg[1] = move->piece;
+	journal_stamp(rec, ts);
+	journal_commit(ring, 1);
+}
+
+void journal_game_result(const struct timespec *ts, uint64_t game, unsigned int ply, GAME_ROLE winner,
+			 int resigned) {
+	if (game == 0 || !atomic_load_explicit(&journalOpen, memory_order_acquire)) {
+		return;
+	}
+	JOURNAL_RING *ring = journal_reserve(1);
+	if (ring == NULL) {
+		return;
+	}
+	JOURNAL_RECORD *rec = journal_slot(ring, 0);
+	memset(rec, 0, sizeof(*rec));
+	rec->type = JOURNAL_RESULT;
+	rec->role = winner;
+	rec->ply = ply;
+	rec->game = game;
+	rec->arg[0] = resigned != 0;
+	journal_stamp(rec, ts);
+	journal_commit(ring, 1);
+}
+
+/*
+ * The rings are kept until the process exits, since threads may still
+ * hold pointers to them.
+ */
+void journal_close(void) {
+	if (!atomic_load_explicit(&journalOpen, memory_order_acquire)) {
+		return;
+	}
+	atomic_store_explicit(&journalOpen, 0, memory_order_release);
+	pthread_mutex_lock(&journal.lock);
+	journal.closing = 1;
+	pthread_cond_signal(&journal.cond);
+	pthread_mutex_unlock(&journal.lock);
+	pthread_join(journal.thread, NULL);
+	if (fdatasync(journal.fd) == -1) {
+		fprintf(stderr, "Failed to sync game journal: %s\n", strerror(errno));
+	}
+	close(journal.fd);
+	journal.fd = -1;
+	free(journal.batch);
+	journal.batch = NULL;
+	debug("%ld: Game journal closed", pthread_self());
+}
@@ -12,8 +12,27 @@
 #include "debug.h"
 #include "protocol.h"
 #include "server.h"
+#include "reactor.h"
+#include "handler_pool.h"
+#include "jeux_service.h"
+#include "outq.h"
+#include "bot.h"
+#include "solver.h"
+#include "metrics.h"
+#include "rating_log.h"
+#include "journal.h"
+#include "trace.h"
+#include "player_store.h"
+#include "matchmaker.h"
+#include "cluster.h"
+#include "handoff.h"
+#include "timer.h"
+#include "game_ext.h"
+#include "client_ext.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
 #include "player_registry.h"
+#include "player_registry_ext.h"
 #include "jeux_globals.h"
 #include "semaphore.h"
 #include "csapp.h"
@@ -22,9 +41,17 @@
 int _debug_packets_ = 1;
 #endif
 
+#define USAGE "Usage: bin/jeux -p <port> [-e [-h <handlers>]] [-n <workers>] [-c <capacity>] [-q <packets>] [-b block|drop|disconnect] [-w <requests>] [-I <secs>] [-V <secs>] [-M <secs>] [-a <name>] [-m <port>] [-l <file> | -d <file>] [-j <file>] [-t <file>] [-g <game>] [-S <node> -P <links>] [-H <socket>]\n"
+
+#define SHUTDOWN_GRACE_MS 5000
+
 volatile sig_atomic_t done = 0;
 
+static PLAYER_STORE *player_store;
+static GAME_ENGINE game_engine;
+
 static void terminate(int status);
+static void start_bot(char *name, int useReactor);
 
 void sighup_handler(int sig, siginfo_t *info, void *context) {
     done = 1;
@@ -37,7 +64,51 @@ void sighup_handler(int sig, siginfo_t *info, void *context) {
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux -p <port> [-e [-h <handlers>]] [-n <workers>] [-c <capacity>]
+ *             [-q <packets>] [-b block|drop|disconnect] [-w <requests>]
+ *             [-I <secs>] [-V <secs>] [-M <secs>] [-a <name>] [-m <port>]
+ *             [-l <file> | -d <file>] [-j <file>] [-t <file>] [-g <game>]
+ *             [-S <node> -P <host>:<port>[,<host>:<port>...]] [-H <socket>]
+ *
+ * With -e, connections are serviced by a fixed pool of event-driven
+ * reactor workers (one per online CPU, unless -n is given) instead of
+ * by one thread per connection.  With -h as well, the reactor workers
+ * only read and frame requests, which are handled by the given number of
+ * handler workers, each pinned to a CPU, that steal work from each other
+ * and handle the requests concerning one game together.  -c sets the
+ * maximum number of simultaneously connected clients (default
+ * MAX_CLIENTS).  -q sets the number of packets that can be queued for
+ * sending to each client, and -b what happens when a client falls that
+ * far behind: the sender waits, the packet is dropped, or the client is
+ * disconnected.  Waiting loses nothing, and is the default for threads
+ * per connection, where only the sender waits; with -e the client is
+ * disconnected by default instead, since a reactor or handler worker that
+ * waited would hold up every other connection it serves.
+ * -w sets how many responses to a client may be waiting to be written
+ * before no more of its pipelined requests are handled (default
+ * JEUX_PIPELINE_DEFAULT).  -I disconnects a client from which nothing
+ * has been received for the given number of seconds, -V withdraws an
+ * invitation that has been open for that long, and -M resigns a game for
+ * a player who has had the move for that long; by default there are no
+ * timeouts.
+ * -a starts a computer opponent that plays perfectly, logged in under the
+ * given user name, which accepts every invitation sent to it.  -m
+ * serves a report of the server's metrics to every connection made to
+ * the given port; the same report is written to stderr on SIGUSR1.  -l
+ * keeps players' ratings in the given log, so that they are restored
+ * when the server is restarted.  -d instead keeps all players and their
+ * ratings in the given memory-mapped player store.  -j records every
+ * game started, move made and result in the given binary journal, which
+ * bin/jeux_replay reads.  -t traces reference counting, the
+ * registration of clients and the packets received and sent, into
+ * per-thread rings that are written to the given file on SIGUSR2 and on
+ * termination, to be decoded by bin/jeux_tracedump.  -S and -P make the
+ * server one node of a cluster that shares the port given by -p: -S is
+ * the number of this node, and -P lists the addresses on which the nodes
+ * accept links from each other, in order of node number.  -H allows a
+ * restart without dropping connections: a server started with the same
+ * Unix-domain socket while this one is running takes over its listening
+ * socket, clients, games and ratings, and this one then exits.
  */
 int main(int argc, char* argv[]){
     struct sigaction act;
@@ -55,30 +126,180 @@ int main(int argc, char* argv[]){
     act3.sa_handler = SIG_IGN;
     act3.sa_flags = -1;
     sigaction(SIGPIPE, &act3, NULL);
+    // Metrics are dumped by a thread of their own on SIGUSR1, and the
+    // trace on SIGUSR2, which must be started before any other thread so
+    // that they all inherit the blocked signals.
+    trace_dump_on_signal(SIGUSR2);
+    metrics_dump_on_signal(SIGUSR1);
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
+    // Option '-e' selects the event-driven reactor, '-n <workers>'
+    // sets the size of its worker pool, and '-h <handlers>' that of a
+    // pool of workers to handle the requests it reads.  Option
+    // '-c <capacity>' sets the maximum number of connected clients.  Options '-q <packets>' and
+    // '-b <policy>' configure the per-client outbound queues, and
+    // '-w <requests>' the in-flight limit of each connection.  Options
+    // '-I <secs>', '-V <secs>' and '-M <secs>' set the idle, invitation
+    // and move timeouts.  Option
+    // '-a <name>' starts a computer opponent under that user name, and
+    // '-m <port>' serves the metrics report on an administrative port.
+    // Option '-l <file>' restores and records ratings in a log, and
+    // '-d <file>' keeps players in a player store.  Option '-j <file>'
+    // records games in a journal, and '-t <file>' traces events into a
+    // trace file.  Option '-g <game>' selects the game
+    // played, such as "gomoku" or "19x19:6".  Options
+    // '-S <node>' and '-P <links>' make this server a node of a cluster.
+    // Option '-H <socket>' hands the server over to a successor started
+    // with the same socket, taking over from a predecessor if there is one.
     int opt;
     char *port = NULL;
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    int useReactor = 0;
+    int numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int numHandlers = 0;
+    int capacity = MAX_CLIENTS;
+    int queueCapacity = OUTQ_DEFAULT_CAPACITY;
+    char *queuePolicyName = NULL;
+    int pipelineDepth = JEUX_PIPELINE_DEFAULT;
+    int idleTimeout = 0;
+    int inviteTimeout = 0;
+    int moveTimeout = 0;
+    char *botName = NULL;
+    char *metricsPort = NULL;
+    char *ratingLog = NULL;
+    char *storePath = NULL;
+    char *journalPath = NULL;
+    char *tracePath = NULL;
+    char *gameSpec = NULL;
+    int clusterNode = -1;
+    char *clusterLinks = NULL;
+    char *handoffPath = NULL;
+    while ((opt = getopt(argc, argv, "p:eh:n:c:q:b:w:I:V:M:a:m:l:d:j:t:g:S:P:H:")) != -1) {
         switch (opt) {
         case 'p':
             port = optarg;
             break;
+        case 'e':
+            useReactor = 1;
+            break;
+        case 'h':
+            numHandlers = atoi(optarg);
+            break;
+        case 'n':
+            numWorkers = atoi(optarg);
+            break;
+        case 'c':
+            capacity = atoi(optarg);
+            break;
+        case 'q':
+            queueCapacity = atoi(optarg);
+            break;
+        case 'b':
+            queuePolicyName = optarg;
+            break;
+        case 'w':
+            pipelineDepth = atoi(optarg);
+            break;
+        case 'I':
+            idleTimeout = atoi(optarg);
+            break;
+        case 'V':
+            inviteTimeout = atoi(optarg);
+            break;
+        case 'M':
+            moveTimeout = atoi(optarg);
+            break;
+        case 'a':
+            botName = optarg;
+            break;
+        case 'm':
+            metricsPort = optarg;
+            break;
+        case 'l':
+            ratingLog = optarg;
+            break;
+        case 'd':
+            storePath = optarg;
+            break;
+        case 'j':
+            journalPath = optarg;
+            break;
+        case 't':
+            tracePath = optarg;
+            break;
+        case 'g':
+            gameSpec = optarg;
+            break;
+        case 'S':
+            clusterNode = atoi(optarg);
+            break;
+        case 'P':
+            clusterLinks = optarg;
+            break;
+        case 'H':
+            handoffPath = optarg;
+            break;
        default: /* '?' */
-            fprintf(stdout, "Usage: bin/jeux -p <port>\n");
+            fprintf(stdout, USAGE);
             exit(EXIT_SUCCESS);
        }
     }
 
-    if (port == NULL) {
-        fprintf(stdout, "Usage: bin/jeux -p <port>\n");
+    // A reactor worker must not wait for a slow reader, as explained above.
+    int queuePolicy = queuePolicyName != NULL ? outq_parse_policy(queuePolicyName)
+        : useReactor ? OUTQ_DISCONNECT : OUTQ_BLOCK;
+    if (port == NULL || numWorkers < 1 || numHandlers < 0 || (numHandlers > 0 && !useReactor)
+        || capacity < 1 || pipelineDepth < 1
+        || idleTimeout < 0 || inviteTimeout < 0 || moveTimeout < 0 || (ratingLog != NULL && storePath != NULL)
+        || outq_configure(queueCapacity, queuePolicy) == -1
+        || (gameSpec != NULL && game_engine_init(&game_engine, gameSpec) == -1)
+        || ((clusterNode != -1 || clusterLinks != NULL)
+            && (clusterLinks == NULL || cluster_configure(clusterNode, clusterLinks) == -1))
+        || (handoffPath != NULL && cluster_enabled())) {
+        fprintf(stdout, USAGE);
         exit(EXIT_SUCCESS);
     }
+    jeux_service_configure(pipelineDepth);
+    client_set_timeouts(idleTimeout, inviteTimeout, moveTimeout);
+    if (tracePath != NULL) {
+        trace_configure(tracePath);
+    }
+    if (gameSpec != NULL) {
+        game_set_engine(&game_engine);
+    }
+    // A predecessor keeps running until it has handed everything over, so
+    // it is waited for before the rating log or player store is opened.
+    if (handoffPath != NULL) {
+        handoff_configure(handoffPath);
+        if (handoff_receive() == -1) {
+            fprintf(stderr, "Failed to take over from the server on %s\n", handoffPath);
+            exit(EXIT_FAILURE);
+        }
+    }
     // Perform required initializations of the client_registry and
     // player_registry.
-    client_registry = creg_init();
+    client_registry = creg_init_capacity(capacity);
     player_registry = preg_init();
+    if (ratingLog != NULL && rating_log_open(ratingLog, player_registry) == -1) {
+        fprintf(stderr, "Failed to open rating log %s\n", ratingLog);
+        exit(EXIT_FAILURE);
+    }
+    if (storePath != NULL) {
+        player_store = pstore_open(storePath);
+        if (player_store == NULL || preg_attach_store(player_registry, player_store) == -1) {
+            fprintf(stderr, "Failed to open player store %s\n", storePath);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (journalPath != NULL && journal_open(journalPath) == -1) {
+        fprintf(stderr, "Failed to open game journal %s\n", journalPath);
+        exit(EXIT_FAILURE);
+    }
+    solver_init();
+    if (matchmaker_start() == -1) {
+        fprintf(stderr, "Failed to start matchmaker\n");
+        exit(EXIT_FAILURE);
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -90,18 +311,83 @@ int main(int argc, char* argv[]){
     struct sockaddr_storage clientaddr;
     pthread_t tid;
 
-    listenfd = Open_listenfd(port);
+    if (metricsPort != NULL && metrics_serve(metricsPort) == -1) {
+        fprintf(stderr, "Failed to listen for metrics on port %s\n", metricsPort);
+        terminate(EXIT_FAILURE);
+    }
+    if (numHandlers > 0 && hpool_start(numHandlers) == -1) {
+        fprintf(stderr, "Failed to start handler workers\n");
+        terminate(EXIT_FAILURE);
+    }
+    if (useReactor && reactor_start(numWorkers) == -1) {
+        fprintf(stderr, "Failed to start reactor\n");
+        terminate(EXIT_FAILURE);
+    }
+    if (cluster_enabled()) {
+        if (cluster_start() == -1) {
+            fprintf(stderr, "Failed to start cluster links\n");
+            terminate(EXIT_FAILURE);
+        }
+        listenfd = cluster_listen(port);
+        if (listenfd == -1) {
+            fprintf(stderr, "Failed to listen on port %s\n", port);
+            terminate(EXIT_FAILURE);
+        }
+    } else if ((listenfd = handoff_listenfd()) == -1) {
+        listenfd = Open_listenfd(port);
+    }
     debug("%ld: Jeux server listening on port %s", pthread_self(), port);
-    done = 0;
-    while(!done) {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = malloc(sizeof(int));
-        *connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen);
-        if (*connfdp != -1) {
-            pthread_create(&tid, NULL, jeux_client_service, connfdp);
+    if (handoff_restore(client_registry, player_registry, useReactor) == -1) {
+        fprintf(stderr, "Failed to restore the state handed over\n");
+        terminate(EXIT_FAILURE);
+    }
+    if (handoff_start(listenfd) == -1) {
+        fprintf(stderr, "Failed to listen for a successor on %s\n", handoffPath);
+        terminate(EXIT_FAILURE);
+    }
+    if (botName != NULL) {
+        start_bot(botName, useReactor);
+    }
+    while (1) {
+        done = 0;
+        while(!done && useReactor) {
+            clientlen = sizeof(struct sockaddr_storage);
+            int connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+            if (connfd != -1) {
+                reactor_add(connfd);
+            }
+        }
+        while(!done && !useReactor) {
+            clientlen = sizeof(struct sockaddr_storage);
+            int connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+            if (connfd != -1) {
+                connfdp = malloc(sizeof(int));
+                *connfdp = connfd;
+                handoff_service_starting();
+                pthread_create(&tid, NULL, jeux_client_service, connfdp);
+            }
+        }
+        if (!handoff_pending()) {
+            break;
+        }
+        if (handoff_hand_over(client_registry, player_registry) == 0) {
+            // The successor now owns every connection, which must be left
+            // as they are, so only the rating log, player store and journal
+            // are closed.
+            rating_log_close();
+            journal_close();
+            if (player_store != NULL) {
+                pstore_close(player_store);
+            }
+            trace_dump();
+            debug("%ld: Jeux server handed over", pthread_self());
+            exit(EXIT_SUCCESS);
+        }
+        // The handoff failed, and may have closed the computer opponent.
+        if (botName != NULL) {
+            start_bot(botName, useReactor);
         }
     }
-    free(connfdp);
     if (done == 1) {
         terminate(EXIT_SUCCESS);
     }
@@ -111,20 +397,76 @@ int main(int argc, char* argv[]){
     terminate(EXIT_FAILURE);
 }
 
+/*
+ * Start the computer opponent and service its connection, unless it is
+ * already logged in.  Its connection is closed rather than handed over
+ * to a successor, as its thread cannot be.
+ */
+static void start_bot(char *name, int useReactor) {
+    CLIENT *client = creg_lookup(client_registry, name);
+    if (client != NULL) {
+        client_unref(client, "after checking for computer opponent");
+        return;
+    }
+    int botfd = bot_start(name);
+    if (botfd == -1) {
+        fprintf(stderr, "Failed to start bot\n");
+        terminate(EXIT_FAILURE);
+    }
+    handoff_exclude(botfd);
+    client_exempt_idle(botfd);
+    if (useReactor) {
+        reactor_add(botfd);
+    } else {
+        int *connfdp = malloc(sizeof(int));
+        pthread_t tid;
+        *connfdp = botfd;
+        handoff_service_starting();
+        pthread_create(&tid, NULL, jeux_client_service, connfdp);
+    }
+}
+
+/*
+ * Cut off the clients that have not closed their connections within
+ * SHUTDOWN_GRACE_MS of being asked to.
+ */
+static void abort_clients(void *arg) {
+    debug("%ld: Aborting connections of remaining clients", pthread_self());
+    creg_abort_all(arg);
+}
+
 /*
  * Function called to cleanly shut down the server.
  */
 void terminate(int status) {
     // Shutdown all client connections.
     // This will trigger the eventual termination of service threads.
+    // A client that never closes its end would keep its service thread
+    // waiting, so after a grace period the connections are shut down for
+    // reading as well.
+    static TIMER abortTimer;
     creg_shutdown_all(client_registry);
+    timer_init(&abortTimer, abort_clients, client_registry);
+    timer_schedule(&abortTimer, timer_now() + SHUTDOWN_GRACE_MS);
     debug("%ld: Waiting for service threads to terminate...", pthread_self());
     creg_wait_for_empty(client_registry);
     debug("%ld: All service threads terminated.", pthread_self());
+    // No timer may fire once the modules are being finalized.
+    timer_cancel(&abortTimer);
+    timer_pause();
+    matchmaker_stop();
+    cluster_stop();
 
-    // Finalize modules.
+    // Finalize modules.  No more results can be posted, so the rating
+    // log and the game journal can be flushed and closed.
+    rating_log_close();
+    journal_close();
+    trace_dump();
     creg_fini(client_registry);
     preg_fini(player_registry);
+    if (player_store != NULL) {
+        pstore_close(player_store);
+    }
 
     debug("%ld: Jeux server terminating", pthread_self());
     exit(status);
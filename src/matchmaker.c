@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "matchmaker.h"
+#include "client_ext.h"
+#include "player.h"
+#include "metrics.h"
+#include "slab.h"
+#include "debug.h"
+
+/*
+ * A queued client.  An entry stays attached to its CLIENT, through
+ * client_set_match(), from the time the client is queued until it has
+ * been matched or has left, including while the matchmaking thread has
+ * it out of the queue trying to start a game.  A client that leaves at
+ * that point is only marked as cancelled, and its entry is discarded
+ * once the attempt is over.
+ */
+struct match_entry {
+	CLIENT *client;
+	int bucket;
+	uint64_t queued;
+	int inFlight;
+	int cancelled;
+	int failures;			/* attempts that failed through nobody's fault */
+	MATCH_ENTRY *prev;
+	MATCH_ENTRY *next;
+};
+
+static SLAB matchSlab = SLAB_INITIALIZER(MATCH_ENTRY, NULL);
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	MATCH_ENTRY *heads[MATCH_NUM_BUCKETS];
+	MATCH_ENTRY *tails[MATCH_NUM_BUCKETS];
+	int count;
+	int running;
+	int stopping;
+	pthread_t thread;
+} mm = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Add an entry at the back of its bucket, or at the front for one that
+ * is being put back after a failed attempt.  The lock must be held.
+ */
+static void matchmaker_insert(MATCH_ENTRY *entry, int atFront) {
+	int b = entry->bucket;
+	if (atFront) {
+		entry->prev = NULL;
+		entry->next = mm.heads[b];
+		if (mm.heads[b] != NULL) {
+			mm.heads[b]->prev = entry;
+		} else {
+			mm.tails[b] = entry;
+		}
+		mm.heads[b] = entry;
+	} else {
+		entry->next = NULL;
+		entry->prev = mm.tails[b];
+		if (mm.tails[b] != NULL) {
+			mm.tails[b]->next = entry;
+		} else {
+			mm.heads[b] = entry;
+		}
+		mm.tails[b] = entry;
+	}
+	mm.count++;
+}
+
+/*
+ * Unlink an entry from its bucket.  The lock must be held.
+ */
+static void matchmaker_unlink(MATCH_ENTRY *entry) {
+	int b = entry->bucket;
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		mm.heads[b] = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		mm.tails[b] = entry->prev;
+	}
+	mm.count--;
+}
+
+/*
+ * Discard entries chained through their next fields, once they have
+ * been detached from their clients.  This is done without the lock, as
+ * the last reference to a CLIENT may be released.
+ */
+static void matchmaker_free(MATCH_ENTRY *list) {
+	while (list != NULL) {
+		MATCH_ENTRY *next = list->next;
+		client_unref(list->client, "because client has left the matchmaking queue");
+		slab_free(&matchSlab, list);
+		metrics_gauge_add(METRICS_MATCHING, -1);
+		list = next;
+	}
+}
+
+int matchmaker_enqueue(CLIENT *client) {
+	PLAYER *player = client_get_player(client);
+	if (player == NULL) {
+		return -1;
+	}
+	int bucket = player_get_rating(player) / MATCH_BUCKET_WIDTH;
+	if (bucket < 0) {
+		bucket = 0;
+	} else if (bucket >= MATCH_NUM_BUCKETS) {
+		bucket = MATCH_NUM_BUCKETS - 1;
+	}
+	pthread_mutex_lock(&mm.lock);
+	if (!mm.running || mm.stopping || client_get_match(client) != NULL) {
+		pthread_mutex_unlock(&mm.lock);
+		return -1;
+	}
+	MATCH_ENTRY *entry = slab_alloc(&matchSlab);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&mm.lock);
+		return -1;
+	}
+	entry->client = client_ref(client, "for matchmaking queue");
+	entry->bucket = bucket;
+	entry->queued = metrics_now();
+	entry->inFlight = 0;
+	entry->cancelled = 0;
+	entry->failures = 0;
+	client_set_match(client, entry);
+	matchmaker_insert(entry, 0);
+	metrics_gauge_add(METRICS_MATCHING, 1);
+	debug("%ld: Client %p queued for matchmaking in bucket %d", pthread_self(), client, bucket);
+	if (mm.count >= 2) {
+		pthread_cond_signal(&mm.cond);
+	}
+	pthread_mutex_unlock(&mm.lock);
+	return 0;
+}
+
+void matchmaker_cancel(CLIENT *client) {
+	pthread_mutex_lock(&mm.lock);
+	MATCH_ENTRY *entry = client_get_match(client);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&mm.lock);
+		return;
+	}
+	if (entry->inFlight) {
+		entry->cancelled = 1;
+		pthread_mutex_unlock(&mm.lock);
+		return;
+	}
+	matchmaker_unlink(entry);
+	client_set_match(client, NULL);
+	pthread_mutex_unlock(&mm.lock);
+	entry->next = NULL;
+	matchmaker_free(entry);
+}
+
+/*
+ * Take a pair out of the queue, the one that has waited longer first,
+ * since it will play first.  The lock must be held.
+ */
+static void matchmaker_take(MATCH_ENTRY *a, MATCH_ENTRY *b, MATCH_ENTRY *pair[2]) {
+	matchmaker_unlink(a);
+	matchmaker_unlink(b);
+	a->inFlight = 1;
+	b->inFlight = 1;
+	pair[0] = a->queued <= b->queued ? a : b;
+	pair[1] = pair[0] == a ? b : a;
+}
+
+/*
+ * Choose a batch of pairs: first clients queued in the same bucket,
+ * taken in the order they arrived, and then the clients left one to a
+ * bucket, each with the next one up if their buckets are close enough
+ * given how long they have waited.  The lock must be held.
+ *
+ * @return  The number of pairs chosen.
+ */
+static int matchmaker_pair(MATCH_ENTRY *pairs[][2], uint64_t now) {
+	int n = 0;
+	for (int b = 0; b < MATCH_NUM_BUCKETS; b++) {
+		while (n < MATCH_BATCH && mm.heads[b] != NULL && mm.heads[b]->next != NULL) {
+			matchmaker_take(mm.heads[b], mm.heads[b]->next, pairs[n++]);
+		}
+	}
+	MATCH_ENTRY *single = NULL;
+	for (int b = 0; b < MATCH_NUM_BUCKETS && n < MATCH_BATCH; b++) {
+		MATCH_ENTRY *entry = mm.heads[b];
+		if (entry == NULL) {
+			continue;
+		}
+		if (single != NULL) {
+			uint64_t oldest = single->queued < entry->queued ? single->queued : entry->queued;
+			uint64_t window = 1 + (now - oldest) / (MATCH_WIDEN_MS * 1000000ULL);
+			if ((uint64_t)(b - single->bucket) <= window) {
+				matchmaker_take(single, entry, pairs[n++]);
+				single = NULL;
+				continue;
+			}
+		}
+		single = entry;
+	}
+	return n;
+}
+
+/*
+ * Thread function for the matchmaker.  Games are started without the
+ * lock held, since that takes the locks of the clients, and each entry
+ * is then either discarded or put back at the front of its bucket to be
+ * tried again.  A client on whose account a game could not be started,
+ * such as one with no free invitation ID, would fail again with the
+ * next opponent too, so it is sent a NACK and leaves the queue instead,
+ * while its partner is put back; so does one whose attempts have failed
+ * MATCH_MAX_FAILURES times through nobody's fault.
+ */
+static void *matchmaker_thread(void *arg) {
+	static MATCH_ENTRY *pairs[MATCH_BATCH][2];
+	static int results[MATCH_BATCH];
+	static CLIENT *failed[MATCH_BATCH];
+	pthread_mutex_lock(&mm.lock);
+	while (1) {
+		while (mm.count < 2 && !mm.stopping) {
+			pthread_cond_wait(&mm.cond, &mm.lock);
+		}
+		if (mm.stopping) {
+			break;
+		}
+		// Give further clients a chance to join the batch.
+		pthread_mutex_unlock(&mm.lock);
+		struct timespec interval = { 0, MATCH_INTERVAL_MS * 1000000L };
+		nanosleep(&interval, NULL);
+		pthread_mutex_lock(&mm.lock);
+		int n = matchmaker_pair(pairs, metrics_now());
+		pthread_mutex_unlock(&mm.lock);
+		int started = 0;
+		for (int i = 0; i < n; i++) {
+			results[i] = client_make_match(pairs[i][0]->client, pairs[i][1]->client, &failed[i]);
+			started += results[i] == 0;
+		}
+		MATCH_ENTRY *done = NULL;
+		MATCH_ENTRY *refused = NULL;
+		pthread_mutex_lock(&mm.lock);
+		for (int i = 0; i < n; i++) {
+			for (int j = 1; j >= 0; j--) {
+				MATCH_ENTRY *entry = pairs[i][j];
+				entry->inFlight = 0;
+				if (results[i] == 0 || entry->cancelled) {
+					client_set_match(entry->client, NULL);
+					entry->next = done;
+					done = entry;
+				} else if (failed[i] == entry->client
+					   || (failed[i] == NULL && ++entry->failures >= MATCH_MAX_FAILURES)) {
+					client_set_match(entry->client, NULL);
+					entry->next = refused;
+					refused = entry;
+				} else {
+					matchmaker_insert(entry, 1);
+				}
+			}
+		}
+		pthread_mutex_unlock(&mm.lock);
+		debug("%ld: Matchmaker started %d of %d games", pthread_self(), started, n);
+		for (MATCH_ENTRY *entry = refused; entry != NULL; entry = entry->next) {
+			debug("%ld: Client %p could not be matched and leaves the queue", pthread_self(), entry->client);
+			client_send_nack(entry->client);
+		}
+		matchmaker_free(done);
+		matchmaker_free(refused);
+		pthread_mutex_lock(&mm.lock);
+	}
+	pthread_mutex_unlock(&mm.lock);
+	return NULL;
+}
+
+int matchmaker_start(void) {
+	pthread_mutex_lock(&mm.lock);
+	if (mm.running) {
+		pthread_mutex_unlock(&mm.lock);
+		return 0;
+	}
+	if (pthread_create(&mm.thread, NULL, matchmaker_thread, NULL) != 0) {
+		pthread_mutex_unlock(&mm.lock);
+		return -1;
+	}
+	mm.running = 1;
+	pthread_mutex_unlock(&mm.lock);
+	return 0;
+}
+
+/*
+ * The queue is left as it is, and matchmaker_start() picks up where the
+ * thread stopped.
+ */
+void matchmaker_pause(void) {
+	pthread_mutex_lock(&mm.lock);
+	if (!mm.running) {
+		pthread_mutex_unlock(&mm.lock);
+		return;
+	}
+	mm.stopping = 1;
+	pthread_cond_signal(&mm.cond);
+	pthread_mutex_unlock(&mm.lock);
+	pthread_join(mm.thread, NULL);
+	pthread_mutex_lock(&mm.lock);
+	mm.stopping = 0;
+	mm.running = 0;
+	pthread_mutex_unlock(&mm.lock);
+}
+
+int matchmaker_is_queued(CLIENT *client) {
+	pthread_mutex_lock(&mm.lock);
+	int queued = client_get_match(client) != NULL;
+	pthread_mutex_unlock(&mm.lock);
+	return queued;
+}
+
+void matchmaker_stop(void) {
+	pthread_mutex_lock(&mm.lock);
+	if (!mm.running) {
+		pthread_mutex_unlock(&mm.lock);
+		return;
+	}
+	mm.stopping = 1;
+	pthread_cond_signal(&mm.cond);
+	pthread_mutex_unlock(&mm.lock);
+	pthread_join(mm.thread, NULL);
+	MATCH_ENTRY *done = NULL;
+	pthread_mutex_lock(&mm.lock);
+	for (int b = 0; b < MATCH_NUM_BUCKETS; b++) {
+		while (mm.heads[b] != NULL) {
+			MATCH_ENTRY *entry = mm.heads[b];
+			matchmaker_unlink(entry);
+			client_set_match(entry->client, NULL);
+			entry->next = done;
+			done = entry;
+		}
+	}
+	mm.running = 0;
+	pthread_mutex_unlock(&mm.lock);
+	matchmaker_free(done);
+}
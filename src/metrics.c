@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define METRICS_SHARDS 16
+#define METRICS_PACKET_TYPES (JEUX_UNWATCH_PKT + 1)
+
+/*
+ * A histogram that can be updated concurrently, with the same buckets
+ * as a HISTOGRAM.
+ */
+typedef struct metrics_hist {
+	atomic_ulong count;
+	atomic_ulong sum;
+	atomic_ulong max;
+	atomic_ulong buckets[HISTOGRAM_BUCKETS];
+} METRICS_HIST;
+
+typedef struct metrics_shard {
+	METRICS_HIST packets[METRICS_PACKET_TYPES];
+	METRICS_HIST lockWaits[METRICS_NUM_LOCKS];
+	atomic_ulong lockAcquired[METRICS_NUM_LOCKS];
+} __attribute__((aligned(64))) METRICS_SHARD;
+
+static METRICS_SHARD shards[METRICS_SHARDS];
+static atomic_long gauges[METRICS_NUM_GAUGES];
+static atomic_uint nextShard;
+static __thread METRICS_SHARD *threadShard;
+
+static const char *metrics_packet_names[METRICS_PACKET_TYPES] = {
+	"NONE", "LOGIN", "USERS", "INVITE", "REVOKE", "ACCEPT", "DECLINE", "MOVE", "RESIGN",
+	"ACK", "NACK", "INVITED", "REVOKED", "ACCEPTED", "DECLINED", "MOVED", "RESIGNED", "ENDED",
+	"HINT", "MATCH", "WATCH", "UNWATCH"
+};
+
+static const char *metrics_lock_names[METRICS_NUM_LOCKS] = {
+	"client", "client_registry", "player_registry"
+};
+
+static const char *metrics_gauge_names[METRICS_NUM_GAUGES] = {
+	"connections", "games", "matching", "remote_clients", "watchers"
+};
+
+static METRICS_SHARD *metrics_shard(void) {
+	if (threadShard == NULL) {
+		threadShard = &shards[atomic_fetch_add_explicit(&nextShard, 1, memory_order_relaxed) % METRICS_SHARDS];
+	}
+	return threadShard;
+}
+
+static void metrics_hist_record(METRICS_HIST *h, uint64_t value) {
+	atomic_fetch_add_explicit(&h->buckets[histogram_bucket(value)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+	unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+								      memory_order_relaxed, memory_order_relaxed)) {
+		continue;
+	}
+}
+
+/*
+ * Add the counts of a shard's histogram into a HISTOGRAM.
+ */
+static void metrics_hist_merge(HISTOGRAM *into, METRICS_HIST *from) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		into->buckets[i] += atomic_load_explicit(&from->buckets[i], memory_order_relaxed);
+	}
+	into->count += atomic_load_explicit(&from->count, memory_order_relaxed);
+	into->sum += atomic_load_explicit(&from->sum, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+	if (max > into->max) {
+		into->max = max;
+	}
+}
+
+uint64_t metrics_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_packet(int type, uint64_t start) {
+	if (type < 0 || type >= METRICS_PACKET_TYPES) {
+		type = JEUX_NO_PKT;
+	}
+	metrics_hist_record(&metrics_shard()->packets[type], metrics_now() - start);
+}
+
+void metrics_mutex_lock(pthread_mutex_t *lock, METRICS_LOCK kind) {
+	METRICS_SHARD *shard = metrics_shard();
+	atomic_fetch_add_explicit(&shard->lockAcquired[kind], 1, memory_order_relaxed);
+	if (pthread_mutex_trylock(lock) == 0) {
+		return;
+	}
+	uint64_t start = metrics_now();
+	pthread_mutex_lock(lock);
+	metrics_hist_record(&shard->lockWaits[kind], metrics_now() - start);
+}
+
+void metrics_sem_wait(sem_t *sem, METRICS_LOCK kind) {
+	METRICS_SHARD *shard = metrics_shard();
+	atomic_fetch_add_explicit(&shard->lockAcquired[kind], 1, memory_order_relaxed);
+	if (sem_trywait(sem) == 0) {
+		return;
+	}
+	uint64_t start = metrics_now();
+	P(sem);
+	metrics_hist_record(&shard->lockWaits[kind], metrics_now() - start);
+}
+
+void metrics_gauge_add(METRICS_GAUGE gauge, long delta) {
+	atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+static void metrics_report_hist(FILE *f, HISTOGRAM *h) {
+	fprintf(f, "%10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", h->count,
+		h->count > 0 ? (double)h->sum / h->count / 1e3 : 0.0,
+		histogram_percentile(h, 0.50) / 1e3, histogram_percentile(h, 0.99) / 1e3,
+		histogram_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+char *metrics_report(size_t *lenp) {
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, lenp);
+	HISTOGRAM *h = malloc(sizeof(HISTOGRAM));
+	if (f == NULL || h == NULL) {
+		if (f != NULL) {
+			fclose(f);
+		}
+		free(buf);
+		free(h);
+		return NULL;
+	}
+	for (int g = 0; g < METRICS_NUM_GAUGES; g++) {
+		fprintf(f, "%-16s %10ld\n", metrics_gauge_names[g], atomic_load(&gauges[g]));
+	}
+	fprintf(f, "\n%-16s %10s %10s %10s %10s %10s %10s\n", "packet", "count", "mean_us",
+		"p50_us", "p99_us", "p999_us", "max_us");
+	for (int type = 0; type < METRICS_PACKET_TYPES; type++) {
+		histogram_init(h);
+		for (int s = 0; s < METRICS_SHARDS; s++) {
+			metrics_hist_merge(h, &shards[s].packets[type]);
+		}
+		if (h->count > 0) {
+			fprintf(f, "%-16s ", metrics_packet_names[type]);
+			metrics_report_hist(f, h);
+		}
+	}
+	fprintf(f, "\n%-16s %10s %10s %10s %10s %10s %10s %10s\n", "lock", "acquired", "waited",
+		"mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+	for (int kind = 0; kind < METRICS_NUM_LOCKS; kind++) {
+		histogram_init(h);
+		unsigned long acquired = 0;
+		for (int s = 0; s < METRICS_SHARDS; s++) {
+			metrics_hist_merge(h, &shards[s].lockWaits[kind]);
+			acquired += atomic_load_explicit(&shards[s].lockAcquired[kind], memory_order_relaxed);
+		}
+		fprintf(f, "%-16s %10lu ", metrics_lock_names[kind], acquired);
+		metrics_report_hist(f, h);
+	}
+	free(h);
+	if (fclose(f) == EOF) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void *metrics_signal_thread(void *arg) {
+	sigset_t *set = arg;
+	pthread_detach(pthread_self());
+	while (1) {
+		int sig;
+		if (sigwait(set, &sig) != 0) {
+			continue;
+		}
+		size_t len;
+		char *report = metrics_report(&len);
+		if (report != NULL) {
+			rio_writen(STDERR_FILENO, report, len);
+			free(report);
+		}
+	}
+	return NULL;
+}
+
+int metrics_dump_on_signal(int sig) {
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, sig);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+		return -1;
+	}
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, metrics_signal_thread, &set) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static void *metrics_thread(void *arg) {
+	int listenfd = (int)(long)arg;
+	pthread_detach(pthread_self());
+	while (1) {
+		int fd = accept(listenfd, NULL, NULL);
+		if (fd == -1) {
+			continue;
+		}
+		size_t len;
+		char *report = metrics_report(&len);
+		if (report != NULL) {
+			rio_writen(fd, report, len);
+			free(report);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+int metrics_serve(char *port) {
+	int listenfd = open_listenfd(port);
+	if (listenfd < 0) {
+		return -1;
+	}
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, metrics_thread, (void *)(long)listenfd) != 0) {
+		close(listenfd);
+		return -1;
+	}
+	debug("%ld: Metrics available on port %s", pthread_self(), port);
+	return 0;
+}
@@ -0,0 +1,588 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "outq.h"
+#include "packet_pool.h"
+#include "refcount.h"
+#include "debug.h"
+
+#define OUTQ_BATCH 32
+#define OUTQ_FLUSHER_EVENTS 64
+
+/*
+ * A queued packet.  The payload either follows the message in the same
+ * allocation, or is shared and released through a callback.
+ */
+typedef struct outq_msg {
+	JEUX_PACKET_HEADER hdr;
+	const void *data;
+	size_t len;
+	void (*release)(void *);
+	void *arg;
+	char payload[];
+} OUTQ_MSG;
+
+/*
+ * A cell of the ring.  The sequence number tells producers and the
+ * consumer whose turn it is to use the cell (Vyukov's bounded queue).
+ */
+typedef struct outq_cell {
+	atomic_size_t seq;
+	OUTQ_MSG *msg;
+} OUTQ_CELL;
+
+struct outq {
+	int fd;
+	REFCOUNT count;
+	atomic_size_t head;		// next position for producers
+	size_t tail;			// next position for the drainer
+	size_t mask;
+	OUTQ_CELL *cells;
+	atomic_int draining;		// held by exactly one drainer
+	atomic_int parked;		// set while waiting in the flusher
+	atomic_int dead;		// no further output will be written
+	atomic_int corked;		// producers leave writing to outq_uncork()
+	atomic_int backlog;		// messages queued and not yet retired
+	int registered;			// fd has been added to the flusher
+	// Messages taken off the ring but not yet completely written,
+	// owned by the drainer.
+	OUTQ_MSG *inflight[OUTQ_BATCH];
+	int numInflight;
+	size_t offset;			// bytes of inflight[0] already written
+	// Producers waiting for space, under OUTQ_BLOCK.
+	atomic_int waiters;
+	pthread_mutex_t spaceMutex;
+	pthread_cond_t spaceCond;
+	OUTQ *nextRetired;
+};
+
+static size_t queueCapacity = OUTQ_DEFAULT_CAPACITY;
+static OUTQ_POLICY queuePolicy = OUTQ_BLOCK;
+
+/*
+ * The flusher thread, which finishes writing queues whose sockets were
+ * full.  Queues being shut down are handed back to it to release its
+ * reference, which it does only between batches of events, so that an
+ * event already returned by epoll_wait() never refers to a freed queue.
+ */
+static struct {
+	pthread_once_t once;
+	int epfd;
+	int wakefd;
+	pthread_mutex_t retireMutex;
+	OUTQ *retired;
+} flusher = { PTHREAD_ONCE_INIT, -1, -1, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static void outq_drain(OUTQ *q);
+
+int outq_configure(int capacity, OUTQ_POLICY policy) {
+	if (capacity < 1 || (policy != OUTQ_BLOCK && policy != OUTQ_DROP && policy != OUTQ_DISCONNECT)) {
+		return -1;
+	}
+	size_t cap = 1;
+	while (cap < (size_t)capacity) {
+		cap <<= 1;
+	}
+	queueCapacity = cap;
+	queuePolicy = policy;
+	return 0;
+}
+
+int outq_parse_policy(const char *name) {
+	if (strcmp(name, "block") == 0) {
+		return OUTQ_BLOCK;
+	} else if (strcmp(name, "drop") == 0) {
+		return OUTQ_DROP;
+	} else if (strcmp(name, "disconnect") == 0) {
+		return OUTQ_DISCONNECT;
+	}
+	return -1;
+}
+
+static void outq_unref(OUTQ *q) {
+	if (refcount_dec(&q->count) == 1) {
+		pthread_mutex_destroy(&q->spaceMutex);
+		pthread_cond_destroy(&q->spaceCond);
+		free(q->cells);
+		free(q);
+	}
+}
+
+static void *outq_flusher_thread(void *arg) {
+	struct epoll_event events[OUTQ_FLUSHER_EVENTS];
+	debug("%ld: Output flusher started", pthread_self());
+	while (1) {
+		int n = epoll_wait(flusher.epfd, events, OUTQ_FLUSHER_EVENTS, -1);
+		for (int i = 0; i < n; i++) {
+			OUTQ *q = events[i].data.ptr;
+			if (q == NULL) {
+				uint64_t val;
+				if (read(flusher.wakefd, &val, sizeof(val)) == -1) {
+					debug("%ld: Failed to read flusher wakeup", pthread_self());
+				}
+				continue;
+			}
+			if (atomic_exchange(&q->parked, 0)) {
+				outq_drain(q);
+			}
+		}
+		pthread_mutex_lock(&flusher.retireMutex);
+		OUTQ *retired = flusher.retired;
+		flusher.retired = NULL;
+		pthread_mutex_unlock(&flusher.retireMutex);
+		while (retired != NULL) {
+			OUTQ *next = retired->nextRetired;
+			outq_unref(retired);
+			retired = next;
+		}
+	}
+	return NULL;
+}
+
+static void outq_flusher_init(void) {
+	flusher.epfd = epoll_create1(EPOLL_CLOEXEC);
+	flusher.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(flusher.epfd, EPOLL_CTL_ADD, flusher.wakefd, &ev);
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, outq_flusher_thread, NULL) == 0) {
+		pthread_detach(tid);
+	}
+}
+
+OUTQ *outq_create(int fd) {
+	OUTQ *q = calloc(1, sizeof(OUTQ));
+	if (q == NULL) {
+		return NULL;
+	}
+	q->cells = malloc(queueCapacity * sizeof(OUTQ_CELL));
+	if (q->cells == NULL) {
+		free(q);
+		return NULL;
+	}
+	for (size_t i = 0; i < queueCapacity; i++) {
+		atomic_init(&q->cells[i].seq, i);
+	}
+	q->fd = fd;
+	q->mask = queueCapacity - 1;
+	refcount_init(&q->count, 1);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->draining, 0);
+	atomic_init(&q->parked, 0);
+	atomic_init(&q->dead, 0);
+	atomic_init(&q->corked, 0);
+	atomic_init(&q->backlog, 0);
+	atomic_init(&q->waiters, 0);
+	pthread_mutex_init(&q->spaceMutex, NULL);
+	pthread_cond_init(&q->spaceCond, NULL);
+	return q;
+}
+
+static void outq_release(OUTQ_MSG *msg) {
+	if (msg->release != NULL) {
+		msg->release(msg->arg);
+	}
+	pool_free(msg);
+}
+
+/*
+ * Release a message that was on the ring, once it has been written or
+ * discarded.
+ */
+static void outq_retire(OUTQ *q, OUTQ_MSG *msg) {
+	atomic_fetch_sub_explicit(&q->backlog, 1, memory_order_relaxed);
+	outq_release(msg);
+}
+
+/*
+ * Append a message to the ring.
+ *
+ * @return 0 if the message was added, -1 if the ring is full.
+ */
+static int outq_enqueue(OUTQ *q, OUTQ_MSG *msg) {
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	while (1) {
+		OUTQ_CELL *cell = &q->cells[pos & q->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed)) {
+				cell->msg = msg;
+				// Sequentially consistent, so that a drainer that is just
+				// going idle either sees this message or is seen to be
+				// idle by the producer's subsequent outq_kick().
+				atomic_store_explicit(&cell->seq, pos + 1, memory_order_seq_cst);
+				return 0;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+}
+
+/*
+ * Take the next message off the ring.  Only the drainer may call this.
+ *
+ * @return  The message, or NULL if the ring is empty.
+ */
+static OUTQ_MSG *outq_dequeue(OUTQ *q) {
+	OUTQ_CELL *cell = &q->cells[q->tail & q->mask];
+	size_t seq = atomic_load_explicit(&cell->seq, memory_order_seq_cst);
+	if (seq != q->tail + 1) {
+		return NULL;
+	}
+	OUTQ_MSG *msg = cell->msg;
+	atomic_store_explicit(&cell->seq, q->tail + q->mask + 1, memory_order_release);
+	q->tail++;
+	return msg;
+}
+
+static void outq_wake_waiters(OUTQ *q) {
+	if (atomic_load(&q->waiters) > 0) {
+		pthread_mutex_lock(&q->spaceMutex);
+		pthread_cond_broadcast(&q->spaceCond);
+		pthread_mutex_unlock(&q->spaceMutex);
+	}
+}
+
+/*
+ * Discard everything the drainer holds or could take.  Only the drainer
+ * may call this.
+ */
+static void outq_discard(OUTQ *q) {
+	for (int i = 0; i < q->numInflight; i++) {
+		outq_retire(q, q->inflight[i]);
+	}
+	q->numInflight = 0;
+	q->offset = 0;
+	OUTQ_MSG *msg;
+	while ((msg = outq_dequeue(q)) != NULL) {
+		outq_retire(q, msg);
+	}
+	outq_wake_waiters(q);
+}
+
+/*
+ * Hand a queue whose socket is full to the flusher thread.  The caller
+ * is the drainer, and remains so on behalf of the flusher.  The socket
+ * is armed before the queue is marked as parked, so an event may arrive
+ * before the flusher can act on it; the socket is therefore checked once
+ * more after parking, and if it has already become writable, the caller
+ * takes the queue back.
+ *
+ * @return 0 if the queue was parked, 1 if the caller should keep
+ * draining.
+ */
+static int outq_park(OUTQ *q) {
+	pthread_once(&flusher.once, outq_flusher_init);
+	struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = q };
+	int error;
+	if (!q->registered) {
+		refcount_inc(&q->count);
+		q->registered = 1;
+		error = epoll_ctl(flusher.epfd, EPOLL_CTL_ADD, q->fd, &ev);
+	} else {
+		error = epoll_ctl(flusher.epfd, EPOLL_CTL_MOD, q->fd, &ev);
+	}
+	if (error == -1) {
+		debug("%ld: [%d] Unable to hand output to flusher: %s", pthread_self(), q->fd, strerror(errno));
+		atomic_store(&q->dead, 1);
+		return 1;
+	}
+	atomic_store(&q->parked, 1);
+	struct pollfd pfd = { .fd = q->fd, .events = POLLOUT };
+	if (poll(&pfd, 1, 0) == 1 && atomic_exchange(&q->parked, 0)) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Write as much of the queue as the socket will accept.  The caller must
+ * be the drainer; on return it no longer is, unless the queue has been
+ * parked with the flusher.
+ */
+static void outq_drain(OUTQ *q) {
+	while (1) {
+		if (atomic_load(&q->dead)) {
+			outq_discard(q);
+		} else {
+			int popped = 0;
+			while (q->numInflight < OUTQ_BATCH) {
+				OUTQ_MSG *msg = outq_dequeue(q);
+				if (msg == NULL) {
+					break;
+				}
+				q->inflight[q->numInflight++] = msg;
+				popped = 1;
+			}
+			if (popped) {
+				outq_wake_waiters(q);
+			}
+		}
+		if (q->numInflight == 0) {
+			// The tail belongs to whoever drains next once the flag is
+			// cleared, so it is read first.
+			size_t tail = q->tail;
+			atomic_store(&q->draining, 0);
+			// A producer may have enqueued after the ring was seen to be
+			// empty but before the flag was cleared; if so, and nobody
+			// else has taken over, keep going.
+			OUTQ_CELL *cell = &q->cells[tail & q->mask];
+			if (atomic_load(&cell->seq) != tail + 1 || atomic_exchange(&q->draining, 1)) {
+				return;
+			}
+			continue;
+		}
+		struct iovec iov[2 * OUTQ_BATCH];
+		int iovcnt = 0;
+		size_t skip = q->offset;
+		for (int i = 0; i < q->numInflight; i++) {
+			OUTQ_MSG *msg = q->inflight[i];
+			char *parts[2] = { (char *)&msg->hdr, (char *)msg->data };
+			size_t lens[2] = { sizeof(msg->hdr), msg->len };
+			for (int j = 0; j < 2; j++) {
+				if (skip >= lens[j]) {
+					skip -= lens[j];
+					continue;
+				}
+				iov[iovcnt].iov_base = parts[j] + skip;
+				iov[iovcnt].iov_len = lens[j] - skip;
+				iovcnt++;
+				skip = 0;
+			}
+		}
+		struct msghdr mh = { .msg_iov = iov, .msg_iovlen = iovcnt };
+		ssize_t n = sendmsg(q->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (outq_park(q) == 0) {
+					return;
+				}
+				continue;
+			}
+			debug("%ld: [%d] Output failed: %s", pthread_self(), q->fd, strerror(errno));
+			atomic_store(&q->dead, 1);
+			continue;
+		}
+		// Retire the messages that have been completely written.
+		size_t done = q->offset + n;
+		int retired = 0;
+		while (retired < q->numInflight) {
+			OUTQ_MSG *msg = q->inflight[retired];
+			size_t total = sizeof(msg->hdr) + msg->len;
+			if (done < total) {
+				break;
+			}
+			done -= total;
+			outq_retire(q, msg);
+			retired++;
+		}
+		memmove(q->inflight, q->inflight + retired, (q->numInflight - retired) * sizeof(OUTQ_MSG *));
+		q->numInflight -= retired;
+		q->offset = done;
+	}
+}
+
+/*
+ * Become the drainer, if nobody else is, and write out the queue.
+ */
+static void outq_kick(OUTQ *q) {
+	if (!atomic_exchange(&q->draining, 1)) {
+		outq_drain(q);
+	}
+}
+
+/*
+ * Add a message to the queue and, unless the queue is corked, write it
+ * out.  The test of the cork follows the sequentially consistent store
+ * that publishes the message, so either the producer sees the queue
+ * uncorked and writes, or outq_uncork() sees the message.  A corked
+ * queue that is full is written out before the policy is applied.
+ */
+static int outq_push(OUTQ *q, OUTQ_MSG *msg, OUTQ_POLICY policy) {
+	int kicked = 0;
+	while (1) {
+		if (atomic_load(&q->dead)) {
+			outq_release(msg);
+			return -1;
+		}
+		// Counted first, so that the drainer never retires a message
+		// that has not been counted.
+		atomic_fetch_add_explicit(&q->backlog, 1, memory_order_relaxed);
+		if (outq_enqueue(q, msg) == 0) {
+			if (!atomic_load(&q->corked)) {
+				outq_kick(q);
+			}
+			return 0;
+		}
+		atomic_fetch_sub_explicit(&q->backlog, 1, memory_order_relaxed);
+		if (!kicked && atomic_load(&q->corked)) {
+			kicked = 1;
+			outq_kick(q);
+			continue;
+		}
+		if (policy == OUTQ_DROP) {
+			debug("%ld: [%d] Output queue full, dropping packet", pthread_self(), q->fd);
+			outq_release(msg);
+			return -1;
+		}
+		if (policy == OUTQ_DISCONNECT) {
+			debug("%ld: [%d] Output queue full, disconnecting", pthread_self(), q->fd);
+			atomic_store(&q->dead, 1);
+			shutdown(q->fd, SHUT_RDWR);
+			outq_release(msg);
+			return -1;
+		}
+		// OUTQ_BLOCK: make sure someone is draining, then wait for space.
+		outq_kick(q);
+		atomic_fetch_add(&q->waiters, 1);
+		pthread_mutex_lock(&q->spaceMutex);
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		pthread_cond_timedwait(&q->spaceCond, &q->spaceMutex, &ts);
+		pthread_mutex_unlock(&q->spaceMutex);
+		atomic_fetch_sub(&q->waiters, 1);
+	}
+}
+
+int outq_send(OUTQ *q, JEUX_PACKET_HEADER *hdr, const void *data, size_t len) {
+	OUTQ_MSG *msg = pool_alloc(sizeof(OUTQ_MSG) + len);
+	if (msg == NULL) {
+		return -1;
+	}
+	msg->hdr = *hdr;
+	if (data != NULL && len > 0) {
+		memcpy(msg->payload, data, len);
+	} else {
+		len = 0;
+	}
+	msg->data = msg->payload;
+	msg->len = len;
+	msg->release = NULL;
+	msg->arg = NULL;
+	return outq_push(q, msg, queuePolicy);
+}
+
+static int outq_push_shared(OUTQ *q, JEUX_PACKET_HEADER *hdr, const void *data, size_t len,
+			    void (*release)(void *), void *arg, OUTQ_POLICY policy) {
+	OUTQ_MSG *msg = pool_alloc(sizeof(OUTQ_MSG));
+	if (msg == NULL) {
+		if (release != NULL) {
+			release(arg);
+		}
+		return -1;
+	}
+	msg->hdr = *hdr;
+	msg->data = data;
+	msg->len = data != NULL ? len : 0;
+	msg->release = release;
+	msg->arg = arg;
+	return outq_push(q, msg, policy);
+}
+
+int outq_send_shared(OUTQ *q, JEUX_PACKET_HEADER *hdr, const void *data, size_t len,
+		     void (*release)(void *), void *arg) {
+	return outq_push_shared(q, hdr, data, len, release, arg, queuePolicy);
+}
+
+int outq_offer_shared(OUTQ *q, JEUX_PACKET_HEADER *hdr, const void *data, size_t len,
+		      void (*release)(void *), void *arg) {
+	return outq_push_shared(q, hdr, data, len, release, arg, OUTQ_DISCONNECT);
+}
+
+void outq_cork(OUTQ *q) {
+	atomic_fetch_add(&q->corked, 1);
+}
+
+void outq_uncork(OUTQ *q) {
+	if (atomic_fetch_sub(&q->corked, 1) == 1) {
+		outq_kick(q);
+	}
+}
+
+int outq_backlog(OUTQ *q) {
+	if (atomic_load(&q->dead)) {
+		return -1;
+	}
+	return atomic_load_explicit(&q->backlog, memory_order_relaxed);
+}
+
+/*
+ * The queue is empty when whoever becomes its drainer finds nothing to
+ * write.  While the flusher is waiting for the socket, it holds the
+ * drainer's flag, and all there is to do is wait.
+ */
+int outq_flush(OUTQ *q, int timeout) {
+	for (int waited = 0; waited <= timeout; ) {
+		if (atomic_load(&q->dead)) {
+			return -1;
+		}
+		if (!atomic_exchange(&q->draining, 1)) {
+			OUTQ_CELL *cell = &q->cells[q->tail & q->mask];
+			if (q->numInflight == 0 && atomic_load(&cell->seq) != q->tail + 1) {
+				atomic_store(&q->draining, 0);
+				return 0;
+			}
+			outq_drain(q);
+			continue;
+		}
+		struct timespec interval = { 0, 1000 * 1000 };
+		nanosleep(&interval, NULL);
+		waited++;
+	}
+	return -1;
+}
+
+void outq_shutdown(OUTQ *q) {
+	atomic_store(&q->dead, 1);
+	outq_wake_waiters(q);
+	// Take over as drainer, either from the flusher or from whichever
+	// thread is writing now, and never give it up.
+	while (!atomic_exchange(&q->parked, 0) && atomic_exchange(&q->draining, 1)) {
+		sched_yield();
+	}
+	outq_discard(q);
+	if (q->registered) {
+		epoll_ctl(flusher.epfd, EPOLL_CTL_DEL, q->fd, NULL);
+		pthread_mutex_lock(&flusher.retireMutex);
+		q->nextRetired = flusher.retired;
+		flusher.retired = q;
+		pthread_mutex_unlock(&flusher.retireMutex);
+		uint64_t one = 1;
+		if (write(flusher.wakefd, &one, sizeof(one)) == -1) {
+			debug("%ld: Failed to wake flusher", pthread_self());
+		}
+	}
+}
+
+void outq_destroy(OUTQ *q) {
+	OUTQ_MSG *msg;
+	while ((msg = outq_dequeue(q)) != NULL) {
+		outq_release(msg);
+	}
+	outq_unref(q);
+}
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "packet_pool.h"
+#include "debug.h"
+
+#define POOL_MIN_SHIFT 5
+#define POOL_NUM_CLASSES 12
+#define POOL_MAX_SIZE ((size_t)1 << (POOL_MIN_SHIFT + POOL_NUM_CLASSES - 1))
+#define POOL_CACHE_BYTES (256 * 1024)
+#define POOL_MIN_CACHED 4
+
+/*
+ * Every buffer is preceded by a small header recording its size class,
+ * which doubles as the link field while the buffer sits on a freelist.
+ * The header is 16 bytes, so buffers keep malloc()'s alignment.
+ */
+typedef struct pool_hdr {
+	struct pool_hdr *next;
+	size_t cls;
+} POOL_HDR;
+
+typedef struct pool_cache {
+	POOL_HDR *head[POOL_NUM_CLASSES];
+	int count[POOL_NUM_CLASSES];
+} POOL_CACHE;
+
+static __thread POOL_CACHE *threadCache = NULL;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheOnce = PTHREAD_ONCE_INIT;
+
+static void pool_cache_destroy(void *arg) {
+	POOL_CACHE *cache = arg;
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		POOL_HDR *block = cache->head[i];
+		while (block != NULL) {
+			POOL_HDR *next = block->next;
+			free(block);
+			block = next;
+		}
+	}
+	free(cache);
+}
+
+static void pool_key_init(void) {
+	pthread_key_create(&cacheKey, pool_cache_destroy);
+}
+
+static POOL_CACHE *pool_get_cache(void) {
+	if (threadCache == NULL) {
+		pthread_once(&cacheOnce, pool_key_init);
+		threadCache = calloc(1, sizeof(POOL_CACHE));
+		if (threadCache != NULL) {
+			pthread_setspecific(cacheKey, threadCache);
+		}
+	}
+	return threadCache;
+}
+
+static size_t pool_class_of(size_t size) {
+	size_t cls = 0;
+	while (((size_t)1 << (cls + POOL_MIN_SHIFT)) < size) {
+		cls++;
+	}
+	return cls;
+}
+
+static int pool_class_limit(size_t cls) {
+	int limit = POOL_CACHE_BYTES >> (cls + POOL_MIN_SHIFT);
+	return limit < POOL_MIN_CACHED ? POOL_MIN_CACHED : limit;
+}
+
+void *pool_alloc(size_t size) {
+	if (size > POOL_MAX_SIZE) {
+		POOL_HDR *block = malloc(sizeof(POOL_HDR) + size);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->cls = POOL_NUM_CLASSES;
+		return block + 1;
+	}
+	size_t cls = pool_class_of(size);
+	POOL_CACHE *cache = pool_get_cache();
+	POOL_HDR *block;
+	if (cache != NULL && cache->head[cls] != NULL) {
+		block = cache->head[cls];
+		cache->head[cls] = block->next;
+		cache->count[cls]--;
+	} else {
+		block = malloc(sizeof(POOL_HDR) + ((size_t)1 << (cls + POOL_MIN_SHIFT)));
+		if (block == NULL) {
+			return NULL;
+		}
+		block->cls = cls;
+	}
+	return block + 1;
+}
+
+void pool_free(void *buf) {
+	if (buf == NULL) {
+		return;
+	}
+	POOL_HDR *block = (POOL_HDR *)buf - 1;
+	size_t cls = block->cls;
+	POOL_CACHE *cache = cls < POOL_NUM_CLASSES ? pool_get_cache() : NULL;
+	if (cache == NULL || cache->count[cls] >= pool_class_limit(cls)) {
+		free(block);
+		return;
+	}
+	block->next = cache->head[cls];
+	cache->head[cls] = block;
+	cache->count[cls]++;
+}
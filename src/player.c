@@ -9,19 +9,77 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <math.h>
+#include <stdatomic.h>
 
 #include "player.h"
+#include "player_ext.h"
 #include "csapp.h"
+#include "rating_log.h"
+#include "refcount.h"
+#include "slab.h"
 #include "debug.h"
+#include "trace.h"
+
+/*
+ * The name of a PLAYER is fixed at creation and is read without locking.
+ * The rating is atomic, and player_post_result() updates it with
+ * compare-and-swap, so no lock is ever taken on a PLAYER.  The rating is
+ * normally kept in ownRating, but a PLAYER loaded from the player store
+ * keeps it in the store's mapped record instead, so that changes to it
+ * reach the disk without being copied.
+ */
+static atomic_ulong ratingEpoch;
 
 struct player {
-	int rating;
+	atomic_int *rating;
+	atomic_int ownRating;
 	char* name;
-	int count;
-	pthread_mutex_t playerMutex;
-	pthread_mutexattr_t mutexAttr;
+	REFCOUNT count;
+	int ownsName;
+	int inBlock;
 };
 
+/*
+ * PLAYERs created one at a time come from a slab.  They need no
+ * construction, since player_init() sets every field.
+ */
+static SLAB playerSlab = SLAB_INITIALIZER(PLAYER, NULL);
+
+/*
+ * Rating changes, indexed by score (0 for a loss, 1 for a draw, 2 for a
+ * win) and by the opponent's rating minus the player's own, offset by
+ * PLAYER_MAX_DIFF.  Beyond PLAYER_MAX_DIFF the truncated change no longer
+ * depends on the difference, so larger differences are clamped.
+ */
+#define PLAYER_K 32
+#define PLAYER_MAX_DIFF 4096
+
+static int8_t ratingDeltas[3][2 * PLAYER_MAX_DIFF + 1];
+static pthread_once_t ratingDeltasOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Fill in ratingDeltas, computing each entry exactly as the Elo formula
+ * below would for the corresponding ratings.
+ */
+static void player_init_deltas(void) {
+	for (int diff = -PLAYER_MAX_DIFF; diff <= PLAYER_MAX_DIFF; diff++) {
+		float E = 1.0/(1.0 + pow(10.0, ((float)diff/400.0)));
+		for (int score = 0; score < 3; score++) {
+			float S = score / 2.0;
+			ratingDeltas[score][diff + PLAYER_MAX_DIFF] = (int)(PLAYER_K * (S-E));
+		}
+	}
+}
+
+static int player_rating_delta(int score, int diff) {
+	if (diff > PLAYER_MAX_DIFF) {
+		diff = PLAYER_MAX_DIFF;
+	} else if (diff < -PLAYER_MAX_DIFF) {
+		diff = -PLAYER_MAX_DIFF;
+	}
+	return ratingDeltas[score][diff + PLAYER_MAX_DIFF];
+}
+
 /*
  * Create a new PLAYER with a specified username.  A private copy is
  * made of the username that is passed.  The newly created PLAYER has
@@ -33,33 +91,88 @@ struct player {
  * was successful, otherwise NULL.
  */
 PLAYER *player_create(char *name) {
-	PLAYER *player = malloc(sizeof(PLAYER));
-	player->rating = PLAYER_INITIAL_RATING;
 	char *temp = malloc((strlen(name) + 1) * sizeof(char));
 	strcpy(temp, name);
-	player->name = temp;
-	player->count = 0;
-	pthread_mutexattr_init(&player->mutexAttr);
-	pthread_mutexattr_settype(&player->mutexAttr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&player->playerMutex, &player->mutexAttr);
+	PLAYER *player = player_create_interned(temp);
+	player->ownsName = 1;
+	return player;
+}
+
+static void player_init(PLAYER *player, char *name, int rating, atomic_int *stored) {
+	if (stored != NULL) {
+		player->rating = stored;
+	} else {
+		atomic_init(&player->ownRating, rating);
+		player->rating = &player->ownRating;
+	}
+	player->name = name;
+	refcount_init(&player->count, 0);
+	player->ownsName = 0;
+	player->inBlock = 0;
 	player_ref(player, "for newly created player");
+}
+
+PLAYER *player_create_interned(char *name) {
+	PLAYER *player = slab_alloc(&playerSlab);
+	if (player == NULL) {
+		return NULL;
+	}
+	player_init(player, name, PLAYER_INITIAL_RATING, NULL);
 	return player;
 }
 
+PLAYER *player_create_mapped(char *name, atomic_int *rating) {
+	PLAYER *player = slab_alloc(&playerSlab);
+	if (player == NULL) {
+		return NULL;
+	}
+	player_init(player, name, 0, rating);
+	return player;
+}
+
+PLAYER *player_create_block(char **names, int *ratings, size_t n) {
+	PLAYER *block = malloc(n * sizeof(PLAYER));
+	if (block == NULL) {
+		return NULL;
+	}
+	for (size_t i = 0; i < n; i++) {
+		player_init(&block[i], names[i], ratings != NULL ? ratings[i] : PLAYER_INITIAL_RATING, NULL);
+		block[i].inBlock = 1;
+	}
+	return block;
+}
+
+PLAYER *player_create_block_mapped(char **names, atomic_int **ratings, size_t n) {
+	PLAYER *block = malloc(n * sizeof(PLAYER));
+	if (block == NULL) {
+		return NULL;
+	}
+	for (size_t i = 0; i < n; i++) {
+		player_init(&block[i], names[i], 0, ratings[i]);
+		block[i].inBlock = 1;
+	}
+	return block;
+}
+
+PLAYER *player_block_at(PLAYER *block, size_t i) {
+	return &block[i];
+}
+
+void player_block_free(PLAYER *block) {
+	free(block);
+}
+
 /*
  * Increase the reference count on a player by one.
  *
  * @param player  The PLAYER whose reference count is to be increased.
  * @param why  A string describing the reason why the reference count is
- * being increased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being increased.
  * @return  The same PLAYER object that was passed as a parameter.
  */
 PLAYER *player_ref(PLAYER *player, char *why) {
-	pthread_mutex_lock(&player->playerMutex);
-	debug("%ld: Increase refrence count on player %p (%d -> %d) %s", pthread_self(), player, player->count, player->count + 1, why);
-	player->count = player->count + 1;
-	pthread_mutex_unlock(&player->playerMutex);
+	int old = refcount_inc(&player->count);
+	trace(TRACE_PLAYER_REF, player, old, old + 1, 0, why);
 	return player;
 }
 
@@ -70,21 +183,20 @@ PLAYER *player_ref(PLAYER *player, char *why) {
  *
  * @param player  The PLAYER whose reference count is to be decreased.
  * @param why  A string describing the reason why the reference count is
- * being decreased.  This is used for debugging printout, to help trace
- * the reference counting.
+ * being decreased.
  *
  */
 void player_unref(PLAYER *player, char *why) {
-	pthread_mutex_lock(&player->playerMutex);
-	debug("%ld: Decrease refrence count on player %p (%d -> %d) %s", pthread_self(), player, player->count, player->count - 1, why);
-	player->count = player->count - 1;
-	if (player->count == 0) {
-		debug("%ld, Free player %p", pthread_self(), player);
-		free(player->name);
-		free(player);
-		return;
+	int old = refcount_dec(&player->count);
+	trace(TRACE_PLAYER_UNREF, player, old, old - 1, 0, why);
+	if (old == 1) {
+		if (player->ownsName) {
+			free(player->name);
+		}
+		if (!player->inBlock) {
+			slab_free(&playerSlab, player);
+		}
 	}
-	pthread_mutex_unlock(&player->playerMutex);
 	return;
 }
 
@@ -95,10 +207,7 @@ void player_unref(PLAYER *player, char *why) {
  * @return the username of the player.
  */
 char *player_get_name(PLAYER *player) {
-	pthread_mutex_lock(&player->playerMutex);
-	char *name = player->name;
-	pthread_mutex_unlock(&player->playerMutex);
-	return name;
+	return player->name;
 }
 /*
  * Get the rating of a player.
@@ -107,10 +216,25 @@ char *player_get_name(PLAYER *player) {
  * @return the rating of the player.
  */
 int player_get_rating(PLAYER *player) {
-	pthread_mutex_lock(&player->playerMutex);
-	int rating = player->rating;
-	pthread_mutex_unlock(&player->playerMutex);
-	return rating;
+	return atomic_load_explicit(player->rating, memory_order_relaxed);
+}
+
+/*
+ * Apply the result of a game to the rating of one player, against the
+ * rating of the opponent when the result was posted.  If the rating
+ * changes concurrently, as a result of another game, the change is
+ * recomputed from the new rating and applied again.
+ *
+ * @return  The change that was applied.
+ */
+static int player_adjust_rating(PLAYER *player, int score, int opponentRating) {
+	int old = atomic_load_explicit(player->rating, memory_order_relaxed);
+	int delta;
+	do {
+		delta = player_rating_delta(score, opponentRating - old);
+	} while (!atomic_compare_exchange_weak_explicit(player->rating, &old, old + delta,
+						       memory_order_relaxed, memory_order_relaxed));
+	return delta;
 }
 
 /*
@@ -128,34 +252,27 @@ int player_get_rating(PLAYER *player) {
  *     R1' = R1 + 32*(S1-E1)
  *     R2' = R2 + 32*(S2-E2)
  *
+ * The changes are taken from ratingDeltas rather than computed, and are
+ * appended to the rating log, if one is open, so that they survive a
+ * restart.
+ *
  * @param player1  One of the PLAYERs that is to be updated.
  * @param player2  The other PLAYER that is to be updated.
  * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
  */
 void player_post_result(PLAYER *player1, PLAYER *player2, int result) {
-	pthread_mutex_lock(&player1->playerMutex);
-	pthread_mutex_lock(&player2->playerMutex);
-	float S1;
-	float S2;
-	if (result == 0) {
-		S1 = 0.5;
-		S2 = 0.5;
-	} else if (result == 1) {
-		S1 = 1.0;
-		S2 = 0.0;
-	} else {
-		S1 = 0.0;
-		S2 = 1.0;
-	}
-	float R1 = player_get_rating(player1);
-	float R2 = player_get_rating(player2);
-	float E1 = 1.0/(1.0 + pow(10.0, ((R2-R1)/400.0)));
-	float E2 = 1.0/(1.0 + pow(10.0, ((R1-R2)/400.0)));
-	int newR1 = R1 + (int)(32.0 * (S1-E1));
-	int newR2 = R2 + (int)(32.0 * (S2-E2));
-	player1->rating = newR1;
-	player2->rating = newR2;
-	pthread_mutex_unlock(&player2->playerMutex);
-	pthread_mutex_unlock(&player1->playerMutex);
+	pthread_once(&ratingDeltasOnce, player_init_deltas);
+	int S1 = result == 0 ? 1 : result == 1 ? 2 : 0;
+	int S2 = 2 - S1;
+	int R1 = player_get_rating(player1);
+	int R2 = player_get_rating(player2);
+	int delta1 = player_adjust_rating(player1, S1, R2);
+	int delta2 = player_adjust_rating(player2, S2, R1);
+	atomic_fetch_add_explicit(&ratingEpoch, 1, memory_order_release);
+	rating_log_append(player1, delta1, player2, delta2);
 	return;
-}
\ No newline at end of file
+}
+
+unsigned long player_rating_epoch(void) {
+	return atomic_load_explicit(&ratingEpoch, memory_order_acquire);
+}
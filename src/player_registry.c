@@ -5,24 +5,158 @@
 #include <pthread.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
 #include "player_registry.h"
+#include "player_registry_ext.h"
+#include "player_ext.h"
+#include "player_store.h"
+#include "name_hash.h"
+#include "metrics.h"
 #include "csapp.h"
 #include "debug.h"
 
-typedef struct player_node {
+#define PREG_SHARDS 64
+#define PREG_INITIAL_SLOTS 16
+#define PREG_ARENA_CHUNK 4096
+
+/*
+ * A slot of a shard's open-addressing table.  The hash is kept next to
+ * the PLAYER pointer so that probing rarely has to touch the PLAYER.
+ */
+typedef struct preg_slot {
+	uint64_t hash;
 	PLAYER *player;
-	struct player_node *next;
-} PLAYER_NODE;
+} PREG_SLOT;
+
+/*
+ * A chunk of interned-name storage.  Names are never freed individually,
+ * since players are never removed from the registry.
+ */
+typedef struct preg_arena {
+	struct preg_arena *next;
+	size_t used;
+	size_t size;
+	char data[];
+} PREG_ARENA;
+
+/*
+ * A list of PLAYER blocks created by preg_preload(), released at
+ * finalization.
+ */
+typedef struct preg_block {
+	struct preg_block *next;
+	PLAYER *players;
+} PREG_BLOCK;
+
+typedef struct preg_shard {
+	pthread_mutex_t lock;
+	size_t numSlots;
+	size_t numPlayers;
+	PREG_SLOT *slots;
+	PREG_ARENA *arena;
+} PREG_SHARD;
 
 struct player_registry {
-    PLAYER_NODE* head;
+    PREG_SHARD shards[PREG_SHARDS];
+    PREG_BLOCK *blocks;
+    PREG_ARENA *bulkNames;
+    PLAYER_STORE *store;
     sem_t registryMutex;
 };
 
+static PREG_SHARD *preg_shard_for(PLAYER_REGISTRY *preg, uint64_t hash) {
+	return &preg->shards[hash % PREG_SHARDS];
+}
+
+/*
+ * Find the slot for a name in a shard: either the slot holding the
+ * PLAYER with that name, or the empty slot at which it would be inserted.
+ * The shard lock must be held.
+ */
+static PREG_SLOT *preg_probe(PREG_SHARD *shard, uint64_t hash, char *name) {
+	size_t mask = shard->numSlots - 1;
+	size_t i = (hash / PREG_SHARDS) & mask;
+	while (1) {
+		PREG_SLOT *slot = &shard->slots[i];
+		if (slot->player == NULL) {
+			return slot;
+		}
+		if (slot->hash == hash && strcmp(player_get_name(slot->player), name) == 0) {
+			return slot;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * Grow the table of a shard so that it can hold at least the specified
+ * number of players at a load factor of at most one half.  The shard
+ * lock must be held.
+ */
+static int preg_reserve(PREG_SHARD *shard, size_t numPlayers) {
+	size_t numSlots = shard->numSlots;
+	while (numSlots < 2 * numPlayers) {
+		numSlots <<= 1;
+	}
+	if (numSlots == shard->numSlots) {
+		return 0;
+	}
+	PREG_SLOT *slots = calloc(numSlots, sizeof(PREG_SLOT));
+	if (slots == NULL) {
+		return -1;
+	}
+	PREG_SLOT *old = shard->slots;
+	size_t oldSlots = shard->numSlots;
+	shard->slots = slots;
+	shard->numSlots = numSlots;
+	for (size_t i = 0; i < oldSlots; i++) {
+		if (old[i].player != NULL) {
+			size_t j = (old[i].hash / PREG_SHARDS) & (numSlots - 1);
+			while (slots[j].player != NULL) {
+				j = (j + 1) & (numSlots - 1);
+			}
+			slots[j] = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * Copy a name into a shard's arena.  The shard lock must be held.
+ */
+static char *preg_intern(PREG_SHARD *shard, char *name) {
+	size_t len = strlen(name) + 1;
+	PREG_ARENA *arena = shard->arena;
+	if (arena == NULL || arena->size - arena->used < len) {
+		size_t size = len > PREG_ARENA_CHUNK ? len : PREG_ARENA_CHUNK;
+		arena = malloc(sizeof(PREG_ARENA) + size);
+		if (arena == NULL) {
+			return NULL;
+		}
+		arena->next = shard->arena;
+		arena->used = 0;
+		arena->size = size;
+		shard->arena = arena;
+	}
+	char *interned = arena->data + arena->used;
+	memcpy(interned, name, len);
+	arena->used += len;
+	return interned;
+}
+
+static void preg_free_arenas(PREG_ARENA *arena) {
+	while (arena != NULL) {
+		PREG_ARENA *next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
 /*
  * Initialize a new player registry.
  *
@@ -30,9 +164,20 @@ struct player_registry {
  * fails.
  */
 PLAYER_REGISTRY *preg_init(void) {
-	PLAYER_REGISTRY *registry = malloc(sizeof(PLAYER_REGISTRY));
+	PLAYER_REGISTRY *registry = calloc(1, sizeof(PLAYER_REGISTRY));
+	if (registry == NULL) {
+		return NULL;
+	}
 	Sem_init(&registry->registryMutex, 0, 1);
-	registry->head = NULL;
+	for (int i = 0; i < PREG_SHARDS; i++) {
+		PREG_SHARD *shard = &registry->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->numSlots = PREG_INITIAL_SLOTS;
+		shard->slots = calloc(PREG_INITIAL_SLOTS, sizeof(PREG_SLOT));
+		if (shard->slots == NULL) {
+			return NULL;
+		}
+	}
 	debug("%ld: Initialize player registry", pthread_self());
 	return registry;
 }
@@ -44,14 +189,28 @@ PLAYER_REGISTRY *preg_init(void) {
  * be referenced again.
  */
 void preg_fini(PLAYER_REGISTRY *preg) {
-	P(&preg->registryMutex);
-	PLAYER_NODE *current = preg->head;
-	while (current != NULL) {
-		PLAYER_NODE *temp = current;
-		current = current->next;
-		player_unref(temp->player, "becuase player registry is being finalized");
-		free(temp);
+	metrics_sem_wait(&preg->registryMutex, METRICS_LOCK_PLAYER_REGISTRY);
+	for (int i = 0; i < PREG_SHARDS; i++) {
+		PREG_SHARD *shard = &preg->shards[i];
+		metrics_mutex_lock(&shard->lock, METRICS_LOCK_PLAYER_REGISTRY);
+		for (size_t j = 0; j < shard->numSlots; j++) {
+			if (shard->slots[j].player != NULL) {
+				player_unref(shard->slots[j].player, "becuase player registry is being finalized");
+			}
+		}
+		free(shard->slots);
+		preg_free_arenas(shard->arena);
+		pthread_mutex_unlock(&shard->lock);
+		pthread_mutex_destroy(&shard->lock);
 	}
+	PREG_BLOCK *block = preg->blocks;
+	while (block != NULL) {
+		PREG_BLOCK *next = block->next;
+		player_block_free(block->players);
+		free(block);
+		block = next;
+	}
+	preg_free_arenas(preg->bulkNames);
 	free(preg);
 	return;
 }
@@ -71,23 +230,216 @@ void preg_fini(PLAYER_REGISTRY *preg) {
  *
  */
 PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name) {
-	P(&preg->registryMutex);
-	PLAYER_NODE *current = preg->head;
-	while (current != NULL && strcmp(player_get_name(current->player), name) != 0) {
-		current = current->next;
-	}
-	if (current == NULL) {
-		PLAYER *player = player_create(name);
-		PLAYER_NODE *node = malloc(sizeof(PLAYER_NODE));
-		node->player = player;
-		node->next = preg->head;
-		preg->head = node;
-		player_ref(player, "for refrence being retained by player registry");
-		V(&preg->registryMutex);
+	uint64_t hash = name_hash(name);
+	PREG_SHARD *shard = preg_shard_for(preg, hash);
+	metrics_mutex_lock(&shard->lock, METRICS_LOCK_PLAYER_REGISTRY);
+	PREG_SLOT *slot = preg_probe(shard, hash, name);
+	if (slot->player != NULL) {
+		PLAYER *player = player_ref(slot->player, "for new refrence to existing player");
+		pthread_mutex_unlock(&shard->lock);
 		return player;
+	}
+	if (2 * (shard->numPlayers + 1) > shard->numSlots) {
+		if (preg_reserve(shard, shard->numPlayers + 1) == -1) {
+			pthread_mutex_unlock(&shard->lock);
+			return NULL;
+		}
+		slot = preg_probe(shard, hash, name);
+	}
+	// Players are kept in the store, if there is one and it has room,
+	// and otherwise only in memory.
+	char *interned;
+	atomic_int *rating = preg->store != NULL ? pstore_add(preg->store, name, hash, &interned) : NULL;
+	PLAYER *player;
+	if (rating != NULL) {
+		player = player_create_mapped(interned, rating);
 	} else {
-		player_ref(current->player, "for new refrence to existing player");
-		V(&preg->registryMutex);
-		return current->player;
+		interned = preg_intern(shard, name);
+		player = interned != NULL ? player_create_interned(interned) : NULL;
+		if (player != NULL && preg->store != NULL) {
+			pstore_overflow(preg->store, player);
+		}
+	}
+	if (player == NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+	slot->hash = hash;
+	slot->player = player;
+	shard->numPlayers++;
+	player_ref(player, "for refrence being retained by player registry");
+	pthread_mutex_unlock(&shard->lock);
+	return player;
+}
+
+PLAYER *preg_lookup(PLAYER_REGISTRY *preg, char *name) {
+	uint64_t hash = name_hash(name);
+	PREG_SHARD *shard = preg_shard_for(preg, hash);
+	metrics_mutex_lock(&shard->lock, METRICS_LOCK_PLAYER_REGISTRY);
+	PREG_SLOT *slot = preg_probe(shard, hash, name);
+	PLAYER *player = NULL;
+	if (slot->player != NULL) {
+		player = player_ref(slot->player, "for reference being returned by preg_lookup()");
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return player;
+}
+
+size_t preg_count(PLAYER_REGISTRY *preg) {
+	size_t count = 0;
+	for (int i = 0; i < PREG_SHARDS; i++) {
+		metrics_mutex_lock(&preg->shards[i].lock, METRICS_LOCK_PLAYER_REGISTRY);
+		count += preg->shards[i].numPlayers;
+		pthread_mutex_unlock(&preg->shards[i].lock);
+	}
+	return count;
+}
+
+void preg_for_each(PLAYER_REGISTRY *preg, void (*fn)(PLAYER *, void *), void *arg) {
+	for (int i = 0; i < PREG_SHARDS; i++) {
+		PREG_SHARD *shard = &preg->shards[i];
+		metrics_mutex_lock(&shard->lock, METRICS_LOCK_PLAYER_REGISTRY);
+		for (size_t j = 0; j < shard->numSlots; j++) {
+			if (shard->slots[j].player != NULL) {
+				fn(shard->slots[j].player, arg);
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/*
+ * Insert the PLAYERs of a newly created block into the registry, with
+ * each shard sized once beforehand, and record the block so that it is
+ * released at finalization.  A PLAYER whose name is already registered
+ * is not inserted.
+ *
+ * @return  The number of PLAYERs inserted.
+ */
+static long preg_insert_block(PLAYER_REGISTRY *preg, PREG_BLOCK *block, char **names, uint64_t *hashes,
+			      size_t n) {
+	metrics_sem_wait(&preg->registryMutex, METRICS_LOCK_PLAYER_REGISTRY);
+	block->next = preg->blocks;
+	preg->blocks = block;
+	V(&preg->registryMutex);
+	size_t perShard[PREG_SHARDS] = {0};
+	for (size_t i = 0; i < n; i++) {
+		perShard[hashes[i] % PREG_SHARDS]++;
+	}
+	for (int i = 0; i < PREG_SHARDS; i++) {
+		if (perShard[i] == 0) {
+			continue;
+		}
+		PREG_SHARD *shard = &preg->shards[i];
+		metrics_mutex_lock(&shard->lock, METRICS_LOCK_PLAYER_REGISTRY);
+		preg_reserve(shard, shard->numPlayers + perShard[i]);
+		pthread_mutex_unlock(&shard->lock);
+	}
+	long added = 0;
+	for (size_t i = 0; i < n; i++) {
+		PLAYER *player = player_block_at(block->players, i);
+		PREG_SHARD *shard = preg_shard_for(preg, hashes[i]);
+		metrics_mutex_lock(&shard->lock, METRICS_LOCK_PLAYER_REGISTRY);
+		if (2 * (shard->numPlayers + 1) > shard->numSlots
+		    && preg_reserve(shard, shard->numPlayers + 1) == -1) {
+			pthread_mutex_unlock(&shard->lock);
+			player_unref(player, "because the player registry could not be grown");
+			continue;
+		}
+		PREG_SLOT *slot = preg_probe(shard, hashes[i], names[i]);
+		if (slot->player == NULL) {
+			slot->hash = hashes[i];
+			slot->player = player;
+			shard->numPlayers++;
+			added++;
+			pthread_mutex_unlock(&shard->lock);
+		} else {
+			pthread_mutex_unlock(&shard->lock);
+			player_unref(player, "because a player with the same name is already registered");
+		}
+	}
+	return added;
+}
+
+long preg_preload(PLAYER_REGISTRY *preg, char **names, int *ratings, size_t n) {
+	if (n == 0) {
+		return 0;
+	}
+	// Intern all the names in one allocation.
+	size_t total = 0;
+	for (size_t i = 0; i < n; i++) {
+		total += strlen(names[i]) + 1;
+	}
+	PREG_ARENA *arena = malloc(sizeof(PREG_ARENA) + total);
+	char **interned = malloc(n * sizeof(char *));
+	uint64_t *hashes = malloc(n * sizeof(uint64_t));
+	PREG_BLOCK *block = malloc(sizeof(PREG_BLOCK));
+	if (arena == NULL || interned == NULL || hashes == NULL || block == NULL) {
+		free(arena);
+		free(interned);
+		free(hashes);
+		free(block);
+		return -1;
+	}
+	arena->used = 0;
+	arena->size = total;
+	for (size_t i = 0; i < n; i++) {
+		size_t len = strlen(names[i]) + 1;
+		interned[i] = arena->data + arena->used;
+		memcpy(interned[i], names[i], len);
+		arena->used += len;
+		hashes[i] = name_hash(interned[i]);
+	}
+	block->players = player_create_block(interned, ratings, n);
+	if (block->players == NULL) {
+		free(arena);
+		free(interned);
+		free(hashes);
+		free(block);
+		return -1;
+	}
+	metrics_sem_wait(&preg->registryMutex, METRICS_LOCK_PLAYER_REGISTRY);
+	arena->next = preg->bulkNames;
+	preg->bulkNames = arena;
+	V(&preg->registryMutex);
+	long added = preg_insert_block(preg, block, interned, hashes, n);
+	free(interned);
+	free(hashes);
+	debug("%ld: Preloaded %ld players into player registry", pthread_self(), added);
+	return added;
+}
+
+long preg_attach_store(PLAYER_REGISTRY *preg, PLAYER_STORE *store) {
+	preg->store = store;
+	size_t n = pstore_count(store);
+	if (n == 0) {
+		return 0;
+	}
+	char **names = malloc(n * sizeof(char *));
+	uint64_t *hashes = malloc(n * sizeof(uint64_t));
+	atomic_int **ratings = malloc(n * sizeof(atomic_int *));
+	PREG_BLOCK *block = malloc(sizeof(PREG_BLOCK));
+	if (names == NULL || hashes == NULL || ratings == NULL || block == NULL) {
+		free(names);
+		free(hashes);
+		free(ratings);
+		free(block);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		ratings[i] = pstore_get(store, i, &names[i], &hashes[i]);
+	}
+	block->players = player_create_block_mapped(names, ratings, n);
+	free(ratings);
+	if (block->players == NULL) {
+		free(names);
+		free(hashes);
+		free(block);
+		return -1;
 	}
+	long added = preg_insert_block(preg, block, names, hashes, n);
+	free(names);
+	free(hashes);
+	debug("%ld: Loaded %ld players from player store", pthread_self(), added);
+	return added;
 }
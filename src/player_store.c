@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "player_store.h"
+#include "player_ext.h"
+#include "name_hash.h"
+#include "debug.h"
+
+#define PSTORE_MAGIC "JEUXPDB1"
+#define PSTORE_PAGE 4096
+
+/*
+ * The header occupies the first page of the file.  The records follow,
+ * and then the heap, starting at the next page boundary.  The first byte
+ * of the heap is never used, so that a name offset of zero marks a record
+ * that was never written, and neither is the last, so that every name in
+ * the heap is NUL-terminated within it.
+ */
+typedef struct pstore_header {
+	char magic[8];
+	uint64_t recordCapacity;
+	uint64_t heapCapacity;
+	uint64_t numRecords;
+	uint64_t heapUsed;
+} PSTORE_HEADER;
+
+typedef struct pstore_record {
+	uint64_t hash;
+	uint32_t name;
+	atomic_int rating;
+} PSTORE_RECORD;
+
+/*
+ * A player that did not fit in the store.  The name is copied, since the
+ * registry's copy is freed before the store is closed.
+ */
+typedef struct pstore_overflow {
+	struct pstore_overflow *next;
+	PLAYER *player;
+	char name[];
+} PSTORE_OVERFLOW;
+
+struct player_store {
+	char *path;
+	int fd;
+	char *map;
+	size_t mapLen;
+	PSTORE_HEADER *header;
+	PSTORE_RECORD *records;
+	char *heap;
+	pthread_mutex_t lock;
+	pthread_cond_t stopCond;
+	int stopping;
+	pthread_t thread;
+	PSTORE_OVERFLOW *overflow;
+	atomic_ulong additions;
+};
+
+static size_t pstore_heap_offset(uint64_t recordCapacity) {
+	size_t size = recordCapacity * sizeof(PSTORE_RECORD);
+	return PSTORE_PAGE + (size + PSTORE_PAGE - 1) / PSTORE_PAGE * PSTORE_PAGE;
+}
+
+/*
+ * Append a player to a mapped store, which must have room for it.
+ */
+static atomic_int *pstore_append(PSTORE_HEADER *header, PSTORE_RECORD *records, char *heap,
+				 char *name, size_t len, uint64_t hash, int rating) {
+	PSTORE_RECORD *record = &records[header->numRecords];
+	memcpy(heap + header->heapUsed, name, len);
+	record->hash = hash;
+	record->name = header->heapUsed;
+	atomic_init(&record->rating, rating);
+	header->heapUsed += len;
+	header->numRecords++;
+	return &record->rating;
+}
+
+/*
+ * Write a new store, replacing the file atomically by renaming a
+ * temporary file over it.  The new store holds the contents of an
+ * existing store, if any, and the players that overflowed it, and is
+ * sized so that at least half of it is free.
+ *
+ * @param path  The pathname of the store.
+ * @param from  The existing store, or NULL.
+ * @param extra  Players to be added to it.
+ * @return  0 if the store was written, otherwise -1.
+ */
+static int pstore_rewrite(char *path, PLAYER_STORE *from, PSTORE_OVERFLOW *extra) {
+	size_t numRecords = from != NULL ? from->header->numRecords : 0;
+	size_t heapUsed = from != NULL ? from->header->heapUsed : 1;
+	for (PSTORE_OVERFLOW *o = extra; o != NULL; o = o->next) {
+		numRecords++;
+		heapUsed += strlen(o->name) + 1;
+	}
+	uint64_t recordCapacity = PSTORE_MIN_RECORDS;
+	while (recordCapacity < 2 * numRecords) {
+		recordCapacity <<= 1;
+	}
+	uint64_t heapCapacity = PSTORE_MIN_HEAP;
+	while (heapCapacity < 2 * heapUsed) {
+		heapCapacity <<= 1;
+	}
+	size_t heapOffset = pstore_heap_offset(recordCapacity);
+	size_t mapLen = heapOffset + heapCapacity;
+
+	size_t pathLen = strlen(path);
+	char *tmp = malloc(pathLen + 5);
+	if (tmp == NULL) {
+		return -1;
+	}
+	memcpy(tmp, path, pathLen);
+	strcpy(tmp + pathLen, ".tmp");
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		free(tmp);
+		return -1;
+	}
+	char *map = MAP_FAILED;
+	if (ftruncate(fd, mapLen) == 0) {
+		map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	PSTORE_HEADER *header = (PSTORE_HEADER *)map;
+	PSTORE_RECORD *records = (PSTORE_RECORD *)(map + PSTORE_PAGE);
+	char *heap = map + heapOffset;
+	memcpy(header->magic, PSTORE_MAGIC, sizeof(header->magic));
+	header->recordCapacity = recordCapacity;
+	header->heapCapacity = heapCapacity;
+	header->numRecords = 0;
+	header->heapUsed = 1;
+	if (from != NULL) {
+		memcpy(records, from->records, from->header->numRecords * sizeof(PSTORE_RECORD));
+		memcpy(heap, from->heap, from->header->heapUsed);
+		header->numRecords = from->header->numRecords;
+		header->heapUsed = from->header->heapUsed;
+	}
+	for (PSTORE_OVERFLOW *o = extra; o != NULL; o = o->next) {
+		pstore_append(header, records, heap, o->name, strlen(o->name) + 1, name_hash(o->name),
+			      player_get_rating(o->player));
+	}
+	int error = msync(map, mapLen, MS_SYNC);
+	munmap(map, mapLen);
+	if (close(fd) == -1 || error == -1 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		error = -1;
+	}
+	free(tmp);
+	return error;
+}
+
+/*
+ * Map an existing store and check that it is intact.  Records at the end
+ * of the array that were never completely written, as may happen if the
+ * server crashed, are discarded.
+ */
+static PLAYER_STORE *pstore_map(char *path) {
+	int fd = open(path, O_RDWR);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat st;
+	PSTORE_HEADER header;
+	if (fstat(fd, &st) == -1 || st.st_size < PSTORE_PAGE
+	    || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+	    || memcmp(header.magic, PSTORE_MAGIC, sizeof(header.magic)) != 0
+	    || header.heapCapacity < 2 || header.numRecords > header.recordCapacity
+	    || header.heapUsed < 1 || header.heapUsed >= header.heapCapacity
+	    || st.st_size != pstore_heap_offset(header.recordCapacity) + header.heapCapacity) {
+		close(fd);
+		return NULL;
+	}
+	PLAYER_STORE *store = calloc(1, sizeof(PLAYER_STORE));
+	char *copy = malloc(strlen(path) + 1);
+	if (store == NULL || copy == NULL) {
+		free(store);
+		free(copy);
+		close(fd);
+		return NULL;
+	}
+	store->mapLen = st.st_size;
+	store->map = mmap(NULL, store->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (store->map == MAP_FAILED) {
+		free(store);
+		free(copy);
+		close(fd);
+		return NULL;
+	}
+	store->path = strcpy(copy, path);
+	store->fd = fd;
+	store->header = (PSTORE_HEADER *)store->map;
+	store->records = (PSTORE_RECORD *)(store->map + PSTORE_PAGE);
+	store->heap = store->map + pstore_heap_offset(header.recordCapacity);
+	size_t n;
+	for (n = 0; n < header.numRecords; n++) {
+		uint32_t name = store->records[n].name;
+		if (name == 0 || name >= header.heapUsed || store->heap[name] == '\0') {
+			break;
+		}
+	}
+	if (n < header.numRecords) {
+		debug("%ld: Discarding %lu incomplete records of player store %s", pthread_self(),
+		      header.numRecords - n, path);
+		store->header->numRecords = n;
+	}
+	pthread_mutex_init(&store->lock, NULL);
+	pthread_cond_init(&store->stopCond, NULL);
+	return store;
+}
+
+static void pstore_unmap(PLAYER_STORE *store) {
+	munmap(store->map, store->mapLen);
+	close(store->fd);
+	pthread_mutex_destroy(&store->lock);
+	pthread_cond_destroy(&store->stopCond);
+	free(store->path);
+	free(store);
+}
+
+/*
+ * Write back the pages dirtied by new players and rating changes, once
+ * per interval and only if there have been any.
+ */
+static void *pstore_thread(void *arg) {
+	PLAYER_STORE *store = arg;
+	unsigned long synced = player_rating_epoch() + atomic_load(&store->additions);
+	pthread_mutex_lock(&store->lock);
+	while (!store->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += PSTORE_SYNC_INTERVAL_MS / 1000;
+		deadline.tv_nsec += (PSTORE_SYNC_INTERVAL_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!store->stopping
+		       && pthread_cond_timedwait(&store->stopCond, &store->lock, &deadline) != ETIMEDOUT) {
+			continue;
+		}
+		unsigned long version = player_rating_epoch() + atomic_load(&store->additions);
+		if (!store->stopping && version != synced) {
+			synced = version;
+			pthread_mutex_unlock(&store->lock);
+			if (msync(store->map, store->mapLen, MS_SYNC) == -1) {
+				fprintf(stderr, "Failed to sync player store: %s\n", strerror(errno));
+			}
+			debug("%ld: Synced player store", pthread_self());
+			pthread_mutex_lock(&store->lock);
+		}
+	}
+	pthread_mutex_unlock(&store->lock);
+	return NULL;
+}
+
+PLAYER_STORE *pstore_open(char *path) {
+	struct stat st;
+	if (stat(path, &st) == -1) {
+		if (errno != ENOENT) {
+			return NULL;
+		}
+		st.st_size = 0;
+	}
+	if (st.st_size == 0) {
+		if (pstore_rewrite(path, NULL, NULL) == -1) {
+			return NULL;
+		}
+	}
+	PLAYER_STORE *store = pstore_map(path);
+	if (store == NULL) {
+		return NULL;
+	}
+	// Make sure that at least half of the store is free before anything
+	// refers to it, since it cannot be grown while it is in use.
+	PSTORE_HEADER *header = store->header;
+	if (2 * header->numRecords > header->recordCapacity || 2 * header->heapUsed > header->heapCapacity) {
+		int error = pstore_rewrite(path, store, NULL);
+		pstore_unmap(store);
+		if (error == -1 || (store = pstore_map(path)) == NULL) {
+			return NULL;
+		}
+	}
+	if (pthread_create(&store->thread, NULL, pstore_thread, store) != 0) {
+		pstore_unmap(store);
+		return NULL;
+	}
+	debug("%ld: Opened player store %s with %lu players", pthread_self(), path,
+	      store->header->numRecords);
+	return store;
+}
+
+size_t pstore_count(PLAYER_STORE *store) {
+	return store->header->numRecords;
+}
+
+atomic_int *pstore_get(PLAYER_STORE *store, size_t i, char **namep, uint64_t *hashp) {
+	PSTORE_RECORD *record = &store->records[i];
+	*namep = store->heap + record->name;
+	*hashp = record->hash;
+	return &record->rating;
+}
+
+atomic_int *pstore_add(PLAYER_STORE *store, char *name, uint64_t hash, char **namep) {
+	size_t len = strlen(name) + 1;
+	pthread_mutex_lock(&store->lock);
+	PSTORE_HEADER *header = store->header;
+	if (header->numRecords == header->recordCapacity || header->heapUsed + len >= header->heapCapacity) {
+		pthread_mutex_unlock(&store->lock);
+		return NULL;
+	}
+	*namep = store->heap + header->heapUsed;
+	atomic_int *rating = pstore_append(header, store->records, store->heap, name, len, hash,
+					   PLAYER_INITIAL_RATING);
+	atomic_fetch_add(&store->additions, 1);
+	pthread_mutex_unlock(&store->lock);
+	return rating;
+}
+
+void pstore_overflow(PLAYER_STORE *store, PLAYER *player) {
+	char *name = player_get_name(player);
+	PSTORE_OVERFLOW *node = malloc(sizeof(PSTORE_OVERFLOW) + strlen(name) + 1);
+	if (node == NULL) {
+		return;
+	}
+	strcpy(node->name, name);
+	node->player = player_ref(player, "for reference being retained by full player store");
+	pthread_mutex_lock(&store->lock);
+	node->next = store->overflow;
+	store->overflow = node;
+	pthread_mutex_unlock(&store->lock);
+}
+
+void pstore_close(PLAYER_STORE *store) {
+	pthread_mutex_lock(&store->lock);
+	store->stopping = 1;
+	pthread_cond_signal(&store->stopCond);
+	pthread_mutex_unlock(&store->lock);
+	pthread_join(store->thread, NULL);
+	if (store->overflow != NULL) {
+		if (pstore_rewrite(store->path, store, store->overflow) == -1) {
+			fprintf(stderr, "Failed to add players to player store %s\n", store->path);
+		}
+		while (store->overflow != NULL) {
+			PSTORE_OVERFLOW *next = store->overflow->next;
+			player_unref(store->overflow->player, "because player store is being closed");
+			free(store->overflow);
+			store->overflow = next;
+		}
+	} else if (msync(store->map, store->mapLen, MS_SYNC) == -1) {
+		fprintf(stderr, "Failed to sync player store: %s\n", strerror(errno));
+	}
+	debug("%ld: Closed player store %s", pthread_self(), store->path);
+	pstore_unmap(store);
+}
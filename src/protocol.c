@@ -8,11 +8,53 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include "protocol.h"
+#include "proto_buf.h"
+#include "packet_pool.h"
 #include "csapp.h"
 #include "debug.h"
 
+/*
+ * Write a vector of buffers in its entirety.  Short writes are continued
+ * from wherever the kernel stopped, and if the descriptor is in
+ * non-blocking mode (as it is for connections serviced by the reactor)
+ * the call waits for the socket to become writable rather than failing
+ * with EAGAIN.  The iovec array is modified.
+ *
+ * @return  0 if all the bytes were written, -1 otherwise.
+ */
+int proto_writev(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+					return -1;
+				}
+				continue;
+			}
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
 /*
  * Send a packet, which consists of a fixed-size header followed by an
  * optional associated data payload.
@@ -25,19 +67,19 @@
  *   In the latter case, errno is set to indicate the error.
  *
  * All multi-byte fields in the packet are assumed to be in network byte order.
+ * The header and payload are handed to the kernel in a single writev().
  */
 int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
-	int returnedBytes = write(fd, hdr, sizeof(*hdr));
-	if (returnedBytes == -1) {
-		return -1;
-	}
+	struct iovec iov[2];
+	int iovcnt = 1;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(*hdr);
 	if (ntohs(hdr->size) > 0 && data != NULL) {
-		returnedBytes = write(fd, data, ntohs(hdr->size));
-		if (returnedBytes == -1) {
-			return -1;
-		}
+		iov[1].iov_base = data;
+		iov[1].iov_len = ntohs(hdr->size);
+		iovcnt = 2;
 	}
-	return 0;
+	return proto_writev(fd, iov, iovcnt);
 }
 
 /*
@@ -54,28 +96,228 @@ int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
  * The returned packet has all multi-byte fields in network byte order.
  * If the returned payload pointer is non-NULL, then the caller has the
  * responsibility of freeing that storage.
+ *
+ * This unbuffered version reads exactly one packet, so that no bytes
+ * belonging to the following packet are consumed; short reads are
+ * continued until the header and payload are complete.
  */
 int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp) {
 	*payloadp = NULL;
-	hdr->size = ntohs(hdr->size);
-	hdr->timestamp_sec = ntohl(hdr->timestamp_sec);
-	hdr->timestamp_nsec = ntohl(hdr->timestamp_nsec);
-	int returnedBytes = read(fd, hdr, sizeof(*hdr));
+	ssize_t returnedBytes = rio_readn(fd, hdr, sizeof(*hdr));
 	if (returnedBytes == -1) {
 		return -1;
 	}
-	if (returnedBytes == 0) {
+	if (returnedBytes < sizeof(*hdr)) {
 		debug("EOF on fd: %d", fd);
 		return -1;
 	}
-	if (hdr->size > 0) {
-		*payloadp = calloc(hdr->size + 1, sizeof(char));
-		returnedBytes = read(fd, *payloadp, hdr->size);
-		if (returnedBytes == -1) {
+	size_t size = ntohs(hdr->size);
+	if (size > 0) {
+		*payloadp = calloc(size + 1, sizeof(char));
+		if (*payloadp == NULL) {
+			return -1;
+		}
+		returnedBytes = rio_readn(fd, *payloadp, size);
+		if (returnedBytes < (ssize_t)size) {
+			debug("EOF on fd: %d", fd);
+			free(*payloadp);
+			*payloadp = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void proto_buf_init(PROTO_BUF *pb, int fd) {
+	pb->fd = fd;
+	pb->start = 0;
+	pb->end = 0;
+	pb->pendPayload = NULL;
+	pb->pendRead = 0;
+}
+
+void proto_buf_fini(PROTO_BUF *pb) {
+	pool_free(pb->pendPayload);
+	pb->pendPayload = NULL;
+}
+
+ssize_t proto_buf_fill(PROTO_BUF *pb) {
+	if (pb->start == pb->end) {
+		pb->start = 0;
+		pb->end = 0;
+	} else if (pb->end == PROTO_BUFSIZE) {
+		memmove(pb->buf, pb->buf + pb->start, pb->end - pb->start);
+		pb->end -= pb->start;
+		pb->start = 0;
+	}
+	ssize_t n;
+	do {
+		n = read(pb->fd, pb->buf + pb->end, PROTO_BUFSIZE - pb->end);
+	} while (n == -1 && errno == EINTR);
+	if (n > 0) {
+		pb->end += n;
+	}
+	return n;
+}
+
+/*
+ * Move whatever is in the buffer of the payload being reassembled into
+ * it, returning 1 if it is then complete.
+ */
+static int proto_buf_absorb(PROTO_BUF *pb) {
+	size_t size = ntohs(pb->pendHdr.size);
+	size_t avail = pb->end - pb->start;
+	size_t want = size - pb->pendRead;
+	size_t take = avail < want ? avail : want;
+	memcpy(pb->pendPayload + pb->pendRead, pb->buf + pb->start, take);
+	pb->pendRead += take;
+	pb->start += take;
+	return pb->pendRead == size;
+}
+
+/*
+ * A packet that is complete in the buffer is left there for
+ * proto_buf_next() to copy out.  One that is not is reassembled as far
+ * as it can be, so that the buffer can be filled again, and when it is
+ * complete it stays pending until it is returned.
+ */
+int proto_buf_complete(PROTO_BUF *pb, JEUX_PACKET_HEADER *hdr) {
+	if (pb->pendPayload == NULL) {
+		if (pb->end - pb->start < sizeof(*hdr)) {
+			return 0;
+		}
+		memcpy(hdr, pb->buf + pb->start, sizeof(*hdr));
+		size_t size = ntohs(hdr->size);
+		if (pb->end - pb->start - sizeof(*hdr) >= size) {
+			return 1;
+		}
+		pb->pendPayload = pool_alloc(size + 1);
+		if (pb->pendPayload == NULL) {
+			return -1;
+		}
+		pb->pendHdr = *hdr;
+		pb->pendRead = 0;
+		pb->start += sizeof(*hdr);
+	}
+	if (!proto_buf_absorb(pb)) {
+		return 0;
+	}
+	*hdr = pb->pendHdr;
+	return 1;
+}
+
+int proto_buf_next(PROTO_BUF *pb, JEUX_PACKET_HEADER *hdr, void **payloadp) {
+	*payloadp = NULL;
+	if (pb->pendPayload == NULL) {
+		if (pb->end - pb->start < sizeof(*hdr)) {
+			return 0;
+		}
+		memcpy(&pb->pendHdr, pb->buf + pb->start, sizeof(*hdr));
+		size_t size = ntohs(pb->pendHdr.size);
+		if (size == 0) {
+			pb->start += sizeof(*hdr);
+			*hdr = pb->pendHdr;
+			return 1;
+		}
+		if (pb->end - pb->start - sizeof(*hdr) >= size) {
+			// The whole packet is in the buffer: the common case.
+			char *payload = pool_alloc(size + 1);
+			if (payload == NULL) {
+				return -1;
+			}
+			memcpy(payload, pb->buf + pb->start + sizeof(*hdr), size);
+			payload[size] = '\0';
+			pb->start += sizeof(*hdr) + size;
+			*hdr = pb->pendHdr;
+			*payloadp = payload;
+			return 1;
+		}
+		pb->pendPayload = pool_alloc(size + 1);
+		if (pb->pendPayload == NULL) {
+			return -1;
+		}
+		pb->pendRead = 0;
+		pb->start += sizeof(*hdr);
+	}
+	if (!proto_buf_absorb(pb)) {
+		return 0;
+	}
+	size_t size = ntohs(pb->pendHdr.size);
+	pb->pendPayload[size] = '\0';
+	*hdr = pb->pendHdr;
+	*payloadp = pb->pendPayload;
+	pb->pendPayload = NULL;
+	pb->pendRead = 0;
+	return 1;
+}
+
+int proto_buf_recv_packet(PROTO_BUF *pb, JEUX_PACKET_HEADER *hdr, void **payloadp) {
+	while (1) {
+		int ret = proto_buf_next(pb, hdr, payloadp);
+		if (ret != 0) {
+			return ret == 1 ? 0 : -1;
+		}
+		ssize_t n = proto_buf_fill(pb);
+		if (n == 0) {
+			debug("EOF on fd: %d", pb->fd);
+			return -1;
+		}
+		if (n == -1) {
+			return -1;
+		}
+	}
+}
+
+int proto_buf_pending(PROTO_BUF *pb) {
+	return pb->end > pb->start;
+}
+
+/*
+ * While a packet is being reassembled, everything read has gone into its
+ * payload, so the saved input is its header and the payload so far,
+ * followed by whatever remains in the buffer.
+ */
+size_t proto_buf_save(PROTO_BUF *pb, char *out, size_t len) {
+	size_t pendLen = pb->pendPayload != NULL ? sizeof(pb->pendHdr) + pb->pendRead : 0;
+	size_t total = pendLen + pb->end - pb->start;
+	if (out == NULL || len < total) {
+		return total;
+	}
+	if (pb->pendPayload != NULL) {
+		memcpy(out, &pb->pendHdr, sizeof(pb->pendHdr));
+		memcpy(out + sizeof(pb->pendHdr), pb->pendPayload, pb->pendRead);
+	}
+	memcpy(out + pendLen, pb->buf + pb->start, pb->end - pb->start);
+	return total;
+}
+
+/*
+ * Input that fits in the buffer is simply put there.  Only a packet too
+ * large for the buffer can have been saved while being reassembled, and
+ * it is reassembled from where it was left.
+ */
+int proto_buf_restore(PROTO_BUF *pb, const char *data, size_t len) {
+	if (len > PROTO_BUFSIZE) {
+		memcpy(&pb->pendHdr, data, sizeof(pb->pendHdr));
+		size_t size = ntohs(pb->pendHdr.size);
+		size_t take = len - sizeof(pb->pendHdr);
+		if (take > size) {
+			take = size;
+		}
+		pb->pendPayload = pool_alloc(size + 1);
+		if (pb->pendPayload == NULL) {
+			return -1;
+		}
+		memcpy(pb->pendPayload, data + sizeof(pb->pendHdr), take);
+		pb->pendRead = take;
+		data += sizeof(pb->pendHdr) + take;
+		len -= sizeof(pb->pendHdr) + take;
+		if (len > PROTO_BUFSIZE) {
 			return -1;
 		}
-	} else {
-		*payloadp = NULL;
 	}
+	memcpy(pb->buf, data, len);
+	pb->start = 0;
+	pb->end = len;
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "rating_log.h"
+#include "player_registry_ext.h"
+#include "name_hash.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * A record in the log consists of this header, in host byte order,
+ * followed by the names of its players without terminating NULs.  A
+ * game produces a record for two players; compaction produces records
+ * for one.  The check is a 32-bit FNV-1a hash of everything in the
+ * record after the check itself.
+ */
+typedef struct rating_log_header {
+	uint32_t check;
+	uint16_t numPlayers;
+	uint16_t nameLen[2];
+	uint16_t unused;
+	int32_t delta[2];
+} RATING_LOG_HEADER;
+
+#define RATING_LOG_MAX_RECORD (sizeof(RATING_LOG_HEADER) + 2 * UINT16_MAX)
+
+/*
+ * The total change to the rating of a player found while replaying the
+ * log.
+ */
+typedef struct rating_log_entry {
+	uint64_t hash;
+	char *name;
+	long delta;
+} RATING_LOG_ENTRY;
+
+/*
+ * Records are appended to buffer; the flushing thread swaps it with
+ * spare before writing it out, so that appends can continue while it
+ * writes.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t flushCond;
+	pthread_cond_t spaceCond;
+	char *buffer;
+	char *spare;
+	size_t len;
+	int closing;
+	int fd;
+	pthread_t thread;
+} rlog = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.flushCond = PTHREAD_COND_INITIALIZER,
+	.spaceCond = PTHREAD_COND_INITIALIZER,
+	.fd = -1
+};
+
+static atomic_int rlogOpen;
+
+static uint32_t rating_log_check(const char *data, size_t len) {
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Encode a record into a buffer, which must have room for it.
+ *
+ * @return  The size of the record.
+ */
+static size_t rating_log_encode(char *buf, int numPlayers, char **names, size_t *lens, long *deltas) {
+	RATING_LOG_HEADER header = {0};
+	header.numPlayers = numPlayers;
+	size_t size = sizeof(RATING_LOG_HEADER);
+	for (int i = 0; i < numPlayers; i++) {
+		header.nameLen[i] = lens[i];
+		header.delta[i] = deltas[i];
+		memcpy(buf + size, names[i], lens[i]);
+		size += lens[i];
+	}
+	memcpy(buf, &header, sizeof(RATING_LOG_HEADER));
+	header.check = rating_log_check(buf + sizeof(uint32_t), size - sizeof(uint32_t));
+	memcpy(buf, &header.check, sizeof(uint32_t));
+	return size;
+}
+
+/*
+ * Validate the record at the start of a region of the log.
+ *
+ * @return  The size of the record, or 0 if the region does not start
+ * with a complete, intact record.
+ */
+static size_t rating_log_decode(char *data, size_t avail, RATING_LOG_HEADER *header) {
+	if (avail < sizeof(RATING_LOG_HEADER)) {
+		return 0;
+	}
+	memcpy(header, data, sizeof(RATING_LOG_HEADER));
+	if (header->numPlayers < 1 || header->numPlayers > 2
+	    || (header->numPlayers == 1 && header->nameLen[1] != 0)) {
+		return 0;
+	}
+	size_t size = sizeof(RATING_LOG_HEADER) + header->nameLen[0] + header->nameLen[1];
+	if (size > avail
+	    || rating_log_check(data + sizeof(uint32_t), size - sizeof(uint32_t)) != header->check) {
+		return 0;
+	}
+	return size;
+}
+
+/*
+ * Find the entry for a name in the replay table, or the empty entry at
+ * which it belongs.
+ */
+static RATING_LOG_ENTRY *rating_log_probe(RATING_LOG_ENTRY *table, size_t mask, uint64_t hash, char *name) {
+	size_t i = hash & mask;
+	while (table[i].name != NULL
+	       && (table[i].hash != hash || strcmp(table[i].name, name) != 0)) {
+		i = (i + 1) & mask;
+	}
+	return &table[i];
+}
+
+/*
+ * Total the changes recorded in the intact prefix of the log for each
+ * player.  The names are copied into arena, which must be at least as
+ * large as the log, since every name occupies more space in the log
+ * than its NUL-terminated copy.
+ *
+ * @return  The table of totals, with numSlots entries, or NULL if it
+ * could not be allocated.
+ */
+static RATING_LOG_ENTRY *rating_log_total(char *data, size_t valid, size_t numRecords, char *arena,
+					  size_t *numSlotsp) {
+	size_t numSlots = 16;
+	while (numSlots < 4 * numRecords) {
+		numSlots <<= 1;
+	}
+	RATING_LOG_ENTRY *table = calloc(numSlots, sizeof(RATING_LOG_ENTRY));
+	if (table == NULL) {
+		return NULL;
+	}
+	size_t off = 0;
+	while (off < valid) {
+		RATING_LOG_HEADER header;
+		size_t size = rating_log_decode(data + off, valid - off, &header);
+		char *name = data + off + sizeof(RATING_LOG_HEADER);
+		for (int i = 0; i < header.numPlayers; i++) {
+			memcpy(arena, name, header.nameLen[i]);
+			arena[header.nameLen[i]] = '\0';
+			name += header.nameLen[i];
+			uint64_t hash = name_hash(arena);
+			RATING_LOG_ENTRY *entry = rating_log_probe(table, numSlots - 1, hash, arena);
+			if (entry->name == NULL) {
+				entry->hash = hash;
+				entry->name = arena;
+				arena += header.nameLen[i] + 1;
+			}
+			entry->delta += header.delta[i];
+		}
+		off += size;
+	}
+	*numSlotsp = numSlots;
+	return table;
+}
+
+/*
+ * Rewrite the log with a single record per player, replacing it
+ * atomically by renaming a temporary file over it.
+ */
+static int rating_log_compact(char *path, char **names, long *deltas, size_t n) {
+	size_t pathLen = strlen(path);
+	char *tmp = malloc(pathLen + 5);
+	char *buf = malloc(RATING_LOG_MAX_RECORD);
+	if (tmp == NULL || buf == NULL) {
+		free(tmp);
+		free(buf);
+		return -1;
+	}
+	memcpy(tmp, path, pathLen);
+	strcpy(tmp + pathLen, ".tmp");
+	int error = -1;
+	FILE *f = fopen(tmp, "w");
+	if (f != NULL) {
+		size_t i;
+		for (i = 0; i < n; i++) {
+			size_t len = strlen(names[i]);
+			size_t size = rating_log_encode(buf, 1, &names[i], &len, &deltas[i]);
+			if (fwrite(buf, size, 1, f) != 1) {
+				break;
+			}
+		}
+		if (i == n && fflush(f) == 0 && fsync(fileno(f)) == 0) {
+			error = 0;
+		}
+		if (fclose(f) == EOF) {
+			error = -1;
+		}
+		if (error == 0) {
+			error = rename(tmp, path);
+		}
+		if (error == -1) {
+			unlink(tmp);
+		}
+	}
+	free(tmp);
+	free(buf);
+	return error;
+}
+
+/*
+ * Read the whole log into memory.
+ */
+static char *rating_log_read(int fd, size_t *sizep) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		return NULL;
+	}
+	char *data = malloc(st.st_size + 1);
+	if (data == NULL) {
+		return NULL;
+	}
+	if (rio_readn(fd, data, st.st_size) != st.st_size) {
+		free(data);
+		return NULL;
+	}
+	*sizep = st.st_size;
+	return data;
+}
+
+/*
+ * Write out a batch of records and wait for them to reach the disk.
+ */
+static void rating_log_write(char *buf, size_t len) {
+	if (rio_writen(rlog.fd, buf, len) != len || fdatasync(rlog.fd) == -1) {
+		fprintf(stderr, "Failed to write rating log: %s\n", strerror(errno));
+	}
+	debug("%ld: Flushed %zu bytes of rating log", pthread_self(), len);
+}
+
+static void *rating_log_thread(void *arg) {
+	pthread_mutex_lock(&rlog.lock);
+	while (1) {
+		while (rlog.len == 0 && !rlog.closing) {
+			pthread_cond_wait(&rlog.flushCond, &rlog.lock);
+		}
+		if (rlog.len == 0) {
+			break;
+		}
+		// Give further results a chance to join the batch.
+		if (rlog.len < RATING_LOG_BATCH && !rlog.closing) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += RATING_LOG_INTERVAL_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			while (rlog.len < RATING_LOG_BATCH && !rlog.closing
+			       && pthread_cond_timedwait(&rlog.flushCond, &rlog.lock, &deadline) != ETIMEDOUT) {
+				continue;
+			}
+		}
+		char *buf = rlog.buffer;
+		size_t len = rlog.len;
+		rlog.buffer = rlog.spare;
+		rlog.spare = buf;
+		rlog.len = 0;
+		pthread_cond_broadcast(&rlog.spaceCond);
+		pthread_mutex_unlock(&rlog.lock);
+		rating_log_write(buf, len);
+		pthread_mutex_lock(&rlog.lock);
+	}
+	pthread_mutex_unlock(&rlog.lock);
+	return NULL;
+}
+
+long rating_log_open(char *path, PLAYER_REGISTRY *preg) {
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		return -1;
+	}
+	size_t size;
+	char *data = rating_log_read(fd, &size);
+	if (data == NULL) {
+		close(fd);
+		return -1;
+	}
+	// Find the intact prefix of the log.
+	size_t valid = 0;
+	size_t numRecords = 0;
+	RATING_LOG_HEADER header;
+	size_t recordSize;
+	while ((recordSize = rating_log_decode(data + valid, size - valid, &header)) != 0) {
+		valid += recordSize;
+		numRecords++;
+	}
+	if (valid < size) {
+		debug("%ld: Discarding %zu bytes at end of rating log", pthread_self(), size - valid);
+	}
+	char *arena = malloc(valid + 1);
+	size_t numSlots = 0;
+	RATING_LOG_ENTRY *table = arena != NULL ? rating_log_total(data, valid, numRecords, arena, &numSlots) : NULL;
+	free(data);
+	char **names = table != NULL ? malloc(numSlots * sizeof(char *)) : NULL;
+	long *deltas = table != NULL ? malloc(numSlots * sizeof(long)) : NULL;
+	int *ratings = table != NULL ? malloc(numSlots * sizeof(int)) : NULL;
+	if (names == NULL || deltas == NULL || ratings == NULL) {
+		free(arena);
+		free(table);
+		free(names);
+		free(deltas);
+		free(ratings);
+		close(fd);
+		return -1;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < numSlots; i++) {
+		if (table[i].name != NULL) {
+			names[n] = table[i].name;
+			deltas[n] = table[i].delta;
+			ratings[n] = PLAYER_INITIAL_RATING + table[i].delta;
+			n++;
+		}
+	}
+	long restored = preg_preload(preg, names, ratings, n);
+	if (rating_log_compact(path, names, deltas, n) == -1) {
+		// Keep the log as it was, less any damaged tail.
+		if (ftruncate(fd, valid) == -1) {
+			restored = -1;
+		}
+	}
+	close(fd);
+	free(arena);
+	free(table);
+	free(names);
+	free(deltas);
+	free(ratings);
+	if (restored == -1) {
+		return -1;
+	}
+	rlog.buffer = malloc(RATING_LOG_BUFFER);
+	rlog.spare = malloc(RATING_LOG_BUFFER);
+	rlog.fd = open(path, O_WRONLY | O_APPEND);
+	if (rlog.buffer == NULL || rlog.spare == NULL || rlog.fd == -1
+	    || pthread_create(&rlog.thread, NULL, rating_log_thread, NULL) != 0) {
+		free(rlog.buffer);
+		free(rlog.spare);
+		if (rlog.fd != -1) {
+			close(rlog.fd);
+			rlog.fd = -1;
+		}
+		return -1;
+	}
+	rlog.len = 0;
+	rlog.closing = 0;
+	atomic_store_explicit(&rlogOpen, 1, memory_order_release);
+	debug("%ld: Restored %ld ratings from %zu records of rating log %s", pthread_self(),
+	      restored, numRecords, path);
+	return restored;
+}
+
+void rating_log_append(PLAYER *player1, int delta1, PLAYER *player2, int delta2) {
+	if (!atomic_load_explicit(&rlogOpen, memory_order_acquire)) {
+		return;
+	}
+	char *names[2] = { player_get_name(player1), player_get_name(player2) };
+	size_t lens[2] = { strlen(names[0]), strlen(names[1]) };
+	long deltas[2] = { delta1, delta2 };
+	if (lens[0] > UINT16_MAX || lens[1] > UINT16_MAX) {
+		return;
+	}
+	size_t size = sizeof(RATING_LOG_HEADER) + lens[0] + lens[1];
+	pthread_mutex_lock(&rlog.lock);
+	// If the flushing thread has fallen a whole buffer behind, wait for it.
+	while (!rlog.closing && rlog.len + size > RATING_LOG_BUFFER) {
+		pthread_cond_signal(&rlog.flushCond);
+		pthread_cond_wait(&rlog.spaceCond, &rlog.lock);
+	}
+	if (!rlog.closing) {
+		size_t old = rlog.len;
+		rlog.len += rating_log_encode(rlog.buffer + old, 2, names, lens, deltas);
+		if (old == 0 || (old < RATING_LOG_BATCH && rlog.len >= RATING_LOG_BATCH)) {
+			pthread_cond_signal(&rlog.flushCond);
+		}
+	}
+	pthread_mutex_unlock(&rlog.lock);
+}
+
+void rating_log_close(void) {
+	if (!atomic_load_explicit(&rlogOpen, memory_order_acquire)) {
+		return;
+	}
+	pthread_mutex_lock(&rlog.lock);
+	rlog.closing = 1;
+	pthread_cond_signal(&rlog.flushCond);
+	pthread_cond_broadcast(&rlog.spaceCond);
+	pthread_mutex_unlock(&rlog.lock);
+	pthread_join(rlog.thread, NULL);
+	atomic_store_explicit(&rlogOpen, 0, memory_order_release);
+	close(rlog.fd);
+	rlog.fd = -1;
+	free(rlog.buffer);
+	free(rlog.spare);
+	rlog.buffer = rlog.spare = NULL;
+	debug("%ld: Rating log closed", pthread_self());
+}
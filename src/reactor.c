@@ -0,0 +1,527 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include "reactor.h"
+#include "jeux_service.h"
+#include "proto_buf.h"
+#include "packet_pool.h"
+#include "client_registry.h"
+#include "client_ext.h"
+#include "handoff.h"
+#include "handler_pool.h"
+#include "server.h"
+#include "debug.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+/*
+ * Per-connection state kept by a reactor worker.  Incoming bytes are
+ * accumulated in a PROTO_BUF, which reassembles packets across reads, so
+ * a connection can be left at any byte boundary when its socket runs dry
+ * and resumed when more data arrives.  Each worker keeps a list of its
+ * connections, so that it can park them all for a handoff, and a list of
+ * those held back by their in-flight limit, whose input is handled once
+ * enough of their output has been written, as that produces no event.
+ *
+ * When there is a handler pool, a worker only reads and frames: once a
+ * connection has a complete request it is busy, and it belongs to the
+ * handler task that handles its requests, and is left alone by the
+ * worker, until the task hands it back through the worker's list of
+ * finished connections and signals the worker's eventfd.  A connection
+ * adopted after a handoff is handed to its worker the same way.  A
+ * connection has at most one task at a time, so its requests are
+ * handled, and its responses written, in the order they were received.
+ */
+typedef struct reactor_worker REACTOR_WORKER;
+
+typedef struct reactor_conn {
+	CLIENT *client;
+	PROTO_BUF in;
+	HANDOFF_CONN handoff;
+	REACTOR_WORKER *worker;
+	struct reactor_conn *prev;
+	struct reactor_conn *next;
+	int held;
+	struct reactor_conn *nextHeld;
+	HPOOL_TASK task;
+	uintptr_t key;			// the key of the requests being handled
+	int busy;
+	int failed;			// set by the task if input could not be framed
+	struct reactor_conn *nextDone;
+} REACTOR_CONN;
+
+struct reactor_worker {
+	int epfd;
+	pthread_t tid;
+	pthread_mutex_t lock;		// protects the list of connections
+	REACTOR_CONN *conns;
+	REACTOR_CONN *held;		// used only by the worker's thread
+	int donefd;
+	pthread_mutex_t doneLock;	// protects the finished connections
+	pthread_cond_t doneCond;
+	REACTOR_CONN *done;
+	int running;			// tasks not yet finished
+};
+
+static REACTOR_WORKER *workers = NULL;
+static int numWorkers = 0;
+static unsigned int nextWorker = 0;
+
+static void reactor_link(REACTOR_WORKER *worker, REACTOR_CONN *conn) {
+	pthread_mutex_lock(&worker->lock);
+	conn->prev = NULL;
+	conn->next = worker->conns;
+	if (worker->conns != NULL) {
+		worker->conns->prev = conn;
+	}
+	worker->conns = conn;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+static void reactor_hold(REACTOR_WORKER *worker, REACTOR_CONN *conn) {
+	if (!conn->held) {
+		conn->held = 1;
+		conn->nextHeld = worker->held;
+		worker->held = conn;
+	}
+}
+
+/*
+ * Release a connection whose client has already been torn down.
+ */
+static void reactor_release(REACTOR_WORKER *worker, REACTOR_CONN *conn) {
+	debug("%ld: [%d] Ending client service", pthread_self(), conn->in.fd);
+	if (conn->held) {
+		REACTOR_CONN **hp = &worker->held;
+		while (*hp != NULL && *hp != conn) {
+			hp = &(*hp)->nextHeld;
+		}
+		if (*hp != NULL) {
+			*hp = conn->nextHeld;
+		}
+	}
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->in.fd, NULL);
+	close(conn->in.fd);
+	proto_buf_fini(&conn->in);
+	pthread_mutex_lock(&worker->lock);
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else if (worker->conns == conn) {
+		worker->conns = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	free(conn);
+}
+
+static void reactor_close(REACTOR_WORKER *worker, REACTOR_CONN *conn) {
+	jeux_service_close(conn->client);
+	reactor_release(worker, conn);
+}
+
+/*
+ * Read as much as is currently available on a connection, dispatching
+ * each packet as soon as it is complete.  A single read() may deliver
+ * several packets, all of which are handled before reading again, and
+ * whose responses are written together.
+ *
+ * @return 0 if the socket has been drained and the connection remains
+ * open, 1 if the connection's in-flight limit has been reached, so that
+ * the rest of its input is to be handled later, or -1 if EOF or an error
+ * was seen and the connection must be closed.
+ */
+static int reactor_read(REACTOR_CONN *conn) {
+	while (1) {
+		JEUX_PACKET_HEADER hdr;
+		void *payload;
+		int ret = 0;
+		// Packets left in the buffer by a handoff are handled once it is
+		// over, as the worker then reads every connection again.
+		client_cork_output(conn->client);
+		while (!handoff_frozen() && jeux_service_ready(conn->client)
+		       && (ret = proto_buf_next(&conn->in, &hdr, &payload)) == 1) {
+			jeux_service_packet(conn->client, &hdr, payload);
+			pool_free(payload);
+		}
+		client_uncork_output(conn->client);
+		if (ret == -1) {
+			return -1;
+		}
+		if (handoff_frozen()) {
+			return 0;
+		}
+		if (!jeux_service_ready(conn->client)) {
+			return 1;
+		}
+		if (ret == 1) {
+			// The limit was reached, but uncorking has written enough.
+			continue;
+		}
+		ssize_t n = proto_buf_fill(&conn->in);
+		if (n == 0) {
+			debug("EOF on fd: %d", conn->in.fd);
+			return -1;
+		}
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+	}
+}
+
+/*
+ * Handle the requests of a connection in a handler worker, for as long
+ * as they are complete and concern the same game as the first, so that
+ * requests concerning another are handled where they are submitted.  The
+ * connection is then handed back to its reactor worker.
+ */
+static void reactor_handle(HPOOL_TASK *task) {
+	REACTOR_CONN *conn = (REACTOR_CONN *)((char *)task - offsetof(REACTOR_CONN, task));
+	REACTOR_WORKER *worker = conn->worker;
+	JEUX_PACKET_HEADER hdr;
+	void *payload;
+	int ret = 0;
+	int first = 1;
+	client_cork_output(conn->client);
+	while (!handoff_frozen() && jeux_service_ready(conn->client)
+	       && (ret = proto_buf_complete(&conn->in, &hdr)) == 1
+	       && (first || jeux_service_key(conn->client, &hdr) == conn->key)) {
+		first = 0;
+		if (proto_buf_next(&conn->in, &hdr, &payload) != 1) {
+			ret = -1;
+			break;
+		}
+		jeux_service_packet(conn->client, &hdr, payload);
+		pool_free(payload);
+	}
+	client_uncork_output(conn->client);
+	if (ret == -1) {
+		conn->failed = 1;
+	}
+	pthread_mutex_lock(&worker->doneLock);
+	conn->nextDone = worker->done;
+	worker->done = conn;
+	if (--worker->running == 0) {
+		pthread_cond_broadcast(&worker->doneCond);
+	}
+	pthread_mutex_unlock(&worker->doneLock);
+	uint64_t one = 1;
+	if (write(worker->donefd, &one, sizeof(one)) == -1) {
+		debug("%ld: Failed to signal reactor worker: %s", pthread_self(), strerror(errno));
+	}
+}
+
+/*
+ * Read as much as is currently available on a connection, until it has
+ * a complete request, which is submitted to the handler pool under the
+ * key of the request.
+ *
+ * @return 0 if the socket has been drained or the connection is now busy,
+ * 1 if the connection's in-flight limit has been reached, or -1 if EOF or
+ * an error was seen and the connection must be closed.
+ */
+static int reactor_dispatch(REACTOR_WORKER *worker, REACTOR_CONN *conn) {
+	while (1) {
+		if (handoff_frozen()) {
+			return 0;
+		}
+		if (!jeux_service_ready(conn->client)) {
+			return 1;
+		}
+		JEUX_PACKET_HEADER hdr;
+		int ret = proto_buf_complete(&conn->in, &hdr);
+		if (ret == -1) {
+			return -1;
+		}
+		if (ret == 1) {
+			conn->key = jeux_service_key(conn->client, &hdr);
+			conn->busy = 1;
+			pthread_mutex_lock(&worker->doneLock);
+			worker->running++;
+			pthread_mutex_unlock(&worker->doneLock);
+			hpool_submit(&conn->task, conn->key);
+			return 0;
+		}
+		ssize_t n = proto_buf_fill(&conn->in);
+		if (n == 0) {
+			debug("EOF on fd: %d", conn->in.fd);
+			return -1;
+		}
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+	}
+}
+
+/*
+ * Read a connection, holding it back if it has reached its in-flight
+ * limit and closing it on EOF.  A busy connection is left alone, and is
+ * read again once it has been handed back, unless its task failed.
+ */
+static void reactor_service(REACTOR_WORKER *worker, REACTOR_CONN *conn) {
+	if (conn->busy) {
+		return;
+	}
+	int ret = -1;
+	if (!conn->failed) {
+		ret = hpool_enabled() ? reactor_dispatch(worker, conn) : reactor_read(conn);
+	}
+	if (ret == -1) {
+		reactor_close(worker, conn);
+	} else if (ret == 1) {
+		reactor_hold(worker, conn);
+	}
+}
+
+/*
+ * Take back the connections whose tasks have finished, and those adopted
+ * from a predecessor.  Any input they received meanwhile has produced no
+ * event that was not ignored, so they are held, to be read again once
+ * the events at hand have been handled: one of those may be for a
+ * connection that is closed in the meantime.
+ */
+static void reactor_collect(REACTOR_WORKER *worker) {
+	uint64_t count;
+	if (read(worker->donefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		debug("%ld: Failed to read reactor eventfd: %s", pthread_self(), strerror(errno));
+	}
+	pthread_mutex_lock(&worker->doneLock);
+	REACTOR_CONN *done = worker->done;
+	worker->done = NULL;
+	pthread_mutex_unlock(&worker->doneLock);
+	while (done != NULL) {
+		REACTOR_CONN *conn = done;
+		done = conn->nextDone;
+		conn->busy = 0;
+		reactor_hold(worker, conn);
+	}
+}
+
+/*
+ * Wait for the tasks of a worker's connections to finish, as they do
+ * between requests when a handoff begins, and take the connections back
+ * before they are parked; they are all read again after the handoff.
+ */
+static void reactor_quiesce(REACTOR_WORKER *worker) {
+	pthread_mutex_lock(&worker->doneLock);
+	while (worker->running > 0) {
+		pthread_cond_wait(&worker->doneCond, &worker->doneLock);
+	}
+	pthread_mutex_unlock(&worker->doneLock);
+	reactor_collect(worker);
+}
+
+/*
+ * Park all of a worker's connections for a handoff, and wait for it to
+ * be over.  If it failed, the connections it closed are released and the
+ * others are read again, since any input they received meanwhile, or
+ * which was left in their buffers, has produced no new event.
+ */
+static void reactor_freeze(REACTOR_WORKER *worker) {
+	pthread_mutex_lock(&worker->lock);
+	REACTOR_CONN *first = worker->conns;
+	for (REACTOR_CONN *conn = first; conn != NULL; conn = conn->next) {
+		conn->handoff.client = conn->client;
+		conn->handoff.in = &conn->in;
+		handoff_park(&conn->handoff);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	if (first == NULL) {
+		return;
+	}
+	handoff_wait(&first->handoff);
+	// Connections are only removed from the list by this thread, and any
+	// added meanwhile are at its head, so the list can be walked without
+	// holding the lock while each connection is handled.
+	pthread_mutex_lock(&worker->lock);
+	REACTOR_CONN *conn = worker->conns;
+	while (conn != NULL) {
+		REACTOR_CONN *next = conn->next;
+		pthread_mutex_unlock(&worker->lock);
+		if (conn->handoff.closed) {
+			reactor_release(worker, conn);
+		} else {
+			reactor_service(worker, conn);
+		}
+		pthread_mutex_lock(&worker->lock);
+		conn = next;
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+static void *reactor_thread(void *arg) {
+	REACTOR_WORKER *worker = arg;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	debug("%ld: Reactor worker started (epfd %d)", pthread_self(), worker->epfd);
+	while (1) {
+		// Connections held back are looked at again every millisecond.
+		int n = epoll_wait(worker->epfd, events, REACTOR_MAX_EVENTS, worker->held != NULL ? 1 : -1);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			debug("%ld: epoll_wait failed: %s", pthread_self(), strerror(errno));
+			return NULL;
+		}
+		for (int i = 0; i < n; i++) {
+			REACTOR_CONN *conn = events[i].data.ptr;
+			// The event without a connection is the start of a handoff,
+			// and the worker's own is that of tasks having finished.
+			if (events[i].data.ptr == worker) {
+				reactor_collect(worker);
+			} else if (conn != NULL) {
+				reactor_service(worker, conn);
+			}
+		}
+		REACTOR_CONN *held = worker->held;
+		worker->held = NULL;
+		while (held != NULL) {
+			REACTOR_CONN *conn = held;
+			held = conn->nextHeld;
+			conn->held = 0;
+			if (jeux_service_ready(conn->client) || handoff_frozen()) {
+				reactor_service(worker, conn);
+			} else {
+				reactor_hold(worker, conn);
+			}
+		}
+		if (handoff_frozen()) {
+			reactor_quiesce(worker);
+			reactor_freeze(worker);
+		}
+	}
+	return NULL;
+}
+
+int reactor_start(int nworkers) {
+	if (nworkers < 1) {
+		return -1;
+	}
+	workers = calloc(nworkers, sizeof(REACTOR_WORKER));
+	if (workers == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < nworkers; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		pthread_mutex_init(&workers[i].doneLock, NULL);
+		pthread_cond_init(&workers[i].doneCond, NULL);
+		workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (workers[i].epfd == -1) {
+			return -1;
+		}
+		// The eventfd is signalled by handler tasks, and by the thread
+		// that adopts connections after a handoff.
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &workers[i];
+		workers[i].donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (workers[i].donefd == -1 || epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].donefd, &ev) == -1) {
+			return -1;
+		}
+		if (handoff_wakefd() != -1) {
+			struct epoll_event ev;
+			ev.events = EPOLLIN | EPOLLET;
+			ev.data.ptr = NULL;
+			if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, handoff_wakefd(), &ev) == -1) {
+				return -1;
+			}
+		}
+		if (pthread_create(&workers[i].tid, NULL, reactor_thread, &workers[i]) != 0) {
+			return -1;
+		}
+		pthread_detach(workers[i].tid);
+		numWorkers++;
+	}
+	debug("%ld: Reactor started with %d workers", pthread_self(), numWorkers);
+	return 0;
+}
+
+int reactor_add(int connfd) {
+	CLIENT *client = creg_register(client_registry, connfd);
+	if (client == NULL) {
+		debug("%ld: [%d] Failed to start client server", pthread_self(), connfd);
+		close(connfd);
+		return -1;
+	}
+	int flags = fcntl(connfd, F_GETFL, 0);
+	REACTOR_CONN *conn = calloc(1, sizeof(REACTOR_CONN));
+	if (flags == -1 || fcntl(connfd, F_SETFL, flags | O_NONBLOCK) == -1 || conn == NULL) {
+		jeux_service_close(client);
+		close(connfd);
+		free(conn);
+		return -1;
+	}
+	conn->client = client;
+	proto_buf_init(&conn->in, connfd);
+	REACTOR_WORKER *worker = &workers[__atomic_fetch_add(&nextWorker, 1, __ATOMIC_RELAXED) % numWorkers];
+	conn->worker = worker;
+	conn->task.run = reactor_handle;
+	reactor_link(worker, conn);
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, connfd, &ev) == -1) {
+		reactor_close(worker, conn);
+		return -1;
+	}
+	debug("%ld: [%d] Starting client service (reactor epfd %d)", pthread_self(), connfd, worker->epfd);
+	return 0;
+}
+
+int reactor_adopt(CLIENT *client, PROTO_BUF *in) {
+	REACTOR_CONN *conn = calloc(1, sizeof(REACTOR_CONN));
+	if (conn == NULL) {
+		jeux_service_close(client);
+		close(in->fd);
+		proto_buf_fini(in);
+		free(in);
+		return -1;
+	}
+	conn->client = client;
+	conn->in = *in;
+	free(in);
+	REACTOR_WORKER *worker = &workers[__atomic_fetch_add(&nextWorker, 1, __ATOMIC_RELAXED) % numWorkers];
+	conn->worker = worker;
+	conn->task.run = reactor_handle;
+	// Complete packets already in the buffer produce no event, so the
+	// connection is handed to its worker as if a task had just finished
+	// with it, and is left alone until the worker has taken it back.
+	conn->busy = 1;
+	reactor_link(worker, conn);
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, conn->in.fd, &ev) == -1) {
+		reactor_close(worker, conn);
+		return -1;
+	}
+	pthread_mutex_lock(&worker->doneLock);
+	conn->nextDone = worker->done;
+	worker->done = conn;
+	pthread_mutex_unlock(&worker->doneLock);
+	uint64_t one = 1;
+	if (write(worker->donefd, &one, sizeof(one)) == -1) {
+		debug("%ld: Failed to signal reactor worker: %s", pthread_self(), strerror(errno));
+	}
+	debug("%ld: [%d] Resuming client service (reactor epfd %d)", pthread_self(), conn->in.fd, worker->epfd);
+	return 0;
+}
@@ -10,18 +10,425 @@
 #include <sys/socket.h>
 #include <semaphore.h>
 #include <time.h>
+#include <poll.h>
 
 #include "server.h"
+#include "jeux_service.h"
+#include "protocol_ext.h"
+#include "game_ext.h"
+#include "metrics.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "matchmaker.h"
+#include "cluster.h"
+#include "proto_buf.h"
+#include "packet_pool.h"
+#include "handoff.h"
 #include "player_registry.h"
 #include "jeux_globals.h"
 #include "debug.h"
+#include "trace.h"
 #include "csapp.h"
 
 
-int get_int_len (int value) {
-  int l = !value;
-  while(value){ l++; value/=10; }
-  return l;
+static int pipelineDepth = JEUX_PIPELINE_DEFAULT;
+
+void jeux_service_configure(int depth) {
+	pipelineDepth = depth;
+}
+
+/*
+ * Output that has failed no longer holds anything back, so that the
+ * connection is read until its EOF.
+ */
+int jeux_service_ready(CLIENT *client) {
+	return client_output_backlog(client) < pipelineDepth;
+}
+
+uintptr_t jeux_service_key(CLIENT *client, JEUX_PACKET_HEADER *hdr) {
+	switch (hdr->type) {
+	case JEUX_REVOKE_PKT:
+	case JEUX_ACCEPT_PKT:
+	case JEUX_DECLINE_PKT:
+	case JEUX_MOVE_PKT:
+	case JEUX_RESIGN_PKT:
+	case JEUX_HINT_PKT:
+		return client_invitation_key(client, hdr->id);
+	default:
+		return (uintptr_t)client;
+	}
+}
+
+/*
+ * Carry out the request in a packet received from a client and send the
+ * ACK or NACK in response.
+ */
+static int jeux_dispatch_packet(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *payload) {
+	int fd __attribute__((unused)) = client_get_fd(client);
+	if (cluster_forward(client, hdr, payload)) {
+		return 0;
+	}
+	if (hdr->type == JEUX_LOGIN_PKT) {
+		debug("%ld: [%d] LOGIN packet received", pthread_self(), fd);
+		if (payload == NULL) {
+			client_send_nack(client);
+		} else if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login '%s'", pthread_self(), fd, (char*)payload);
+			if (cluster_claim(client, payload) == -1) {
+				debug("%ld: [%d] Username [%s] is logged in on another node", pthread_self(), fd, (char*)payload);
+				client_send_nack(client);
+				return 0;
+			}
+			PLAYER *player = preg_register(player_registry, payload);
+			int error = client_login(client, player);
+			if (error == -1) {
+				debug("%ld: [%d] Some client is already logged in with that username [%s]", pthread_self(), fd, (char*)payload);
+				player_unref(player, "because login failed");
+				cluster_logout(client);
+				client_send_nack(client);
+			} else {
+				client_send_ack(client, NULL, 0);
+			}
+		} else {
+			debug("%ld: [%d] Already logged in (player %p [%s])", pthread_self(), fd, (void *)client_get_player(client), player_get_name(client_get_player(client)));
+			client_send_nack(client);
+		}
+	} else if (hdr->type == JEUX_USERS_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] USERS packet received", pthread_self(), fd);
+			CREG_USERS *users = creg_users_snapshot(client_registry);
+			if (users == NULL) {
+				debug("%ld: [%d] Unable to build users list", pthread_self(), fd);
+				client_send_nack(client);
+				return 0;
+			}
+			size_t len;
+			const char *data = creg_users_data(users, &len);
+			debug("%ld: [%d] Users", pthread_self(), fd);
+			client_send_ack(client, (void *)data, len);
+			creg_users_unref(users);
+		}
+	} else if (hdr->type == JEUX_INVITE_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] INVITE packet received", pthread_self(), fd);
+			debug("%ld: [%d] Invite '%s'", pthread_self(), fd, (char *)payload);
+			CLIENT *target = creg_lookup(client_registry, payload);
+			if (target == NULL) {
+				target = cluster_lookup(payload);
+			}
+			if (target == NULL) {
+				debug("%ld: [%d] No client logged in as user '%s'", pthread_self(), fd, (char *)payload);
+				client_send_nack(client);
+			} else {
+				GAME_ROLE targetRole;
+				GAME_ROLE sourceRole;
+				if (hdr->role == 1) {
+					targetRole = FIRST_PLAYER_ROLE;
+					sourceRole = SECOND_PLAYER_ROLE;
+				} else if (hdr->role == 2) {
+					targetRole = SECOND_PLAYER_ROLE;
+					sourceRole = FIRST_PLAYER_ROLE;
+				}
+				int error = client_make_invitation(client, target, sourceRole, targetRole);
+				client_unref(target, "after invitation attempt");
+				if (error == -1) {
+					client_send_nack(client);
+				} else {
+					client_send_ack(client, NULL, 0);
+				}
+			}
+		}
+	} else if (hdr->type == JEUX_REVOKE_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] REVOKE packet received", pthread_self(), fd);
+			debug("%ld: [%d] Revoke '%d'", pthread_self(), fd, hdr->id);
+			int error = client_revoke_invitation(client, hdr->id);
+			if (error == -1) {
+				client_send_nack(client);
+			} else {
+				client_send_ack(client, NULL, 0);
+			}
+		}
+	} else if (hdr->type == JEUX_DECLINE_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] DECLINE packet received", pthread_self(), fd);
+			debug("%ld: [%d] Decline '%d'", pthread_self(), fd, hdr->id);
+			int error = client_decline_invitation(client, hdr->id);
+			if (error == -1) {
+				client_send_nack(client);
+			} else {
+				client_send_ack(client, NULL, 0);
+			}
+		}
+	} else if (hdr->type == JEUX_ACCEPT_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] ACCEPT packet received", pthread_self(), fd);
+			debug("%ld: [%d] Accept '%d'", pthread_self(), fd, hdr->id);
+			char *str = NULL;
+			int error = client_accept_invitation(client, hdr->id, &str);
+			if (error == -1) {
+				client_send_nack(client);
+			} else {
+				if (str != NULL) {
+					int len = strlen(str);
+					client_send_ack(client, str, len);
+				} else {
+					client_send_ack(client, NULL, 0);
+				}
+			}
+			if (str != NULL) {
+				free(str);
+			}
+		}
+	} else if (hdr->type == JEUX_MOVE_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] MOVE packet received", pthread_self(), fd);
+			debug("%ld: [%d] Move '%d' (%s)", pthread_self(), fd, hdr->id, (char*)payload);
+			int error = client_make_move(client, hdr->id, (char*)payload);
+			if (error == -1) {
+				client_send_nack(client);
+			} else {
+				client_send_ack(client, NULL, 0);
+			}
+		}
+	} else if (hdr->type == JEUX_RESIGN_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] RESIGN packet received", pthread_self(), fd);
+			debug("%ld: [%d] Resign '%d'", pthread_self(), fd, hdr->id);
+			int error = client_resign_game(client, hdr->id);
+			if (error == -1) {
+				client_send_nack(client);
+			} else {
+				client_send_ack(client, NULL, 0);
+			}
+		}
+	} else if (hdr->type == JEUX_HINT_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] HINT packet received", pthread_self(), fd);
+			char move[GAME_MOVE_MAX + 1];
+			GAME_ROLE outcome;
+			int error = client_hint(client, hdr->id, move, sizeof(move), &outcome);
+			if (error == -1) {
+				client_send_nack(client);
+			} else {
+				debug("%ld: [%d] Hint '%d' (%s)", pthread_self(), fd, hdr->id, move);
+				JEUX_PACKET_HEADER pkt = {0};
+				pkt.type = JEUX_ACK_PKT;
+				pkt.role = outcome;
+				pkt.size = strlen(move);
+				client_send_packet(client, &pkt, move);
+			}
+		}
+	} else if (hdr->type == JEUX_MATCH_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] MATCH packet received", pthread_self(), fd);
+			if (matchmaker_enqueue(client) == -1) {
+				client_send_nack(client);
+			} else {
+				client_send_ack(client, NULL, 0);
+			}
+		}
+	} else if (hdr->type == JEUX_WATCH_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else if (payload == NULL || *(char *)payload == '\0') {
+			debug("%ld: [%d] WATCH packet without a username", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] WATCH packet received", pthread_self(), fd);
+			debug("%ld: [%d] Watch '%s'", pthread_self(), fd, (char *)payload);
+			CLIENT *player = creg_lookup(client_registry, payload);
+			if (player == NULL) {
+				debug("%ld: [%d] No client logged in as user '%s'", pthread_self(), fd, (char *)payload);
+				client_send_nack(client);
+			} else {
+				// The ACK, with the watch ID, is sent by client_watch().
+				int id = client_watch(client, player);
+				client_unref(player, "after watch attempt");
+				if (id == -1) {
+					client_send_nack(client);
+				}
+			}
+		}
+	} else if (hdr->type == JEUX_UNWATCH_PKT) {
+		if (client_get_player(client) == NULL) {
+			debug("%ld: [%d] Login required", pthread_self(), fd);
+			client_send_nack(client);
+		} else {
+			debug("%ld: [%d] UNWATCH packet received", pthread_self(), fd);
+			debug("%ld: [%d] Unwatch '%d'", pthread_self(), fd, hdr->id);
+			if (client_unwatch(client, hdr->id) == -1) {
+				client_send_nack(client);
+			} else {
+				client_send_ack(client, NULL, 0);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Handle a single packet received from a client.  This is the request
+ * dispatcher shared by the thread-per-connection service loop and the
+ * event-driven reactor: it carries out the client's request and sends the
+ * ACK or NACK in response.  Whether the client is logged in is taken from
+ * the CLIENT itself, so no per-connection state is needed by the caller.
+ * The time taken is recorded in the metrics for the packet type.
+ *
+ * @param client  The CLIENT from which the packet was received.
+ * @param hdr  The header of the received packet, in network byte order.
+ * @param payload  The NUL-terminated payload of the packet, or NULL.
+ * @return 0 if the request was handled, -1 if an internal failure
+ * prevented the request from being carried out.
+ */
+int jeux_service_packet(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *payload) {
+	uint64_t start = metrics_now();
+	trace(TRACE_PACKET_RECV, client, hdr->id, ntohs(hdr->size), hdr->type, NULL);
+	client_touch(client);
+	int error = jeux_dispatch_packet(client, hdr, payload);
+	metrics_packet(hdr->type, start);
+	return error;
+}
+
+/*
+ * Tear down the state associated with a client whose connection has
+ * reached EOF.  If the client was logged in, the reference to the PLAYER
+ * obtained at login is discarded and the client is logged out, and any
+ * name it claimed in a cluster is released; the client is then removed
+ * from the client registry.  Its idle timer is stopped first and output
+ * to the client is shut down before it is unregistered, and the caller
+ * is responsible for closing the file descriptor once this has returned.
+ *
+ * @param client  The CLIENT whose connection has ended.
+ */
+void jeux_service_close(CLIENT *client) {
+	client_stop_idle(client);
+	PLAYER *player = client_get_player(client);
+	if (player != NULL) {
+		player_unref(player, "because server thread is discarding reference to logged in player");
+		debug("%ld: [%d] Logging out client", pthread_self(), client_get_fd(client));
+		client_logout(client);
+	}
+	cluster_logout(client);
+	client_shutdown_output(client);
+	creg_unregister(client_registry, client);
+}
+
+/*
+ * Receive the next packet from a client, unless its service thread is to
+ * freeze for a handoff.  When there is a handoff socket, the wait for
+ * input also watches for the start of a handoff, which is only noticed
+ * between packets.
+ *
+ * @return  0 if a packet was received, 1 if the thread is to freeze,
+ * -1 on EOF or error.
+ */
+static int jeux_recv_packet(PROTO_BUF *in, JEUX_PACKET_HEADER *hdr, void **payloadp) {
+	int wakefd = handoff_wakefd();
+	if (wakefd == -1) {
+		return proto_buf_recv_packet(in, hdr, payloadp);
+	}
+	while (1) {
+		if (handoff_frozen()) {
+			return 1;
+		}
+		int ret = proto_buf_next(in, hdr, payloadp);
+		if (ret != 0) {
+			return ret == 1 ? 0 : -1;
+		}
+		struct pollfd fds[2] = { { in->fd, POLLIN, 0 }, { wakefd, POLLIN, 0 } };
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (fds[0].revents != 0) {
+			ssize_t n = proto_buf_fill(in);
+			if (n == 0) {
+				debug("EOF on fd: %d", in->fd);
+				return -1;
+			}
+			if (n == -1 && errno != EAGAIN) {
+				return -1;
+			}
+		}
+	}
+}
+
+/*
+ * The service loop for a client, as run by jeux_client_service() and by
+ * the threads started for connections handed over by a predecessor.
+ * The input buffer is released when the loop ends.
+ */
+static void jeux_service_loop(CLIENT *client, PROTO_BUF *in) {
+	int connfd = in->fd;
+	while (1) {
+		JEUX_PACKET_HEADER hdr;
+		void *payload;
+		int recvValue = jeux_recv_packet(in, &hdr, &payload);
+		if (recvValue == 1) {
+			HANDOFF_CONN conn = { .client = client, .in = in };
+			handoff_park(&conn);
+			handoff_wait(&conn);
+			if (!conn.closed) {
+				continue;
+			}
+			// The client was closed by a handoff that then failed.
+			recvValue = -1;
+		} else if (recvValue == -1) {
+			jeux_service_close(client);
+		}
+		if (recvValue == -1) {
+			close(connfd);
+			debug("%ld: [%d] Ending client service", pthread_self(), connfd);
+			proto_buf_fini(in);
+			free(in);
+			return;
+		}
+		// Everything already received is handled before the responses are
+		// written, and they are written together.
+		client_cork_output(client);
+		do {
+			jeux_service_packet(client, &hdr, payload);
+			pool_free(payload);
+		} while (jeux_service_ready(client) && !handoff_frozen()
+			 && proto_buf_next(in, &hdr, &payload) == 1);
+		client_uncork_output(client);
+		// Once the limit is reached, nothing more is read until enough of
+		// the output has been written.
+		while (!jeux_service_ready(client) && !handoff_frozen()) {
+			client_flush_output(client, 1);
+		}
+	}
 }
 
 /*
@@ -50,223 +457,66 @@ void *jeux_client_service(void *arg) {
 	free(arg);
 	debug("%ld: [%d] Starting client service", pthread_self(), connfd);
 	CLIENT *client = creg_register(client_registry, connfd);
+	handoff_service_started();
 	if (client == NULL) {
 		debug("%ld: [%d] Failed to start client server", pthread_self(), connfd);
 		close(connfd);
 		return NULL;
 	}
-	int loggedIn = 0;
-	while (1) {
-		JEUX_PACKET_HEADER *hdr = malloc(sizeof(JEUX_PACKET_HEADER));
-		void **payloadp = malloc(sizeof(void*));
-		int recvValue = proto_recv_packet(connfd, hdr, payloadp);
-		if (recvValue == -1) {
-			close(connfd);
-			if (loggedIn) {
-				PLAYER *player = client_get_player(client);
-				player_unref(player, "because server thread is discarding reference to logged in player");
-				debug("%ld: [%d] Logging out client", pthread_self(), connfd);
-				client_logout(client);
-			}
-			creg_unregister(client_registry, client);
-			debug("%ld: [%d] Ending client service", pthread_self(), connfd);
-			free(hdr);
-			if (*payloadp != NULL) {
-				free(*payloadp);
-			}
-			free(payloadp);
-			return NULL;
-		} else {
-			if (hdr->type == JEUX_LOGIN_PKT) {
-				debug("%ld: [%d] LOGIN packet received", pthread_self(), connfd);
-				if (!loggedIn) {
-					debug("%ld: [%d] Login '%s'", pthread_self(), connfd, (char*)*payloadp);
-					CLIENT *existingClient = creg_lookup(client_registry, *payloadp);
-					if (existingClient != NULL) {
-						debug("%ld: [%d] Client %p is already logged in with that username [%s]", pthread_self(), connfd, existingClient, (char*)*payloadp);
-						client_unref(existingClient, "becuase the lookup of the client is no longer needed");
-						client_send_nack(client);
-					} else {
-						PLAYER *player = preg_register(player_registry, *payloadp);
-						int error = client_login(client, player);
-						if (error == -1) {
-							client_send_nack(client);
-						} else {
-							loggedIn = 1;
-							client_send_ack(client, NULL, 0);
-						}
-					}
-				} else {
-					debug("%ld: [%d] Already logged in (player %p [%s])", pthread_self(), connfd, (void *)client_get_player(client), player_get_name(client_get_player(client)));
-					client_send_nack(client);
-				}
-			} else if (hdr->type == JEUX_USERS_PKT) {
-				if (!loggedIn) {
-					debug("%ld: [%d] Login required", pthread_self(), connfd);
-					client_send_nack(client);
-				} else {
-					debug("%ld: [%d] USERS packet received", pthread_self(), connfd);
-					PLAYER **playerList = creg_all_players(client_registry);
-					debug("%ld: [%d] Users", pthread_self(), connfd);
-					char *targetBuffer = NULL;
-   					int bufferSize = 1;
-   					PLAYER **freePlayerList = playerList;
-					while (*playerList != NULL) {
-						char *tmp;
-						int playerRatingLength = get_int_len(player_get_rating(*playerList));
-						int totalLength = strlen(player_get_name(*playerList)) + playerRatingLength + 2; // for tab newline
-						tmp = realloc(targetBuffer, sizeof *tmp * (bufferSize + totalLength));
-						if (tmp) {
-							char playerRating[playerRatingLength + 1];
-						    snprintf(playerRating, playerRatingLength + 1, "%d", player_get_rating(*playerList));
-							targetBuffer = tmp;
-							if (bufferSize == 1) {
-								strcpy(targetBuffer, player_get_name(*playerList));
-							} else {
-								strcat(targetBuffer, player_get_name(*playerList));
-							}
-							bufferSize += totalLength;
-							strcat(targetBuffer, "\t");
-							strcat(targetBuffer, playerRating);
-							strcat(targetBuffer, "\n");
-							player_unref(*playerList, "for player removed from players list");
-						}
-						else {
-							free(freePlayerList);
-						 	free(targetBuffer);
-						 	targetBuffer = NULL;
-						 	bufferSize = 0;
-						 	debug("%ld: [%d] Unable to allocate or extend input buffer", pthread_self(), connfd);
-						 	client_send_nack(client);
-						 	free(hdr);
-							free(*payloadp);
-							free(payloadp);
-						 	continue;
-						}
-						playerList++;
-					}
-					bufferSize = (bufferSize - 1);
-					client_send_ack(client, targetBuffer, bufferSize);
-					free(freePlayerList);
-					free(targetBuffer);
-				}
-			} else if (hdr->type == JEUX_INVITE_PKT) {
-				if (!loggedIn) {
-					debug("%ld: [%d] Login required", pthread_self(), connfd);
-					client_send_nack(client);
-				} else {
-					debug("%ld: [%d] INVITE packet received", pthread_self(), connfd);
-					debug("%ld: [%d] Invite '%s'", pthread_self(), connfd, (char *)*payloadp);
-					CLIENT *target = creg_lookup(client_registry, *payloadp);
-					if (target == NULL) {
-						debug("%ld: [%d] No client logged in as user '%s'", pthread_self(), connfd, (char *)*payloadp);
-						client_send_nack(client);
-					} else {
-						GAME_ROLE targetRole;
-						GAME_ROLE sourceRole;
-						if (hdr->role == 1) {
-							targetRole = FIRST_PLAYER_ROLE;
-							sourceRole = SECOND_PLAYER_ROLE;
-						} else if (hdr->role == 2) {
-							targetRole = SECOND_PLAYER_ROLE;
-							sourceRole = FIRST_PLAYER_ROLE;
-						}
-						int error = client_make_invitation(client, target, sourceRole, targetRole);
-						client_unref(target, "after invitation attempt");
-						if (error == -1) {
-							client_send_nack(client);
-						} else {
-							client_send_ack(client, NULL, 0);
-						}
-					}
-				}
-			} else if (hdr->type == JEUX_REVOKE_PKT) {
-				if (!loggedIn) {
-					debug("%ld: [%d] Login required", pthread_self(), connfd);
-					client_send_nack(client);
-				} else {
-					debug("%ld: [%d] REVOKE packet received", pthread_self(), connfd);
-					debug("%ld: [%d] Revoke '%d'", pthread_self(), connfd, hdr->id);
-					int error = client_revoke_invitation(client, hdr->id);
-					if (error == -1) {
-						client_send_nack(client);
-					} else {
-						client_send_ack(client, NULL, 0);
-					}
-				}
-			} else if (hdr->type == JEUX_DECLINE_PKT) {
-				if (!loggedIn) {
-					debug("%ld: [%d] Login required", pthread_self(), connfd);
-					client_send_nack(client);
-				} else {
-					debug("%ld: [%d] DECLINE packet received", pthread_self(), connfd);
-					debug("%ld: [%d] Decline '%d'", pthread_self(), connfd, hdr->id);
-					int error = client_decline_invitation(client, hdr->id);
-					if (error == -1) {
-						client_send_nack(client);
-					} else {
-						client_send_ack(client, NULL, 0);
-					}
-				}
-			} else if (hdr->type == JEUX_ACCEPT_PKT) {
-				if (!loggedIn) {
-					debug("%ld: [%d] Login required", pthread_self(), connfd);
-					client_send_nack(client);
-				} else {
-					debug("%ld: [%d] ACCEPT packet received", pthread_self(), connfd);
-					debug("%ld: [%d] Accept '%d'", pthread_self(), connfd, hdr->id);
-					char **strp = (char**)malloc(sizeof(char*));
-					int error = client_accept_invitation(client, hdr->id, strp);
-					if (error == -1) {
-						client_send_nack(client);
-					} else {
-						if (*strp != NULL) {
-							int len = strlen(*strp);
-							client_send_ack(client, *strp, len);
-						} else {
-							client_send_ack(client, NULL, 0);
-						}
-					}
-					if (*strp != NULL) {
-						free(*strp);
-					}
-					free(strp);
-				}
-			} else if (hdr->type == JEUX_MOVE_PKT) {
-				if (!loggedIn) {
-					debug("%ld: [%d] Login required", pthread_self(), connfd);
-					client_send_nack(client);
-				} else {
-					debug("%ld: [%d] MOVE packet received", pthread_self(), connfd);
-					debug("%ld: [%d] Move '%d' (%s)", pthread_self(), connfd, hdr->id, (char*)*payloadp);
-					int error = client_make_move(client, hdr->id, (char*)*payloadp);
-					if (error == -1) {
-						client_send_nack(client);
-					} else {
-						client_send_ack(client, NULL, 0);
-					}
-				}
-			} else if (hdr->type == JEUX_RESIGN_PKT) {
-				if (!loggedIn) {
-					debug("%ld: [%d] Login required", pthread_self(), connfd);
-					client_send_nack(client);
-				} else {
-					debug("%ld: [%d] RESIGN packet received", pthread_self(), connfd);
-					debug("%ld: [%d] Resign '%d'", pthread_self(), connfd, hdr->id);
-					int error = client_resign_game(client, hdr->id);
-					if (error == -1) {
-						client_send_nack(client);
-					} else {
-						client_send_ack(client, NULL, 0);
-					}
-				}
-			}
-			free(hdr);
-			if (*payloadp != NULL) {
-				free(*payloadp);
-			}
-			free(payloadp);
-		}
+	PROTO_BUF *in = malloc(sizeof(PROTO_BUF));
+	if (in == NULL) {
+		debug("%ld: [%d] Failed to allocate input buffer", pthread_self(), connfd);
+		jeux_service_close(client);
+		close(connfd);
+		return NULL;
 	}
+	proto_buf_init(in, connfd);
+	jeux_service_loop(client, in);
 	return NULL;
-}
\ No newline at end of file
+}
+
+typedef struct jeux_adopted {
+	CLIENT *client;
+	PROTO_BUF *in;
+} JEUX_ADOPTED;
+
+/*
+ * Thread function for the thread that handles a connection handed over
+ * by a predecessor.
+ */
+static void *jeux_adopted_service(void *arg) {
+	JEUX_ADOPTED adopted = *(JEUX_ADOPTED *)arg;
+	pthread_detach(pthread_self());
+	free(arg);
+	debug("%ld: [%d] Resuming client service", pthread_self(), adopted.in->fd);
+	jeux_service_loop(adopted.client, adopted.in);
+	return NULL;
+}
+
+/*
+ * Start a thread to service a connection that has been handed over by a
+ * predecessor, whose client is already registered.
+ *
+ * @param client  The registered CLIENT.
+ * @param in  The input buffer of the connection, as restored, which is
+ * released by the thread.
+ * @return 0 if the thread was started, otherwise -1, in which case the
+ * client has been unregistered and its connection closed.
+ */
+int jeux_service_adopt(CLIENT *client, PROTO_BUF *in) {
+	JEUX_ADOPTED *adopted = malloc(sizeof(JEUX_ADOPTED));
+	pthread_t tid;
+	if (adopted != NULL) {
+		adopted->client = client;
+		adopted->in = in;
+		if (pthread_create(&tid, NULL, jeux_adopted_service, adopted) == 0) {
+			return 0;
+		}
+		free(adopted);
+	}
+	jeux_service_close(client);
+	close(in->fd);
+	proto_buf_fini(in);
+	free(in);
+	return -1;
+}
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "slab.h"
+#include "debug.h"
+
+struct slab_magazine {
+	SLAB_MAGAZINE *next;
+	int count;
+	void *objects[SLAB_MAGAZINE_SIZE];
+};
+
+/*
+ * A thread's magazines for one SLAB.  The loaded magazine is used first;
+ * the previous one is swapped in when the loaded one runs out (or fills
+ * up), so that a thread alternating between allocation and release at a
+ * magazine boundary does not keep going to the depot.
+ */
+typedef struct slab_cache {
+	SLAB_MAGAZINE *loaded;
+	SLAB_MAGAZINE *previous;
+} SLAB_CACHE;
+
+static SLAB *slabs[SLAB_MAX_TYPES];
+static atomic_int numSlabs;
+
+static __thread SLAB_CACHE threadCaches[SLAB_MAX_TYPES];
+static __thread int threadRegistered;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Return a magazine to the depot of its SLAB.  The depot lock must be
+ * held.
+ */
+static void slab_depot_put(SLAB *slab, SLAB_MAGAZINE *mag) {
+	SLAB_MAGAZINE **list = mag->count > 0 ? &slab->full : &slab->empty;
+	mag->next = *list;
+	*list = mag;
+}
+
+static void slab_thread_exit(void *arg) {
+	SLAB_CACHE *caches = arg;
+	int n = atomic_load(&numSlabs);
+	for (int i = 0; i < n; i++) {
+		SLAB *slab = slabs[i];
+		pthread_mutex_lock(&slab->lock);
+		if (caches[i].loaded != NULL) {
+			slab_depot_put(slab, caches[i].loaded);
+		}
+		if (caches[i].previous != NULL) {
+			slab_depot_put(slab, caches[i].previous);
+		}
+		pthread_mutex_unlock(&slab->lock);
+		caches[i].loaded = NULL;
+		caches[i].previous = NULL;
+	}
+}
+
+static void slab_key_init(void) {
+	pthread_key_create(&cacheKey, slab_thread_exit);
+}
+
+/*
+ * Get the calling thread's magazines for a SLAB, assigning the SLAB an
+ * index the first time it is used by any thread.
+ */
+static SLAB_CACHE *slab_cache(SLAB *slab) {
+	int id = atomic_load_explicit(&slab->id, memory_order_acquire);
+	if (id < 0) {
+		pthread_mutex_lock(&slab->lock);
+		id = atomic_load_explicit(&slab->id, memory_order_relaxed);
+		if (id < 0) {
+			id = atomic_load(&numSlabs);
+			if (id == SLAB_MAX_TYPES) {
+				fprintf(stderr, "Too many slabs (%s)\n", slab->name);
+				abort();
+			}
+			slabs[id] = slab;
+			atomic_store(&numSlabs, id + 1);
+			atomic_store_explicit(&slab->id, id, memory_order_release);
+		}
+		pthread_mutex_unlock(&slab->lock);
+	}
+	if (!threadRegistered) {
+		pthread_once(&cacheOnce, slab_key_init);
+		pthread_setspecific(cacheKey, threadCaches);
+		threadRegistered = 1;
+	}
+	return &threadCaches[id];
+}
+
+/*
+ * Carve a new chunk of objects, construct them, and load all but one
+ * of them into a magazine.
+ *
+ * @return  The remaining object, or NULL if memory could not be
+ * allocated.
+ */
+static void *slab_grow(SLAB *slab, SLAB_MAGAZINE *mag) {
+	size_t size = (slab->size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+	char *chunk = aligned_alloc(SLAB_ALIGN, SLAB_MAGAZINE_SIZE * size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	for (int i = 0; i < SLAB_MAGAZINE_SIZE; i++) {
+		if (slab->construct != NULL) {
+			slab->construct(chunk + i * size);
+		}
+	}
+	for (int i = 1; i < SLAB_MAGAZINE_SIZE; i++) {
+		mag->objects[mag->count++] = chunk + i * size;
+	}
+	atomic_fetch_add_explicit(&slab->objects, SLAB_MAGAZINE_SIZE, memory_order_relaxed);
+	debug("%ld: Grew %s slab to %lu objects", pthread_self(), slab->name, atomic_load(&slab->objects));
+	return chunk;
+}
+
+void *slab_alloc(SLAB *slab) {
+	SLAB_CACHE *cache = slab_cache(slab);
+	if (cache->loaded != NULL && cache->loaded->count > 0) {
+		return cache->loaded->objects[--cache->loaded->count];
+	}
+	if (cache->previous != NULL && cache->previous->count > 0) {
+		SLAB_MAGAZINE *mag = cache->loaded;
+		cache->loaded = cache->previous;
+		cache->previous = mag;
+		return cache->loaded->objects[--cache->loaded->count];
+	}
+	// Both magazines are empty: exchange one for a full magazine from
+	// the depot, or else refill it with newly constructed objects.
+	pthread_mutex_lock(&slab->lock);
+	SLAB_MAGAZINE *mag = slab->full;
+	if (mag != NULL) {
+		slab->full = mag->next;
+		if (cache->previous == NULL) {
+			cache->previous = cache->loaded;
+		} else {
+			slab_depot_put(slab, cache->loaded);
+		}
+		cache->loaded = mag;
+		pthread_mutex_unlock(&slab->lock);
+		return mag->objects[--mag->count];
+	}
+	pthread_mutex_unlock(&slab->lock);
+	if (cache->loaded == NULL && (cache->loaded = calloc(1, sizeof(SLAB_MAGAZINE))) == NULL) {
+		return NULL;
+	}
+	return slab_grow(slab, cache->loaded);
+}
+
+void slab_free(SLAB *slab, void *object) {
+	SLAB_CACHE *cache = slab_cache(slab);
+	if (cache->loaded != NULL && cache->loaded->count < SLAB_MAGAZINE_SIZE) {
+		cache->loaded->objects[cache->loaded->count++] = object;
+		return;
+	}
+	if (cache->previous != NULL && cache->previous->count < SLAB_MAGAZINE_SIZE) {
+		SLAB_MAGAZINE *mag = cache->loaded;
+		cache->loaded = cache->previous;
+		cache->previous = mag;
+		cache->loaded->objects[cache->loaded->count++] = object;
+		return;
+	}
+	// Both magazines are full, or there are none yet: exchange one for an
+	// empty magazine from the depot, or a new one.
+	pthread_mutex_lock(&slab->lock);
+	SLAB_MAGAZINE *mag = slab->empty;
+	if (mag != NULL) {
+		slab->empty = mag->next;
+	}
+	if (mag != NULL || (mag = calloc(1, sizeof(SLAB_MAGAZINE))) != NULL) {
+		if (cache->previous == NULL) {
+			cache->previous = cache->loaded;
+		} else {
+			slab_depot_put(slab, cache->loaded);
+		}
+		cache->loaded = mag;
+		mag->objects[mag->count++] = object;
+	}
+	// Otherwise the object is lost, since it cannot be given back to
+	// the system allocator.
+	pthread_mutex_unlock(&slab->lock);
+}
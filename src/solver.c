@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "solver.h"
+#include "debug.h"
+
+/*
+ * One entry per board.  The score is the result of the position for the
+ * side to move: zero for a draw, otherwise 10 minus the number of pieces
+ * on the board when the game ends, positive if the side to move wins and
+ * negative if it loses, so that quicker wins and slower losses score
+ * higher.  The move holds the best cell (0 if the game is over) together
+ * with SOLVER_SOLVED, which marks the positions reached by the search.
+ */
+typedef struct solver_entry {
+	int8_t score;
+	uint8_t move;
+} SOLVER_ENTRY;
+
+#define SOLVER_SOLVED 0x80
+#define SOLVER_CELL_MASK 0x0f
+
+static const uint16_t solver_lines[8] = {
+	0007, 0070, 0700,	// rows
+	0111, 0222, 0444,	// columns
+	0421, 0124		// diagonals
+};
+
+static const uint16_t solver_pow3[9] = { 1, 3, 9, 27, 81, 243, 729, 2187, 6561 };
+static SOLVER_ENTRY solver_table[SOLVER_NUM_BOARDS];
+static pthread_once_t solver_once = PTHREAD_ONCE_INIT;
+
+static int solver_has_line(uint16_t mask) {
+	for (int i = 0; i < 8; i++) {
+		if ((mask & solver_lines[i]) == solver_lines[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Solve the position in which the side to move has the cells in mine and
+ * its opponent those in theirs, and return its score.  The opponent has
+ * just moved, so only it can have completed a line.
+ */
+static int solver_solve(uint16_t mine, uint16_t theirs, int index, int mineDigit) {
+	SOLVER_ENTRY *entry = &solver_table[index];
+	if (entry->move & SOLVER_SOLVED) {
+		return entry->score;
+	}
+	uint16_t occupied = mine | theirs;
+	int pieces = __builtin_popcount(occupied);
+	if (solver_has_line(theirs)) {
+		entry->score = -(10 - pieces);
+		entry->move = SOLVER_SOLVED;
+		return entry->score;
+	}
+	if (pieces == 9) {
+		entry->score = 0;
+		entry->move = SOLVER_SOLVED;
+		return 0;
+	}
+	int best = -100;
+	int bestCell = 0;
+	for (int i = 0; i < 9; i++) {
+		uint16_t cell = 1 << i;
+		if (occupied & cell) {
+			continue;
+		}
+		int score = -solver_solve(theirs, mine | cell, index + mineDigit * solver_pow3[i], 3 - mineDigit);
+		if (score > best) {
+			best = score;
+			bestCell = i + 1;
+		}
+	}
+	entry->score = best;
+	entry->move = SOLVER_SOLVED | bestCell;
+	return best;
+}
+
+static void solver_build(void) {
+	solver_solve(0, 0, 0, 1);
+	debug("%ld: Solved all tic-tac-toe positions", pthread_self());
+}
+
+void solver_init(void) {
+	pthread_once(&solver_once, solver_build);
+}
+
+int solver_lookup(uint16_t index, int *valuep) {
+	solver_init();
+	int value = SOLVER_DRAW;
+	int cell = 0;
+	if (index < SOLVER_NUM_BOARDS && (solver_table[index].move & SOLVER_SOLVED)) {
+		SOLVER_ENTRY *entry = &solver_table[index];
+		value = entry->score > 0 ? SOLVER_WIN : entry->score < 0 ? SOLVER_LOSS : SOLVER_DRAW;
+		cell = entry->move & SOLVER_CELL_MASK;
+	}
+	if (valuep != NULL) {
+		*valuep = value;
+	}
+	return cell;
+}
@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "timer.h"
+#include "csapp.h"
+
+/*
+ * The pending timers are kept in TIMER_WHEEL_SLOTS lists, in the slot of
+ * their tick, and in one more list, of the timers that have expired and
+ * are waiting to be fired, so that a timer function can set or cancel
+ * any timer, including another one that has expired in the same tick.
+ */
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_DUE TIMER_WHEEL_SLOTS
+
+/*
+ * The values of pending: which list a pending timer is in.
+ */
+#define TIMER_IN_SLOT 1
+#define TIMER_EXPIRED 2
+
+_Static_assert((TIMER_WHEEL_SLOTS & TIMER_WHEEL_MASK) == 0, "wheel size must be a power of two");
+
+static struct {
+	pthread_mutex_t lock;		// protects everything in the wheel
+	pthread_cond_t cond;		// the wheel has work, or a function has returned
+	pthread_once_t once;
+	TIMER *slots[TIMER_WHEEL_SLOTS + 1];
+	uint64_t current;		// the last tick whose slot has been reached
+	int count;			// pending timers
+	int paused;
+	int firing;			// a timer function is running
+} wheel = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT
+};
+
+/*
+ * The wheel is turned by the same clock by which timers are set and
+ * their functions check the time, so a timer that has expired is never
+ * found to be early.
+ */
+uint64_t timer_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_init(TIMER *timer, void (*fire)(void *arg), void *arg) {
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->tick = 0;
+	timer->fire = fire;
+	timer->arg = arg;
+	timer->pending = 0;
+}
+
+static TIMER **timer_list(TIMER *timer) {
+	return timer->pending == TIMER_EXPIRED ? &wheel.slots[TIMER_DUE]
+		: &wheel.slots[timer->tick & TIMER_WHEEL_MASK];
+}
+
+static void timer_link(TIMER *timer, int pending) {
+	timer->pending = pending;
+	TIMER **list = timer_list(timer);
+	timer->prev = NULL;
+	timer->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = timer;
+	}
+	*list = timer;
+}
+
+static void timer_unlink(TIMER *timer) {
+	if (timer->prev != NULL) {
+		timer->prev->next = timer->next;
+	} else {
+		*timer_list(timer) = timer->next;
+	}
+	if (timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+	timer->pending = 0;
+}
+
+/*
+ * Move the timers of the slot of the current tick that expire in it to
+ * the list of those to be fired.
+ */
+static void timer_expire(void) {
+	TIMER *next;
+	for (TIMER *timer = wheel.slots[wheel.current & TIMER_WHEEL_MASK]; timer != NULL; timer = next) {
+		next = timer->next;
+		if (timer->tick <= wheel.current) {
+			timer_unlink(timer);
+			timer_link(timer, TIMER_EXPIRED);
+		}
+	}
+}
+
+/*
+ * The thread that turns the wheel.  It catches up one tick at a time if
+ * it has fallen behind, and fires the timers that have expired before
+ * going on to the next tick.
+ */
+static void *timer_thread(void *arg) {
+	pthread_detach(pthread_self());
+	pthread_mutex_lock(&wheel.lock);
+	while (1) {
+		if (wheel.paused || wheel.count == 0) {
+			pthread_cond_wait(&wheel.cond, &wheel.lock);
+			continue;
+		}
+		TIMER *timer = wheel.slots[TIMER_DUE];
+		if (timer != NULL) {
+			timer_unlink(timer);
+			wheel.count--;
+			wheel.firing = 1;
+			pthread_mutex_unlock(&wheel.lock);
+			timer->fire(timer->arg);
+			pthread_mutex_lock(&wheel.lock);
+			wheel.firing = 0;
+			if (wheel.paused) {
+				pthread_cond_broadcast(&wheel.cond);
+			}
+			continue;
+		}
+		uint64_t now = timer_now();
+		if (wheel.current >= now / TIMER_TICK_MS) {
+			uint64_t next = (wheel.current + 1) * TIMER_TICK_MS;
+			struct timespec deadline = { next / 1000, (next % 1000) * 1000000 };
+			pthread_cond_timedwait(&wheel.cond, &wheel.lock, &deadline);
+			continue;
+		}
+		wheel.current++;
+		timer_expire();
+	}
+	return NULL;
+}
+
+static void timer_start(void) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wheel.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	wheel.current = timer_now() / TIMER_TICK_MS;
+	// As with the signal threads, the thread takes no signals.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_t tid;
+	Pthread_create(&tid, NULL, timer_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+int timer_schedule(TIMER *timer, uint64_t when) {
+	pthread_once(&wheel.once, timer_start);
+	pthread_mutex_lock(&wheel.lock);
+	int added = !timer->pending;
+	if (added) {
+		if (wheel.count++ == 0) {
+			// The wheel stops turning while no timer is pending, so
+			// it is brought up to date rather than made to catch up.
+			uint64_t now = timer_now() / TIMER_TICK_MS;
+			if (wheel.current < now) {
+				wheel.current = now;
+			}
+			pthread_cond_broadcast(&wheel.cond);
+		}
+	} else {
+		timer_unlink(timer);
+	}
+	uint64_t tick = (when + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	timer->tick = tick > wheel.current ? tick : wheel.current + 1;
+	timer_link(timer, TIMER_IN_SLOT);
+	pthread_mutex_unlock(&wheel.lock);
+	return added;
+}
+
+int timer_cancel(TIMER *timer) {
+	pthread_mutex_lock(&wheel.lock);
+	int cancelled = timer->pending != 0;
+	if (cancelled) {
+		timer_unlink(timer);
+		wheel.count--;
+	}
+	pthread_mutex_unlock(&wheel.lock);
+	return cancelled;
+}
+
+void timer_pause(void) {
+	pthread_once(&wheel.once, timer_start);
+	pthread_mutex_lock(&wheel.lock);
+	wheel.paused = 1;
+	while (wheel.firing) {
+		pthread_cond_wait(&wheel.cond, &wheel.lock);
+	}
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+void timer_resume(void) {
+	pthread_once(&wheel.once, timer_start);
+	pthread_mutex_lock(&wheel.lock);
+	wheel.paused = 0;
+	pthread_cond_broadcast(&wheel.cond);
+	pthread_mutex_unlock(&wheel.lock);
+}
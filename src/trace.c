@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define TRACE_RING_MASK (TRACE_RING_EVENTS - 1)
+#define TRACE_WORDS (sizeof(TRACE_EVENT) / sizeof(uint64_t))
+
+_Static_assert((TRACE_RING_EVENTS & TRACE_RING_MASK) == 0, "ring size must be a power of two");
+_Static_assert(sizeof(TRACE_EVENT) % sizeof(uint64_t) == 0, "trace events must be whole words");
+
+/*
+ * A ring of events written only by the thread that owns it.  head counts
+ * the events ever recorded in it, and the event numbered i is kept in
+ * slot i % TRACE_RING_EVENTS until it is overwritten by event i +
+ * TRACE_RING_EVENTS.  As with the rings of the journal, a thread gives
+ * its ring up when it exits, and the ring is then taken over, with the
+ * events left in it, by the next thread that needs one.
+ *
+ * The slots are written and read a word at a time with relaxed atomic
+ * accesses.  Before overwriting a slot, the owner issues a release
+ * fence, which orders the store of head that published its previous
+ * event before the new contents of the slot; so a dump that copies a
+ * slot and then, after an acquire fence, reads head again, cannot have
+ * seen any of an event that head does not account for, and can tell
+ * which of the events it copied might have been overwritten.
+ */
+typedef struct trace_ring {
+	uint64_t slots[TRACE_RING_EVENTS][TRACE_WORDS];
+	atomic_uint_fast64_t head;
+	atomic_int owned;
+	struct trace_ring *next;
+} TRACE_RING;
+
+static struct {
+	pthread_mutex_t lock;		// protects the list of rings and dumps
+	TRACE_RING *rings;
+	char *path;
+	pthread_key_t key;
+	uint64_t startTicks;
+	uint64_t startNanos;
+	atomic_uint threads;
+} tracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+int traceEnabled = 0;
+
+static __thread TRACE_RING *traceRing;
+static __thread uint16_t traceThread;
+
+static inline uint64_t trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t trace_nanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Give up the ring of a thread that is exiting.
+ */
+static void trace_release_ring(void *arg) {
+	TRACE_RING *ring = arg;
+	atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+void trace_configure(char *path) {
+	tracer.path = path;
+	pthread_key_create(&tracer.key, trace_release_ring);
+	tracer.startNanos = trace_nanos();
+	tracer.startTicks = trace_ticks();
+	traceEnabled = 1;
+}
+
+/*
+ * Get a ring for the calling thread, which has none, taking over one
+ * that has been given up or adding a new one, and record the start of
+ * the thread in it.
+ */
+static TRACE_RING *trace_ring(void) {
+	pthread_mutex_lock(&tracer.lock);
+	TRACE_RING *ring;
+	for (ring = tracer.rings; ring != NULL; ring = ring->next) {
+		if (atomic_load_explicit(&ring->owned, memory_order_acquire) == 0) {
+			break;
+		}
+	}
+	if (ring == NULL && (ring = calloc(1, sizeof(TRACE_RING))) != NULL) {
+		ring->next = tracer.rings;
+		tracer.rings = ring;
+	}
+	if (ring != NULL) {
+		atomic_store_explicit(&ring->owned, 1, memory_order_relaxed);
+		pthread_setspecific(tracer.key, ring);
+	}
+	pthread_mutex_unlock(&tracer.lock);
+	if (ring == NULL) {
+		return NULL;
+	}
+	traceRing = ring;
+	traceThread = atomic_fetch_add_explicit(&tracer.threads, 1, memory_order_relaxed) + 1;
+	trace_record(TRACE_THREAD, (void *)pthread_self(), 0, 0, syscall(SYS_gettid), NULL);
+	return ring;
+}
+
+void trace_record(TRACE_EVENT_ID event, const void *object, int before, int after,
+		  unsigned int arg, const char *reason) {
+	TRACE_RING *ring = traceRing;
+	if (ring == NULL && (ring = trace_ring()) == NULL) {
+		return;
+	}
+	TRACE_EVENT ev = {
+		.time = trace_ticks(),
+		.object = (uintptr_t)object,
+		.reason = (uintptr_t)reason,
+		.before = before,
+		.after = after,
+		.event = event,
+		.thread = traceThread,
+		.arg = arg
+	};
+	uint64_t words[TRACE_WORDS];
+	memcpy(words, &ev, sizeof(ev));
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t *slot = ring->slots[head & TRACE_RING_MASK];
+	atomic_thread_fence(memory_order_release);
+	for (size_t i = 0; i < TRACE_WORDS; i++) {
+		__atomic_store_n(&slot[i], words[i], __ATOMIC_RELAXED);
+	}
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Copy the events still in a ring, oldest first.
+ *
+ * @return  The number of events copied.
+ */
+static size_t trace_copy_ring(TRACE_RING *ring, TRACE_EVENT *out) {
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+	for (uint64_t i = first; i < head; i++) {
+		uint64_t *slot = ring->slots[i & TRACE_RING_MASK];
+		uint64_t words[TRACE_WORDS];
+		for (size_t w = 0; w < TRACE_WORDS; w++) {
+			words[w] = __atomic_load_n(&slot[w], __ATOMIC_RELAXED);
+		}
+		memcpy(&out[i - first], words, sizeof(TRACE_EVENT));
+	}
+	atomic_thread_fence(memory_order_acquire);
+	// Event i may have been overwritten if event i + TRACE_RING_EVENTS
+	// has been started, which it may have been if its predecessor has
+	// been published.
+	uint64_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t valid = now >= TRACE_RING_EVENTS ? now - TRACE_RING_EVENTS + 1 : 0;
+	if (valid <= first) {
+		return head - first;
+	}
+	if (valid >= head) {
+		return 0;
+	}
+	memmove(out, &out[valid - first], (head - valid) * sizeof(TRACE_EVENT));
+	return head - valid;
+}
+
+static int trace_compare_address(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Write the contents of the trace file, gathering the reasons referred
+ * to by the events.
+ */
+static int trace_write(int fd, TRACE_EVENT *events, size_t numEvents) {
+	uint64_t *reasons = malloc((numEvents + 1) * sizeof(uint64_t));
+	if (reasons == NULL) {
+		return -1;
+	}
+	size_t numReasons = 0;
+	for (size_t i = 0; i < numEvents; i++) {
+		if (events[i].reason != 0) {
+			reasons[numReasons++] = events[i].reason;
+		}
+	}
+	qsort(reasons, numReasons, sizeof(uint64_t), trace_compare_address);
+	size_t distinct = 0;
+	for (size_t i = 0; i < numReasons; i++) {
+		if (distinct == 0 || reasons[distinct - 1] != reasons[i]) {
+			reasons[distinct++] = reasons[i];
+		}
+	}
+	TRACE_HEADER header = {
+		.startTicks = tracer.startTicks,
+		.startNanos = tracer.startNanos,
+		.dumpNanos = trace_nanos(),
+		.dumpTicks = trace_ticks(),
+		.numEvents = numEvents,
+		.numReasons = distinct
+	};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	int error = 0;
+	if (rio_writen(fd, &header, sizeof(header)) != sizeof(header)
+	    || rio_writen(fd, events, numEvents * sizeof(TRACE_EVENT)) != (ssize_t)(numEvents * sizeof(TRACE_EVENT))) {
+		error = -1;
+	}
+	for (size_t i = 0; i < distinct && error == 0; i++) {
+		// Reasons are string literals, so the address is still valid.
+		const char *text = (const char *)(uintptr_t)reasons[i];
+		TRACE_REASON reason = { .address = reasons[i], .len = strlen(text) };
+		if (rio_writen(fd, &reason, sizeof(reason)) != sizeof(reason)
+		    || rio_writen(fd, (void *)text, reason.len) != reason.len) {
+			error = -1;
+		}
+	}
+	free(reasons);
+	return error;
+}
+
+int trace_dump(void) {
+	if (!traceEnabled) {
+		return -1;
+	}
+	pthread_mutex_lock(&tracer.lock);
+	size_t numRings = 0;
+	for (TRACE_RING *ring = tracer.rings; ring != NULL; ring = ring->next) {
+		numRings++;
+	}
+	size_t numEvents = 0;
+	TRACE_EVENT *events = malloc((numRings * TRACE_RING_EVENTS + 1) * sizeof(TRACE_EVENT));
+	if (events != NULL) {
+		for (TRACE_RING *ring = tracer.rings; ring != NULL; ring = ring->next) {
+			numEvents += trace_copy_ring(ring, &events[numEvents]);
+		}
+	}
+	int error = -1;
+	size_t len = strlen(tracer.path);
+	char *temp = malloc(len + 5);
+	if (events != NULL && temp != NULL) {
+		// The dump is written beside the trace file and renamed over it,
+		// so that a reader never sees a partial dump.
+		memcpy(temp, tracer.path, len);
+		memcpy(temp + len, ".tmp", 5);
+		int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd != -1) {
+			error = trace_write(fd, events, numEvents);
+			if (close(fd) == -1 || (error == 0 && rename(temp, tracer.path) == -1)) {
+				error = -1;
+			}
+			if (error == -1) {
+				unlink(temp);
+			}
+		}
+	}
+	pthread_mutex_unlock(&tracer.lock);
+	debug("%ld: Dumped %zu trace events to %s", pthread_self(), numEvents, tracer.path);
+	free(temp);
+	free(events);
+	return error;
+}
+
+static void *trace_signal_thread(void *arg) {
+	sigset_t *set = arg;
+	pthread_detach(pthread_self());
+	while (1) {
+		int sig;
+		if (sigwait(set, &sig) != 0) {
+			continue;
+		}
+		if (traceEnabled && trace_dump() == -1) {
+			fprintf(stderr, "Failed to dump trace to %s\n", tracer.path);
+		}
+	}
+	return NULL;
+}
+
+int trace_dump_on_signal(int sig) {
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, sig);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+		return -1;
+	}
+	// The thread is started with every signal blocked, so that it takes
+	// none but its own.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_t tid;
+	int error = pthread_create(&tid, NULL, trace_signal_thread, &set);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return error == 0 ? 0 : -1;
+}
@@ -5,6 +5,20 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "game_engine.h"
+#include "game_ext.h"
+#include "protocol_ext.h"
+#include "outq.h"
+#include "handler_pool.h"
 
 static void init() {
 #ifndef NO_SERVER
@@ -71,3 +85,1303 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/jclient -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * The k-in-a-row engine is checked against a brute-force scan of the
+ * whole board after every move of random games, in both its SSE2 and its
+ * scalar builds.
+ */
+void game_mnk_init_scalar(GAME_ENGINE *engine, const char *name, int width, int height, int connect, int gravity);
+
+typedef void (*MNK_INIT)(GAME_ENGINE *, const char *, int, int, int, int);
+
+/*
+ * Determine by brute force whether a piece has k in a row anywhere.
+ */
+static int mnk_brute_force(int board[GAME_MAX_HEIGHT][GAME_MAX_WIDTH], int width, int height, int k, int piece) {
+    static const int dirs[4][2] = { { 0, 1 }, { 1, 0 }, { 1, 1 }, { 1, -1 } };
+    for(int r = 0; r < height; r++) {
+	for(int c = 0; c < width; c++) {
+	    for(int d = 0; d < 4; d++) {
+		int n = 0;
+		int rr = r, cc = c;
+		while(n < k && rr >= 0 && rr < height && cc >= 0 && cc < width && board[rr][cc] == piece) {
+		    n++;
+		    rr += dirs[d][0];
+		    cc += dirs[d][1];
+		}
+		if(n == k)
+		    return 1;
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ * Play random games and check the result after every move.
+ */
+static void mnk_check_games(MNK_INIT init, int width, int height, int k, int gravity, int games, unsigned int seed) {
+    GAME_ENGINE engine;
+    init(&engine, "test", width, height, k, gravity);
+    srandom(seed);
+    for(int g = 0; g < games; g++) {
+	_Alignas(16) char state[GAME_STATE_SIZE];
+	int board[GAME_MAX_HEIGHT][GAME_MAX_WIDTH] = { { 0 } };
+	int heights[GAME_MAX_WIDTH] = { 0 };
+	engine.create(&engine, state);
+	GAME_ROLE winner;
+	cr_assert_eq(engine.is_over(&engine, state, &winner), 0, "Empty %dx%d board was over", width, height);
+	for(int moves = 0; moves < width * height; moves++) {
+	    GAME_MOVE move = { .engine = &engine, .piece = moves % 2 == 0 ? 1 : 0 };
+	    int r, c;
+	    if(gravity) {
+		do {
+		    c = random() % width;
+		} while(heights[c] == height);
+		r = height - 1 - heights[c];
+		if(r > 0 && board[r - 1][c] == 0) {
+		    move.cell = (r - 1) * width + c;
+		    cr_assert_eq(engine.apply(&engine, state, &move), -1,
+				 "Piece was placed above the lowest free cell of column %d", c);
+		}
+		move.cell = random() % 2 ? -1 - c : r * width + c;
+	    } else {
+		do {
+		    r = random() % height;
+		    c = random() % width;
+		} while(board[r][c] != 0);
+		move.cell = r * width + c;
+	    }
+	    if(moves > 0) {
+		GAME_MOVE taken = move;
+		int cell = random() % (width * height);
+		if(board[cell / width][cell % width] != 0) {
+		    taken.cell = cell;
+		    cr_assert_eq(engine.apply(&engine, state, &taken), -1, "Piece was placed on an occupied cell");
+		}
+	    }
+	    cr_assert_eq(engine.apply(&engine, state, &move), 0, "Legal move to row %d, column %d was refused", r, c);
+	    int piece = moves % 2 == 0 ? 1 : 2;
+	    board[r][c] = piece;
+	    heights[c]++;
+	    int won = mnk_brute_force(board, width, height, k, piece);
+	    int over = engine.is_over(&engine, state, &winner);
+	    cr_assert_eq(over, won || moves + 1 == width * height,
+			 "%dx%d:%d game %d: is_over() was %d after move %d", width, height, k, g, over, moves + 1);
+	    if(over) {
+		GAME_ROLE expected = !won ? NULL_ROLE : piece == 1 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+		cr_assert_eq(winner, expected, "%dx%d:%d game %d: winner was %d, expected %d",
+			     width, height, k, g, winner, expected);
+		break;
+	    }
+	}
+    }
+}
+
+static void mnk_check_boards(MNK_INIT init) {
+    mnk_check_games(init, 3, 3, 3, 0, 2000, 1);
+    mnk_check_games(init, 4, 4, 3, 0, 2000, 2);
+    mnk_check_games(init, 7, 6, 4, 1, 2000, 3);
+    mnk_check_games(init, 15, 15, 5, 0, 200, 4);
+    mnk_check_games(init, 19, 19, 5, 0, 100, 5);
+    mnk_check_games(init, 19, 19, 6, 0, 100, 6);
+    mnk_check_games(init, 19, 19, 19, 0, 10, 7);
+    mnk_check_games(init, 8, 19, 2, 1, 1000, 8);
+}
+
+Test(student_suite, 02_mnk_sse2, .timeout = 60) {
+    fprintf(stderr, "server_suite/02_mnk_sse2\n");
+    mnk_check_boards(game_mnk_init);
+}
+
+Test(student_suite, 02_mnk_scalar, .timeout = 60) {
+    fprintf(stderr, "server_suite/02_mnk_scalar\n");
+    mnk_check_boards(game_mnk_init_scalar);
+}
+
+Test(student_suite, 02_mnk_parse, .timeout = 5) {
+    fprintf(stderr, "server_suite/02_mnk_parse\n");
+    static const struct {
+	int width, height, gravity;
+	char *text;
+	int ret, cell, piece;
+    } cases[] = {
+	{ 15, 15, 0, "h8->X", 0, 7 * 15 + 7, 1 },
+	{ 15, 15, 0, "A1->o", 0, 0, 0 },
+	{ 15, 15, 0, "o15 X", 0, 14 * 15 + 14, 1 },
+	{ 19, 19, 0, "s19->O", 0, 18 * 19 + 18, 0 },
+	{ 7, 6, 1, "d->O", 0, -1 - 3, 0 },
+	{ 7, 6, 1, "d6->X", 0, 5 * 7 + 3, 1 },
+	{ 15, 15, 0, "d->O", -1 },
+	{ 15, 15, 0, "p1->X", -1 },
+	{ 15, 15, 0, "h0->X", -1 },
+	{ 15, 15, 0, "h16->X", -1 },
+	{ 15, 15, 0, "h100000000000->X", -1 },
+	{ 15, 15, 0, "h8", -1 },
+	{ 15, 15, 0, "8->X", -1 },
+	{ 15, 15, 0, "", -1 },
+    };
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+	GAME_ENGINE engine;
+	game_mnk_init(&engine, "test", cases[i].width, cases[i].height, 5, cases[i].gravity);
+	_Alignas(16) char state[GAME_STATE_SIZE];
+	engine.create(&engine, state);
+	GAME_MOVE move = { .engine = &engine };
+	char text[32];
+	strcpy(text, cases[i].text);
+	int ret = engine.parse(&engine, state, text, &move);
+	cr_assert_eq(ret, cases[i].ret, "Parsing \"%s\" returned %d", cases[i].text, ret);
+	if(ret == 0) {
+	    cr_assert_eq(move.cell, cases[i].cell, "\"%s\" was cell %d", cases[i].text, move.cell);
+	    cr_assert_eq(move.piece, cases[i].piece, "\"%s\" was piece %d", cases[i].text, move.piece);
+	}
+    }
+}
+
+Test(student_suite, 02_mnk_gravity, .timeout = 5) {
+    fprintf(stderr, "server_suite/02_mnk_gravity\n");
+    GAME_ENGINE engine;
+    game_mnk_init(&engine, "test", 7, 6, 4, 1);
+    _Alignas(16) char state[GAME_STATE_SIZE];
+    engine.create(&engine, state);
+    GAME_MOVE move = { .engine = &engine, .piece = 1, .cell = 0 };
+    cr_assert_eq(engine.apply(&engine, state, &move), -1, "Piece was placed at the top of an empty column");
+    move.cell = -1 - 3;
+    cr_assert_eq(engine.apply(&engine, state, &move), 0, "Drop into an empty column was refused");
+    move.piece = 0;
+    move.cell = 5 * 7 + 3;
+    cr_assert_eq(engine.apply(&engine, state, &move), -1, "Piece was placed on the one dropped");
+    move.cell = 4 * 7 + 3;
+    cr_assert_eq(engine.apply(&engine, state, &move), 0, "Piece was not placed on the one dropped");
+    for(int i = 2; i < 6; i++) {
+	move.piece = i % 2 == 0 ? 1 : 0;
+	move.cell = -1 - 3;
+	cr_assert_eq(engine.apply(&engine, state, &move), 0, "Drop %d into column d was refused", i + 1);
+    }
+    move.piece = 1;
+    cr_assert_eq(engine.apply(&engine, state, &move), -1, "Drop into a full column was accepted");
+    move.cell = -1 - 7;
+    cr_assert_eq(engine.apply(&engine, state, &move), -1, "Drop beside the board was accepted");
+    GAME_ROLE winner;
+    cr_assert_eq(engine.is_over(&engine, state, &winner), 0, "Game was over with no line of four");
+}
+
+/*
+ * The tests below each start a server of their own, with the options
+ * they need, on a port of their own, and talk to it over the socket.
+ * The server is killed if the test dies, as it does when an assertion
+ * fails, so that it does not outlive the test.
+ */
+static pid_t start_server(int port, char *opts[]) {
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    char *argv[32] = { "bin/jeux", "-p", portstr };
+    int argc = 3;
+    for(int i = 0; opts != NULL && opts[i] != NULL; i++)
+	argv[argc++] = opts[i];
+    argv[argc] = NULL;
+    pid_t pid = fork();
+    if(pid == 0) {
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	execv("bin/jeux", argv);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    cr_assert_neq(pid, -1, "Server could not be started");
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    int status;
+    kill(pid, SIGHUP);
+    cr_assert_eq(waitpid(pid, &status, 0), pid, "Server could not be waited for");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Server exit status was 0x%x", status);
+}
+
+/*
+ * Connect to a server, waiting for it to start listening.
+ */
+static int connect_server(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	cr_assert_neq(fd, -1, "Socket could not be created");
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	    return fd;
+	close(fd);
+	usleep(100000);
+    }
+    cr_assert_fail("Could not connect to server on port %d", port);
+    return -1;
+}
+
+static void send_request(int fd, int type, int id, int role, void *data, size_t size) {
+    JEUX_PACKET_HEADER hdr = { .type = type, .id = id, .role = role, .size = htons(size) };
+    cr_assert_eq(proto_send_packet(fd, &hdr, data), 0, "Packet of type %d could not be sent", type);
+}
+
+/*
+ * Receive packets until one of a given type arrives, skipping any others
+ * (notifications, for the most part).
+ *
+ * @return  The payload, which the caller must free, or NULL if there is none.
+ */
+static char *expect_packet(int fd, int type, JEUX_PACKET_HEADER *hdr) {
+    while(1) {
+	void *payload;
+	cr_assert_eq(proto_recv_packet(fd, hdr, &payload), 0, "EOF while waiting for packet of type %d", type);
+	if(hdr->type == type)
+	    return payload;
+	free(payload);
+    }
+}
+
+/*
+ * Send a request and return the type of the response, ACK or NACK.
+ */
+static int request(int fd, int type, int id, int role, void *data, size_t size, JEUX_PACKET_HEADER *hdr,
+		   char **payloadp) {
+    send_request(fd, type, id, role, data, size);
+    while(1) {
+	void *payload;
+	cr_assert_eq(proto_recv_packet(fd, hdr, &payload), 0, "EOF while waiting for response to type %d", type);
+	if(hdr->type == JEUX_ACK_PKT || hdr->type == JEUX_NACK_PKT) {
+	    if(payloadp != NULL)
+		*payloadp = payload;
+	    else
+		free(payload);
+	    return hdr->type;
+	}
+	free(payload);
+    }
+}
+
+static int login(int port, char *name) {
+    int fd = connect_server(port);
+    JEUX_PACKET_HEADER hdr;
+    cr_assert_eq(request(fd, JEUX_LOGIN_PKT, 0, 0, name, strlen(name), &hdr, NULL), JEUX_ACK_PKT,
+		 "Login of %s was refused", name);
+    return fd;
+}
+
+/*
+ * Start a game in which x, logged in as xname, invites o, logged in as
+ * oname, to play second.
+ */
+static void start_game(int x, int o, char *oname, int *xidp, int *oidp) {
+    JEUX_PACKET_HEADER hdr;
+    cr_assert_eq(request(x, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, oname, strlen(oname), &hdr, NULL),
+		 JEUX_ACK_PKT, "Invitation was refused");
+    free(expect_packet(o, JEUX_INVITED_PKT, &hdr));
+    *oidp = hdr.id;
+    cr_assert_eq(request(o, JEUX_ACCEPT_PKT, *oidp, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT,
+		 "Acceptance was refused");
+    free(expect_packet(x, JEUX_ACCEPTED_PKT, &hdr));
+    *xidp = hdr.id;
+}
+
+/*
+ * Make a move that must be accepted, and return the MOVED payload sent
+ * to the opponent.
+ */
+static char *move(int fd, int id, int opponent, void *data, size_t size) {
+    JEUX_PACKET_HEADER hdr;
+    cr_assert_eq(request(fd, JEUX_MOVE_PKT, id, 0, data, size, &hdr, NULL), JEUX_ACK_PKT,
+		 "Move in game %d was refused", id);
+    char *moved = expect_packet(opponent, JEUX_MOVED_PKT, &hdr);
+    cr_assert_neq(moved, NULL, "MOVED packet had no payload");
+    return moved;
+}
+
+/*
+ * Ask for a hint, and check the predicted winner and, if there is only
+ * one best move, the move.
+ */
+static void check_hint(int fd, int id, GAME_ROLE winner, char *best) {
+    JEUX_PACKET_HEADER hdr;
+    char *hint;
+    cr_assert_eq(request(fd, JEUX_HINT_PKT, id, 0, NULL, 0, &hdr, &hint), JEUX_ACK_PKT, "Hint was refused");
+    cr_assert_eq(hdr.role, winner, "Predicted winner was %d, expected %d", hdr.role, winner);
+    cr_assert_neq(hint, NULL, "Hint had no move");
+    if(best != NULL)
+	cr_assert_str_eq(hint, best, "Hint was %s, expected %s", hint, best);
+    free(hint);
+}
+
+Test(student_suite, 03_hint, .timeout = 15) {
+    fprintf(stderr, "server_suite/03_hint\n");
+    pid_t pid = start_server(9981, NULL);
+    int x = login(9981, "alice");
+    int o = login(9981, "bob");
+    int xid, oid;
+    start_game(x, o, "bob", &xid, &oid);
+    JEUX_PACKET_HEADER hdr;
+
+    // Tic-tac-toe is a draw under perfect play.
+    check_hint(x, xid, NULL_ROLE, NULL);
+    cr_assert_eq(request(o, JEUX_HINT_PKT, oid, 0, NULL, 0, &hdr, NULL), JEUX_NACK_PKT,
+		 "Hint was given to the player not on the move");
+    free(move(x, xid, o, "1->X", 4));
+    // O must block the corner move with the centre.
+    check_hint(o, oid, NULL_ROLE, "5->O");
+    free(move(o, oid, x, "4->O", 4));
+    check_hint(x, xid, FIRST_PLAYER_ROLE, NULL);
+    free(move(x, xid, o, "2->X", 4));
+    check_hint(o, oid, FIRST_PLAYER_ROLE, NULL);
+    free(move(o, oid, x, "5->O", 4));
+    // X wins at once at 3, which is the quickest win.
+    check_hint(x, xid, FIRST_PLAYER_ROLE, "3->X");
+    free(move(x, xid, o, "3->X", 4));
+    cr_assert_eq(request(x, JEUX_HINT_PKT, xid, 0, NULL, 0, &hdr, NULL), JEUX_NACK_PKT,
+		 "Hint was given after the game was over");
+    cr_assert_eq(request(x, JEUX_HINT_PKT, xid + 1, 0, NULL, 0, &hdr, NULL), JEUX_NACK_PKT,
+		 "Hint was given for a game that does not exist");
+    close(x);
+    close(o);
+    stop_server(pid);
+}
+
+Test(student_suite, 04_binary_move, .timeout = 15) {
+    fprintf(stderr, "server_suite/04_binary_move\n");
+    pid_t pid = start_server(9982, NULL);
+    int x = login(9982, "alice");
+    int o = login(9982, "bob");
+    static char *text[] = { "5->X", "1o", "9 x", "3", "7->X" };
+    static unsigned char binary[][2] = {
+	{ 5, GAME_MOVE_X }, { 1, GAME_MOVE_O }, { 9, GAME_MOVE_X }, { 3, GAME_MOVE_O }, { 7, GAME_MOVE_X }
+    };
+    int n = sizeof(binary) / sizeof(binary[0]);
+    char *boards[sizeof(binary) / sizeof(binary[0])];
+    JEUX_PACKET_HEADER hdr;
+
+    // A text move without a piece is refused; "3" is sent with one below.
+    int xid, oid;
+    start_game(x, o, "bob", &xid, &oid);
+    for(int i = 0; i < n; i++) {
+	int fd = i % 2 == 0 ? x : o;
+	if(i == 3) {
+	    cr_assert_eq(request(fd, JEUX_MOVE_PKT, oid, 0, text[i], strlen(text[i]), &hdr, NULL), JEUX_NACK_PKT,
+			 "Move without a piece was accepted");
+	    boards[i] = move(fd, oid, x, "3->O", 4);
+	} else {
+	    boards[i] = move(fd, i % 2 == 0 ? xid : oid, i % 2 == 0 ? o : x, text[i], strlen(text[i]));
+	}
+    }
+    cr_assert_eq(request(x, JEUX_RESIGN_PKT, xid, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT, "Resignation was refused");
+
+    // The same moves in binary form must leave the same boards.
+    start_game(x, o, "bob", &xid, &oid);
+    unsigned char bad[][2] = { { 5, 3 }, { 5, 0 } };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+	cr_assert_eq(request(x, JEUX_MOVE_PKT, xid, 0, bad[i], 2, &hdr, NULL), JEUX_NACK_PKT,
+		     "Binary move with piece %d was accepted", bad[i][1]);
+    for(int i = 0; i < n; i++) {
+	int fd = i % 2 == 0 ? x : o;
+	char *board = move(fd, i % 2 == 0 ? xid : oid, i % 2 == 0 ? o : x, binary[i], 2);
+	cr_assert_str_eq(board, boards[i], "Board after binary move %d was\n%s\nnot\n%s", i + 1, board, boards[i]);
+	free(board);
+	free(boards[i]);
+    }
+    // Binary and text moves may be mixed, and an occupied cell is refused either way.
+    cr_assert_eq(request(o, JEUX_MOVE_PKT, oid, 0, binary[0], 2, &hdr, NULL), JEUX_NACK_PKT,
+		 "Binary move to an occupied cell was accepted");
+    unsigned char block[2] = { 4, GAME_MOVE_O };
+    free(move(o, oid, x, block, 2));
+    free(move(x, xid, o, "2->X", 4));
+    close(x);
+    close(o);
+    stop_server(pid);
+}
+
+/*
+ * Play a game of tic-tac-toe to its end, with text moves, X first.
+ */
+static void play_game(int x, int xid, int o, int oid, char *moves[]) {
+    for(int i = 0; moves[i] != NULL; i++)
+	free(i % 2 == 0 ? move(x, xid, o, moves[i], strlen(moves[i])) : move(o, oid, x, moves[i], strlen(moves[i])));
+}
+
+/*
+ * Games played with a journal, and replayed from it once the server has
+ * stopped, must give every player the rating that the server gave.
+ */
+Test(student_suite, 05_journal_replay, .timeout = 30) {
+    fprintf(stderr, "server_suite/05_journal_replay\n");
+    char journal[64];
+    snprintf(journal, sizeof(journal), "/tmp/jeux_tests_%d.jnl", getpid());
+    unlink(journal);
+    char *opts[] = { "-j", journal, NULL };
+    pid_t pid = start_server(9983, opts);
+    int alice = login(9983, "alice");
+    int bob = login(9983, "bob");
+    int carol = login(9983, "carol");
+    int xid, oid;
+    JEUX_PACKET_HEADER hdr;
+
+    start_game(alice, bob, "bob", &xid, &oid);
+    play_game(alice, xid, bob, oid, (char *[]){ "1->X", "4->O", "2->X", "5->O", "3->X", NULL });
+    start_game(bob, carol, "carol", &xid, &oid);
+    play_game(bob, xid, carol, oid,
+	      (char *[]){ "5->X", "1->O", "3->X", "7->O", "4->X", "6->O", "8->X", "2->O", "9->X", NULL });
+    start_game(carol, alice, "alice", &xid, &oid);
+    play_game(carol, xid, alice, oid, (char *[]){ "5->X", "1->O", NULL });
+    cr_assert_eq(request(carol, JEUX_RESIGN_PKT, xid, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT,
+		 "Resignation was refused");
+    start_game(carol, bob, "bob", &xid, &oid);
+    play_game(carol, xid, bob, oid, (char *[]){ "1->X", "5->O", "9->X", "3->O", "7->X", "4->O", "8->X", NULL });
+    start_game(bob, alice, "alice", &xid, &oid);
+    play_game(bob, xid, alice, oid, (char *[]){ "9->X", NULL });
+    cr_assert_eq(request(alice, JEUX_RESIGN_PKT, oid, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT,
+		 "Resignation was refused");
+    // A player who disconnects resigns.
+    start_game(alice, carol, "carol", &xid, &oid);
+    play_game(alice, xid, carol, oid, (char *[]){ "5->X", NULL });
+    close(carol);
+    free(expect_packet(alice, JEUX_ENDED_PKT, &hdr));
+    // Carol logs in again, to be in the USERS response, once the logout is done.
+    for(int i = 0; i < 50; i++) {
+	carol = connect_server(9983);
+	if(request(carol, JEUX_LOGIN_PKT, 0, 0, "carol", 5, &hdr, NULL) == JEUX_ACK_PKT)
+	    break;
+	close(carol);
+	carol = -1;
+	usleep(100000);
+    }
+    cr_assert_neq(carol, -1, "Carol could not log in again");
+
+    char *users;
+    cr_assert_eq(request(alice, JEUX_USERS_PKT, 0, 0, NULL, 0, &hdr, &users), JEUX_ACK_PKT, "USERS was refused");
+    cr_assert_neq(users, NULL, "USERS response had no payload");
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(pid);
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "bin/jeux_replay %s 2>/dev/null", journal);
+    FILE *replay = popen(cmd, "r");
+    cr_assert_neq(replay, NULL, "Replay could not be run");
+    char line[128];
+    int lines = 0;
+    while(fgets(line, sizeof(line), replay) != NULL) {
+	char *p = users;
+	size_t len = strlen(line);
+	while((p = strstr(p, line)) != NULL && p != users && p[-1] != '\n')
+	    p += len;
+	cr_assert_neq(p, NULL, "Replayed rating %swas not in USERS response:\n%s", line, users);
+	lines++;
+    }
+    int ret = pclose(replay);
+    cr_assert_eq(ret, 0, "Replay exit status was 0x%x", ret);
+    cr_assert_eq(lines, 3, "Replay gave %d ratings, not 3, for USERS response:\n%s", lines, users);
+    free(users);
+    unlink(journal);
+}
+
+static double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * The timeouts are set to a second, and each is expected to expire
+ * within a second or so after that.
+ */
+Test(student_suite, 06_idle_timeout, .timeout = 15) {
+    fprintf(stderr, "server_suite/06_idle_timeout\n");
+    char *opts[] = { "-I", "1", NULL };
+    pid_t pid = start_server(9984, opts);
+    int busy = login(9984, "alice");
+    int idle = login(9984, "bob");
+    JEUX_PACKET_HEADER hdr;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // A connection with requests more often than the timeout stays open.
+    for(int i = 0; i < 10; i++) {
+	usleep(300000);
+	cr_assert_eq(request(busy, JEUX_USERS_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT,
+		     "USERS was refused after %.1f seconds", seconds_since(&start));
+    }
+    void *payload;
+    cr_assert_eq(proto_recv_packet(idle, &hdr, &payload), -1, "Idle connection was not closed");
+    close(idle);
+    close(busy);
+    stop_server(pid);
+}
+
+Test(student_suite, 07_invite_timeout, .timeout = 15) {
+    fprintf(stderr, "server_suite/07_invite_timeout\n");
+    char *opts[] = { "-V", "1", NULL };
+    pid_t pid = start_server(9985, opts);
+    int source = login(9985, "alice");
+    int target = login(9985, "bob");
+    JEUX_PACKET_HEADER hdr;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    cr_assert_eq(request(source, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "bob", 3, &hdr, NULL), JEUX_ACK_PKT,
+		 "Invitation was refused");
+    int sourceId = hdr.id;
+    free(expect_packet(target, JEUX_INVITED_PKT, &hdr));
+    int targetId = hdr.id;
+    free(expect_packet(target, JEUX_REVOKED_PKT, &hdr));
+    cr_assert_eq(hdr.id, targetId, "REVOKED was for invitation %d, not %d", hdr.id, targetId);
+    double elapsed = seconds_since(&start);
+    cr_assert(elapsed > 0.9 && elapsed < 3, "Invitation timed out after %.2f seconds", elapsed);
+    free(expect_packet(source, JEUX_DECLINED_PKT, &hdr));
+    cr_assert_eq(hdr.id, sourceId, "DECLINED was for invitation %d, not %d", hdr.id, sourceId);
+    cr_assert_eq(request(target, JEUX_ACCEPT_PKT, targetId, 0, NULL, 0, &hdr, NULL), JEUX_NACK_PKT,
+		 "Timed-out invitation was accepted");
+
+    // An invitation accepted in time starts a game as usual.
+    int xid, oid;
+    start_game(source, target, "bob", &xid, &oid);
+    usleep(1500000);
+    free(move(source, xid, target, "5->X", 4));
+    close(source);
+    close(target);
+    stop_server(pid);
+}
+
+Test(student_suite, 08_move_timeout, .timeout = 15) {
+    fprintf(stderr, "server_suite/08_move_timeout\n");
+    char *opts[] = { "-M", "1", NULL };
+    pid_t pid = start_server(9986, opts);
+    int x = login(9986, "alice");
+    int o = login(9986, "bob");
+    JEUX_PACKET_HEADER hdr;
+    int xid, oid;
+    start_game(x, o, "bob", &xid, &oid);
+
+    // X moves in time; O does not, and resigns.
+    usleep(500000);
+    free(move(x, xid, o, "5->X", 4));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    free(expect_packet(x, JEUX_RESIGNED_PKT, &hdr));
+    cr_assert_eq(hdr.id, xid, "RESIGNED was for invitation %d, not %d", hdr.id, xid);
+    double elapsed = seconds_since(&start);
+    cr_assert(elapsed > 0.9 && elapsed < 3, "Move timed out after %.2f seconds", elapsed);
+    free(expect_packet(x, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "Winner was %d, not X", hdr.role);
+    free(expect_packet(o, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.id, oid, "ENDED was for invitation %d, not %d", hdr.id, oid);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "Winner was %d, not X", hdr.role);
+    cr_assert_eq(request(o, JEUX_MOVE_PKT, oid, 0, "1->O", 4, &hdr, NULL), JEUX_NACK_PKT,
+		 "Move was accepted after the game was over");
+    close(x);
+    close(o);
+    stop_server(pid);
+}
+
+/*
+ * The outbound queue is tested on its own, over a socket pair whose
+ * buffers are kept small, so that packets of OUTQ_TEST_LEN bytes soon
+ * back up into the queue and then into the flusher.
+ */
+#define OUTQ_TEST_LEN 60000
+
+typedef struct {
+    OUTQ *q;
+    int id;
+    int count;
+} OUTQ_PRODUCER;
+
+static OUTQ *outq_pair(int capacity, OUTQ_POLICY policy, int fds[2]) {
+    cr_assert_eq(outq_configure(capacity, policy), 0, "Queue could not be configured");
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "Socket pair could not be created");
+    int size = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    OUTQ *q = outq_create(fds[0]);
+    cr_assert_neq(q, NULL, "Queue could not be created");
+    return q;
+}
+
+static void outq_unpair(OUTQ *q, int fds[2]) {
+    outq_shutdown(q);
+    outq_destroy(q);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/*
+ * Send packets numbered from 0 in the role field and the first bytes of
+ * the payload, under the producer's ID.
+ */
+static void *outq_produce(void *arg) {
+    OUTQ_PRODUCER *p = arg;
+    char payload[OUTQ_TEST_LEN] = { 0 };
+    for(int i = 0; i < p->count; i++) {
+	memcpy(payload, &i, sizeof(i));
+	JEUX_PACKET_HEADER hdr = { .type = JEUX_MOVED_PKT, .id = p->id, .size = htons(sizeof(payload)) };
+	if(outq_send(p->q, &hdr, payload, sizeof(payload)) == -1)
+	    return (void *)-1L;
+    }
+    return NULL;
+}
+
+/*
+ * Fill a queue that is not being read until a packet is refused.
+ *
+ * @return  The number of packets queued.
+ */
+static int outq_fill(OUTQ *q) {
+    static char payload[OUTQ_TEST_LEN];
+    JEUX_PACKET_HEADER hdr = { .type = JEUX_MOVED_PKT, .size = htons(sizeof(payload)) };
+    for(int i = 0; i < 1000; i++) {
+	if(outq_send(q, &hdr, payload, sizeof(payload)) == -1)
+	    return i;
+    }
+    cr_assert_fail("A queue not being read took 1000 packets");
+    return -1;
+}
+
+/*
+ * Under OUTQ_BLOCK, producers that fill a queue wait for the reader, and
+ * every packet arrives, in the order in which each producer sent them.
+ */
+Test(student_suite, 09_outq_block, .timeout = 30) {
+    fprintf(stderr, "server_suite/09_outq_block\n");
+    int fds[2];
+    OUTQ *q = outq_pair(4, OUTQ_BLOCK, fds);
+    OUTQ_PRODUCER producers[4];
+    pthread_t tids[4];
+    for(int i = 0; i < 4; i++) {
+	producers[i] = (OUTQ_PRODUCER){ q, i, 100 };
+	cr_assert_eq(pthread_create(&tids[i], NULL, outq_produce, &producers[i]), 0, "Producer could not start");
+    }
+    int next[4] = { 0 };
+    for(int n = 0; n < 400; n++) {
+	if(n % 50 == 0)
+	    usleep(10000);
+	JEUX_PACKET_HEADER hdr;
+	void *payload;
+	cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0, "Packet %d was not received", n);
+	cr_assert(hdr.id < 4 && ntohs(hdr.size) == OUTQ_TEST_LEN, "Packet %d was garbled", n);
+	int seq;
+	memcpy(&seq, payload, sizeof(seq));
+	cr_assert_eq(seq, next[hdr.id], "Producer %d's packet %d arrived as %d", hdr.id, next[hdr.id], seq);
+	next[hdr.id]++;
+	free(payload);
+    }
+    for(int i = 0; i < 4; i++) {
+	void *ret;
+	pthread_join(tids[i], &ret);
+	cr_assert_eq(ret, NULL, "Producer %d had a packet refused", i);
+    }
+    cr_assert_eq(outq_flush(q, 1000), 0, "Queue was not empty");
+    cr_assert_eq(outq_backlog(q), 0, "Backlog of an empty queue was %d", outq_backlog(q));
+    outq_unpair(q, fds);
+}
+
+/*
+ * Under OUTQ_DROP, a packet for a full queue is refused, but the
+ * connection carries on once the reader catches up.
+ */
+Test(student_suite, 09_outq_drop, .timeout = 30) {
+    fprintf(stderr, "server_suite/09_outq_drop\n");
+    int fds[2];
+    OUTQ *q = outq_pair(4, OUTQ_DROP, fds);
+    int queued = outq_fill(q);
+    cr_assert(queued >= 4, "Only %d packets were queued", queued);
+    for(int n = 0; n < queued; n++) {
+	JEUX_PACKET_HEADER hdr;
+	void *payload;
+	cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0, "Queued packet %d was not received", n);
+	free(payload);
+    }
+    cr_assert_eq(outq_flush(q, 1000), 0, "Queue was not emptied");
+    JEUX_PACKET_HEADER hdr = { .type = JEUX_ACK_PKT };
+    cr_assert_eq(outq_send(q, &hdr, NULL, 0), 0, "Packet was refused once the queue was empty");
+    void *payload;
+    cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0, "Packet was not received");
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT, "Packet of type %d was received, not an ACK", hdr.type);
+    outq_unpair(q, fds);
+}
+
+/*
+ * Under OUTQ_DISCONNECT, a full queue shuts the connection down, and the
+ * reader sees EOF.
+ */
+Test(student_suite, 09_outq_disconnect, .timeout = 30) {
+    fprintf(stderr, "server_suite/09_outq_disconnect\n");
+    int fds[2];
+    OUTQ *q = outq_pair(4, OUTQ_DISCONNECT, fds);
+    int queued = outq_fill(q);
+    cr_assert(queued >= 4, "Only %d packets were queued", queued);
+    cr_assert_eq(outq_backlog(q), -1, "Queue was not shut down");
+    JEUX_PACKET_HEADER hdr = { .type = JEUX_ACK_PKT };
+    cr_assert_eq(outq_send(q, &hdr, NULL, 0), -1, "Packet was queued after the queue was shut down");
+    int n = 0;
+    void *payload;
+    while(proto_recv_packet(fds[1], &hdr, &payload) == 0) {
+	free(payload);
+	n++;
+    }
+    cr_assert(n <= queued, "%d packets were received, but only %d were queued", n, queued);
+    outq_unpair(q, fds);
+}
+
+/*
+ * Check that every line of one USERS response is in another, and that
+ * they have as many lines.
+ */
+static void check_same_users(char *users, char *expected) {
+    int lines = 0;
+    for(char *line = users; *line != '\0'; lines++) {
+	char *end = strchr(line, '\n');
+	cr_assert_neq(end, NULL, "USERS response did not end with a newline:\n%s", users);
+	char want[128];
+	snprintf(want, sizeof(want), "%.*s", (int)(end - line + 1), line);
+	char *p = expected;
+	while((p = strstr(p, want)) != NULL && p != expected && p[-1] != '\n')
+	    p++;
+	cr_assert_neq(p, NULL, "Rating %swas not in USERS response:\n%s", want, expected);
+	line = end + 1;
+    }
+    int expectedLines = 0;
+    for(char *p = expected; *p != '\0'; p++)
+	expectedLines += *p == '\n';
+    cr_assert_eq(lines, expectedLines, "USERS response had %d lines, not %d:\n%s", lines, expectedLines, users);
+}
+
+/*
+ * Log in alice, bob and carol on a fresh server, and return their USERS
+ * response.
+ */
+static char *users_after_restart(int port, char *opts[]) {
+    pid_t pid = start_server(port, opts);
+    int alice = login(port, "alice");
+    int bob = login(port, "bob");
+    int carol = login(port, "carol");
+    JEUX_PACKET_HEADER hdr;
+    char *users;
+    cr_assert_eq(request(alice, JEUX_USERS_PKT, 0, 0, NULL, 0, &hdr, &users), JEUX_ACK_PKT, "USERS was refused");
+    cr_assert_neq(users, NULL, "USERS response had no payload");
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(pid);
+    return users;
+}
+
+/*
+ * Play games between alice, bob and carol on a server that keeps their
+ * ratings, and check that the ratings are restored, unchanged, each
+ * time the server is restarted.
+ */
+static void check_ratings_kept(int port, char *opts[]) {
+    pid_t pid = start_server(port, opts);
+    int alice = login(port, "alice");
+    int bob = login(port, "bob");
+    int carol = login(port, "carol");
+    int xid, oid;
+    JEUX_PACKET_HEADER hdr;
+
+    start_game(alice, bob, "bob", &xid, &oid);
+    play_game(alice, xid, bob, oid, (char *[]){ "1->X", "4->O", "2->X", "5->O", "3->X", NULL });
+    start_game(carol, bob, "bob", &xid, &oid);
+    play_game(carol, xid, bob, oid, (char *[]){ "1->X", "5->O", "9->X", "3->O", "7->X", "4->O", "8->X", NULL });
+    start_game(bob, carol, "carol", &xid, &oid);
+    play_game(bob, xid, carol, oid,
+	      (char *[]){ "5->X", "1->O", "3->X", "7->O", "4->X", "6->O", "8->X", "2->O", "9->X", NULL });
+    char *users;
+    cr_assert_eq(request(alice, JEUX_USERS_PKT, 0, 0, NULL, 0, &hdr, &users), JEUX_ACK_PKT, "USERS was refused");
+    cr_assert_neq(users, NULL, "USERS response had no payload");
+    cr_assert_neq(strstr(users, "alice\t1516\n"), NULL, "First win did not give alice 1516:\n%s", users);
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(pid);
+
+    for(int i = 0; i < 2; i++) {
+	char *restored = users_after_restart(port, opts);
+	check_same_users(restored, users);
+	free(restored);
+    }
+    free(users);
+}
+
+/*
+ * Ratings kept in the rating log are replayed from it, and the log once
+ * compacted on the first restart gives the same ratings on the second.
+ */
+Test(student_suite, 10_rating_log, .timeout = 30) {
+    fprintf(stderr, "server_suite/10_rating_log\n");
+    char log[64];
+    snprintf(log, sizeof(log), "/tmp/jeux_tests_%d.log", getpid());
+    unlink(log);
+    char *opts[] = { "-l", log, NULL };
+    check_ratings_kept(9987, opts);
+    unlink(log);
+}
+
+/*
+ * Ratings kept in the player store are found there again on each
+ * restart.
+ */
+Test(student_suite, 11_player_store, .timeout = 30) {
+    fprintf(stderr, "server_suite/11_player_store\n");
+    char store[64];
+    snprintf(store, sizeof(store), "/tmp/jeux_tests_%d.db", getpid());
+    unlink(store);
+    char *opts[] = { "-d", store, NULL };
+    check_ratings_kept(9988, opts);
+    unlink(store);
+}
+
+/*
+ * Players who send MATCH are paired and each sent ACCEPTED for a game in
+ * which the other holds the other role.  A player for whom no game can
+ * be started is taken out of the queue rather than holding up the
+ * player it was paired with, who is matched with someone else.
+ */
+Test(student_suite, 12_match, .timeout = 15) {
+    fprintf(stderr, "server_suite/12_match\n");
+    pid_t pid = start_server(9989, NULL);
+    int alice = login(9989, "alice");
+    int bob = login(9989, "bob");
+    JEUX_PACKET_HEADER hdr;
+
+    cr_assert_eq(request(alice, JEUX_MATCH_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT, "MATCH was refused");
+    cr_assert_eq(request(alice, JEUX_MATCH_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_NACK_PKT,
+		 "MATCH was accepted from a player already queued");
+    cr_assert_eq(request(bob, JEUX_MATCH_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT, "MATCH was refused");
+    free(expect_packet(alice, JEUX_ACCEPTED_PKT, &hdr));
+    int aliceId = hdr.id, aliceRole = hdr.role;
+    free(expect_packet(bob, JEUX_ACCEPTED_PKT, &hdr));
+    int bobId = hdr.id, bobRole = hdr.role;
+    cr_assert(aliceRole + bobRole == FIRST_PLAYER_ROLE + SECOND_PLAYER_ROLE && aliceRole != bobRole,
+	      "Matched players had roles %d and %d", aliceRole, bobRole);
+    if(aliceRole == FIRST_PLAYER_ROLE)
+	free(move(alice, aliceId, bob, "5->X", 4));
+    else
+	free(move(bob, bobId, alice, "5->X", 4));
+
+    // Carol has every invitation ID in use, so no game can be started for her.
+    int carol = login(9989, "carol");
+    int dave = login(9989, "dave");
+    int invitations = 0;
+    while(request(carol, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "dave", 4, &hdr, NULL) == JEUX_ACK_PKT)
+	invitations++;
+    cr_assert(invitations > 0, "No invitation was made");
+    int erin = login(9989, "erin");
+    cr_assert_eq(request(carol, JEUX_MATCH_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT, "MATCH was refused");
+    cr_assert_eq(request(erin, JEUX_MATCH_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT, "MATCH was refused");
+    free(expect_packet(carol, JEUX_NACK_PKT, &hdr));
+    int frank = login(9989, "frank");
+    cr_assert_eq(request(frank, JEUX_MATCH_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT, "MATCH was refused");
+    free(expect_packet(erin, JEUX_ACCEPTED_PKT, &hdr));
+    free(expect_packet(frank, JEUX_ACCEPTED_PKT, &hdr));
+    close(alice);
+    close(bob);
+    close(carol);
+    close(dave);
+    close(erin);
+    close(frank);
+    stop_server(pid);
+}
+
+/*
+ * Log in, retrying until a server that is still starting up, such as a
+ * node whose links with the others are not yet up, accepts the login.
+ */
+static int login_when_ready(int port, char *name) {
+    JEUX_PACKET_HEADER hdr;
+    for(int i = 0; i < 50; i++) {
+	int fd = connect_server(port);
+	if(request(fd, JEUX_LOGIN_PKT, 0, 0, name, strlen(name), &hdr, NULL) == JEUX_ACK_PKT)
+	    return fd;
+	close(fd);
+	usleep(100000);
+    }
+    cr_assert_fail("Login of %s was refused", name);
+    return -1;
+}
+
+/*
+ * Two nodes of a cluster: a name is logged in on only one of them, games
+ * are played between users of different nodes, and the games a node
+ * hosts for the users of a node that dies are ended.
+ */
+Test(student_suite, 13_cluster, .timeout = 30) {
+    fprintf(stderr, "server_suite/13_cluster\n");
+    char *links = "127.0.0.1:9992,127.0.0.1:9993";
+    pid_t node0 = start_server(9990, (char *[]){ "-S", "0", "-P", links, NULL });
+    pid_t node1 = start_server(9991, (char *[]){ "-S", "1", "-P", links, NULL });
+    int alice = login_when_ready(9990, "alice");
+    int bob = login_when_ready(9991, "bob");
+    JEUX_PACKET_HEADER hdr;
+
+    int ports[] = { 9990, 9991 };
+    for(int i = 0; i < 2; i++) {
+	int fd = connect_server(ports[i]);
+	cr_assert_eq(request(fd, JEUX_LOGIN_PKT, 0, 0, "alice", 5, &hdr, NULL), JEUX_NACK_PKT,
+		     "alice was logged in twice, on port %d", ports[i]);
+	close(fd);
+    }
+
+    // A game hosted by node 0, with bob's requests forwarded from node 1.
+    int xid, oid;
+    start_game(alice, bob, "bob", &xid, &oid);
+    play_game(alice, xid, bob, oid, (char *[]){ "1->X", "4->O", "2->X", "5->O", NULL });
+    cr_assert_eq(request(bob, JEUX_MOVE_PKT, oid, 0, "5->O", 4, &hdr, NULL), JEUX_NACK_PKT,
+		 "Move to an occupied cell was accepted");
+    // The mover is sent ENDED ahead of the ACK of the move that ends the game.
+    send_request(alice, JEUX_MOVE_PKT, xid, 0, "3->X", 4);
+    free(expect_packet(alice, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "Winner was %d, not X", hdr.role);
+    free(expect_packet(alice, JEUX_ACK_PKT, &hdr));
+    free(expect_packet(bob, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.id, oid, "ENDED was for invitation %d, not %d", hdr.id, oid);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "Winner was %d, not X", hdr.role);
+
+    // A game hosted by node 1, which then dies: alice's game is resigned.
+    start_game(bob, alice, "alice", &xid, &oid);
+    free(move(bob, xid, alice, "5->X", 4));
+    kill(node1, SIGKILL);
+    waitpid(node1, NULL, 0);
+    free(expect_packet(alice, JEUX_RESIGNED_PKT, &hdr));
+    cr_assert_eq(hdr.id, oid, "RESIGNED was for invitation %d, not %d", hdr.id, oid);
+    free(expect_packet(alice, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, SECOND_PLAYER_ROLE, "Winner was %d, not O", hdr.role);
+    cr_assert_eq(request(alice, JEUX_MOVE_PKT, oid, 0, "1->O", 4, &hdr, NULL), JEUX_NACK_PKT,
+		 "Move was accepted in a game of a node that has gone");
+    close(alice);
+    close(bob);
+    stop_server(node0);
+}
+
+/*
+ * A node that leaves a forwarded request unanswered is taken to have
+ * gone, by both nodes, so that the game is ended for both players
+ * whether or not the move was made.  The nodes then link up again.
+ */
+Test(student_suite, 13_cluster_stalled_node, .timeout = 30) {
+    fprintf(stderr, "server_suite/13_cluster_stalled_node\n");
+    char *links = "127.0.0.1:9996,127.0.0.1:9997";
+    pid_t node0 = start_server(9994, (char *[]){ "-S", "0", "-P", links, NULL });
+    pid_t node1 = start_server(9995, (char *[]){ "-S", "1", "-P", links, NULL });
+    int alice = login_when_ready(9994, "alice");
+    int bob = login_when_ready(9995, "bob");
+    JEUX_PACKET_HEADER hdr;
+    int xid, oid;
+    start_game(alice, bob, "bob", &xid, &oid);
+    free(move(alice, xid, bob, "5->X", 4));
+
+    kill(node0, SIGSTOP);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    send_request(bob, JEUX_MOVE_PKT, oid, 0, "1->O", 4);
+    free(expect_packet(bob, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.id, oid, "ENDED was for invitation %d, not %d", hdr.id, oid);
+    free(expect_packet(bob, JEUX_NACK_PKT, &hdr));
+    double elapsed = seconds_since(&start);
+    cr_assert(elapsed > 1.5 && elapsed < 5, "Forwarded move was given up after %.2f seconds", elapsed);
+    kill(node0, SIGCONT);
+    free(expect_packet(alice, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.id, xid, "ENDED was for invitation %d, not %d", hdr.id, xid);
+
+    int invited = 0;
+    for(int i = 0; i < 50 && !invited; i++) {
+	invited = request(bob, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "alice", 5, &hdr, NULL) == JEUX_ACK_PKT;
+	if(!invited)
+	    usleep(100000);
+    }
+    cr_assert(invited, "alice could not be invited once the nodes had linked up again");
+    free(expect_packet(alice, JEUX_INVITED_PKT, &hdr));
+    close(alice);
+    close(bob);
+    stop_server(node0);
+    stop_server(node1);
+}
+
+/*
+ * Start a server that takes over from the one running with the same
+ * handoff socket, and wait for that one to exit once it has handed over
+ * its clients.
+ */
+static pid_t take_over(int port, char *opts[], pid_t old) {
+    pid_t pid = start_server(port, opts);
+    int status;
+    cr_assert_eq(waitpid(old, &status, 0), old, "Old server could not be waited for");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Old server exit status was 0x%x", status);
+    return pid;
+}
+
+/*
+ * Hand a server with a game in progress and an open invitation over to
+ * a successor, which must carry on with both over the same connections,
+ * and then hand that one over in turn.
+ */
+static void check_handoff(int port, char *mode[]) {
+    char sock[64];
+    snprintf(sock, sizeof(sock), "/tmp/jeux_tests_%d_%d.sock", getpid(), port);
+    unlink(sock);
+    char *opts[16] = { "-H", sock };
+    for(int i = 0; mode[i] != NULL; i++)
+	opts[i + 2] = mode[i];
+    pid_t pid = start_server(port, opts);
+    int alice = login(port, "alice");
+    int bob = login(port, "bob");
+    int carol = login(port, "carol");
+    JEUX_PACKET_HEADER hdr;
+    int xid, oid;
+    start_game(alice, bob, "bob", &xid, &oid);
+    free(move(alice, xid, bob, "1->X", 4));
+    cr_assert_eq(request(carol, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "alice", 5, &hdr, NULL), JEUX_ACK_PKT,
+		 "Invitation was refused");
+    free(expect_packet(alice, JEUX_INVITED_PKT, &hdr));
+    int invited = hdr.id;
+
+    pid = take_over(port, opts, pid);
+    free(move(bob, oid, alice, "4->O", 4));
+    free(move(alice, xid, bob, "2->X", 4));
+    free(move(bob, oid, alice, "5->O", 4));
+    send_request(alice, JEUX_MOVE_PKT, xid, 0, "3->X", 4);
+    free(expect_packet(alice, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "Winner was %d, not X", hdr.role);
+    free(expect_packet(alice, JEUX_ACK_PKT, &hdr));
+    free(expect_packet(bob, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "Winner was %d, not X", hdr.role);
+    cr_assert_eq(request(alice, JEUX_ACCEPT_PKT, invited, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT,
+		 "Invitation made before the handoff could not be accepted");
+    free(expect_packet(carol, JEUX_ACCEPTED_PKT, &hdr));
+
+    // A request sent just as a successor starts is answered by one server
+    // or the other, and the ratings go with the clients.
+    send_request(bob, JEUX_USERS_PKT, 0, 0, NULL, 0);
+    pid = take_over(port, opts, pid);
+    char *users = expect_packet(bob, JEUX_ACK_PKT, &hdr);
+    cr_assert(users != NULL && strstr(users, "alice\t1516\n") != NULL, "Rating was not handed over:\n%s", users);
+    free(users);
+    int dave = login(port, "dave");
+    close(alice);
+    close(bob);
+    close(carol);
+    close(dave);
+    stop_server(pid);
+    unlink(sock);
+}
+
+Test(student_suite, 14_handoff, .timeout = 30) {
+    fprintf(stderr, "server_suite/14_handoff\n");
+    check_handoff(9998, (char *[]){ NULL });
+}
+
+Test(student_suite, 14_handoff_reactor, .timeout = 30) {
+    fprintf(stderr, "server_suite/14_handoff_reactor\n");
+    check_handoff(9999, (char *[]){ "-e", "-n", "2", "-h", "2", NULL });
+}
+
+/*
+ * A spectator is sent the state of the game it starts watching, every
+ * move made in it and its result, under its own watch ID, until the game
+ * is over or it stops watching.
+ */
+Test(student_suite, 15_watch, .timeout = 15) {
+    fprintf(stderr, "server_suite/15_watch\n");
+    pid_t pid = start_server(10000, NULL);
+    int alice = login(10000, "alice");
+    int bob = login(10000, "bob");
+    int carol = login(10000, "carol");
+    JEUX_PACKET_HEADER hdr;
+    int xid, oid;
+
+    cr_assert_eq(request(carol, JEUX_WATCH_PKT, 0, 0, "alice", 5, &hdr, NULL), JEUX_NACK_PKT,
+		 "WATCH of a player not playing was accepted");
+    start_game(alice, bob, "bob", &xid, &oid);
+    char *board = move(alice, xid, bob, "5->X", 4);
+    cr_assert_eq(request(carol, JEUX_WATCH_PKT, 0, 0, NULL, 0, &hdr, NULL), JEUX_NACK_PKT,
+		 "WATCH without a username was accepted");
+    cr_assert_eq(request(carol, JEUX_WATCH_PKT, 0, 0, "carol", 5, &hdr, NULL), JEUX_NACK_PKT,
+		 "WATCH of the spectator itself was accepted");
+    cr_assert_eq(request(carol, JEUX_WATCH_PKT, 0, 0, "nobody", 6, &hdr, NULL), JEUX_NACK_PKT,
+		 "WATCH of a player not logged in was accepted");
+    char *state;
+    cr_assert_eq(request(carol, JEUX_WATCH_PKT, 0, 0, "bob", 3, &hdr, &state), JEUX_ACK_PKT, "WATCH was refused");
+    int watch = hdr.id;
+    cr_assert_eq(hdr.role, SECOND_PLAYER_ROLE, "Watched player's role was %d, not O", hdr.role);
+    cr_assert(state != NULL && strcmp(state, board) == 0, "Watched game state was\n%s\nnot\n%s", state, board);
+    free(state);
+    free(board);
+
+    char *moves[] = { "1->O", "3->X", "7->O", "9->X", "6->O", "4->X", "8->O", "2->X", NULL };
+    for(int i = 0; moves[i] != NULL; i++) {
+	if(i % 2 == 0)
+	    board = move(bob, oid, alice, moves[i], 4);
+	else
+	    board = move(alice, xid, bob, moves[i], 4);
+	char *seen = expect_packet(carol, JEUX_MOVED_PKT, &hdr);
+	cr_assert_eq(hdr.id, watch, "MOVED was for watch %d, not %d", hdr.id, watch);
+	cr_assert(seen != NULL && strcmp(seen, board) == 0, "Spectator saw\n%s\nnot\n%s", seen, board);
+	free(seen);
+	free(board);
+    }
+    free(expect_packet(carol, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.id, watch, "ENDED was for watch %d, not %d", hdr.id, watch);
+    cr_assert_eq(hdr.role, NULL_ROLE, "Result of a drawn game was %d", hdr.role);
+
+    // A spectator that stops watching is sent no more of the game.
+    start_game(alice, bob, "bob", &xid, &oid);
+    cr_assert_eq(request(carol, JEUX_WATCH_PKT, 0, 0, "alice", 5, &hdr, NULL), JEUX_ACK_PKT, "WATCH was refused");
+    watch = hdr.id;
+    cr_assert_eq(request(carol, JEUX_UNWATCH_PKT, watch, 0, NULL, 0, &hdr, NULL), JEUX_ACK_PKT, "UNWATCH was refused");
+    cr_assert_eq(request(carol, JEUX_UNWATCH_PKT, watch, 0, NULL, 0, &hdr, NULL), JEUX_NACK_PKT,
+		 "UNWATCH of a game no longer watched was accepted");
+    free(move(alice, xid, bob, "5->X", 4));
+    send_request(carol, JEUX_USERS_PKT, 0, 0, NULL, 0);
+    void *payload;
+    cr_assert_eq(proto_recv_packet(carol, &hdr, &payload), 0, "EOF while waiting for USERS");
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT, "Packet of type %d was sent to a spectator no longer watching", hdr.type);
+    free(payload);
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(pid);
+}
+
+/*
+ * Requests sent back to back, without waiting for the responses, are
+ * answered in order, however few responses may be waiting to be
+ * written.
+ */
+static void check_pipeline(int port, char *opts[]) {
+    pid_t pid = start_server(port, opts);
+    int alice = login(port, "alice");
+    int bob = login(port, "bob");
+    int xid, oid;
+    start_game(alice, bob, "bob", &xid, &oid);
+    JEUX_PACKET_HEADER hdr;
+
+    // Each USERS is ACKed, and each HINT for a game that does not exist NACKed.
+    for(int i = 0; i < 200; i++) {
+	if(i % 2 == 0)
+	    send_request(alice, JEUX_USERS_PKT, 0, 0, NULL, 0);
+	else
+	    send_request(alice, JEUX_HINT_PKT, xid + 1, 0, NULL, 0);
+    }
+    for(int i = 0; i < 200; i++) {
+	void *payload;
+	cr_assert_eq(proto_recv_packet(alice, &hdr, &payload), 0, "EOF while waiting for response %d", i);
+	int expected = i % 2 == 0 ? JEUX_ACK_PKT : JEUX_NACK_PKT;
+	cr_assert_eq(hdr.type, expected, "Response %d was of type %d, not %d", i, hdr.type, expected);
+	free(payload);
+    }
+
+    // A HINT or MOVE pipelined after a move is refused, since the move has
+    // been made by the time it is handled.
+    send_request(alice, JEUX_MOVE_PKT, xid, 0, "1->X", 4);
+    send_request(alice, JEUX_HINT_PKT, xid, 0, NULL, 0);
+    send_request(alice, JEUX_MOVE_PKT, xid, 0, "2->X", 4);
+    send_request(alice, JEUX_USERS_PKT, 0, 0, NULL, 0);
+    int expected[] = { JEUX_ACK_PKT, JEUX_NACK_PKT, JEUX_NACK_PKT, JEUX_ACK_PKT };
+    for(int i = 0; i < 4; i++) {
+	void *payload;
+	cr_assert_eq(proto_recv_packet(alice, &hdr, &payload), 0, "EOF while waiting for response %d", i);
+	cr_assert_eq(hdr.type, expected[i], "Response %d was of type %d, not %d", i, hdr.type, expected[i]);
+	free(payload);
+    }
+    free(expect_packet(bob, JEUX_MOVED_PKT, &hdr));
+    close(alice);
+    close(bob);
+    stop_server(pid);
+}
+
+Test(student_suite, 16_pipeline, .timeout = 15) {
+    fprintf(stderr, "server_suite/16_pipeline\n");
+    check_pipeline(10001, (char *[]){ "-w", "1", NULL });
+}
+
+Test(student_suite, 16_pipeline_reactor, .timeout = 15) {
+    fprintf(stderr, "server_suite/16_pipeline_reactor\n");
+    check_pipeline(10002, (char *[]){ "-e", "-n", "2", "-w", "2", NULL });
+}
+
+typedef struct {
+    HPOOL_TASK task;
+    atomic_int *counter;
+    atomic_int *release;
+} HPOOL_TEST_TASK;
+
+static void hpool_count(HPOOL_TASK *task) {
+    HPOOL_TEST_TASK *t = (HPOOL_TEST_TASK *)task;
+    while(t->release != NULL && !atomic_load(t->release))
+	usleep(1000);
+    atomic_fetch_add(t->counter, 1);
+}
+
+/*
+ * Tasks queued behind one that is held up on its worker are stolen and
+ * run by the other workers.
+ */
+Test(student_suite, 17_hpool_steal, .timeout = 15) {
+    fprintf(stderr, "server_suite/17_hpool_steal\n");
+    cr_assert_eq(hpool_start(4), 0, "Handler pool could not be started");
+    cr_assert(hpool_enabled(), "Handler pool was not enabled");
+    atomic_int slow = 0, fast = 0, release = 0;
+    HPOOL_TEST_TASK blocker = { .counter = &slow, .release = &release };
+    blocker.task.run = hpool_count;
+    hpool_submit(&blocker.task, 1);
+    static HPOOL_TEST_TASK tasks[1000];
+    for(int i = 0; i < 1000; i++) {
+	tasks[i] = (HPOOL_TEST_TASK){ .counter = &fast };
+	tasks[i].task.run = hpool_count;
+	hpool_submit(&tasks[i].task, 1);
+    }
+    for(int i = 0; i < 500 && atomic_load(&fast) < 1000; i++)
+	usleep(10000);
+    cr_assert_eq(atomic_load(&fast), 1000, "Only %d tasks were run while one was held up", atomic_load(&fast));
+    cr_assert_eq(atomic_load(&slow), 0, "Held-up task finished before it was released");
+    atomic_store(&release, 1);
+    for(int i = 0; i < 500 && atomic_load(&slow) == 0; i++)
+	usleep(10000);
+    cr_assert_eq(atomic_load(&slow), 1, "Released task did not finish");
+}
+
+/*
+ * Play several games at once, a move in each in turn, on a server whose
+ * requests are handled by the handler pool.
+ */
+Test(student_suite, 17_handler_pool, .timeout = 30) {
+    fprintf(stderr, "server_suite/17_handler_pool\n");
+    pid_t pid = start_server(10003, (char *[]){ "-e", "-n", "2", "-h", "4", NULL });
+    int x[8], o[8], xid[8], oid[8];
+    for(int i = 0; i < 8; i++) {
+	char xname[16], oname[16];
+	snprintf(xname, sizeof(xname), "x%d", i);
+	snprintf(oname, sizeof(oname), "o%d", i);
+	x[i] = login(10003, xname);
+	o[i] = login(10003, oname);
+	start_game(x[i], o[i], oname, &xid[i], &oid[i]);
+    }
+    char *moves[] = { "1->X", "4->O", "2->X", "5->O", NULL };
+    for(int m = 0; moves[m] != NULL; m++) {
+	for(int i = 0; i < 8; i++)
+	    free(m % 2 == 0 ? move(x[i], xid[i], o[i], moves[m], 4) : move(o[i], oid[i], x[i], moves[m], 4));
+    }
+    JEUX_PACKET_HEADER hdr;
+    for(int i = 0; i < 8; i++)
+	send_request(x[i], JEUX_MOVE_PKT, xid[i], 0, "3->X", 4);
+    for(int i = 0; i < 8; i++) {
+	free(expect_packet(o[i], JEUX_ENDED_PKT, &hdr));
+	cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "Winner of game %d was %d, not X", i, hdr.role);
+	free(expect_packet(x[i], JEUX_ACK_PKT, &hdr));
+    }
+    char *users;
+    cr_assert_eq(request(x[0], JEUX_USERS_PKT, 0, 0, NULL, 0, &hdr, &users), JEUX_ACK_PKT, "USERS was refused");
+    for(int i = 0; i < 8; i++) {
+	char want[32];
+	snprintf(want, sizeof(want), "x%d\t1516\n", i);
+	cr_assert_neq(strstr(users, want), NULL, "Winner x%d was not rated 1516:\n%s", i, users);
+	close(x[i]);
+	close(o[i]);
+    }
+    free(users);
+    stop_server(pid);
+}
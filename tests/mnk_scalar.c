@@ -0,0 +1,7 @@
+/*
+ * The k-in-a-row engine built without SSE2, so that the tests can check
+ * its scalar win check against the same games as the vector one.
+ */
+#undef __SSE2__
+#define game_mnk_init game_mnk_init_scalar
+#include "../src/game_mnk.c"
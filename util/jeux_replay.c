@@ -0,0 +1,402 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+#include "player.h"
+
+/*
+ * Reader for the game journal written by the Jeux server with -j.
+ *
+ * Usage: jeux_replay [-a] [-g <game>] <journal>
+ *
+ * The journal is mapped and scanned in place.  By default, the result
+ * of every game is applied, in the order the games ended, to ratings
+ * computed exactly as the server computes them, and the final rating of
+ * every player who finished a game is printed in the format of a USERS
+ * response.  With -a, every game is audited instead: its moves must be
+ * numbered from 1 without gaps, alternate between X and O, and be
+ * followed by a result after the last of them, unless the game is still
+ * in progress.  The pieces, not the players, must alternate, since the
+ * server accepts a move from either player as long as it places the
+ * piece to move.  A line is printed for each game, and the exit status is
+ * 1 if any game fails the audit.  With -g, the records of one game are
+ * printed in order.
+ */
+
+#define USAGE "Usage: bin/jeux_replay [-a] [-g <game>] <journal>\n"
+
+#define REPLAY_K 32
+#define REPLAY_MAX_DIFF 4096
+
+/*
+ * What is known about a game from its START and NAME records.
+ */
+typedef struct replay_game {
+	uint64_t id;
+	const JOURNAL_RECORD *start;
+	char *names[2];
+	size_t lens[2];
+	int audited;
+} REPLAY_GAME;
+
+typedef struct replay_player {
+	char *name;
+	int rating;
+} REPLAY_PLAYER;
+
+/*
+ * An open-addressing table, used both for games, keyed by ID, and for
+ * players, keyed by name.
+ */
+typedef struct replay_table {
+	void **slots;
+	size_t mask;
+	size_t count;
+} REPLAY_TABLE;
+
+static uint64_t replay_hash(const char *data, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int replay_table_init(REPLAY_TABLE *table, size_t expected) {
+	size_t size = 16;
+	while (size < 2 * expected) {
+		size <<= 1;
+	}
+	table->slots = calloc(size, sizeof(void *));
+	table->mask = size - 1;
+	table->count = 0;
+	return table->slots != NULL ? 0 : -1;
+}
+
+static REPLAY_GAME *replay_find_game(REPLAY_TABLE *games, uint64_t id) {
+	size_t i = replay_hash((const char *)&id, sizeof(id)) & games->mask;
+	REPLAY_GAME *game;
+	while ((game = games->slots[i]) != NULL && game->id != id) {
+		i = (i + 1) & games->mask;
+	}
+	return game;
+}
+
+static REPLAY_GAME *replay_add_game(REPLAY_TABLE *games, const JOURNAL_RECORD *start) {
+	size_t i = replay_hash((const char *)&start->game, sizeof(start->game)) & games->mask;
+	while (games->slots[i] != NULL) {
+		if (((REPLAY_GAME *)games->slots[i])->id == start->game) {
+			return NULL;
+		}
+		i = (i + 1) & games->mask;
+	}
+	REPLAY_GAME *game = calloc(1, sizeof(REPLAY_GAME));
+	if (game == NULL) {
+		return NULL;
+	}
+	game->id = start->game;
+	game->start = start;
+	for (int p = 0; p < 2; p++) {
+		game->names[p] = calloc(start->arg[p] + 1, 1);
+	}
+	games->slots[i] = game;
+	games->count++;
+	return game;
+}
+
+static REPLAY_PLAYER *replay_player(REPLAY_TABLE *players, const char *name) {
+	size_t i = replay_hash(name, strlen(name)) & players->mask;
+	REPLAY_PLAYER *player;
+	while ((player = players->slots[i]) != NULL && strcmp(player->name, name) != 0) {
+		i = (i + 1) & players->mask;
+	}
+	if (player == NULL && (player = malloc(sizeof(REPLAY_PLAYER))) != NULL) {
+		player->name = (char *)name;
+		player->rating = PLAYER_INITIAL_RATING;
+		players->slots[i] = player;
+		players->count++;
+	}
+	return player;
+}
+
+/*
+ * The rating change for a score (0 for a loss, 1 for a draw, 2 for a
+ * win) against an opponent, as computed by the server.
+ */
+static int replay_delta(int score, int rating, int opponent) {
+	int diff = opponent - rating;
+	if (diff > REPLAY_MAX_DIFF) {
+		diff = REPLAY_MAX_DIFF;
+	} else if (diff < -REPLAY_MAX_DIFF) {
+		diff = -REPLAY_MAX_DIFF;
+	}
+	float E = 1.0/(1.0 + pow(10.0, ((float)diff/400.0)));
+	float S = score / 2.0;
+	return (int)(REPLAY_K * (S-E));
+}
+
+static int replay_compare_time(const void *a, const void *b) {
+	const JOURNAL_RECORD *x = *(const JOURNAL_RECORD *const *)a;
+	const JOURNAL_RECORD *y = *(const JOURNAL_RECORD *const *)b;
+	if (x->sec != y->sec) {
+		return x->sec < y->sec ? -1 : 1;
+	}
+	if (x->nsec != y->nsec) {
+		return x->nsec < y->nsec ? -1 : 1;
+	}
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Order the records of games by game, then by ply, with a result after
+ * the move with the same ply.
+ */
+static int replay_compare_game(const void *a, const void *b) {
+	const JOURNAL_RECORD *x = *(const JOURNAL_RECORD *const *)a;
+	const JOURNAL_RECORD *y = *(const JOURNAL_RECORD *const *)b;
+	if (x->game != y->game) {
+		return x->game < y->game ? -1 : 1;
+	}
+	if (x->ply != y->ply) {
+		return x->ply < y->ply ? -1 : 1;
+	}
+	if (x->type != y->type) {
+		return x->type < y->type ? -1 : 1;
+	}
+	return x < y ? -1 : x > y;
+}
+
+static int replay_compare_names(const void *a, const void *b) {
+	const REPLAY_PLAYER *x = *(const REPLAY_PLAYER *const *)a;
+	const REPLAY_PLAYER *y = *(const REPLAY_PLAYER *const *)b;
+	return strcmp(x->name, y->name);
+}
+
+static const char *replay_role(int role) {
+	return role == FIRST_PLAYER_ROLE ? "first" : role == SECOND_PLAYER_ROLE ? "second" : "draw";
+}
+
+static void replay_ratings(REPLAY_TABLE *games, const JOURNAL_RECORD **events, size_t numEvents) {
+	const JOURNAL_RECORD **results = malloc((numEvents + 1) * sizeof(JOURNAL_RECORD *));
+	size_t numResults = 0;
+	for (size_t i = 0; results != NULL && i < numEvents; i++) {
+		if (events[i]->type == JOURNAL_RESULT && replay_find_game(games, events[i]->game) != NULL) {
+			results[numResults++] = events[i];
+		}
+	}
+	REPLAY_TABLE players;
+	if (results == NULL || replay_table_init(&players, 2 * games->count) == -1) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	qsort(results, numResults, sizeof(JOURNAL_RECORD *), replay_compare_time);
+	for (size_t i = 0; i < numResults; i++) {
+		REPLAY_GAME *game = replay_find_game(games, results[i]->game);
+		REPLAY_PLAYER *first = replay_player(&players, game->names[0]);
+		REPLAY_PLAYER *second = replay_player(&players, game->names[1]);
+		if (first == NULL || second == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		int score = results[i]->role == FIRST_PLAYER_ROLE ? 2 : results[i]->role == SECOND_PLAYER_ROLE ? 0 : 1;
+		int R1 = first->rating;
+		int R2 = second->rating;
+		first->rating += replay_delta(score, R1, R2);
+		second->rating += replay_delta(2 - score, R2, R1);
+	}
+	REPLAY_PLAYER **sorted = malloc((players.count + 1) * sizeof(REPLAY_PLAYER *));
+	size_t n = 0;
+	for (size_t i = 0; sorted != NULL && i <= players.mask; i++) {
+		if (players.slots[i] != NULL) {
+			sorted[n++] = players.slots[i];
+		}
+	}
+	qsort(sorted, n, sizeof(REPLAY_PLAYER *), replay_compare_names);
+	for (size_t i = 0; i < n; i++) {
+		printf("%s\t%d\n", sorted[i]->name, sorted[i]->rating);
+	}
+	fprintf(stderr, "%zu results applied to %zu players\n", numResults, n);
+}
+
+/*
+ * Audit the records of one game, given in order.
+ *
+ * @return 0 if the game passes, otherwise -1.
+ */
+static int replay_audit_game(REPLAY_GAME *game, const JOURNAL_RECORD **records, size_t n, int verbose) {
+	const char *problem = NULL;
+	const JOURNAL_RECORD *result = NULL;
+	unsigned int moves = 0;
+	if (verbose && game != NULL) {
+		printf("game %lu: %s (first) vs %s (second), started at %u.%09u\n", (unsigned long)game->id,
+		       game->names[0], game->names[1], game->start->sec, game->start->nsec);
+	}
+	for (size_t i = 0; i < n; i++) {
+		const JOURNAL_RECORD *rec = records[i];
+		if (verbose) {
+			if (rec->type == JOURNAL_MOVE) {
+				printf("  %u. %s cell %d piece %d at %u.%09u\n", rec->ply, replay_role(rec->role),
+				       rec->arg[0], rec->arg[1], rec->sec, rec->nsec);
+			} else {
+				printf("  result after %u moves: %s%s, at %u.%09u\n", rec->ply, replay_role(rec->role),
+				       rec->arg[0] ? " (resigned)" : "", rec->sec, rec->nsec);
+			}
+		}
+		if (problem != NULL) {
+			continue;
+		}
+		if (result != NULL) {
+			problem = "records after the result";
+		} else if (rec->type == JOURNAL_RESULT) {
+			result = rec;
+			if (rec->ply != moves) {
+				problem = "result does not follow the last move";
+			} else if (!rec->arg[0] && rec->role != NULL_ROLE
+				   && rec->role != (records[i - 1]->arg[1] == 1 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE)) {
+				problem = "game won by the side that did not make the last move";
+			}
+		} else if (rec->ply != moves + 1) {
+			problem = rec->ply <= moves ? "move recorded twice" : "moves missing";
+		} else if (rec->arg[1] != rec->ply % 2) {
+			problem = "pieces do not alternate";
+		} else {
+			moves++;
+		}
+	}
+	if (game == NULL) {
+		problem = "no start";
+	}
+	if (!verbose) {
+		printf("%lu\t%s\t%s\t%u\t%s\t%s\n", (unsigned long)records[0]->game,
+		       game != NULL ? game->names[0] : "?", game != NULL ? game->names[1] : "?", moves,
+		       result == NULL ? "in progress" : replay_role(result->role),
+		       problem != NULL ? problem : "ok");
+	} else if (problem != NULL) {
+		printf("  audit failed: %s\n", problem);
+	}
+	return problem != NULL ? -1 : 0;
+}
+
+static int replay_audit(REPLAY_TABLE *games, const JOURNAL_RECORD **events, size_t numEvents, uint64_t only) {
+	qsort(events, numEvents, sizeof(JOURNAL_RECORD *), replay_compare_game);
+	int failed = 0;
+	size_t start = 0;
+	while (start < numEvents) {
+		size_t end = start;
+		while (end < numEvents && events[end]->game == events[start]->game) {
+			end++;
+		}
+		if (only == 0 || events[start]->game == only) {
+			REPLAY_GAME *game = replay_find_game(games, events[start]->game);
+			if (game != NULL) {
+				game->audited = 1;
+			}
+			if (replay_audit_game(game, events + start, end - start, only != 0) == -1) {
+				failed = 1;
+			}
+		}
+		start = end;
+	}
+	// Games that were started but in which no move has been made.
+	for (size_t i = 0; i <= games->mask; i++) {
+		REPLAY_GAME *game = games->slots[i];
+		if (game == NULL || game->audited || (only != 0 && game->id != only)) {
+			continue;
+		}
+		if (only != 0) {
+			printf("game %lu: %s (first) vs %s (second), started at %u.%09u, no moves\n",
+			       (unsigned long)game->id, game->names[0], game->names[1], game->start->sec,
+			       game->start->nsec);
+		} else {
+			printf("%lu\t%s\t%s\t0\tin progress\tok\n", (unsigned long)game->id, game->names[0],
+			       game->names[1]);
+		}
+	}
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int audit = 0;
+	uint64_t only = 0;
+	while ((opt = getopt(argc, argv, "ag:")) != -1) {
+		switch (opt) {
+		case 'a':
+			audit = 1;
+			break;
+		case 'g':
+			only = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, USAGE);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, USAGE);
+		exit(EXIT_FAILURE);
+	}
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	size_t numRecords = st.st_size / sizeof(JOURNAL_RECORD);
+	const JOURNAL_RECORD *records = NULL;
+	if (numRecords > 0) {
+		records = mmap(NULL, numRecords * sizeof(JOURNAL_RECORD), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (records == MAP_FAILED) {
+			perror(argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+		madvise((void *)records, numRecords * sizeof(JOURNAL_RECORD), MADV_SEQUENTIAL);
+	}
+	size_t numStarts = 0;
+	size_t numEvents = 0;
+	for (size_t i = 0; i < numRecords; i++) {
+		if (records[i].type == JOURNAL_START) {
+			numStarts++;
+		} else if (records[i].type == JOURNAL_MOVE || records[i].type == JOURNAL_RESULT) {
+			numEvents++;
+		}
+	}
+	REPLAY_TABLE games;
+	const JOURNAL_RECORD **events = malloc((numEvents + 1) * sizeof(JOURNAL_RECORD *));
+	if (events == NULL || replay_table_init(&games, numStarts) == -1) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	numEvents = 0;
+	REPLAY_GAME *game = NULL;
+	for (size_t i = 0; i < numRecords; i++) {
+		const JOURNAL_RECORD *rec = &records[i];
+		if (rec->type == JOURNAL_START) {
+			game = replay_add_game(&games, rec);
+		} else if (rec->type == JOURNAL_NAME) {
+			// The names of a game directly follow its start.
+			int p = rec->role == SECOND_PLAYER_ROLE;
+			if (game != NULL && game->id == rec->game && game->names[p] != NULL
+			    && game->lens[p] + rec->len <= (size_t)game->start->arg[p]) {
+				memcpy(game->names[p] + game->lens[p], rec->text, rec->len);
+				game->lens[p] += rec->len;
+			}
+		} else if (rec->type == JOURNAL_MOVE || rec->type == JOURNAL_RESULT) {
+			events[numEvents++] = rec;
+		}
+	}
+	fprintf(stderr, "%zu records, %zu games\n", numRecords, games.count);
+	if (audit || only != 0) {
+		return replay_audit(&games, events, numEvents, only);
+	}
+	replay_ratings(&games, events, numEvents);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+/*
+ * Decoder for the trace file written by the Jeux server with -t.
+ *
+ * Usage: jeux_tracedump [-o <object>] [-T <thread>] <trace>
+ *
+ * The events of all the threads are merged in time order, and one line
+ * is printed for each: the time in seconds since tracing was enabled,
+ * the serial number of the thread, the event, the object, the two values
+ * and the other argument it carries, and the reason, if any.  With -o,
+ * only the events for the object at the given address are printed, such
+ * as the history of the reference count of one CLIENT; with -T, only
+ * those recorded by the given thread.
+ */
+
+#define USAGE "Usage: bin/jeux_tracedump [-o <object>] [-T <thread>] <trace>\n"
+
+static const char *eventNames[] = {
+#define TRACE_NAME(name, text) text,
+	TRACE_EVENTS(TRACE_NAME)
+#undef TRACE_NAME
+};
+
+typedef struct dump_reason {
+	uint64_t address;
+	const char *text;
+	uint32_t len;
+} DUMP_REASON;
+
+static const TRACE_EVENT *dumpEvents;
+
+/*
+ * Order events by time, keeping those with the same time in the order
+ * they were dumped, which is the order in which each thread recorded
+ * them.
+ */
+static int dump_compare_time(const void *a, const void *b) {
+	const TRACE_EVENT *x = &dumpEvents[*(const uint32_t *)a];
+	const TRACE_EVENT *y = &dumpEvents[*(const uint32_t *)b];
+	if (x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+	return (*(const uint32_t *)a > *(const uint32_t *)b) - (*(const uint32_t *)a < *(const uint32_t *)b);
+}
+
+static int dump_compare_reason(const void *a, const void *b) {
+	uint64_t x = ((const DUMP_REASON *)a)->address;
+	uint64_t y = ((const DUMP_REASON *)b)->address;
+	return (x > y) - (x < y);
+}
+
+static const DUMP_REASON *dump_find_reason(const DUMP_REASON *reasons, size_t n, uint64_t address) {
+	DUMP_REASON key = { .address = address };
+	return bsearch(&key, reasons, n, sizeof(DUMP_REASON), dump_compare_reason);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	uint64_t object = 0;
+	int filterObject = 0;
+	unsigned long thread = 0;
+	while ((opt = getopt(argc, argv, "o:T:")) != -1) {
+		switch (opt) {
+		case 'o':
+			object = strtoull(optarg, NULL, 16);
+			filterObject = 1;
+			break;
+		case 'T':
+			thread = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, USAGE);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, USAGE);
+		exit(EXIT_FAILURE);
+	}
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	size_t size = st.st_size;
+	const char *data = NULL;
+	if (size >= sizeof(TRACE_HEADER)) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			perror(argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	const TRACE_HEADER *header = (const TRACE_HEADER *)data;
+	if (header == NULL || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+	    || size < sizeof(TRACE_HEADER) + (uint64_t)header->numEvents * sizeof(TRACE_EVENT)) {
+		fprintf(stderr, "%s: Not a trace file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	dumpEvents = (const TRACE_EVENT *)(data + sizeof(TRACE_HEADER));
+	size_t numEvents = header->numEvents;
+
+	// The reasons follow the events, each with its text.
+	DUMP_REASON *reasons = malloc((header->numReasons + 1) * sizeof(DUMP_REASON));
+	uint32_t *order = malloc((numEvents + 1) * sizeof(uint32_t));
+	if (reasons == NULL || order == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	size_t offset = sizeof(TRACE_HEADER) + numEvents * sizeof(TRACE_EVENT);
+	size_t numReasons = 0;
+	while (numReasons < header->numReasons && offset + sizeof(TRACE_REASON) <= size) {
+		const TRACE_REASON *reason = (const TRACE_REASON *)(data + offset);
+		offset += sizeof(TRACE_REASON);
+		if (offset + reason->len > size) {
+			break;
+		}
+		reasons[numReasons].address = reason->address;
+		reasons[numReasons].text = data + offset;
+		reasons[numReasons].len = reason->len;
+		numReasons++;
+		offset += reason->len;
+	}
+	if (numReasons < header->numReasons) {
+		fprintf(stderr, "%s: Truncated trace file\n", argv[optind]);
+	}
+	qsort(reasons, numReasons, sizeof(DUMP_REASON), dump_compare_reason);
+
+	for (size_t i = 0; i < numEvents; i++) {
+		order[i] = i;
+	}
+	qsort(order, numEvents, sizeof(uint32_t), dump_compare_time);
+
+	// Ticks are converted to time by the two readings of both clocks.
+	double nanosPerTick = 1.0;
+	if (header->dumpTicks > header->startTicks) {
+		nanosPerTick = (double)(header->dumpNanos - header->startNanos)
+			/ (double)(header->dumpTicks - header->startTicks);
+	}
+	fprintf(stderr, "%zu events, %zu reasons\n", numEvents, numReasons);
+	for (size_t i = 0; i < numEvents; i++) {
+		const TRACE_EVENT *ev = &dumpEvents[order[i]];
+		if ((filterObject && ev->object != object) || (thread != 0 && ev->thread != thread)) {
+			continue;
+		}
+		double seconds = ((double)ev->time - (double)header->startTicks) * nanosPerTick / 1e9;
+		const char *name = ev->event < TRACE_NUM_EVENTS ? eventNames[ev->event] : "?";
+		printf("%.9f\t%u\t%s\t%#" PRIx64 "\t%d\t%d\t%u", seconds, ev->thread, name, ev->object,
+		       ev->before, ev->after, ev->arg);
+		if (ev->reason != 0) {
+			const DUMP_REASON *reason = dump_find_reason(reasons, numReasons, ev->reason);
+			if (reason != NULL) {
+				printf("\t%.*s", (int)reason->len, reason->text);
+			} else {
+				printf("\t?");
+			}
+		}
+		printf("\n");
+	}
+	return EXIT_SUCCESS;
+}